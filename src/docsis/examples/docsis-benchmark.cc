@@ -0,0 +1,253 @@
+/* -*- Mode:C++; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+
+// Scale benchmark of a DOCSIS headend.
+//
+// Sweeps the number of segments of the CMTS, of CMs per segment, of
+// channels and the offered load, and prints
+// one CSV row per point with the wall clock time, the simulator events per
+// second, the peak resident memory and the packets per second, so that
+// scheduler changes can be compared against a baseline:
+//
+//   ./waf --run "docsis-benchmark --segments=1,16 --cms=10,100,1000 --channels=1,4 --load=0.5,0.9"
+//
+// A single segment is a plain CmtsDevice, more are MAC domains of one
+// CmtsChassis.
+//
+// Every CM offers the same constant bit rate upstream and downstream, load
+// being the fraction of the capacity of the channels of that direction.
+// The peak memory is that of the point on Linux, where the high water mark
+// is reset between points, and of the process so far elsewhere.
+
+#include "ns3/core-module.h"
+#include "ns3/docsis-helper.h"
+#include "ns3/docsis.h"
+#include "ns3/map-scheduler.h"
+#include "ns3/ipv4-header.h"
+#include "ns3/udp-header.h"
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <sys/resource.h>
+
+using namespace ns3;
+
+NS_LOG_COMPONENT_DEFINE ("DocsisBenchmark");
+
+// Counts the events the simulator runs, which ns-3 does not report.
+class CountingMapScheduler : public MapScheduler
+{
+public:
+  static TypeId GetTypeId (void);
+  virtual Event RemoveNext (void);
+
+  static uint64_t s_events;
+};
+
+NS_OBJECT_ENSURE_REGISTERED (CountingMapScheduler);
+
+uint64_t CountingMapScheduler::s_events = 0;
+
+TypeId
+CountingMapScheduler::GetTypeId (void)
+{
+  static TypeId tid = TypeId ("ns3::CountingMapScheduler")
+    .SetParent<MapScheduler> ()
+    .AddConstructor<CountingMapScheduler> ()
+  ;
+  return tid;
+}
+
+Scheduler::Event
+CountingMapScheduler::RemoveNext (void)
+{
+  s_events++;
+  return MapScheduler::RemoveNext ();
+}
+
+static uint64_t g_sent = 0;
+static uint64_t g_received = 0;
+
+static std::vector<double>
+ParseList (std::string list)
+{
+  std::vector<double> values;
+  std::istringstream stream (list);
+  std::string item;
+  while (std::getline (stream, item, ','))
+    values.push_back (atof (item.c_str ()));
+  return values;
+}
+
+// Resets the peak resident memory, where the system allows it.
+static void
+ResetPeakRss (void)
+{
+#ifdef __linux__
+  std::ofstream clearRefs ("/proc/self/clear_refs");
+  clearRefs << "5";
+#endif
+}
+
+// Peak resident memory, in kB.
+static uint64_t
+GetPeakRss (void)
+{
+#ifdef __linux__
+  std::ifstream status ("/proc/self/status");
+  std::string line;
+  while (std::getline (status, line))
+    if (line.compare (0, 6, "VmHWM:") == 0)
+      return atol (line.c_str () + 6);
+#endif
+  struct rusage usage;
+  getrusage (RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+static Ptr<Packet>
+CreateDatagram (uint32_t size)
+{
+  Ptr<Packet> packet = Create<Packet> (size - 28);
+  UdpHeader udp;
+  udp.SetSourcePort (9);
+  udp.SetDestinationPort (9);
+  packet->AddHeader (udp);
+  Ipv4Header ip;
+  ip.SetProtocol (17);
+  ip.SetPayloadSize (packet->GetSize ());
+  ip.SetSource (Ipv4Address ("10.1.0.1"));
+  ip.SetDestination (Ipv4Address ("10.1.0.2"));
+  packet->AddHeader (ip);
+  return packet;
+}
+
+static void
+Send (Ptr<NetDevice> device, Address destination, uint32_t size, Time interval)
+{
+  g_sent++;
+  device->Send (CreateDatagram (size), destination, 0x800);
+  Simulator::Schedule (interval, &Send, device, destination, size, interval);
+}
+
+static bool
+Receive (Ptr<NetDevice> device, Ptr<const Packet> packet, uint16_t protocol, const Address &source)
+{
+  g_received++;
+  return true;
+}
+
+static void
+RunPoint (std::ostream &output, uint32_t nSegments, uint32_t nCms, uint32_t nChannels, double load, Time duration, uint32_t size)
+{
+  g_sent = g_received = CountingMapScheduler::s_events = 0;
+  ResetPeakRss ();
+  SystemWallClockMs clock;
+  clock.Start ();
+
+  NodeContainer cmtsNode;
+  cmtsNode.Create (1);
+
+  DocsisHelper docsis;
+  docsis.SetChannelsAmount (nChannels, nChannels);
+  NetDeviceContainer devices;
+  Ptr<Hfc> hfc;
+  if (nSegments == 1)
+    {
+      NodeContainer cmNodes;
+      cmNodes.Create (nCms);
+      devices = docsis.Install (cmtsNode.Get (0), cmNodes);
+      hfc = DynamicCast<Hfc> (devices.Get (0)->GetChannel ());
+    }
+  else
+    {
+      Ptr<CmtsChassis> chassis = docsis.InstallChassis (cmtsNode.Get (0));
+      devices.Add (chassis);
+      for (uint32_t segment = 0; segment < nSegments; segment++)
+        {
+          NodeContainer cmNodes;
+          cmNodes.Create (nCms);
+          devices.Add (docsis.Install (chassis, cmNodes));
+        }
+      hfc = DynamicCast<Hfc> (chassis->GetMacDomain (0)->GetChannel ());
+    }
+  docsis.AssignStreams (devices, 1);
+
+  // Every segment has the same channels, and the load is per segment.
+  double upstreamCapacity = 0;
+  double downstreamCapacity = 0;
+  for (uint32_t channel = 0; channel < nChannels; channel++)
+    {
+      upstreamCapacity += hfc->GetUpstreamDataRate (channel).GetBitRate ();
+      downstreamCapacity += hfc->GetDownstreamDataRate (channel).GetBitRate ();
+    }
+  Time upstreamInterval = Seconds (size * 8.0 * nCms / (load * upstreamCapacity));
+  Time downstreamInterval = Seconds (size * 8.0 * nCms / (load * downstreamCapacity));
+
+  // The sources start spread over one interval so that the CMs do not
+  // request in lockstep.
+  Ptr<UniformRandomVariable> start = CreateObject<UniformRandomVariable> ();
+  start->SetStream (0);
+  Address cmtsAddress = devices.Get (0)->GetAddress ();
+  devices.Get (0)->SetReceiveCallback (MakeCallback (&Receive));
+  for (uint32_t i = 1; i < devices.GetN (); i++)
+    {
+      devices.Get (i)->SetReceiveCallback (MakeCallback (&Receive));
+      Simulator::Schedule (Seconds (start->GetValue (0, upstreamInterval.GetSeconds ())),
+                           &Send, devices.Get (i), cmtsAddress, size, upstreamInterval);
+      Simulator::Schedule (Seconds (start->GetValue (0, downstreamInterval.GetSeconds ())),
+                           &Send, devices.Get (0), devices.Get (i)->GetAddress (), size, downstreamInterval);
+    }
+
+  Simulator::Stop (duration);
+  Simulator::Run ();
+  Simulator::Destroy ();
+
+  double wall = clock.End () / 1000.0;
+  output << nSegments << "," << nCms << "," << nChannels << "," << load << "," << duration.GetSeconds () << "," << wall << ","
+         << CountingMapScheduler::s_events << "," << CountingMapScheduler::s_events / wall << ","
+         << GetPeakRss () << "," << g_sent << "," << g_received << "," << g_received / wall << std::endl;
+}
+
+int
+main (int argc, char *argv[])
+{
+  std::string segments = "1";
+  std::string cms = "10,100";
+  std::string channels = "1,4";
+  std::string load = "0.5,0.9";
+  double duration = 1;
+  uint32_t size = 1000;
+  std::string outputFile;
+
+  CommandLine cmd;
+  cmd.AddValue ("segments", "Comma separated numbers of segments of the CMTS", segments);
+  cmd.AddValue ("cms", "Comma separated numbers of CMs per segment", cms);
+  cmd.AddValue ("channels", "Comma separated numbers of upstream and downstream channels", channels);
+  cmd.AddValue ("load", "Comma separated offered loads, as a fraction of the capacity", load);
+  cmd.AddValue ("duration", "Simulated seconds of every point", duration);
+  cmd.AddValue ("size", "Bytes of every IP packet", size);
+  cmd.AddValue ("output", "CSV file to write, standard output when empty", outputFile);
+  cmd.Parse (argc, argv);
+
+  GlobalValue::Bind ("SchedulerType", TypeIdValue (CountingMapScheduler::GetTypeId ()));
+
+  std::ofstream file;
+  if (!outputFile.empty ())
+    file.open (outputFile.c_str ());
+  std::ostream &output = outputFile.empty () ? std::cout : file;
+
+  output << "segments,cms,channels,load,simSeconds,wallSeconds,events,eventsPerSecond,peakRssKb,"
+         << "packetsSent,packetsReceived,packetsPerSecond" << std::endl;
+
+  std::vector<double> segmentsList = ParseList (segments);
+  std::vector<double> cmsList = ParseList (cms);
+  std::vector<double> channelsList = ParseList (channels);
+  std::vector<double> loadList = ParseList (load);
+  for (uint32_t s = 0; s < segmentsList.size (); s++)
+    for (uint32_t i = 0; i < cmsList.size (); i++)
+      for (uint32_t j = 0; j < channelsList.size (); j++)
+        for (uint32_t k = 0; k < loadList.size (); k++)
+          RunPoint (output, segmentsList[s], cmsList[i], channelsList[j], loadList[k], Seconds (duration), size);
+
+  return 0;
+}
@@ -43,8 +43,10 @@ main (int argc, char *argv[])
   n1->AddDevice (net1);
 
   Simulator::Schedule (Seconds (1.0), &SendOnePacket, net0, net1->GetAddress());
-//  Simulator::Schedule (Seconds (2.0), &SendOnePacket, net1, net0->GetAddress());
+  Simulator::Schedule (Seconds (2.0), &SendOnePacket, net1, net0->GetAddress());
 
+  // The CMTS keeps sending MAPs, so the run has to be bounded.
+  Simulator::Stop (Seconds (3.0));
   Simulator::Run ();
   Simulator::Destroy ();
   return 0;
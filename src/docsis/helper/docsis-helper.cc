@@ -1,11 +1,265 @@
 /* -*- Mode:C++; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
 
 #include "docsis-helper.h"
+#include "ns3/log.h"
+#include "ns3/internet-stack-helper.h"
+#include "ns3/ipv4-address-helper.h"
+#include "ns3/ipv4.h"
+#include "ns3/double.h"
+#include "ns3/simulator.h"
+#include <sstream>
+
+NS_LOG_COMPONENT_DEFINE ("DocsisHelper");
 
 namespace ns3 {
 
-/* ... */
+DocsisHelper::DocsisHelper () : m_upstreamChannels (1), m_downstreamChannels (1), m_delayPerKm (MicroSeconds (5))
+{
+  m_cmtsFactory.SetTypeId ("ns3::CmtsDevice");
+  m_cmFactory.SetTypeId ("ns3::CmDevice");
+  m_cmQueueFactory.SetTypeId ("ns3::DropTailQueue");
+
+  Ptr<ConstantRandomVariable> distance = CreateObject<ConstantRandomVariable> ();
+  distance->SetAttribute ("Constant", DoubleValue (1));
+  m_distance = distance;
+}
+
+void
+DocsisHelper::SetCmtsAttribute (std::string name, const AttributeValue &value)
+{
+  m_cmtsFactory.Set (name, value);
+}
+
+void
+DocsisHelper::SetCmAttribute (std::string name, const AttributeValue &value)
+{
+  m_cmFactory.Set (name, value);
+}
+
+void
+DocsisHelper::SetCmQueue (std::string type,
+                          std::string n1, const AttributeValue &v1,
+                          std::string n2, const AttributeValue &v2,
+                          std::string n3, const AttributeValue &v3,
+                          std::string n4, const AttributeValue &v4)
+{
+  m_cmQueueFactory.SetTypeId (type);
+  m_cmQueueFactory.Set (n1, v1);
+  m_cmQueueFactory.Set (n2, v2);
+  m_cmQueueFactory.Set (n3, v3);
+  m_cmQueueFactory.Set (n4, v4);
+}
+
+void
+DocsisHelper::SetPrimaryServiceFlows (DocsisServiceFlow upstream, DocsisServiceFlow downstream)
+{
+  m_upstreamFlow = upstream;
+  m_downstreamFlow = downstream;
+}
+
+void
+DocsisHelper::SetChannelsAmount (uint32_t upstream, uint32_t downstream)
+{
+  m_upstreamChannels = upstream;
+  m_downstreamChannels = downstream;
+}
+
+void
+DocsisHelper::SetUpstreamPhyProfile (uint32_t channel, Hfc::PhyProfile profile)
+{
+  m_upstreamProfiles[channel] = profile;
+}
+
+void
+DocsisHelper::SetDownstreamPhyProfile (uint32_t channel, Hfc::PhyProfile profile)
+{
+  m_downstreamProfiles[channel] = profile;
+}
+
+void
+DocsisHelper::SetUpstreamOfdmChannel (uint32_t channel, Hfc::OfdmChannel ofdm)
+{
+  m_upstreamOfdm[channel] = ofdm;
+}
+
+void
+DocsisHelper::SetDownstreamOfdmChannel (uint32_t channel, Hfc::OfdmChannel ofdm)
+{
+  m_downstreamOfdm[channel] = ofdm;
+}
+
+void
+DocsisHelper::SetDistance (Ptr<RandomVariableStream> distance, Time delayPerKm)
+{
+  m_distance = distance;
+  m_delayPerKm = delayPerKm;
+}
+
+Ptr<Hfc>
+DocsisHelper::CreateChannel (void)
+{
+  Ptr<Hfc> channel = CreateObject<Hfc> ();
+  channel->SetUpstreamChannelsAmount (m_upstreamChannels);
+  channel->SetDownstreamChannelsAmount (m_downstreamChannels);
+  for (std::map<uint32_t, Hfc::PhyProfile>::const_iterator profile = m_upstreamProfiles.begin (); profile != m_upstreamProfiles.end (); profile++)
+    channel->SetUpstreamPhyProfile (profile->first, profile->second);
+  for (std::map<uint32_t, Hfc::PhyProfile>::const_iterator profile = m_downstreamProfiles.begin (); profile != m_downstreamProfiles.end (); profile++)
+    channel->SetDownstreamPhyProfile (profile->first, profile->second);
+  for (std::map<uint32_t, Hfc::OfdmChannel>::const_iterator ofdm = m_upstreamOfdm.begin (); ofdm != m_upstreamOfdm.end (); ofdm++)
+    channel->SetUpstreamOfdmChannel (ofdm->first, ofdm->second);
+  for (std::map<uint32_t, Hfc::OfdmChannel>::const_iterator ofdm = m_downstreamOfdm.begin (); ofdm != m_downstreamOfdm.end (); ofdm++)
+    channel->SetDownstreamOfdmChannel (ofdm->first, ofdm->second);
+  return channel;
+}
+
+void
+DocsisHelper::InstallCms (Ptr<Hfc> channel, NodeContainer cms, NetDeviceContainer &devices)
+{
+  channel->ReserveCms (cms.GetN ());
+  devices.Reserve (devices.GetN () + cms.GetN ());
+
+  // The distance is set before attaching, so the CMTS sees every CM once.
+  for (NodeContainer::Iterator node = cms.Begin (); node != cms.End (); node++)
+    {
+      Ptr<CmDevice> cm = m_cmFactory.Create<CmDevice> ();
+      cm->SetAddress (Mac48Address::Allocate ());
+      cm->SetMtu (1500);
+      cm->SetQueue (m_cmQueueFactory.Create<Queue> ());
+      cm->SetUpstreamServiceFlow (0, m_upstreamFlow);
+      cm->SetDownstreamServiceFlow (0, m_downstreamFlow);
+      cm->SetTimeDistanceToCMTS (Seconds (m_delayPerKm.GetSeconds () * m_distance->GetValue ()));
+      (*node)->AddDevice (cm);
+      cm->Attach (channel);
+      devices.Add (cm);
+    }
+}
+
+NetDeviceContainer
+DocsisHelper::Install (Ptr<Node> cmtsNode, NodeContainer cms)
+{
+  NS_LOG_FUNCTION (this << cmtsNode << cms.GetN ());
+
+  Ptr<Hfc> channel = CreateChannel ();
+  NetDeviceContainer devices;
+  devices.Reserve (1 + cms.GetN ());
+
+  Ptr<CmtsDevice> cmts = m_cmtsFactory.Create<CmtsDevice> ();
+  cmts->SetAddress (Mac48Address::Allocate ());
+  cmts->SetMtu (1500);
+  cmtsNode->AddDevice (cmts);
+  cmts->Attach (channel);
+  cmts->ReserveCms (cms.GetN ());
+  devices.Add (cmts);
+  InstallCms (channel, cms, devices);
+
+  return devices;
+}
+
+Ptr<CmtsChassis>
+DocsisHelper::InstallChassis (Ptr<Node> node)
+{
+  NS_LOG_FUNCTION (this << node);
+
+  Ptr<CmtsChassis> chassis = CreateObject<CmtsChassis> ();
+  chassis->SetAddress (Mac48Address::Allocate ());
+  chassis->SetMtu (1500);
+  node->AddDevice (chassis);
+  return chassis;
+}
 
+NetDeviceContainer
+DocsisHelper::Install (Ptr<CmtsChassis> chassis, NodeContainer cms)
+{
+  NS_LOG_FUNCTION (this << chassis << cms.GetN ());
 
+  Ptr<Hfc> channel = CreateChannel ();
+  Ptr<CmtsDevice> domain = m_cmtsFactory.Create<CmtsDevice> ();
+  chassis->AddMacDomain (domain);
+  domain->Attach (channel);
+  domain->ReserveCms (cms.GetN ());
+
+  NetDeviceContainer devices;
+  InstallCms (channel, cms, devices);
+  return devices;
+}
+
+Ipv4InterfaceContainer
+DocsisHelper::InstallInternetStack (NetDeviceContainer devices, Ipv4Address network, Ipv4Mask mask)
+{
+  InternetStackHelper stack;
+  for (NetDeviceContainer::Iterator device = devices.Begin (); device != devices.End (); device++)
+    {
+      Ptr<Node> node = (*device)->GetNode ();
+      if (!node->GetObject<Ipv4> ())
+        stack.Install (node);
+    }
+
+  Ipv4AddressHelper addresses;
+  addresses.SetBase (network, mask);
+  return addresses.Assign (devices);
+}
+
+int64_t
+DocsisHelper::AssignStreams (NetDeviceContainer devices, int64_t stream)
+{
+  int64_t currentStream = stream;
+  m_distance->SetStream (currentStream++);
+  for (NetDeviceContainer::Iterator device = devices.Begin (); device != devices.End (); device++)
+    {
+      Ptr<CmDevice> cm = DynamicCast<CmDevice> (*device);
+      if (cm)
+        {
+          currentStream += cm->AssignStreams (currentStream);
+          Ptr<DocsisPieQueue> queue = DynamicCast<DocsisPieQueue> (cm->GetQueue ());
+          if (queue)
+            currentStream += queue->AssignStreams (currentStream);
+          Ptr<DocsisDualQueue> dual = DynamicCast<DocsisDualQueue> (cm->GetQueue ());
+          if (dual)
+            currentStream += dual->AssignStreams (currentStream);
+        }
+      Ptr<CmtsDevice> cmts = DynamicCast<CmtsDevice> (*device);
+      if (cmts)
+        currentStream += DynamicCast<Hfc> (cmts->GetChannel ())->AssignStreams (currentStream);
+      Ptr<CmtsChassis> chassis = DynamicCast<CmtsChassis> (*device);
+      if (chassis)
+        for (uint32_t i = 0; i < chassis->GetNMacDomains (); i++)
+          currentStream += DynamicCast<Hfc> (chassis->GetMacDomain (i)->GetChannel ())->AssignStreams (currentStream);
+    }
+  return currentStream - stream;
 }
 
+void
+DocsisHelper::EnablePcapInternal (std::string prefix, Ptr<NetDevice> nd, bool promiscuous, bool explicitFilename)
+{
+  if (!DynamicCast<CmDevice> (nd) && !DynamicCast<CmtsDevice> (nd) && !DynamicCast<CmtsChassis> (nd))
+    {
+      NS_LOG_INFO ("DocsisHelper::EnablePcapInternal(): Device " << nd << " is not a DOCSIS device");
+      return;
+    }
+
+  PcapHelper pcapHelper;
+  std::string filename = explicitFilename ? prefix : pcapHelper.GetFilenameFromDevice (prefix, nd);
+
+  // A chassis is traced per segment, as <file>-<segment>.pcap. Segments
+  // added later are not traced.
+  Ptr<CmtsChassis> chassis = DynamicCast<CmtsChassis> (nd);
+  if (chassis)
+    {
+      std::string base = filename.substr (0, filename.rfind (".pcap"));
+      for (uint32_t i = 0; i < chassis->GetNMacDomains (); i++)
+        {
+          std::ostringstream segment;
+          segment << base << "-" << i << ".pcap";
+          EnablePcapInternal (segment.str (), chassis->GetMacDomain (i), promiscuous, true);
+        }
+      return;
+    }
+
+  Ptr<DocsisPcapWriter> writer = CreateObject<DocsisPcapWriter> ();
+  writer->Open (filename);
+  nd->TraceConnectWithoutContext ("Sniffer", MakeCallback (&DocsisPcapWriter::Write, writer));
+  // Writes out what is still buffered once the simulation is over.
+  Simulator::ScheduleDestroy (&DocsisPcapWriter::Close, writer);
+}
+
+}
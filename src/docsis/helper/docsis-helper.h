@@ -2,11 +2,117 @@
 #ifndef DOCSIS_HELPER_H
 #define DOCSIS_HELPER_H
 
+#include <map>
+#include <string>
 #include "ns3/docsis.h"
+#include "ns3/object-factory.h"
+#include "ns3/net-device-container.h"
+#include "ns3/node-container.h"
+#include "ns3/random-variable-stream.h"
+#include "ns3/ipv4-address.h"
+#include "ns3/ipv4-interface-container.h"
+#include "ns3/trace-helper.h"
 
 namespace ns3 {
 
-/* ... */
+/**
+ * \brief Builds an HFC segment: one CMTS and any number of cable modems
+ * sharing a Hfc channel.
+ *
+ * Every CM gets a fresh MAC address and a distance to the CMTS drawn from
+ * the distance variable, turned into a propagation delay.
+ *
+ * A CMTS chassis serves many segments, each installed on its own Hfc with
+ * the same channel setup and CMTS attributes.
+ *
+ * Pcap traces are DLT_DOCSIS captures of the MAC frames, MAPs included,
+ * each device sends and receives. A CM only receives what is addressed to
+ * it and the broadcasts, so promiscuous traces are no different. A chassis
+ * gets one trace per segment it has when pcap is enabled on it; enable it
+ * once every segment is installed.
+ */
+class DocsisHelper : public PcapHelperForDevice
+{
+public:
+  DocsisHelper ();
+  virtual ~DocsisHelper () {}
+
+  void SetCmtsAttribute (std::string name, const AttributeValue &value);
+  void SetCmAttribute (std::string name, const AttributeValue &value);
+
+  /**
+   * Sets the type and attributes of the upstream queue every CM gets, for
+   * example ns3::DocsisPieQueue.
+   */
+  void SetCmQueue (std::string type,
+                   std::string n1 = "", const AttributeValue &v1 = EmptyAttributeValue (),
+                   std::string n2 = "", const AttributeValue &v2 = EmptyAttributeValue (),
+                   std::string n3 = "", const AttributeValue &v3 = EmptyAttributeValue (),
+                   std::string n4 = "", const AttributeValue &v4 = EmptyAttributeValue ());
+
+  /**
+   * Sets the primary service flows every CM is provisioned with, which
+   * carry its rate tier.
+   */
+  void SetPrimaryServiceFlows (DocsisServiceFlow upstream, DocsisServiceFlow downstream);
+
+  void SetChannelsAmount (uint32_t upstream, uint32_t downstream);
+  void SetUpstreamPhyProfile (uint32_t channel, Hfc::PhyProfile profile);
+  void SetDownstreamPhyProfile (uint32_t channel, Hfc::PhyProfile profile);
+  void SetUpstreamOfdmChannel (uint32_t channel, Hfc::OfdmChannel ofdm);
+  void SetDownstreamOfdmChannel (uint32_t channel, Hfc::OfdmChannel ofdm);
+
+  /**
+   * \param distance distance from every CM to the CMTS, in kilometers
+   * \param delayPerKm propagation delay of the plant
+   */
+  void SetDistance (Ptr<RandomVariableStream> distance, Time delayPerKm = MicroSeconds (5));
+
+  /**
+   * \returns the CMTS device first, followed by one CM device per node of
+   * cms, in the same order.
+   */
+  NetDeviceContainer Install (Ptr<Node> cmts, NodeContainer cms);
+
+  /**
+   * Adds a CMTS chassis to the node, with no segments yet.
+   */
+  Ptr<CmtsChassis> InstallChassis (Ptr<Node> node);
+  /**
+   * Adds a segment to the chassis: a new Hfc, its MAC domain and the CMs.
+   *
+   * \returns one CM device per node of cms, in the same order. The MAC
+   * domain is the last one of the chassis.
+   */
+  NetDeviceContainer Install (Ptr<CmtsChassis> chassis, NodeContainer cms);
+
+  /**
+   * Installs an internet stack on the nodes that have none and numbers the
+   * devices from network.
+   */
+  Ipv4InterfaceContainer InstallInternetStack (NetDeviceContainer devices, Ipv4Address network, Ipv4Mask mask);
+
+  int64_t AssignStreams (NetDeviceContainer devices, int64_t stream);
+
+private:
+  virtual void EnablePcapInternal (std::string prefix, Ptr<NetDevice> nd, bool promiscuous, bool explicitFilename);
+  Ptr<Hfc> CreateChannel (void);
+  void InstallCms (Ptr<Hfc> channel, NodeContainer cms, NetDeviceContainer &devices);
+
+  ObjectFactory m_cmtsFactory;
+  ObjectFactory m_cmFactory;
+  ObjectFactory m_cmQueueFactory;
+  DocsisServiceFlow m_upstreamFlow;
+  DocsisServiceFlow m_downstreamFlow;
+  uint32_t m_upstreamChannels;
+  uint32_t m_downstreamChannels;
+  std::map<uint32_t, Hfc::PhyProfile> m_upstreamProfiles;
+  std::map<uint32_t, Hfc::PhyProfile> m_downstreamProfiles;
+  std::map<uint32_t, Hfc::OfdmChannel> m_upstreamOfdm;
+  std::map<uint32_t, Hfc::OfdmChannel> m_downstreamOfdm;
+  Ptr<RandomVariableStream> m_distance;
+  Time m_delayPerKm;
+};
 
 }
 
@@ -24,31 +24,77 @@
 #include "ns3/simulator.h"
 #include "docsis-header.h"
 #include "mac-management-message.h"
+#include "docsis-pie-queue.h"
+#include "docsis-dual-queue.h"
 #include "ns3/llc-snap-header.h"
+#include "ns3/uinteger.h"
+#include "ns3/enum.h"
+#include "ns3/drop-tail-queue.h"
+#include <cmath>
+#include <algorithm>
 
 NS_LOG_COMPONENT_DEFINE ("CmNetDevice");
 
 namespace ns3 {
 
+  NS_OBJECT_ENSURE_REGISTERED (CmDevice);
+
   TypeId
   CmDevice::GetTypeId (void)
   {
     static TypeId tid = TypeId("ns3::CmDevice")
         .SetParent<NetDevice> ()
         .AddConstructor<CmDevice> ()
+        .AddAttribute ("MaxRequestRetries",
+                       "Contention request retries before the packet is dropped",
+                       UintegerValue (16),
+                       MakeUintegerAccessor (&CmDevice::m_maxRequestRetries),
+                       MakeUintegerChecker<uint32_t> ())
+        .AddAttribute ("RequestStrategy",
+                       "How the CM asks the CMTS for upstream bandwidth",
+                       EnumValue (kRequestHeadOfLine),
+                       MakeEnumAccessor (&CmDevice::m_requestStrategy),
+                       MakeEnumChecker (kRequestHeadOfLine, "HeadOfLine",
+                                        kRequestPiggyback, "Piggyback",
+                                        kRequestQueueDepth, "QueueDepth"))
+        .AddAttribute ("Initialization",
+                       "Whether the CM ranges and registers, or is ranged analytically and registered on attach",
+                       EnumValue (kFastStart),
+                       MakeEnumAccessor (&CmDevice::m_initialization),
+                       MakeEnumChecker (kFastStart, "FastStart",
+                                        kFullInitialization, "Full"))
+        .AddAttribute ("T3",
+                       "How long the CM waits for a RNG-RSP before it ranges again",
+                       TimeValue (MilliSeconds (200)),
+                       MakeTimeAccessor (&CmDevice::m_t3),
+                       MakeTimeChecker ())
+        .AddAttribute ("ResequencingTimeout",
+                       "How long bonded downstream frames wait for a missing sequence number",
+                       TimeValue (MilliSeconds (2)),
+                       MakeTimeAccessor (&CmDevice::m_resequencingTimeout),
+                       MakeTimeChecker ())
         .AddTraceSource("MacTx",
                         "Trace source indicating a packet has arrived for transmission by this device",
                         MakeTraceSourceAccessor(&CmDevice::m_sendTrace) )
+        .AddTraceSource("MacTxDrop",
+                        "Trace source indicating a packet has been dropped by the device before transmission",
+                        MakeTraceSourceAccessor(&CmDevice::m_dropTrace) )
         .AddTraceSource("MacRx",
                         "A packet has been received by this device, has been passed up from the physical layer "
                         "and is being forwarded up the local protocol stack.  This is a non-promiscuous trace,",
                         MakeTraceSourceAccessor(&CmDevice::m_receiveTrace) )
+        .AddTraceSource("MacRxDrop",
+                        "Trace source indicating a bonded downstream frame arrived after its place in sequence was given up",
+                        MakeTraceSourceAccessor(&CmDevice::m_rxDropTrace) )
         .AddTraceSource("PhyTxBegin",
                         "Trace source indicating a packet has begun transmitting over the channel",
                         MakeTraceSourceAccessor(&CmDevice::m_transmitStartTrace) )
         .AddTraceSource("PhyTxEnd",
                         "Trace source indicating a packet has been completely transmitted over the channel",
                         MakeTraceSourceAccessor(&CmDevice::m_transmitCompleteTrace) )
+        .AddTraceSource("Sniffer",
+                        "Every frame sent or received by this device, with the bytes of PHY overhead it begins with",
+                        MakeTraceSourceAccessor(&CmDevice::m_snifferTrace) )
         .AddTraceSource("ChannelConnect",
                         "Trace source indicating a connection to a channel",
                         MakeTraceSourceAccessor(&CmDevice::m_attachTrace) )
@@ -65,15 +111,40 @@ namespace ns3 {
 
   CmDevice::CmDevice () : m_channels(0), m_transferRate(NULL), m_deviceIndex(0),
                           m_mtu(1), m_linkUp(false), m_node(NULL),
-                          m_channel(NULL), m_uChannelStatus(0), m_lastPacket(),
-                          m_timeDistance(0)
+                          m_channel(NULL), m_handle(Hfc::kNoHandle),
+                          m_uChannelStatus(0), m_lastPacket(),
+                          m_timeDistance(0), m_initialization(kFastStart), m_initState(kOperational), m_rangingOffset(0), m_rangingSid(0),
+                          m_rangingBackoffExponent(0), m_rangingDeferCount(0), m_rangingBackoffDrawn(false), m_maintenancePending(false), m_t3(MilliSeconds (200)),
+                          m_maxRequestRetries(16), m_requestStrategy(kRequestHeadOfLine),
+                          m_resequencingTimeout(MilliSeconds (2))
   {
+    m_backoffRng = CreateObject<UniformRandomVariable> ();
+    m_upstreamFlows.push_back (DocsisServiceFlow ());
+    m_downstreamFlows.push_back (DocsisServiceFlow ());
+    m_queues.push_back (CreateObject<DropTailQueue> ());
   }
 
   CmDevice::~CmDevice ()
   {
   }
 
+  void
+  CmDevice::DoDispose (void)
+  {
+    NS_LOG_FUNCTION (this);
+    for (std::map<uint32_t, DsidState>::iterator dsid = m_dsids.begin (); dsid != m_dsids.end (); dsid++)
+      Simulator::Cancel (dsid->second.timeout);
+    m_dsids.clear ();
+    Simulator::Cancel (m_rangingTimeout);
+    m_services.clear ();
+    m_servicesByReference.clear ();
+    m_queues.clear ();
+    m_lastPacket = 0;
+    m_channel = 0;
+    m_node = 0;
+    NetDevice::DoDispose ();
+  }
+
   void
   CmDevice::AddLinkChangeCallback (Callback<void> callback)
   {
@@ -147,7 +218,7 @@ namespace ns3 {
   bool
   CmDevice::IsBroadcast (void) const
   {
-    return false;
+    return true;
   }
 
 
@@ -175,7 +246,7 @@ namespace ns3 {
   bool
   CmDevice::NeedsArp (void) const
   {
-    return false;
+    return true;
   }
 
 
@@ -185,7 +256,31 @@ namespace ns3 {
     NS_LOG_FUNCTION (this << packet << dest << protocolNumber);
     m_sendTrace(packet);
 
-    m_packetQueue.push_back(packet);
+    if (!m_channel || m_services.empty () || m_initState != kOperational)
+      return false;
+
+    // Packets are classified as the stack hands them down, and go to the
+    // primary flow when their own flow was not admitted.
+    uint32_t reference = m_upstreamClassifier.Classify (packet, protocolNumber);
+    std::list<ServiceStruct>::iterator service = reference < m_servicesByReference.size () ? m_servicesByReference[reference] : m_services.end ();
+    if (service == m_services.end ())
+      service = m_servicesByReference[0];
+
+    // **** Headers section ****
+    PDUHeader pduh;
+    pduh.Setup (m_address, Mac48Address::ConvertFrom (dest), protocolNumber);
+    packet->AddHeader (pduh);
+    packet->AddPaddingAtEnd (4);	// CRC
+    // **** Headers section ****
+    // The DOCSIS header is added when the frame is sent, since it may carry
+    // a piggybacked request.
+
+    if (!service->queue->Enqueue (packet))
+      {
+        m_dropTrace (packet);
+        return false;
+      }
+    ChangeState (service, kNewPacket);
     return true;
   }
 
@@ -205,7 +300,8 @@ namespace ns3 {
 
     Address old_address = m_address;
     m_address = Mac48Address::ConvertFrom (address);
-    m_channel->CmChangedAddress(this, old_address);
+    if (m_channel)
+      m_channel->CmChangedAddress(this, old_address);
   }
 
 
@@ -260,16 +356,33 @@ namespace ns3 {
     NS_LOG_FUNCTION (this << channel);
     m_attachTrace(channel);
 
-    if (!m_channel)
+    if (m_channel)
       {
         Deattach();
       }
 
+    // The CMTS looks at the state when the CM attaches, to tell a CM to
+    // register from one that already is.
     m_channel = channel;
-    m_channel->Attach(this);
+    if (m_initialization == kFastStart)
+      {
+        m_rangingOffset = m_timeDistance;
+        m_initState = kOperational;
+      }
+    else
+      {
+        m_rangingOffset = Seconds (0);
+        m_rangingSid = 0;
+        StartRanging ();
+      }
+    m_handle = m_channel->Attach(this);
     m_uChannelStatus.resize((int)m_channel->GetUpstreamChannelsAmount());
-    m_linkUp = true;
-    m_linkChangeCallbacks();
+
+    if (m_initState == kOperational)
+      {
+        m_linkUp = true;
+        m_linkChangeCallbacks();
+      }
   }
 
   void
@@ -283,24 +396,41 @@ namespace ns3 {
 
     m_channel->Deattach(this);
     m_channel = NULL;
+    m_handle = Hfc::kNoHandle;
     m_uChannelStatus.resize(0);
+    m_services.clear();
+    m_servicesByReference.clear();
+    Simulator::Cancel (m_rangingTimeout);
     m_linkUp = false;
     m_linkChangeCallbacks();
   }
 
+  uint32_t
+  CmDevice::GetHandle() const
+  {
+    return m_handle;
+  }
+
   void
-  CmDevice::Receive(Ptr< Packet > packet, uint32_t channel)
+  CmDevice::Receive(Ptr<const Packet> packet, uint32_t channel, ParsedMAP *map)
   {
     NS_LOG_FUNCTION (this << packet);
     m_receiveTrace(packet);
+    m_snifferTrace(packet, m_channel->GetDownstreamPhyOverhead (channel));
 
-    ProcessPacket(packet, channel);
+    // Broadcasts hand the same packet to every CM, take a private copy to
+    // strip the headers from.
+    ProcessPacket(packet->Copy (), channel, map);
   }
 
   void
   CmDevice::SetTimeDistanceToCMTS(Time time)
   {
     m_timeDistance = time;
+    if (m_initialization == kFastStart)
+      m_rangingOffset = time;
+    if (m_channel)
+      m_channel->CmChangedTimeDistance(this);
   }
 
   Time
@@ -309,84 +439,850 @@ namespace ns3 {
     return m_timeDistance;
   }
 
+  Time
+  CmDevice::GetRangingOffset() const
+  {
+    return m_rangingOffset;
+  }
+
+  CmDevice::CmInitState
+  CmDevice::GetInitState() const
+  {
+    return m_initState;
+  }
+
   void
-  CmDevice::TransmitStart(Ptr< Packet > packet, uint32_t channel)
+  CmDevice::AddUpstreamService(uint16_t sid, uint32_t channel, const DocsisMinislotClock &clock, DocsisUpstreamChannelMode mode, uint32_t reference)
   {
-    NS_LOG_FUNCTION (this << packet);
+    NS_LOG_FUNCTION (this << sid << channel << clock.GetTicksPerMinislot () << mode << reference);
+    NS_ASSERT_MSG (reference < m_queues.size (), "No upstream service flow with reference " << reference);
+
+    ServiceStruct service;
+    service.serviceId = sid;
+    service.reference = reference;
+    service.channel = channel;
+    service.clock = clock;
+    service.mode = mode;
+    service.queue = m_queues[reference];
+    m_services.push_back(service);
+
+    if (m_servicesByReference.size () <= reference)
+      m_servicesByReference.resize (reference + 1, m_services.end ());
+    m_servicesByReference[reference] = --m_services.end ();
+
+    SetUpstreamMinislotClock (channel, clock);
+  }
+
+  void
+  CmDevice::SetUpstreamMinislotClock(uint32_t channel, const DocsisMinislotClock &clock)
+  {
+    if (m_upstreamClocks.size () <= channel)
+      m_upstreamClocks.resize (channel + 1);
+    m_upstreamClocks[channel] = clock;
+
+    for (std::list<ServiceStruct>::iterator service = m_services.begin (); service != m_services.end (); service++)
+      if (service->channel == channel)
+        service->clock = clock;
+  }
+
+  void
+  CmDevice::SetUpstreamBondingGroup(uint16_t sid, std::vector<uint32_t> channels)
+  {
+    NS_LOG_FUNCTION (this << sid << channels.size ());
+
+    std::list<ServiceStruct>::iterator service = FindService (sid);
+    if (service == m_services.end ()) return;
+
+    service->bondedChannels = channels.size () > 1 ? channels : std::vector<uint32_t> ();
+  }
+
+  int64_t
+  CmDevice::AssignStreams(int64_t stream)
+  {
+    m_backoffRng->SetStream (stream);
+    return 1;
+  }
+
+  void
+  CmDevice::SetQueue(Ptr<Queue> queue)
+  {
+    NS_LOG_FUNCTION (this << queue);
+    bool primary = !m_servicesByReference.empty () && m_servicesByReference[0] != m_services.end ();
+    NS_ASSERT_MSG (primary ? IsQueueEmpty (m_servicesByReference[0]) : m_queues[0]->IsEmpty (),
+                   "The upstream queue can only be replaced while it is empty.");
+
+    m_queues[0] = queue;
+    if (primary)
+      m_servicesByReference[0]->queue = queue;
+    ConfigureQueue (0);
+  }
+
+  Ptr<Queue>
+  CmDevice::GetQueue(uint32_t reference) const
+  {
+    return reference < m_queues.size () ? m_queues[reference] : NULL;
+  }
+
+  uint32_t
+  CmDevice::AddUpstreamServiceFlow(DocsisServiceFlow flow, Ptr<Queue> queue)
+  {
+    uint32_t reference = m_upstreamFlows.size ();
+    m_upstreamFlows.push_back (flow);
+    if (!queue)
+      queue = flow.lowLatency ? Ptr<Queue> (CreateObject<DocsisDualQueue> ()) : Ptr<Queue> (CreateObject<DropTailQueue> ());
+    m_queues.push_back (queue);
+    ConfigureQueue (reference);
+
+    if (m_channel)
+      m_channel->CmChangedServiceFlows (this);
+    return reference;
+  }
+
+  uint32_t
+  CmDevice::AddDownstreamServiceFlow(DocsisServiceFlow flow)
+  {
+    uint32_t reference = m_downstreamFlows.size ();
+    m_downstreamFlows.push_back (flow);
+
+    if (m_channel)
+      m_channel->CmChangedServiceFlows (this);
+    return reference;
+  }
+
+  void
+  CmDevice::SetUpstreamServiceFlow(uint32_t reference, DocsisServiceFlow flow)
+  {
+    NS_ASSERT_MSG (reference < m_upstreamFlows.size (), "No upstream service flow with reference " << reference);
+    m_upstreamFlows[reference] = flow;
+    ConfigureQueue (reference);
+
+    if (m_channel)
+      m_channel->CmChangedServiceFlows (this);
+  }
+
+  void
+  CmDevice::SetDownstreamServiceFlow(uint32_t reference, DocsisServiceFlow flow)
+  {
+    NS_ASSERT_MSG (reference < m_downstreamFlows.size (), "No downstream service flow with reference " << reference);
+    m_downstreamFlows[reference] = flow;
+
+    if (m_channel)
+      m_channel->CmChangedServiceFlows (this);
+  }
+
+  void
+  CmDevice::AddUpstreamClassifier(DocsisClassifierRule rule)
+  {
+    m_upstreamClassifier.AddRule (rule);
+  }
+
+  void
+  CmDevice::AddDownstreamClassifier(DocsisClassifierRule rule)
+  {
+    m_downstreamClassifier.AddRule (rule);
+
+    // The CMTS keeps its own copy to classify with.
+    if (m_channel)
+      m_channel->CmChangedServiceFlows (this);
+  }
+
+  const std::vector<DocsisServiceFlow> &
+  CmDevice::GetUpstreamServiceFlows() const
+  {
+    return m_upstreamFlows;
+  }
+
+  const std::vector<DocsisServiceFlow> &
+  CmDevice::GetDownstreamServiceFlows() const
+  {
+    return m_downstreamFlows;
+  }
+
+  const DocsisClassifier &
+  CmDevice::GetDownstreamClassifier() const
+  {
+    return m_downstreamClassifier;
+  }
+
+  bool
+  CmDevice::IsQueueEmpty(std::list<ServiceStruct>::iterator service)
+  {
+    return !service->head && service->queue->IsEmpty ();
+  }
+
+  void
+  CmDevice::ConfigureQueue(uint32_t reference)
+  {
+    const DocsisServiceFlow &flow = m_upstreamFlows[reference];
+    Ptr<DocsisDualQueue> dual = DynamicCast<DocsisDualQueue> (m_queues[reference]);
+    if (dual && flow.latencyTarget.IsStrictlyPositive ())
+      dual->SetAttribute ("Target", TimeValue (flow.latencyTarget));
+
+    // DOCSIS-PIE estimates the latency from the flow's rate when it has one.
+    Ptr<DocsisPieQueue> pie = DynamicCast<DocsisPieQueue> (m_queues[reference]);
+    if (!pie) return;
+
+    pie->SetAttribute ("MaxSustainedRate", DataRateValue (flow.maxSustainedRate));
+    if (flow.latencyTarget.IsStrictlyPositive ())
+      pie->SetAttribute ("LatencyTarget", TimeValue (flow.latencyTarget));
+  }
+
+  void
+  CmDevice::TransmitStart(Ptr< Packet > packet, std::list<ServiceStruct>::iterator service, uint32_t channel)
+  {
+    NS_LOG_FUNCTION (this << packet << channel);
     m_transmitStartTrace(packet);
+    m_snifferTrace(packet, m_channel->GetUpstreamPhyOverhead (channel));
 
-    Time txTime = Seconds (m_channel->GetUpstreamDataRate(channel).CalculateTxTime(packet->GetSize()));
+    Time txTime = m_channel->GetUpstreamTxTime (channel, packet->GetSize (), m_handle);
 
-    Simulator::Schedule(txTime, &CmDevice::TransmitComplete, this, channel);
+    Simulator::Schedule(txTime, &CmDevice::TransmitComplete, this, service->serviceId);
     m_channel->UpTransmitStart(channel, packet, this, txTime);
 
     m_lastPacket = packet;
   }
 
   void
-  CmDevice::TransmitComplete(uint32_t channel)
+  CmDevice::TransmitComplete(uint32_t serviceId)
   {
     NS_LOG_FUNCTION (this);
     m_transmitCompleteTrace(m_lastPacket);
     m_lastPacket = NULL;
 
-    if (!m_packetQueue.empty())
+    std::list<ServiceStruct>::iterator service = FindService (serviceId);
+    if (service == m_services.end ()) return;
+
+    ChangeState (service, kReadyToSend);
+  }
+
+  void
+  CmDevice::SendRequest(uint32_t serviceId)
+  {
+    std::list<ServiceStruct>::iterator service = FindService (serviceId);
+    if (service == m_services.end ()) return;
+
+    if (IsQueueEmpty (service))
       {
-        TransmitStart(m_packetQueue.front(), channel);
-        m_packetQueue.pop_front();
+        service->state = kDecision;
+        ProcessState (service);
+        return;
       }
+
+    uint32_t minislots = RequestedMinislots (service);
+    uint32_t overhead = m_channel->GetUpstreamPhyOverhead (service->channel);
+
+    Ptr<Packet> request = Create<Packet> ();
+    DocsisHeader dh;
+    if (minislots > 255 && (m_requestStrategy == kRequestQueueDepth || !service->bondedChannels.empty ()))
+      dh.setupMSHRequestQD (overhead, service->serviceId, std::min (minislots, (uint32_t) 0xFFFF), kUpstream);
+    else
+      dh.setupMSHRequest (overhead, service->serviceId, std::min (minislots, (uint32_t) 255), kUpstream);
+    request->AddHeader (dh);
+
+    TransmitStart (request, service, service->channel);
   }
 
   void
-  CmDevice::ProcessPacket(Ptr< Packet > packet, uint32_t channel)
+  CmDevice::SendData(uint32_t serviceId, Slot slot)
+  {
+    std::list<ServiceStruct>::iterator service = FindService (serviceId);
+    if (service == m_services.end ()) return;
+
+    service->grantEnd = slot.minislot + slot.length;
+    uint32_t budget = GrantBytes (slot.channel, slot.length);
+
+    Ptr<Packet> burst;
+    if (!service->bondedChannels.empty ())
+      burst = Segment (service, slot.channel, budget);
+    else
+      {
+        if (!service->head)
+          burst = Concatenate (service, budget);
+        if (!burst)
+          burst = Fragment (service, budget);
+      }
+
+    if (!burst)
+      {
+        // Nothing fits, the grant goes unused.
+        ChangeState (service, kReadyToSend);
+        return;
+      }
+
+    TransmitStart (burst, service, slot.channel);
+  }
+
+  Ptr<Packet>
+  CmDevice::Concatenate(std::list<ServiceStruct>::iterator service, uint32_t budget)
+  {
+    uint32_t overhead = m_channel->GetUpstreamPhyOverhead (service->channel);
+    DocsisHeader concatenation;
+    concatenation.setupMSHConcatenation (0, 0, 0, kUpstream);
+
+    // Take the frames that fit whole. More than one needs a concatenation
+    // header, and only the burst as a whole carries the PHY overhead. Frames
+    // leave the queue only once they are known to fit, so the queue sees
+    // its departures when the grants are used.
+    uint32_t bytes = 0;
+    m_burstFrames.clear ();
+    while (!service->queue->IsEmpty () && m_burstFrames.size () < 255)
+      {
+        uint32_t next = bytes + FrameBytes (service, service->queue->Peek ());
+        if (overhead + next + (m_burstFrames.empty () ? 0 : concatenation.GetSerializedSize ()) > budget) break;
+        bytes = next;
+        m_burstFrames.push_back (service->queue->Dequeue ());
+      }
+    uint32_t frames = m_burstFrames.size ();
+    if (frames == 0)
+      return NULL;
+
+    // Headers go on the queued packets themselves, and the first one takes
+    // the others at its end.
+    Ptr<Packet> burst;
+    for (uint32_t i = 0; i < frames; i++)
+      {
+        Ptr<Packet> pdu = m_burstFrames[i];
+
+        DocsisHeader dh;
+        dh.setupPduPacket (frames > 1 ? 0 : overhead, pdu->GetSize (), kUpstream);
+
+        // The last frame sent on the grants known so far asks for what is
+        // left, which saves a contention cycle.
+        uint8_t request = i == frames - 1 ? std::min (PiggybackRequest (service), (uint32_t) 255) : 0;
+        if (request > 0)
+          {
+            DocsisHeader::ExtendedHeader::ExtendedHeaderElement ehe;
+            ehe.m_type = DocsisHeader::kEHRequest;
+            ehe.m_length = 3;
+            ehe.m_sid = service->serviceId;
+            ehe.m_minislots = request;
+            dh.addExtendedHeader (ehe);
+          }
+        pdu->AddHeader (dh);
+
+        if (!burst)
+          burst = pdu;
+        else
+          burst->AddAtEnd (pdu);
+      }
+    m_burstFrames.clear ();
+
+    if (frames > 1)
+      {
+        concatenation.setupMSHConcatenation (overhead, frames, burst->GetSize (), kUpstream);
+        burst->AddHeader (concatenation);
+      }
+
+    return burst;
+  }
+
+  Ptr<Packet>
+  CmDevice::Fragment(std::list<ServiceStruct>::iterator service, uint32_t budget)
+  {
+    if (IsQueueEmpty (service))
+      return NULL;
+
+    DocsisHeader::ExtendedHeader::ExtendedHeaderElement ehe;
+    ehe.m_type = DocsisHeader::kUpstreamPrivacy;
+    ehe.m_length = 5;
+    ehe.m_sid = service->serviceId;
+
+    DocsisHeader fh;
+    fh.setupMSHFragmentation (m_channel->GetUpstreamPhyOverhead (service->channel), 0, ehe, kUpstream);
+    uint32_t overhead = fh.GetSerializedSize () + 4;	// Fragment CRC
+    if (budget <= overhead)
+      return NULL;
+
+    // The whole MAC frame is split, so its header goes on first.
+    if (!service->head)
+      {
+        service->head = service->queue->Dequeue ();
+        DocsisHeader dh;
+        dh.setupPduPacket (0, service->head->GetSize (), kUpstream);
+        service->head->AddHeader (dh);
+
+        service->fragmentSequence = 0;
+        ehe.m_firstFragment = true;
+      }
+    Ptr<Packet> head = service->head;
+
+    // Fragments share the buffer of the queued packet.
+    uint32_t length = std::min (head->GetSize (), budget - overhead);
+    Ptr<Packet> fragment = head->CreateFragment (0, length);
+    head->RemoveAtStart (length);
+    if (head->GetSize () == 0)
+      {
+        service->head = NULL;
+        ehe.m_lastFragment = true;
+      }
+    fragment->AddPaddingAtEnd (4);
+
+    ehe.m_fragmentSequence = service->fragmentSequence++ & 0x0F;
+    ehe.m_minislots = std::min (PiggybackRequest (service), (uint32_t) 255);
+    fh.setupMSHFragmentation (m_channel->GetUpstreamPhyOverhead (service->channel), fragment->GetSize (), ehe, kUpstream);
+    fragment->AddHeader (fh);
+
+    return fragment;
+  }
+
+  Ptr<Packet>
+  CmDevice::Segment(std::list<ServiceStruct>::iterator service, uint32_t channel, uint32_t budget)
+  {
+    SegmentHeader sh;
+    sh.Setup (m_channel->GetUpstreamPhyOverhead (channel), false, 0, 0, 0, 0);
+    if (IsQueueEmpty (service) || budget <= sh.GetSerializedSize ())
+      return NULL;
+
+    // The queue is cut as one stream of bytes, so frames continue from one
+    // segment to the next whatever channel carries them.
+    Ptr<Packet> segment = Create<Packet> ();
+    uint32_t room = budget - sh.GetSerializedSize ();
+    bool pointerValid = false;
+    uint16_t pointer = 0;
+    while (room > 0 && !IsQueueEmpty (service))
+      {
+        if (!service->head)
+          {
+            if (!pointerValid)
+              {
+                pointerValid = true;
+                pointer = segment->GetSize ();
+              }
+
+            service->head = service->queue->Dequeue ();
+            DocsisHeader dh;
+            dh.setupPduPacket (0, service->head->GetSize (), kUpstream);
+            service->head->AddHeader (dh);
+          }
+        Ptr<Packet> head = service->head;
+
+        uint32_t length = std::min (head->GetSize (), room);
+        segment->AddAtEnd (head->CreateFragment (0, length));
+        head->RemoveAtStart (length);
+        room -= length;
+
+        if (head->GetSize () == 0)
+          service->head = NULL;
+      }
+
+    uint32_t request = std::min (PiggybackRequest (service), (uint32_t) 0x3FFF);
+    sh.Setup (m_channel->GetUpstreamPhyOverhead (channel), pointerValid, pointer, service->segmentSequence++ & 0x1FFF, 0, request);
+    segment->AddHeader (sh);
+    return segment;
+  }
+
+  uint32_t
+  CmDevice::PiggybackRequest(std::list<ServiceStruct>::iterator service)
+  {
+    // Segment headers always have room for a request.
+    if ((m_requestStrategy == kRequestHeadOfLine && service->bondedChannels.empty ()) || service->mode == kUnsolicitedGrant ||
+        service->pendingGrants != 1 || IsQueueEmpty (service))
+      return 0;
+
+    service->piggybacked = true;
+    service->requestEnd = service->grantEnd;
+    return RequestedMinislots (service);
+  }
+
+  uint32_t
+  CmDevice::FrameBytes(std::list<ServiceStruct>::iterator service, Ptr<const Packet> pdu)
+  {
+    // The rest of a frame already being fragmented goes out as a fragment.
+    if (pdu == service->head)
+      {
+        DocsisHeader::ExtendedHeader::ExtendedHeaderElement ehe;
+        ehe.m_type = DocsisHeader::kUpstreamPrivacy;
+        ehe.m_length = 5;
+        DocsisHeader fh;
+        fh.setupMSHFragmentation (0, 0, ehe, kUpstream);
+        return fh.GetSerializedSize () + pdu->GetSize () + 4;
+      }
+
+    DocsisHeader dh;
+    dh.setupPduPacket (0, pdu->GetSize (), kUpstream);
+    uint32_t bytes = pdu->GetSize () + dh.GetSerializedSize ();
+
+    // Room for a piggybacked request is always reserved.
+    if (m_requestStrategy != kRequestHeadOfLine)
+      bytes += 4;
+
+    return bytes;
+  }
+
+  uint32_t
+  CmDevice::GrantBytes(uint32_t channel, uint32_t minislots)
+  {
+    double bits = m_upstreamClocks[channel].GetDuration (minislots).GetSeconds () * m_channel->GetUpstreamDataRate (channel, m_handle).GetBitRate ();
+    return (uint32_t) std::floor (bits / 8 + 1e-6);
+  }
+
+  uint32_t
+  CmDevice::RequestedMinislots(std::list<ServiceStruct>::iterator service)
   {
+    if (IsQueueEmpty (service)) return 0;
+
+    // Every queued frame takes the same MAC header, so the queue's byte and
+    // packet counts are enough to size a request.
     DocsisHeader dh;
+    dh.setupPduPacket (0, 0, kUpstream);
+    uint32_t queued = service->queue->GetNBytes () + service->queue->GetNPackets () * dh.GetSerializedSize ();
+
+    uint32_t bytes = m_channel->GetUpstreamPhyOverhead (service->channel);
+    if (!service->bondedChannels.empty ())
+      {
+        // A bonded flow asks for the whole stream, plus a segment header for
+        // every channel it is likely to be spread over.
+        SegmentHeader sh;
+        sh.Setup (bytes, false, 0, 0, 0, 0);
+        bytes = sh.GetSerializedSize () * service->bondedChannels.size () + queued;
+        if (service->head)
+          bytes += service->head->GetSize ();
+        return BytesToMinislots (service, bytes);
+      }
+
+    if (m_requestStrategy != kRequestQueueDepth)
+      return BytesToMinislots (service, bytes + FrameBytes (service, service->head ? Ptr<const Packet> (service->head) : service->queue->Peek ()));
+
+    // The whole queue, packed in concatenated bursts, with room for a
+    // piggybacked request in every frame.
+    uint32_t frames = service->queue->GetNPackets ();
+    bytes += queued + frames * 4;
+    if (service->head)
+      {
+        bytes += FrameBytes (service, service->head);
+        frames++;
+      }
+
+    if (frames > 1)
+      {
+        DocsisHeader concatenation;
+        concatenation.setupMSHConcatenation (0, 0, 0, kUpstream);
+        bytes += concatenation.GetSerializedSize ();
+      }
+    return BytesToMinislots (service, bytes);
+  }
+
+  bool
+  CmDevice::ScheduleSlot(std::list<ServiceStruct>::iterator service, Slot slot, bool isRequest)
+  {
+    // The burst has to leave early enough to reach the CMTS at the start of
+    // the slot. Slot times are on the simulation clock, so the offset of a
+    // ranged CM is its one way delay.
+    Time txTime = slot.startingTime - m_rangingOffset;
+    if (txTime < Simulator::Now () || slot.length == 0)
+      return false;
+
+    if (isRequest)
+      Simulator::ScheduleWithContext (GetContext (), txTime - Simulator::Now (), &CmDevice::SendRequest, this, service->serviceId);
+    else
+      Simulator::ScheduleWithContext (GetContext (), txTime - Simulator::Now (), &CmDevice::SendData, this, service->serviceId, slot);
+    return true;
+  }
+
+  uint32_t
+  CmDevice::BytesToMinislots(std::list<ServiceStruct>::iterator service, uint32_t bytes)
+  {
+    return service->clock.GetMinislotsCovering (m_channel->GetUpstreamTxTime (service->channel, bytes, m_handle));
+  }
+
+  std::list<CmDevice::ServiceStruct>::iterator
+  CmDevice::FindService(uint32_t serviceId)
+  {
+    std::list<ServiceStruct>::iterator service = m_services.begin ();
+    while (service != m_services.end () && service->serviceId != serviceId)
+      service++;
+    return service;
+  }
+
+  bool
+  CmDevice::UsesChannel(std::list<ServiceStruct>::iterator service, uint32_t channel)
+  {
+    if (service->bondedChannels.empty ())
+      return service->channel == channel;
+    return std::find (service->bondedChannels.begin (), service->bondedChannels.end (), channel) != service->bondedChannels.end ();
+  }
+
+  // The context of the node, for the events the CM schedules while it
+  // handles a broadcast delivered in the context of another CM.
+  uint32_t
+  CmDevice::GetContext() const
+  {
+    return m_node ? m_node->GetId () : Simulator::GetContext ();
+  }
+
+  void
+  CmDevice::ProcessPacket(Ptr< Packet > packet, uint32_t channel, ParsedMAP *map)
+  {
+    DocsisHeader dh (m_channel->GetDownstreamPhyOverhead (channel));
     packet->RemoveHeader(dh);
 
     if (dh.IsDataPacket())
-      ProcessData(packet, channel);
+      {
+        const DocsisHeader::ExtendedHeader::ExtendedHeaderElement *ehe = dh.findExtendedHeader (DocsisHeader::kDownstreamService);
+        if (ehe && ehe->m_length == 5)
+          Resequence (ehe->m_sid, ehe->m_packetSequenceNumber, packet, channel);
+        else
+          ProcessData(packet, channel);
+      }
 
     if (dh.IsManagementPacket())
-      ProcessManagement(packet, channel);
+      ProcessManagement(packet, channel, map);
   }
 
   void
-  CmDevice::ProcessManagement(Ptr< Packet > packet, uint32_t channel)
+  CmDevice::ProcessManagement(Ptr< Packet > packet, uint32_t channel, ParsedMAP *map)
   {
     MacManagementMessageHeader mmmh;
     packet->RemoveHeader (mmmh);
 
     if (!mmmh.IsValidDestination (m_address)) return;
 
-    if (mmmh.IsMAPPacket ())
-      ProcessMAP (packet, channel);
+    switch (mmmh.GetType ())
+      {
+      case MacManagementMessageHeader::kMAP:
+        m_cmtsAddress = mmmh.GetSource ();
+        ProcessMAP (packet, channel, map);
+        break;
+      case MacManagementMessageHeader::kRangingResponse:
+        ProcessRangingResponse (packet);
+        break;
+      case MacManagementMessageHeader::kRegistrationResponse:
+        ProcessRegistrationResponse (packet);
+        break;
+      default:
+        break;
+      }
   }
 
   void
-  CmDevice::ProcessMAP(Ptr< Packet > packet, uint32_t channel)
+  CmDevice::ProcessMAP(Ptr< Packet > packet, uint32_t channel, ParsedMAP *map)
   {
-    MAPHeader mh;
-    packet->RemoveHeader (mh);
-
-    for(MAPHeader::InfoElementIterator ies=mh.InfoElementBegin (); ies != mh.InfoElementEnd (); ies++)
+    // The copy each CM strips is the same MAP, so the first CM of the
+    // delivery parses and indexes it and the rest only read the result.
+    ParsedMAP own;
+    ParsedMAP &parsed = map ? *map : own;
+    if (!parsed.valid)
+      {
+        packet->RemoveHeader (parsed.map);
+        parsed.index.Build (parsed.map);
+        parsed.valid = true;
+      }
+    const MAPHeader &mh = parsed.map;
+    const MAPIndex &index = parsed.index;
+    uint32_t ucid = mh.GetUpstreamChannelId ();
+
+    // CMs initialize on the primary upstream channel.
+    if (m_initState != kOperational && ucid == 0)
+      ProcessMaintenance (mh, index);
+
+    // IEs after the null IE are zero length grants announcing grants pending.
+    uint32_t nullIndex = mh.GetNullInformationElement ();
+    const uint8_t *broadcastFirst, *broadcastLast;
+    index.FindInformationElements (MAPHeader::BROADCAST_SID, broadcastFirst, broadcastLast);
+
+    // A bonded flow takes grants from the MAP of every channel in its group,
+    // but contends and learns about its requests on the primary one only.
+    for (std::list<ServiceStruct>::iterator service = m_services.begin (); service != m_services.end (); service++)
       {
-        if (ies->m_type == MAPHeader::kShortDataGrant || ies->m_type == MAPHeader::kLargeDataGrant)
+        if (!UsesChannel (service, ucid)) continue;
+        service->availableSlots.clear ();
+        service->requestSlots.clear ();
+
+        bool primary = service->channel == ucid;
+        if (primary)
           {
-            for (std::list<ServiceStruct>::iterator service = m_services.begin (); service != m_services.end (); service++)\
-              {
-                if (service->channel == mh.GetUpstreamChannelId () && service->serviceId == ies->m_sid)
-                  {
-                    Slot slot;
-                    MAPHeader::InfoElementIterator nextInfo = ies; nextInfo++;
+            service->grantPending = false;
+            service->ackTime = mh.GetAckTime ();
+            service->backoffStart = mh.GetDataBackoffStart ();
+            service->backoffEnd = mh.GetDataBackoffEnd ();
+          }
 
-                    slot.startingTime = Time(service->timePerMinislot.GetDouble() * mh.GetSlotNumber (*ies));
-                    slot.length = nextInfo->m_offset - ies->m_offset;
+        // Walk the IEs addressed to the SID and the broadcast ones together,
+        // in MAP order.
+        const uint8_t *own, *ownLast;
+        index.FindInformationElements (service->serviceId, own, ownLast);
+        const uint8_t *broadcast = primary ? broadcastFirst : broadcastLast;
+        while (own != ownLast || broadcast != broadcastLast)
+          {
+            bool fromOwn = broadcast == broadcastLast || (own != ownLast && *own < *broadcast);
+            uint32_t index = fromOwn ? *own++ : *broadcast++;
+            const MAPHeader::InformationElement &ie = mh.GetInformationElement (index);
+
+            bool isGrant = fromOwn && (ie.m_type == MAPHeader::kShortDataGrant || ie.m_type == MAPHeader::kLargeDataGrant || ie.m_type == MAPHeader::kUnsolicitedGrant);
+            bool isRequest = primary && ie.m_type == MAPHeader::kRequest;
+            if (!isGrant && !isRequest) continue;
 
-                    service->availableSlots.push_back(slot);
-                  }
+            if (index > nullIndex)
+              {
+                service->grantPending = service->grantPending || isGrant;
+                continue;
               }
+            if (index + 1 >= mh.GetNInformationElements ()) continue;
+
+            Slot slot;
+            slot.minislot = mh.GetSlotNumber (ie);
+            slot.startingTime = m_upstreamClocks[ucid].GetMinislotStart (slot.minislot);
+            slot.length = mh.GetInformationElement (index + 1).m_offset - ie.m_offset;
+            slot.channel = ucid;
+
+            if (isGrant)
+              service->availableSlots.push_back(slot);
+            else
+              service->requestSlots.push_back(slot);
+          }
+      }
+
+    for (std::list<ServiceStruct>::iterator service = m_services.begin (); service != m_services.end (); service++)
+      if (service->channel == ucid || (UsesChannel (service, ucid) && !service->availableSlots.empty ()))
+        ChangeState (service, kNewMap);
+  }
+
+  void
+  CmDevice::ProcessMaintenance(const MAPHeader &mh, const MAPIndex &index)
+  {
+    // One RNG-REQ at a time, until it is answered or T3 runs out. The
+    // minislot timing comes with the UCD, which the CMTS hands over on
+    // attach.
+    if (m_maintenancePending || m_rangingTimeout.IsRunning () || m_upstreamClocks.empty ()) return;
+
+    MAPHeader::IEType wanted = MAPHeader::kInitialManteinance;
+    uint16_t sid = MAPHeader::BROADCAST_SID;
+    if (m_initState == kInitialRanging)
+      {
+        // Initial maintenance is contended for like requests, with the
+        // ranging backoff window.
+        if (!m_rangingBackoffDrawn)
+          {
+            m_rangingBackoffExponent = std::min (std::max (m_rangingBackoffExponent, mh.GetRangingBackoffStart ()), mh.GetRangingBackoffEnd ());
+            m_rangingDeferCount = m_backoffRng->GetInteger (0, (1 << m_rangingBackoffExponent) - 1);
+            m_rangingBackoffDrawn = true;
+          }
+      }
+    else
+      {
+        wanted = m_initState == kStationRanging ? MAPHeader::kStationManteinance : MAPHeader::kShortDataGrant;
+        sid = m_rangingSid;
+      }
+
+    uint32_t nullIndex = mh.GetNullInformationElement ();
+    const uint8_t *first, *last;
+    index.FindInformationElements (sid, first, last);
+    for (; first != last; first++)
+      {
+        const MAPHeader::InformationElement &ie = mh.GetInformationElement (*first);
+        if (ie.m_type != wanted || *first >= nullIndex || *first + 1u >= mh.GetNInformationElements ()) continue;
+
+        Time start = m_upstreamClocks[0].GetMinislotStart (mh.GetSlotNumber (ie));
+        Time txTime = start - m_rangingOffset;
+        if (txTime < Simulator::Now ()) continue;
+
+        if (m_initState == kInitialRanging && m_rangingDeferCount > 0)
+          {
+            m_rangingDeferCount--;
+            continue;
           }
+
+        // T3 starts when the RNG-REQ goes out, in the context of the CM.
+        m_maintenancePending = true;
+        Simulator::ScheduleWithContext (GetContext (), txTime - Simulator::Now (), &CmDevice::SendMaintenance, this, 0);
+        return;
+      }
+  }
+
+  void
+  CmDevice::SendMaintenance(uint32_t channel)
+  {
+    m_maintenancePending = false;
+    if (!m_channel || m_initState == kOperational) return;
+
+    Ptr<Packet> packet = Create<Packet> ();
+    MacManagementMessageHeader::MmmType type;
+    if (m_initState == kRegistering)
+      {
+        RegistrationRequestHeader reg;
+        reg.SetSid (m_rangingSid);
+        packet->AddHeader (reg);
+        type = MacManagementMessageHeader::kRegistrationRequest;
+      }
+    else
+      {
+        RangingRequestHeader rng;
+        rng.SetSid (m_rangingSid);
+        packet->AddHeader (rng);
+        type = MacManagementMessageHeader::kRangingRequest;
+      }
+
+    MacManagementMessageHeader mmmh;
+    mmmh.Setup (m_address, m_cmtsAddress, packet->GetSize () + 6, type);
+    packet->AddHeader (mmmh);
+
+    DocsisHeader dh;
+    dh.setupMSHManagement (m_channel->GetUpstreamPhyOverhead (channel), packet->GetSize (), kUpstream);
+    packet->AddHeader (dh);
+
+    m_transmitStartTrace (packet);
+    m_snifferTrace (packet, m_channel->GetUpstreamPhyOverhead (channel));
+    m_channel->UpTransmitStart (channel, packet, this, m_channel->GetUpstreamTxTime (channel, packet->GetSize ()));
+    if (type == MacManagementMessageHeader::kRangingRequest)
+      m_rangingTimeout = Simulator::Schedule (m_t3, &CmDevice::RangingTimeout, this);
+  }
+
+  void
+  CmDevice::ProcessRangingResponse(Ptr< Packet > packet)
+  {
+    RangingResponseHeader rsp;
+    packet->RemoveHeader (rsp);
+    if (m_initState != kInitialRanging && m_initState != kStationRanging) return;
+
+    NS_LOG_FUNCTION (this << rsp.GetSid () << rsp.GetTimingAdjust () << rsp.GetStatus ());
+    Simulator::Cancel (m_rangingTimeout);
+
+    if (rsp.GetStatus () == RangingResponseHeader::kAbort)
+      {
+        m_rangingOffset = Seconds (0);
+        m_rangingSid = 0;
+        StartRanging ();
+        return;
       }
+
+    m_rangingOffset += NanoSeconds (rsp.GetTimingAdjust ());
+    m_rangingSid = rsp.GetSid ();
+    m_initState = rsp.GetStatus () == RangingResponseHeader::kSuccess ? kRegistering : kStationRanging;
+  }
+
+  void
+  CmDevice::ProcessRegistrationResponse(Ptr< Packet > packet)
+  {
+    RegistrationResponseHeader rsp;
+    packet->RemoveHeader (rsp);
+    if (m_initState != kRegistering || rsp.GetResponse () != 0) return;
+
+    NS_LOG_FUNCTION (this << m_rangingSid);
+    m_initState = kOperational;
+    m_rangingSid = 0;
+    m_linkUp = true;
+    m_linkChangeCallbacks ();
+  }
+
+  void
+  CmDevice::RangingTimeout()
+  {
+    NS_LOG_FUNCTION (this);
+
+    // The RNG-REQ collided, or station maintenance went wrong. Contend
+    // again, with a wider window.
+    m_rangingBackoffExponent++;
+    m_initState = kInitialRanging;
+    m_rangingBackoffDrawn = false;
+  }
+
+  void
+  CmDevice::StartRanging()
+  {
+    m_initState = kInitialRanging;
+    m_rangingBackoffExponent = 0;
+    m_rangingBackoffDrawn = false;
+    Simulator::Cancel (m_rangingTimeout);
   }
 
   void
@@ -395,7 +1291,7 @@ namespace ns3 {
     PDUHeader pduh;
     packet->RemoveHeader (pduh);
     packet->RemoveAtEnd (4);
-    if (pduh.GetDestination () != m_address) return;
+    if (pduh.GetDestination () != m_address && !pduh.GetDestination ().IsBroadcast ()) return;
 
     uint16_t protocol = pduh.GetTypeLength ();
     if (protocol <= 1500)
@@ -408,7 +1304,272 @@ namespace ns3 {
         protocol = llc.GetType ();
       }
 
-    m_rxCallback(this, packet, protocol, pduh.GetSource ());
+    // A broadcast reaches every CM of a delivery window in one event, in
+    // the context of the first, and the stack runs what a frame sets off in
+    // the context it gets the frame in. A frame for the stack of another
+    // node takes an event to get there.
+    if (Simulator::GetContext () != GetContext ())
+      {
+        Simulator::ScheduleWithContext (GetContext (), Seconds (0), &CmDevice::ForwardUp, this, packet, protocol, pduh.GetSource ());
+        return;
+      }
+    ForwardUp (packet, protocol, pduh.GetSource ());
+  }
+
+  void
+  CmDevice::ForwardUp(Ptr<Packet> packet, uint16_t protocol, Mac48Address source)
+  {
+    if (!m_rxCallback.IsNull ())
+      m_rxCallback(this, packet, protocol, source);
+  }
+
+  void
+  CmDevice::Resequence(uint32_t dsid, uint16_t sequence, Ptr< Packet > packet, uint32_t channel)
+  {
+    // The CMTS numbers every DSID from zero once the CM is registered.
+    DsidState &state = m_dsids[dsid];
+    int16_t offset = (int16_t) (sequence - (uint16_t) state.expected);
+    if (offset < 0)
+      {
+        // Its place in sequence was already given up.
+        m_rxDropTrace (packet);
+        return;
+      }
+
+    state.pending[state.expected + offset] = packet;
+    ReleaseInOrder (dsid, channel);
+  }
+
+  void
+  CmDevice::ReleaseInOrder(uint32_t dsid, uint32_t channel)
+  {
+    DsidState &state = m_dsids[dsid];
+    while (!state.pending.empty () && state.pending.begin ()->first == state.expected)
+      {
+        Ptr<Packet> packet = state.pending.begin ()->second;
+        state.pending.erase (state.pending.begin ());
+        state.expected++;
+        ProcessData (packet, channel);
+      }
+
+    if (state.pending.empty ())
+      {
+        Simulator::Cancel (state.timeout);
+        return;
+      }
+
+    // The timer runs for the oldest gap only.
+    if (state.timeout.IsRunning () && state.timeoutFor == state.expected)
+      return;
+
+    Simulator::Cancel (state.timeout);
+    state.timeoutFor = state.expected;
+    state.timeout = Simulator::Schedule (m_resequencingTimeout, &CmDevice::ResequencingTimeout, this, dsid, channel);
+  }
+
+  void
+  CmDevice::ResequencingTimeout(uint32_t dsid, uint32_t channel)
+  {
+    DsidState &state = m_dsids[dsid];
+    if (state.pending.empty ()) return;
+
+    // Give up on the missing frames and go on with the next one received.
+    state.expected = state.pending.begin ()->first;
+    ReleaseInOrder (dsid, channel);
+  }
+
+  void
+  CmDevice::ChangeState(std::list<ServiceStruct>::iterator service, CmEvent newEvent)
+  {
+    service->currEvent = newEvent;
+    ProcessState (service);
+  }
+
+  void
+  CmDevice::ProcessState(std::list<ServiceStruct>::iterator service)
+  {
+    switch (service->state)
+      {
+      case kIdle:
+        ProcessIdle (service);
+        break;
+      case kDecision:
+        ProcessDecision (service);
+        break;
+      case kToSendRequest:
+        ProcessToSendRequest (service);
+        break;
+      case kReqSend:
+        ProcessRequestSend (service);
+        break;
+      case kWaitForMap:
+        ProcessWaitForMap (service);
+        break;
+      case kToSend:
+        ProcessToSend (service);
+        break;
+      case kContention:
+        ProcessContention (service);
+        break;
+      default:
+        break;
+      }
+  }
+
+  void
+  CmDevice::ProcessIdle(std::list<ServiceStruct>::iterator service)
+  {
+    if (service->currEvent != kNewPacket) return;
+
+    service->state = kDecision;
+    ProcessState (service);
+  }
+
+  void
+  CmDevice::ProcessDecision(std::list<ServiceStruct>::iterator service)
+  {
+    if (IsQueueEmpty (service))
+      service->state = kIdle;
+    else if (service->mode == kUnsolicitedGrant || service->mode == kProactiveGrant)
+      service->state = kWaitForMap;	// Grants arrive without asking, PGS piggybacks the excess
+    else if (service->piggybacked || service->grantPending)
+      {
+        // The CMTS already knows about the backlog.
+        service->piggybacked = false;
+        service->state = kWaitForMap;
+      }
+    else if (service->mode == kRealTimePolling)
+      service->state = kToSendRequest;	// Requests go in unicast polls
+    else
+      {
+        service->state = kContention;
+        service->backoffExponent = 0;
+        service->backoffDrawn = false;
+        service->retries = 0;
+      }
+  }
+
+  void
+  CmDevice::ProcessToSendRequest(std::list<ServiceStruct>::iterator service)
+  {
+    if (service->currEvent != kNewMap) return;
+
+    for (std::vector<Slot>::const_iterator slot = service->requestSlots.begin (); slot != service->requestSlots.end (); slot++)
+      if (ScheduleSlot (service, *slot, true))
+        {
+          service->requestEnd = slot->minislot + slot->length;
+          service->state = kReqSend;
+          return;
+        }
+  }
+
+  void
+  CmDevice::ProcessRequestSend(std::list<ServiceStruct>::iterator service)
+  {
+    if (service->currEvent != kReadyToSend) return;
+
+    service->state = kWaitForMap;
+  }
+
+  void
+  CmDevice::ProcessWaitForMap(std::list<ServiceStruct>::iterator service)
+  {
+    if (service->currEvent != kNewMap) return;
+
+    for (std::vector<Slot>::const_iterator slot = service->availableSlots.begin (); slot != service->availableSlots.end (); slot++)
+      if (ScheduleSlot (service, *slot, false))
+        service->pendingGrants++;
+
+    if (service->pendingGrants > 0)
+      {
+        service->retries = 0;
+        service->state = kToSend;
+      }
+    else if (service->mode != kUnsolicitedGrant && service->mode != kProactiveGrant && !service->grantPending &&
+             (int32_t) (service->ackTime - service->requestEnd) >= 0)
+      RequestLost (service);
+  }
+
+  void
+  CmDevice::ProcessToSend(std::list<ServiceStruct>::iterator service)
+  {
+    if (service->currEvent == kNewMap)
+      {
+        // Unsolicited grants keep coming while earlier ones are in use.
+        for (std::vector<Slot>::const_iterator slot = service->availableSlots.begin (); slot != service->availableSlots.end (); slot++)
+          if (ScheduleSlot (service, *slot, false))
+            service->pendingGrants++;
+        return;
+      }
+
+    if (service->currEvent != kReadyToSend) return;
+
+    if (--service->pendingGrants > 0) return;
+
+    service->state = kDecision;
+    ProcessState (service);
+  }
+
+  void
+  CmDevice::ProcessContention(std::list<ServiceStruct>::iterator service)
+  {
+    if (service->currEvent != kNewMap) return;
+
+    // Truncated binary exponential backoff: defer a random number of request
+    // opportunities within the current window.
+    if (!service->backoffDrawn)
+      {
+        service->backoffExponent = std::min (std::max (service->backoffExponent, service->backoffStart), service->backoffEnd);
+        service->deferCount = m_backoffRng->GetInteger (0, (1 << service->backoffExponent) - 1);
+        service->backoffDrawn = true;
+      }
+
+    for (std::vector<Slot>::const_iterator slot = service->requestSlots.begin (); slot != service->requestSlots.end (); slot++)
+      {
+        if (slot->startingTime - m_rangingOffset < Simulator::Now () || slot->length == 0) continue;
+
+        if (service->deferCount > 0)
+          {
+            service->deferCount--;
+            continue;
+          }
+
+        if (ScheduleSlot (service, *slot, true))
+          {
+            service->requestEnd = slot->minislot + slot->length;
+            service->state = kReqSend;
+            return;
+          }
+      }
+  }
+
+  void
+  CmDevice::RequestLost(std::list<ServiceStruct>::iterator service)
+  {
+    NS_LOG_FUNCTION (this << service->serviceId << service->retries);
+
+    if (++service->retries > m_maxRequestRetries)
+      {
+        if (!IsQueueEmpty (service))
+          {
+            m_dropTrace (service->head ? service->head : service->queue->Dequeue ());
+            service->head = NULL;
+          }
+        service->state = kDecision;
+        ProcessState (service);
+        if (service->state == kIdle) return;
+      }
+    else if (service->mode == kBestEffort)
+      {
+        service->backoffExponent++;
+        service->backoffDrawn = false;
+        service->state = kContention;
+      }
+    else
+      service->state = kToSendRequest;
+
+    // The MAP that revealed the loss may already offer a new opportunity.
+    ProcessState (service);
   }
 
 }
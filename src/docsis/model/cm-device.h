@@ -22,17 +22,26 @@
 
 #include <vector>
 #include <list>
+#include <map>
 #include "docsis-enums.h"
+#include "docsis-service-flow.h"
+#include "docsis-minislot-clock.h"
 #include "ns3/packet.h"
 #include "ns3/net-device.h"
 #include "ns3/node.h"
 #include "ns3/mac48-address.h"
 #include "ns3/traced-callback.h"
 #include "ns3/nstime.h"
+#include "ns3/event-id.h"
+#include "ns3/random-variable-stream.h"
+#include "ns3/queue.h"
 
 namespace ns3 {
 
   class Hfc;
+  class MAPHeader;
+  class MAPIndex;
+  struct ParsedMAP;
 
   class CmDevice : public NetDevice
   {
@@ -60,20 +69,67 @@ namespace ns3 {
       EventCount
     };
 
+    // Initialization, on the primary upstream channel. Fast start CMs are
+    // operational as soon as they attach.
+    enum CmInitState {
+      kInitialRanging,	// Contending in initial maintenance
+      kStationRanging,	// Adjusting in unicast station maintenance
+      kRegistering,	// Waiting for the grant to send REG-REQ in, then REG-RSP
+      kOperational
+    };
+
     struct Slot {
-      Slot() : startingTime(Seconds(0)), length(0) {}
+      Slot() : startingTime(Seconds(0)), minislot(0), length(0), channel(0) {}
       Time startingTime;
+      uint32_t minislot;
       uint16_t length;
+      uint32_t channel;
     };
     struct ServiceStruct{
+      ServiceStruct() : serviceId(0), reference(0), channel(0), mode(kBestEffort), state(kIdle), currEvent(kNone), fragmentSequence(0),
+                        pendingGrants(0), grantPending(false), ackTime(0), backoffStart(0), backoffEnd(0), backoffExponent(0),
+                        deferCount(0), backoffDrawn(false), retries(0), requestEnd(0), piggybacked(false), grantEnd(0),
+                        segmentSequence(0) {}
       uint32_t serviceId;
-      uint32_t channel;
-      Time timePerMinislot;
+      uint32_t reference;	// Service flow reference, 0 for the primary flow
+      uint32_t channel;	// Primary channel, where requests go
+      std::vector<uint32_t> bondedChannels;	// Empty unless the flow is bonded
+      DocsisMinislotClock clock;
       DocsisUpstreamChannelMode mode;
       CmUpstreamState state;
       CmEvent currEvent;
-      std::list<Slot> availableSlots;
-      std::list<Packet> packetQueue;
+      std::vector<Slot> availableSlots;	// Kept between MAPs for their capacity
+      std::vector<Slot> requestSlots;
+      Ptr<Queue> queue;
+      Ptr<Packet> head;	// Frame taken from the queue and partly sent
+      uint8_t fragmentSequence;	// Of the next fragment of the head
+      uint32_t pendingGrants;
+
+      // Contention resolution, driven by the last MAP.
+      bool grantPending;
+      uint32_t ackTime;
+      uint8_t backoffStart;
+      uint8_t backoffEnd;
+      uint8_t backoffExponent;
+      uint32_t deferCount;
+      bool backoffDrawn;
+      uint32_t retries;
+      uint32_t requestEnd;
+
+      // Whether a request for the rest of the queue went out piggybacked on
+      // the grant in use.
+      bool piggybacked;
+      uint32_t grantEnd;
+
+      uint16_t segmentSequence;
+    };
+
+    struct DsidState {
+      DsidState() : expected(0), timeoutFor(0) {}
+      uint32_t expected;	// Sequence numbers, extended past their 16 bits
+      std::map< uint32_t, Ptr<Packet> > pending;
+      EventId timeout;
+      uint32_t timeoutFor;
     };
 
     void AddLinkChangeCallback (Callback<void> callback);
@@ -103,19 +159,83 @@ namespace ns3 {
 
     void Attach(Ptr<Hfc> channel);
     void Deattach();
+    uint32_t GetHandle() const;
 
-    void Receive(Ptr< Packet > packet, uint32_t channel);
+    // A broadcast comes with the MAP it carries, shared by the CMs it
+    // reaches at once; frames for one CM come with none.
+    void Receive(Ptr<const Packet> packet, uint32_t channel, ParsedMAP *map);
 
+    // The physical one way delay. Fast start CMs take it as their ranging
+    // offset, the others learn their offset by ranging.
     void SetTimeDistanceToCMTS(Time time);
     Time GetTimeDistanceToCMTS();
+    Time GetRangingOffset() const;
+    CmInitState GetInitState() const;
+
+    void AddUpstreamService(uint16_t sid, uint32_t channel, const DocsisMinislotClock &clock, DocsisUpstreamChannelMode mode, uint32_t reference = 0);
+    void SetUpstreamMinislotClock(uint32_t channel, const DocsisMinislotClock &clock);
+    void SetUpstreamBondingGroup(uint16_t sid, std::vector<uint32_t> channels);
+
+    int64_t AssignStreams(int64_t stream);
+
+    // Frames wait here until a grant takes them, so the queue sees its
+    // departures at the pace of the grants. A DropTailQueue by default.
+    void SetQueue(Ptr<Queue> queue);
+    Ptr<Queue> GetQueue(uint32_t reference = 0) const;
+
+    // Service flows besides the primary ones, which have reference 0, and
+    // the classifiers that steer packets onto them. Flows added while
+    // attached are admitted by the CMTS right away. Without a queue of its
+    // own, a low latency flow gets a DocsisDualQueue, and any other flow a
+    // DropTailQueue.
+    uint32_t AddUpstreamServiceFlow(DocsisServiceFlow flow, Ptr<Queue> queue = 0);
+    uint32_t AddDownstreamServiceFlow(DocsisServiceFlow flow);
+    // Changes the rate limits of a flow, the primary ones included. The
+    // scheduling mode of an admitted flow stays as it was admitted.
+    void SetUpstreamServiceFlow(uint32_t reference, DocsisServiceFlow flow);
+    void SetDownstreamServiceFlow(uint32_t reference, DocsisServiceFlow flow);
+    void AddUpstreamClassifier(DocsisClassifierRule rule);
+    void AddDownstreamClassifier(DocsisClassifierRule rule);
+    const std::vector<DocsisServiceFlow> &GetUpstreamServiceFlows() const;
+    const std::vector<DocsisServiceFlow> &GetDownstreamServiceFlows() const;
+    const DocsisClassifier &GetDownstreamClassifier() const;
+
+  protected:
+    virtual void DoDispose (void);
 
   private:
-    void TransmitStart(Ptr< Packet > packet, uint32_t channel);
-    void TransmitComplete(uint32_t channel);
-    void ProcessPacket(Ptr< Packet > packet, uint32_t channel);
-    void ProcessManagement(Ptr< Packet > packet, uint32_t channel);
-    void ProcessMAP(Ptr< Packet > packet, uint32_t channel);
+    void TransmitStart(Ptr< Packet > packet, std::list<ServiceStruct>::iterator service, uint32_t channel);
+    void TransmitComplete(uint32_t serviceId);
+    void SendRequest(uint32_t serviceId);
+    void SendData(uint32_t serviceId, Slot slot);
+    Ptr<Packet> Concatenate(std::list<ServiceStruct>::iterator service, uint32_t budget);
+    Ptr<Packet> Fragment(std::list<ServiceStruct>::iterator service, uint32_t budget);
+    Ptr<Packet> Segment(std::list<ServiceStruct>::iterator service, uint32_t channel, uint32_t budget);
+    uint32_t PiggybackRequest(std::list<ServiceStruct>::iterator service);
+    bool IsQueueEmpty(std::list<ServiceStruct>::iterator service);
+    void ConfigureQueue(uint32_t reference);
+    uint32_t FrameBytes(std::list<ServiceStruct>::iterator service, Ptr<const Packet> pdu);
+    uint32_t GrantBytes(uint32_t channel, uint32_t minislots);
+    uint32_t RequestedMinislots(std::list<ServiceStruct>::iterator service);
+    bool ScheduleSlot(std::list<ServiceStruct>::iterator service, Slot slot, bool isRequest);
+    uint32_t BytesToMinislots(std::list<ServiceStruct>::iterator service, uint32_t bytes);
+    std::list<ServiceStruct>::iterator FindService(uint32_t serviceId);
+    bool UsesChannel(std::list<ServiceStruct>::iterator service, uint32_t channel);
+    uint32_t GetContext() const;
+    void ProcessPacket(Ptr< Packet > packet, uint32_t channel, ParsedMAP *map);
+    void ProcessManagement(Ptr< Packet > packet, uint32_t channel, ParsedMAP *map);
+    void ProcessMAP(Ptr< Packet > packet, uint32_t channel, ParsedMAP *map);
+    void ProcessMaintenance(const MAPHeader &mh, const MAPIndex &index);
+    void ProcessRangingResponse(Ptr< Packet > packet);
+    void ProcessRegistrationResponse(Ptr< Packet > packet);
+    void SendMaintenance(uint32_t channel);
+    void RangingTimeout();
+    void StartRanging();
     void ProcessData(Ptr< Packet > packet, uint32_t channel);
+    void ForwardUp(Ptr< Packet > packet, uint16_t protocol, Mac48Address source);
+    void Resequence(uint32_t dsid, uint16_t sequence, Ptr< Packet > packet, uint32_t channel);
+    void ReleaseInOrder(uint32_t dsid, uint32_t channel);
+    void ResequencingTimeout(uint32_t dsid, uint32_t channel);
 
     void ChangeState(std::list<ServiceStruct>::iterator service, CmEvent newEvent);
     void ProcessState(std::list<ServiceStruct>::iterator service);
@@ -126,6 +246,7 @@ namespace ns3 {
     void ProcessWaitForMap(std::list<ServiceStruct>::iterator service);
     void ProcessToSend(std::list<ServiceStruct>::iterator service);
     void ProcessContention(std::list<ServiceStruct>::iterator service);
+    void RequestLost(std::list<ServiceStruct>::iterator service);
 
     uint32_t m_channels;
     uint32_t* m_transferRate;
@@ -135,19 +256,46 @@ namespace ns3 {
     Ptr<Node> m_node;
     Mac48Address m_address;
     Ptr<Hfc> m_channel;
+    uint32_t m_handle;	// Given by the channel on attach
     ReceiveCallback m_rxCallback;
     TracedCallback<> m_linkChangeCallbacks;
-    std::list< Ptr<Packet> > m_packetQueue;
+    std::vector< Ptr<Packet> > m_burstFrames;
     std::vector<DocsisChannelStatus> m_uChannelStatus;
     std::list<ServiceStruct> m_services;
+    std::vector< std::list<ServiceStruct>::iterator > m_servicesByReference;
+    std::vector<DocsisServiceFlow> m_upstreamFlows;	// Indexed by reference
+    std::vector<DocsisServiceFlow> m_downstreamFlows;
+    std::vector< Ptr<Queue> > m_queues;	// Per upstream flow
+    DocsisClassifier m_upstreamClassifier;
+    DocsisClassifier m_downstreamClassifier;
+    std::vector<DocsisMinislotClock> m_upstreamClocks;
     Ptr<Packet> m_lastPacket;
 
     Time m_timeDistance;
+    DocsisInitialization m_initialization;
+    CmInitState m_initState;
+    Time m_rangingOffset;	// Bursts leave this early for their slot
+    uint16_t m_rangingSid;	// Temporary SID, given in the first RNG-RSP
+    Mac48Address m_cmtsAddress;	// Learnt from the MAPs
+    uint8_t m_rangingBackoffExponent;
+    uint32_t m_rangingDeferCount;
+    bool m_rangingBackoffDrawn;
+    bool m_maintenancePending;	// A RNG-REQ or REG-REQ is waiting for its slot
+    EventId m_rangingTimeout;	// T3, running while a RNG-REQ is unanswered
+    Time m_t3;
+    uint32_t m_maxRequestRetries;
+    DocsisRequestStrategy m_requestStrategy;
+    Ptr<UniformRandomVariable> m_backoffRng;
+    std::map<uint32_t, DsidState> m_dsids;
+    Time m_resequencingTimeout;
 
     TracedCallback< Ptr<const Packet> > m_sendTrace;
+    TracedCallback< Ptr<const Packet> > m_dropTrace;
     TracedCallback< Ptr<const Packet> > m_transmitStartTrace;
     TracedCallback< Ptr<const Packet> > m_transmitCompleteTrace;
     TracedCallback< Ptr<const Packet> > m_receiveTrace;
+    TracedCallback< Ptr<const Packet> > m_rxDropTrace;
+    TracedCallback< Ptr<const Packet>, uint32_t > m_snifferTrace;
     TracedCallback< Ptr<const Hfc> > m_attachTrace;
     TracedCallback< Ptr<const Hfc> > m_deattachTrace;
     TracedCallback< Address > m_addressChangeTrace;
@@ -0,0 +1,368 @@
+/* -*- Mode:C++; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/*
+ * Copyright (c) 2013 Martín Javier Di Liscia
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * Author: Martín Javier Di Liscia
+ */
+
+#include "ns3/log.h"
+#include "cmts-chassis.h"
+#include "cm-device.h"
+#include "ns3/channel.h"
+
+NS_LOG_COMPONENT_DEFINE ("CmtsChassis");
+
+namespace ns3 {
+
+NS_OBJECT_ENSURE_REGISTERED (CmtsChassis);
+
+TypeId
+CmtsChassis::GetTypeId (void)
+{
+  static TypeId tid = TypeId("ns3::CmtsChassis")
+    .SetParent<NetDevice> ()
+    .AddConstructor<CmtsChassis> ()
+    .AddTraceSource("MacTx",
+                    "Trace source indicating a packet has arrived for transmission by this device",
+                    MakeTraceSourceAccessor(&CmtsChassis::m_sendTrace) )
+    .AddTraceSource("MacTxDrop",
+                    "A packet has been dropped because no segment serves its destination",
+                    MakeTraceSourceAccessor(&CmtsChassis::m_dropTrace) )
+    .AddTraceSource("MacRx",
+                    "A packet has been received by a segment and is being forwarded up the local protocol stack",
+                    MakeTraceSourceAccessor(&CmtsChassis::m_receiveTrace) )
+    ;
+
+  return tid;
+}
+
+CmtsChassis::CmtsChassis () : m_started(false), m_deviceIndex(0), m_mtu(1500), m_node(NULL)
+{
+}
+
+CmtsChassis::~CmtsChassis ()
+{
+}
+
+void
+CmtsChassis::DoInitialize (void)
+{
+  NS_LOG_FUNCTION (this);
+
+  // The node only initializes the devices it holds.
+  m_started = true;
+  for (std::vector< Ptr<CmtsDevice> >::iterator domain = m_domains.begin (); domain != m_domains.end (); domain++)
+    (*domain)->Initialize ();
+
+  NetDevice::DoInitialize ();
+}
+
+void
+CmtsChassis::DoDispose (void)
+{
+  NS_LOG_FUNCTION (this);
+
+  for (std::vector< Ptr<CmtsDevice> >::iterator domain = m_domains.begin (); domain != m_domains.end (); domain++)
+    (*domain)->Dispose ();
+  m_domains.clear ();
+  m_domainsByCm.clear ();
+  m_node = 0;
+  NetDevice::DoDispose ();
+}
+
+void
+CmtsChassis::AddMacDomain (Ptr<CmtsDevice> domain)
+{
+  NS_LOG_FUNCTION (this << domain);
+
+  domain->SetAddress (m_address);
+  domain->SetMtu (m_mtu);
+  domain->SetNode (m_node);
+  domain->SetIfIndex (m_deviceIndex);
+  domain->SetReceiveCallback (MakeCallback (&CmtsChassis::Receive, this));
+  domain->AddLinkChangeCallback (MakeCallback (&CmtsChassis::LinkChanged, this));
+  domain->AddCmChangeCallback (MakeCallback (&CmtsChassis::CmChanged, this));
+  m_domains.push_back (domain);
+
+  // The domain may have been attached with its CMs already.
+  std::vector<Mac48Address> cms = domain->GetCmAddresses ();
+  for (std::vector<Mac48Address>::iterator cm = cms.begin (); cm != cms.end (); cm++)
+    m_domainsByCm[*cm] = domain;
+
+  if (m_started)
+    domain->Initialize ();
+  m_linkChangeCallbacks ();
+}
+
+uint32_t
+CmtsChassis::GetNMacDomains (void) const
+{
+  return m_domains.size ();
+}
+
+Ptr<CmtsDevice>
+CmtsChassis::GetMacDomain (uint32_t i) const
+{
+  return m_domains[i];
+}
+
+Ptr<CmtsDevice>
+CmtsChassis::FindMacDomain (Mac48Address cm) const
+{
+  std::tr1::unordered_map< Mac48Address, Ptr<CmtsDevice>, Mac48AddressHash >::const_iterator entry = m_domainsByCm.find (cm);
+  if (entry == m_domainsByCm.end ())
+    return NULL;
+  return entry->second;
+}
+
+void
+CmtsChassis::CmChanged (Ptr<CmtsDevice> domain, Mac48Address cm, bool attached)
+{
+  NS_LOG_FUNCTION (this << domain << cm << attached);
+
+  if (attached)
+    {
+      m_domainsByCm[cm] = domain;
+      return;
+    }
+
+  // A CM of another domain may have taken the address since.
+  std::tr1::unordered_map< Mac48Address, Ptr<CmtsDevice>, Mac48AddressHash >::iterator entry = m_domainsByCm.find (cm);
+  if (entry != m_domainsByCm.end () && entry->second == domain)
+    m_domainsByCm.erase (entry);
+}
+
+bool
+CmtsChassis::Receive (Ptr<NetDevice> domain, Ptr<const Packet> packet, uint16_t protocol, const Address &source)
+{
+  m_receiveTrace (packet);
+  if (!m_rxCallback.IsNull ())
+    return m_rxCallback (this, packet, protocol, source);
+  return true;
+}
+
+void
+CmtsChassis::LinkChanged (void)
+{
+  m_linkChangeCallbacks ();
+}
+
+void
+CmtsChassis::AddLinkChangeCallback (Callback<void> callback)
+{
+  m_linkChangeCallbacks.ConnectWithoutContext (callback);
+}
+
+
+Address
+CmtsChassis::GetAddress (void) const
+{
+  return m_address;
+}
+
+
+Address
+CmtsChassis::GetBroadcast (void) const
+{
+  return Mac48Address ("ff:ff:ff:ff:ff:ff");
+}
+
+
+Ptr< Channel >
+CmtsChassis::GetChannel (void) const
+{
+  // Every segment has its own.
+  return NULL;
+}
+
+
+uint32_t
+CmtsChassis::GetIfIndex (void) const
+{
+  return m_deviceIndex;
+}
+
+
+uint16_t
+CmtsChassis::GetMtu (void) const
+{
+  return m_mtu;
+}
+
+
+Address
+CmtsChassis::GetMulticast (Ipv4Address multicastGroup) const
+{
+  return Mac48Address ("00:00:00:00:00:00");
+}
+
+
+Address
+CmtsChassis::GetMulticast (Ipv6Address addr) const
+{
+  return Mac48Address ("00:00:00:00:00:00");
+}
+
+
+Ptr< Node >
+CmtsChassis::GetNode (void) const
+{
+  return m_node;
+}
+
+
+bool
+CmtsChassis::IsBridge (void) const
+{
+  return false;
+}
+
+
+bool
+CmtsChassis::IsBroadcast (void) const
+{
+  return true;
+}
+
+
+bool
+CmtsChassis::IsLinkUp (void) const
+{
+  for (std::vector< Ptr<CmtsDevice> >::const_iterator domain = m_domains.begin (); domain != m_domains.end (); domain++)
+    if ((*domain)->IsLinkUp ())
+      return true;
+  return false;
+}
+
+
+bool
+CmtsChassis::IsMulticast (void) const
+{
+  return false;
+}
+
+
+bool
+CmtsChassis::IsPointToPoint (void) const
+{
+  return false;
+}
+
+
+bool
+CmtsChassis::NeedsArp (void) const
+{
+  return true;
+}
+
+
+bool
+CmtsChassis::Send (Ptr< Packet > packet, const Address &dest, uint16_t protocolNumber)
+{
+  return SendFrom (packet, m_address, dest, protocolNumber);
+}
+
+
+bool
+CmtsChassis::SendFrom (Ptr< Packet > packet, const Address &source, const Address &to, uint16_t protocolNumber)
+{
+  NS_LOG_FUNCTION (this << packet << to << protocolNumber);
+  m_sendTrace (packet);
+
+  Mac48Address dest = Mac48Address::ConvertFrom (to);
+  if (dest.IsBroadcast ())
+    {
+      bool sent = false;
+      for (std::vector< Ptr<CmtsDevice> >::iterator domain = m_domains.begin (); domain != m_domains.end (); domain++)
+        sent = (*domain)->Send (packet->Copy (), dest, protocolNumber) || sent;
+      return sent;
+    }
+
+  Ptr<CmtsDevice> domain = FindMacDomain (dest);
+  if (!domain)
+    {
+      m_dropTrace (packet);
+      return false;
+    }
+  return domain->Send (packet, dest, protocolNumber);
+}
+
+void
+CmtsChassis::SetAddress (Address address)
+{
+  NS_LOG_FUNCTION (this << address);
+
+  m_address = Mac48Address::ConvertFrom (address);
+  for (std::vector< Ptr<CmtsDevice> >::iterator domain = m_domains.begin (); domain != m_domains.end (); domain++)
+    (*domain)->SetAddress (m_address);
+}
+
+
+void
+CmtsChassis::SetIfIndex (const uint32_t index)
+{
+  NS_LOG_FUNCTION (this << index);
+
+  m_deviceIndex = index;
+  for (std::vector< Ptr<CmtsDevice> >::iterator domain = m_domains.begin (); domain != m_domains.end (); domain++)
+    (*domain)->SetIfIndex (index);
+}
+
+
+bool
+CmtsChassis::SetMtu (const uint16_t mtu)
+{
+  NS_LOG_FUNCTION (this << mtu);
+
+  m_mtu = mtu;
+  for (std::vector< Ptr<CmtsDevice> >::iterator domain = m_domains.begin (); domain != m_domains.end (); domain++)
+    (*domain)->SetMtu (mtu);
+  return true;
+}
+
+
+void
+CmtsChassis::SetNode (Ptr< Node > node)
+{
+  NS_LOG_FUNCTION (this << node);
+
+  m_node = node;
+  for (std::vector< Ptr<CmtsDevice> >::iterator domain = m_domains.begin (); domain != m_domains.end (); domain++)
+    (*domain)->SetNode (node);
+}
+
+
+void
+CmtsChassis::SetPromiscReceiveCallback (PromiscReceiveCallback cb)
+{
+  return;
+}
+
+
+void
+CmtsChassis::SetReceiveCallback (ReceiveCallback cb)
+{
+  m_rxCallback = cb;
+}
+
+
+bool
+CmtsChassis::SupportsSendFrom (void) const
+{
+  return false;
+}
+
+}
@@ -0,0 +1,110 @@
+/* -*- Mode:C++; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/*
+ * Copyright (c) 2013 Martín Javier Di Liscia
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * Author: Martín Javier Di Liscia
+ */
+#ifndef CMTS_CHASSIS_H
+#define CMTS_CHASSIS_H
+
+#include <vector>
+#include <tr1/unordered_map>
+#include "cmts-device.h"
+
+namespace ns3 {
+
+/**
+ * \brief A CMTS that serves many HFC segments
+ *
+ * Every segment is a MAC domain: a CmtsDevice attached to the Hfc of the
+ * segment, with its own channels, CMs and schedulers. The chassis is the
+ * one interface the node sees, so the segments share its address, its
+ * routes and whatever backhaul links the node has, and only meet there.
+ *
+ * Frames the CMs send upstream go up through the chassis. Frames sent
+ * down go to the MAC domain that serves the CM they are addressed to,
+ * and broadcasts go to every segment.
+ */
+class CmtsChassis : public NetDevice
+{
+public:
+  static TypeId GetTypeId (void);
+  CmtsChassis ();
+  ~CmtsChassis ();
+
+  /**
+   * Adds a segment. The domain takes the address and MTU of the chassis
+   * and must not be added to the node itself.
+   */
+  void AddMacDomain (Ptr<CmtsDevice> domain);
+  uint32_t GetNMacDomains (void) const;
+  Ptr<CmtsDevice> GetMacDomain (uint32_t i) const;
+  // The domain that serves the CM, null when none does.
+  Ptr<CmtsDevice> FindMacDomain (Mac48Address cm) const;
+
+  void AddLinkChangeCallback (Callback<void> callback);
+  Address GetAddress (void) const;
+  Address GetBroadcast (void) const;
+  Ptr< Channel > GetChannel (void) const;
+  uint32_t GetIfIndex (void) const;
+  uint16_t GetMtu (void) const;
+  Address GetMulticast (Ipv4Address multicastGroup) const;
+  Address GetMulticast (Ipv6Address addr) const;
+  Ptr< Node > GetNode (void) const;
+  bool IsBridge (void) const;
+  bool IsBroadcast (void) const;
+  bool IsLinkUp (void) const;
+  bool IsMulticast (void) const;
+  bool IsPointToPoint (void) const;
+  bool NeedsArp (void) const;
+  bool Send (Ptr< Packet > packet, const Address &dest, uint16_t protocolNumber);
+  bool SendFrom (Ptr< Packet > packet, const Address &source, const Address &dest, uint16_t protocolNumber);
+  void SetAddress (Address address);
+  void SetIfIndex (const uint32_t index);
+  bool SetMtu (const uint16_t mtu);
+  void SetNode (Ptr< Node > node);
+  void SetPromiscReceiveCallback (PromiscReceiveCallback cb);
+  void SetReceiveCallback (ReceiveCallback cb);
+  bool SupportsSendFrom (void) const;
+
+protected:
+  virtual void DoInitialize (void);
+  virtual void DoDispose (void);
+
+private:
+  bool Receive (Ptr<NetDevice> domain, Ptr<const Packet> packet, uint16_t protocol, const Address &source);
+  void LinkChanged (void);
+  void CmChanged (Ptr<CmtsDevice> domain, Mac48Address cm, bool attached);
+
+  std::vector< Ptr<CmtsDevice> > m_domains;
+  std::tr1::unordered_map< Mac48Address, Ptr<CmtsDevice>, Mac48AddressHash > m_domainsByCm;	// Kept by the domains as their CMs come and go
+  bool m_started;
+
+  uint32_t m_deviceIndex;
+  uint16_t m_mtu;
+  Ptr<Node> m_node;
+  Mac48Address m_address;
+  ReceiveCallback m_rxCallback;
+  TracedCallback<> m_linkChangeCallbacks;
+
+  TracedCallback< Ptr<const Packet> > m_sendTrace;
+  TracedCallback< Ptr<const Packet> > m_dropTrace;
+  TracedCallback< Ptr<const Packet> > m_receiveTrace;
+};
+
+}
+
+#endif /* CMTS_CHASSIS_H */
@@ -25,20 +25,149 @@
 #include "mac-management-message.h"
 #include "hfc.h"
 #include "ns3/llc-snap-header.h"
+#include "ns3/uinteger.h"
+#include "ns3/boolean.h"
+#include <cmath>
+#include <algorithm>
+#include <functional>
 
 NS_LOG_COMPONENT_DEFINE ("CmtsNetDevice");
 
 namespace ns3 {
 
+NS_OBJECT_ENSURE_REGISTERED (CmtsDevice);
+
+static const uint32_t kMaxFrameBytes = 1522;
+// Longest common period of the periodic grants of a channel that is laid
+// out ahead, in MAPs, and most periodic grants in one MAP.
+static const uint32_t kMaxPatternMaps = 256;
+static const uint32_t kMaxPeriodicGrants = (MAPHeader::MAX_INFORMATION_ELEMENTS - 1) / 4;
+static const uint32_t kGrantGridsPerMap = 16;
+
+size_t
+Mac48AddressHash::operator() (Mac48Address const &address) const
+{
+  uint8_t buffer[6];
+  address.CopyTo (buffer);
+
+  // The NIC specific half varies the most, fold it into the low bits.
+  uint64_t value = 0;
+  for (uint32_t i = 0; i < 6; i++)
+    value = (value << 8) | buffer[i];
+  return (size_t) (value ^ (value >> 24));
+}
+
+// Matches the scheduler entries of the flows of one CM.
+struct FlowOfCm
+{
+  FlowOfCm (uint32_t handle) : handle (handle) {}
+  bool operator() (const CmtsDevice::FlowId &flow) const { return flow.handle == handle; }
+  bool operator() (const CmtsDevice::ReservedWait &wait) const { return wait.flow.handle == handle; }
+  uint32_t handle;
+};
+
 TypeId
 CmtsDevice::GetTypeId (void)
 {
   static TypeId tid = TypeId("ns3::CmtsDevice")
     .SetParent<NetDevice> ()
     .AddConstructor<CmtsDevice> ()
+    .AddAttribute ("MapInterval",
+                   "Time covered by every upstream MAP",
+                   TimeValue (MilliSeconds (2)),
+                   MakeTimeAccessor (&CmtsDevice::m_mapInterval),
+                   MakeTimeChecker ())
+    .AddAttribute ("InitialTimestamp",
+                   "DOCSIS timestamp, in 10.24 MHz ticks, at the start of the simulation; only its low 32 bits go on the wire",
+                   UintegerValue (0),
+                   MakeUintegerAccessor (&CmtsDevice::m_initialTimestamp),
+                   MakeUintegerChecker<uint64_t> ())
+    .AddAttribute ("ContentionRequestSlots",
+                   "Broadcast request opportunities reserved at the start of every MAP",
+                   UintegerValue (4),
+                   MakeUintegerAccessor (&CmtsDevice::m_contentionRequests),
+                   MakeUintegerChecker<uint32_t> ())
+    .AddAttribute ("UgsGrantSize",
+                   "Minislots of a UGS or PGS grant, for flows that do not set their grant size",
+                   UintegerValue (16),
+                   MakeUintegerAccessor (&CmtsDevice::m_ugsGrantSize),
+                   MakeUintegerChecker<uint32_t> ())
+    .AddAttribute ("PollingInterval",
+                   "MAPs between unicast request polls for real time polling service flows",
+                   UintegerValue (1),
+                   MakeUintegerAccessor (&CmtsDevice::m_pollingInterval),
+                   MakeUintegerChecker<uint32_t> (1))
+    .AddAttribute ("MaxGrantSize",
+                   "Largest data grant, in minislots, given to a single SID in one MAP",
+                   UintegerValue (255),
+                   MakeUintegerAccessor (&CmtsDevice::m_maxGrantSize),
+                   MakeUintegerChecker<uint32_t> (1))
+    .AddAttribute ("DataBackoffStart",
+                   "Initial contention backoff window for requests, as a power of two",
+                   UintegerValue (3),
+                   MakeUintegerAccessor (&CmtsDevice::m_dataBackoffStart),
+                   MakeUintegerChecker<uint8_t> (0, 15))
+    .AddAttribute ("DataBackoffEnd",
+                   "Maximum contention backoff window for requests, as a power of two",
+                   UintegerValue (10),
+                   MakeUintegerAccessor (&CmtsDevice::m_dataBackoffEnd),
+                   MakeUintegerChecker<uint8_t> (0, 15))
+    .AddAttribute ("DownstreamBondingGroupSize",
+                   "Downstream channels bonded for every CM, starting from the primary channel",
+                   UintegerValue (1),
+                   MakeUintegerAccessor (&CmtsDevice::m_bondingGroupSize),
+                   MakeUintegerChecker<uint32_t> (1, 32))
+    .AddAttribute ("UpstreamBondingGroupSize",
+                   "Upstream channels bonded for every CM, starting from the primary channel",
+                   UintegerValue (1),
+                   MakeUintegerAccessor (&CmtsDevice::m_upstreamBondingGroupSize),
+                   MakeUintegerChecker<uint32_t> (1, 32))
+    .AddAttribute ("MaxSegmentsOutOfOrder",
+                   "Bonded upstream segments held behind a missing one before it is given up",
+                   UintegerValue (32),
+                   MakeUintegerAccessor (&CmtsDevice::m_maxSegmentsOutOfOrder),
+                   MakeUintegerChecker<uint32_t> (1))
+    .AddAttribute ("MaxFlowPackets",
+                   "Downstream packets a service flow queues before it drops",
+                   UintegerValue (1000),
+                   MakeUintegerAccessor (&CmtsDevice::m_maxFlowPackets),
+                   MakeUintegerChecker<uint32_t> (1))
+    .AddAttribute ("DownstreamQuantum",
+                   "Bytes a downstream service flow of traffic priority 0 is served per round, priority p gets p + 1 times as many",
+                   UintegerValue (1522),
+                   MakeUintegerAccessor (&CmtsDevice::m_quantum),
+                   MakeUintegerChecker<uint32_t> (1))
+    .AddAttribute ("InitialRangingInterval",
+                   "Time between initial maintenance regions, offered while some CM still has to range",
+                   TimeValue (MilliSeconds (10)),
+                   MakeTimeAccessor (&CmtsDevice::m_initialRangingInterval),
+                   MakeTimeChecker ())
+    .AddAttribute ("RangingBackoffStart",
+                   "Initial backoff window for initial ranging, as a power of two",
+                   UintegerValue (2),
+                   MakeUintegerAccessor (&CmtsDevice::m_rangingBackoffStart),
+                   MakeUintegerChecker<uint8_t> (0, 15))
+    .AddAttribute ("RangingBackoffEnd",
+                   "Maximum backoff window for initial ranging, as a power of two",
+                   UintegerValue (6),
+                   MakeUintegerAccessor (&CmtsDevice::m_rangingBackoffEnd),
+                   MakeUintegerChecker<uint8_t> (0, 15))
+    .AddAttribute ("RangingTolerance",
+                   "Largest timing error of a RNG-REQ for ranging to succeed",
+                   TimeValue (NanoSeconds (1)),
+                   MakeTimeAccessor (&CmtsDevice::m_rangingTolerance),
+                   MakeTimeChecker ())
+    .AddAttribute ("UseLLC",
+                   "Add an LLC/SNAP header to downstream data frames",
+                   BooleanValue (false),
+                   MakeBooleanAccessor (&CmtsDevice::m_useLLC),
+                   MakeBooleanChecker ())
     .AddTraceSource("MacTx",
                     "Trace source indicating a packet has arrived for transmission by this device",
                     MakeTraceSourceAccessor(&CmtsDevice::m_sendTrace) )
+    .AddTraceSource("MacTxDrop",
+                    "Trace source indicating a packet has been dropped by the device before transmission",
+                    MakeTraceSourceAccessor(&CmtsDevice::m_dropTrace) )
     .AddTraceSource("MacRx",
                     "A packet has been received by this device, has been passed up from the physical layer "
                     "and is being forwarded up the local protocol stack.  This is a non-promiscuous trace,",
@@ -49,6 +178,9 @@ CmtsDevice::GetTypeId (void)
     .AddTraceSource("PhyTxEnd",
                     "Trace source indicating a packet has been completely transmitted over the channel",
                     MakeTraceSourceAccessor(&CmtsDevice::m_transmitCompleteTrace) )
+    .AddTraceSource("Sniffer",
+                    "Every frame sent or received by this device, with the bytes of PHY overhead it begins with",
+                    MakeTraceSourceAccessor(&CmtsDevice::m_snifferTrace) )
     .AddTraceSource("ChannelConnect",
                     "Trace source indicating a connection to a channel",
                     MakeTraceSourceAccessor(&CmtsDevice::m_attachTrace) )
@@ -58,12 +190,15 @@ CmtsDevice::GetTypeId (void)
     .AddTraceSource("AddressChange",
                     "Trace source indicating an address change",
                     MakeTraceSourceAccessor(&CmtsDevice::m_addressChangeTrace) )
+    .AddTraceSource("PeriodicGrant",
+                    "A UGS or PGS grant has been put in a MAP: its SID, when it starts and how late that is against its nominal start",
+                    MakeTraceSourceAccessor(&CmtsDevice::m_periodicGrantTrace) )
     ;
 
   return tid;
 }
 
-CmtsDevice::CmtsDevice () : m_deviceIndex(0), m_mtu(1), m_node(NULL), m_hfc(NULL), m_packetQueues(0), m_packetQueuesTransmissionEndTime(0), m_lastPackets(0), m_channelSelector(MakeNullCallback< TEMPLATE_SELECTOR_T >())
+CmtsDevice::CmtsDevice () : m_useLLC(false), m_startupTime(0), m_initializingCms(0), m_maxRTT(0), m_started(false), m_deviceIndex(0), m_mtu(1), m_node(NULL), m_hfc(NULL), m_packetQueues(0), m_lastPackets(0), m_nextSid(1), m_nextDsid(1), m_channelSelector(MakeNullCallback< TEMPLATE_SELECTOR_T >())
 {
 }
 
@@ -71,6 +206,44 @@ CmtsDevice::~CmtsDevice ()
 {
 }
 
+void
+CmtsDevice::DoInitialize (void)
+{
+  NS_LOG_FUNCTION (this);
+
+  m_started = true;
+  if (m_hfc)
+    {
+      SetupUpstreamChannels ();
+      for (uint32_t channel = 0; channel < m_upChannelDescs.size (); channel++)
+        ScheduleMAP (channel, m_upChannelDescs[channel].clock.GetNextMinislot (Simulator::Now ()) + 1);
+    }
+
+  NetDevice::DoInitialize ();
+}
+
+void
+CmtsDevice::DoDispose (void)
+{
+  NS_LOG_FUNCTION (this);
+
+  for (uint32_t channel = 0; channel < m_upChannelDescs.size (); channel++)
+    Simulator::Cancel (m_upChannelDescs[channel].mapEvent);
+  for (std::vector<CmState>::iterator state = m_cms.begin (); state != m_cms.end (); state++)
+    for (std::vector<DownServiceStruct>::iterator service = state->downstreamServices.begin (); service != state->downstreamServices.end (); service++)
+      Simulator::Cancel (service->release);
+
+  m_sids.clear ();
+  m_cms.clear ();
+  m_cmsByAddress.clear ();
+  m_packetQueues.clear ();
+  m_downChannelDescs.clear ();
+  m_lastPackets.clear ();
+  m_node = 0;
+  m_hfc = 0;
+  NetDevice::DoDispose ();
+}
+
 void
 CmtsDevice::AddLinkChangeCallback (Callback<void> callback)
 {
@@ -144,7 +317,7 @@ CmtsDevice::IsBridge (void) const
 bool
 CmtsDevice::IsBroadcast (void) const
 {
-  return false;
+  return true;
 }
 
 
@@ -165,14 +338,14 @@ CmtsDevice::IsMulticast (void) const
 bool
 CmtsDevice::IsPointToPoint (void) const
 {
-  return true;
+  return false;
 }
 
 
 bool
 CmtsDevice::NeedsArp (void) const
 {
-  return false;
+  return true;
 }
 
 
@@ -184,11 +357,87 @@ CmtsDevice::Send (Ptr< Packet > packet, const Address &dest, uint16_t protocolNu
 
 
 bool
-CmtsDevice::SendFrom (Ptr< Packet > packet, const Address &source, const Address &dest, uint16_t protocolNumber)
+CmtsDevice::SendFrom (Ptr< Packet > packet, const Address &source, const Address &to, uint16_t protocolNumber)
 {
-  NS_LOG_FUNCTION (this << packet << dest << protocolNumber);
+  NS_LOG_FUNCTION (this << packet << to << protocolNumber);
   m_sendTrace(packet);
 
+  // Addresses handed down by ARP carry no type, normalize them before
+  // looking the CM up.
+  Mac48Address dest = Mac48Address::ConvertFrom (to);
+
+  CmState *destiny = LookupCm (dest);
+  if (!destiny && !dest.IsBroadcast ())
+    return false;
+
+  // Packets are classified before any MAC header goes on, and go to the
+  // primary flow when their own flow was not admitted.
+  DownServiceStruct *service = NULL;
+  uint32_t reference = 0;
+  if (destiny && !destiny->downstreamServices.empty ())
+    {
+      reference = destiny->downstreamClassifier.Classify (packet, protocolNumber);
+      if (reference >= destiny->downstreamServices.size ())
+        reference = 0;
+      service = &destiny->downstreamServices[reference];
+    }
+
+  // Frames to a CM wait in the queue of their service flow for the
+  // scheduler. Broadcasts go straight to a channel, and so does everything
+  // when a channel selector places the frames itself.
+  if (!service || !m_channelSelector.IsNull ())
+    {
+      uint32_t channel = 0;
+      if (!m_channelSelector.IsNull ())
+        {
+          std::list<DownServiceStruct> services;
+          if (destiny)
+            services.assign (destiny->downstreamServices.begin (), destiny->downstreamServices.end ());
+          channel = m_channelSelector(m_hfc, m_packetQueues, services);
+        }
+
+      PacketAddress pa;
+      pa.packet = BuildFrame (BuildPdu (packet, dest, protocolNumber), service, channel);
+      pa.address = dest;
+      pa.destiny = destiny ? destiny->cm : NULL;
+      pa.channel = channel;
+      m_packetQueues[channel].push_back (pa);
+      if (!m_lastPackets[channel])
+        TransmitNext (channel);
+      return true;
+    }
+
+  // The dual queue of a low latency flow looks at the IP header behind
+  // the PDU header, so frames wait with everything but the DOCSIS header.
+  if (service->dualQueue)
+    {
+      if (!service->dualQueue->Enqueue (BuildPdu (packet, dest, protocolNumber)))
+        {
+          m_dropTrace (packet);
+          return false;
+        }
+    }
+  else
+    {
+      if (service->packets.size () >= m_maxFlowPackets)
+        {
+          m_dropTrace (packet);
+          return false;
+        }
+
+      FlowPacket queued;
+      queued.packet = BuildPdu (packet, dest, protocolNumber);
+      queued.bytes = queued.packet->GetSize ();
+      service->packets.push_back (queued);
+    }
+  if (service->GetNPackets () == 1 && !service->throttled)
+    ActivateFlow (destiny->cm->GetHandle (), reference);
+  return true;
+}
+
+Ptr<Packet>
+CmtsDevice::BuildPdu(Ptr<Packet> packet, Mac48Address dest, uint16_t protocolNumber)
+{
   // **** Headers section ****
   uint16_t typeLength = protocolNumber;
   if (m_useLLC)
@@ -201,35 +450,36 @@ CmtsDevice::SendFrom (Ptr< Packet > packet, const Address &source, const Address
     }
 
   PDUHeader pduh;
-  pduh.Setup (m_address, Mac48Address::ConvertFrom (dest), typeLength);
+  pduh.Setup (m_address, dest, typeLength);
   packet->AddHeader (pduh);
-
-  DocsisHeader dh;
-  dh.setupPduPacket (m_downstreamOverhead, packet->GetSize (), kDownstream);
-  packet->AddHeader (dh);
+  packet->AddPaddingAtEnd (4);	// CRC
   // **** Headers section ****
 
-  PacketAddress pa;
-  pa.packet = packet;
-  pa.address = dest;
-  pa.channel = m_channelSelector.IsNull () ? m_downstreamServices[dest].begin()->channel : m_channelSelector(m_hfc, m_packetQueues, m_downstreamServices[dest]);
-
-  m_packetQueues[pa.channel].push_back(pa);
-  Time packetSizeInTime = Seconds (m_hfc->GetUpstreamDataRate(pa.channel).CalculateTxTime(packet->GetSize()));
+  return packet;
+}
 
-  if (m_hfc->GetDownstreamChannelStatus (pa.channel) == kIdle)
-    {
-      m_packetQueuesTransmissionEndTime[pa.channel] = Simulator::Now () + packetSizeInTime;
-      TransmitStart(m_packetQueues[pa.channel].front().packet, m_connectedDevices[m_packetQueues[pa.channel].front().address], m_packetQueues[pa.channel].front ().channel);
-      m_packetQueues[pa.channel].pop_front();
-    }
-  else
+Ptr<Packet>
+CmtsDevice::BuildFrame(Ptr<Packet> packet, DownServiceStruct *service, uint32_t channel)
+{
+  // **** Headers section ****
+  DocsisHeader dh;
+  dh.setupPduPacket (m_hfc->GetDownstreamPhyOverhead (channel), packet->GetSize (), kDownstream);
+  if (service && service->channels.size () > 1)
     {
-      m_packetQueuesTransmissionEndTime[pa.channel] += packetSizeInTime;
+      // Bonded flows carry their DSID and a sequence number so the CM can
+      // put them back in order.
+      DocsisHeader::ExtendedHeader::ExtendedHeaderElement ehe;
+      ehe.m_type = DocsisHeader::kDownstreamService;
+      ehe.m_length = 5;
+      ehe.m_sid = service->dsid;
+      ehe.m_packetSequenceNumber = service->nextSequence++;
+      dh.addExtendedHeader (ehe);
     }
-  return true;
-}
+  packet->AddHeader (dh);
+  // **** Headers section ****
 
+  return packet;
+}
 
 void
 CmtsDevice::SetAddress (Address address)
@@ -295,23 +545,29 @@ CmtsDevice::Attach(Ptr<Hfc> channel)
   NS_LOG_FUNCTION (this << channel);
   m_attachTrace(channel);
 
-  if (!m_hfc)
+  if (m_hfc)
     {
       Deattach();
     }
 
   m_hfc = channel;
   m_hfc->Attach(this);
+  m_mapGroups.clear ();
 
   uint32_t downChannels = m_hfc->GetDownstreamChannelsAmount();
-  uint32_t upChannels = m_hfc->GetUpstreamChannelsAmount ();
 
   m_packetQueues.resize ((int)downChannels);
-  m_packetQueuesTransmissionEndTime.resize ((int)downChannels);
   m_lastPackets.resize ((int)downChannels);
-  m_upChannelDescs.resize ((int)upChannels);
   m_downChannelDescs.resize ((int)downChannels);
 
+  // The channels of another Hfc may be timed differently, and the CMs of
+  // the last one are gone.
+  m_upChannelDescs.clear ();
+  SetupUpstreamChannels ();
+  if (m_started)
+    for (uint32_t channel = 0; channel < m_upChannelDescs.size (); channel++)
+      ScheduleMAP (channel, m_upChannelDescs[channel].clock.GetNextMinislot (Simulator::Now ()) + 1);
+
   m_linkChangeCallbacks();
 }
 
@@ -324,45 +580,148 @@ CmtsDevice::Deattach()
   if (!m_hfc)
     return;
 
+  for (uint32_t channel = 0; channel < m_upChannelDescs.size (); channel++)
+    Simulator::Cancel (m_upChannelDescs[channel].mapEvent);
   m_hfc->Deattach(this);
   m_hfc = NULL;
   m_linkChangeCallbacks();
 }
 
 void
-CmtsDevice::CmAttached(Ptr<CmDevice> cm)
+CmtsDevice::CmAttached(Ptr<CmDevice> cm, uint32_t handle)
 {
-  m_connectedDevices[cm->GetAddress()] = cm;
+  NS_LOG_FUNCTION (this << cm << handle);
+  if (m_cms.size () <= handle)
+    m_cms.resize (handle + 1);
+
+  CmState &state = m_cms[handle];
+  state.active = true;
+  state.cm = cm;
+  state.address = Mac48Address::ConvertFrom (cm->GetAddress ());
+  m_cmsByAddress[state.address] = handle;
+  m_cmChangeCallbacks (this, state.address, true);
+
+  if (cm->GetInitState () == CmDevice::kOperational)
+    RegisterCm (handle);
+  else
+    {
+      // The CM learns the upstream timing from the UCD, and ranges in the
+      // MAPs of the primary channel.
+      m_initializingCms++;
+      cm->SetUpstreamMinislotClock (0, m_upChannelDescs[0].clock);
+      m_hfc->JoinGroup (GetMapGroup (0), handle);
+    }
 
-  UpServiceStruct defaultUpService;
-  m_upstreamServices[cm->GetAddress()] = std::list<UpServiceStruct>();
-  m_upstreamServices[cm->GetAddress()].push_back(defaultUpService);
+  // A new CM can only make the round trip longer.
+  Time rtt = cm->GetTimeDistanceToCMTS () + cm->GetTimeDistanceToCMTS ();
+  if (rtt > m_maxRTT)
+    m_maxRTT = rtt;
+}
 
-  DownServiceStruct defaultDownService;
-  m_downstreamServices[cm->GetAddress()] = std::list<DownServiceStruct>();
-  m_downstreamServices[cm->GetAddress()].push_back(defaultDownService);
+void
+CmtsDevice::ReserveCms(uint32_t cms)
+{
+  m_sids.reserve (m_nextSid + cms);
+  m_cms.reserve (m_cms.size () + cms);
 }
 
 void
-CmtsDevice::CmDeattached(Ptr<CmDevice> cm)
+CmtsDevice::CmDeattached(Ptr<CmDevice> cm, uint32_t handle)
 {
-  m_connectedDevices.erase(cm->GetAddress());
-  m_upstreamServices.erase (cm->GetAddress());
-  m_downstreamServices.erase (cm->GetAddress());
+  NS_LOG_FUNCTION (this << cm << handle);
+  if (handle >= m_cms.size () || m_cms[handle].cm != cm) return;
+
+  CmState &state = m_cms[handle];
+  for (std::list<UpServiceStruct>::iterator service = state.upstreamServices.begin (); service != state.upstreamServices.end (); service++)
+    ReleaseSid (service->serviceId);
+  if (state.rangingSid != 0)
+    ReleaseSid (state.rangingSid);
+  if (!state.registered)
+    m_initializingCms--;
+
+  // Another CM may have been attached under the same (default) address.
+  std::tr1::unordered_map< Mac48Address, uint32_t, Mac48AddressHash >::iterator entry = m_cmsByAddress.find (state.address);
+  if (entry != m_cmsByAddress.end () && entry->second == handle)
+    {
+      m_cmsByAddress.erase (entry);
+      m_cmChangeCallbacks (this, state.address, false);
+    }
+
+  // The handle may be given to another CM, so the scheduler forgets the
+  // flows of this one.
+  for (std::vector<DownServiceStruct>::iterator service = state.downstreamServices.begin (); service != state.downstreamServices.end (); service++)
+    Simulator::Cancel (service->release);
+  FlowOfCm ofCm (handle);
+  for (std::vector<DownstreamChannelDescription>::iterator dcd = m_downChannelDescs.begin (); dcd != m_downChannelDescs.end (); dcd++)
+    {
+      for (uint32_t ring = 0; ring < 2; ring++)
+        dcd->rings[ring].erase (std::remove_if (dcd->rings[ring].begin (), dcd->rings[ring].end (), ofCm), dcd->rings[ring].end ());
+      dcd->reservedWaits.erase (std::remove_if (dcd->reservedWaits.begin (), dcd->reservedWaits.end (), ofCm), dcd->reservedWaits.end ());
+      std::make_heap (dcd->reservedWaits.begin (), dcd->reservedWaits.end (), std::greater<ReservedWait> ());
+    }
+
+  state = CmState ();
+  m_maxRTT = CalculateMaxRTT ();
 }
 
 void
 CmtsDevice::CmChangedAddress(Ptr<CmDevice> cm, Address old_address)
 {
-  if (cm->GetAddress () == old_address) return;
+  uint32_t handle = cm->GetHandle ();
+  if (handle >= m_cms.size () || m_cms[handle].cm != cm) return;
+
+  CmState &state = m_cms[handle];
+  Mac48Address address = Mac48Address::ConvertFrom (cm->GetAddress ());
+  if (address == state.address) return;
+
+  std::tr1::unordered_map< Mac48Address, uint32_t, Mac48AddressHash >::iterator entry = m_cmsByAddress.find (state.address);
+  if (entry != m_cmsByAddress.end () && entry->second == handle)
+    {
+      m_cmsByAddress.erase (entry);
+      m_cmChangeCallbacks (this, state.address, false);
+    }
 
-  m_connectedDevices[cm->GetAddress()] = cm;
-  m_upstreamServices[cm->GetAddress()] = m_upstreamServices[old_address];
-  m_downstreamServices[cm->GetAddress()] = m_downstreamServices[old_address];
+  state.address = address;
+  m_cmsByAddress[address] = handle;
+  m_cmChangeCallbacks (this, address, true);
+}
 
-  m_connectedDevices.erase(old_address);
-  m_upstreamServices.erase (old_address);
-  m_downstreamServices.erase (old_address);
+void
+CmtsDevice::CmChangedTimeDistance(Ptr<CmDevice> cm)
+{
+  Time rtt = cm->GetTimeDistanceToCMTS () + cm->GetTimeDistanceToCMTS ();
+  if (rtt > m_maxRTT)
+    m_maxRTT = rtt;
+  else
+    m_maxRTT = CalculateMaxRTT ();
+}
+
+void
+CmtsDevice::CmChangedServiceFlows(Ptr<CmDevice> cm)
+{
+  NS_LOG_FUNCTION (this << cm);
+  uint32_t handle = cm->GetHandle ();
+  if (handle >= m_cms.size () || m_cms[handle].cm != cm || !m_cms[handle].registered) return;
+
+  AdmitServiceFlows (handle);
+}
+
+void
+CmtsDevice::CmChangedProfile(Ptr<CmDevice> cm, uint32_t channel)
+{
+  NS_LOG_FUNCTION (this << cm << channel);
+  // The periodic grants of the CM are sized in bytes.
+  if (channel < m_upChannelDescs.size ())
+    m_upChannelDescs[channel].patternValid = false;
+}
+
+Ptr<DocsisDualQueue>
+CmtsDevice::GetDownstreamQueue(Mac48Address cm, uint32_t reference)
+{
+  CmState *state = LookupCm (cm);
+  if (!state || reference >= state->downstreamServices.size ())
+    return 0;
+  return state->downstreamServices[reference].dualQueue;
 }
 
 void
@@ -374,25 +733,66 @@ CmtsDevice::RegisterChannelSelector(selector_t selector)
 void
 CmtsDevice::SetUpstreamChannelDescription(uint32_t channel, UpstreamChannelDescription desc)
 {
-  m_upChannelDescs[channel] = desc;
+  UpstreamChannelDescription &ucd = m_upChannelDescs[channel];
+  bool timingChanged = ucd.clock != desc.clock;
+
+  // The next MAP starts where the last one ended, counted in the new
+  // minislots.
+  if (timingChanged && ucd.clock.IsValid () && desc.clock.IsValid ())
+    ucd.lastMinislotGrantSent = desc.clock.GetNextMinislot (ucd.clock.GetMinislotStart (ucd.lastMinislotGrantSent + 1)) - 1;
+  ucd.clock = desc.clock;
+  SetupUpstreamChannels ();
+
+  if (!timingChanged) return;
+
+  // Push the new minislot clock to every CM using the channel. The
+  // periodic grants are anchored anew, on the new minislots.
+  ucd.patternValid = false;
+  for (uint32_t sid = 0; sid < m_sids.size (); sid++)
+    if (m_sids[sid].active && (m_sids[sid].channel == channel ||
+                               std::find (m_sids[sid].channels.begin (), m_sids[sid].channels.end (), channel) != m_sids[sid].channels.end ()))
+      {
+        m_sids[sid].cm->SetUpstreamMinislotClock (channel, ucd.clock);
+        if (m_sids[sid].channel == channel)
+          m_sids[sid].grantAnchored = false;
+      }
+}
+
+void
+CmtsDevice::UpstreamPhyProfileChanged(uint32_t channel)
+{
+  if (channel >= m_upChannelDescs.size ()) return;
+
+  // The CMs are back on profile A, which may size the periodic grants
+  // differently even when the minislots stay the same.
+  m_upChannelDescs[channel].patternValid = false;
+  UpstreamChannelDescription desc = m_upChannelDescs[channel];
+  desc.clock = DocsisMinislotClock (DocsisMinislotClock::GetTicksCovering (m_hfc->GetUpstreamTxTime (channel, m_hfc->GetUpstreamMinislotSize (channel))),
+                                    m_initialTimestamp);
+  SetUpstreamChannelDescription (channel, desc);
 }
 
 void
 CmtsDevice::SetDownstreamChannelDescription(uint32_t channel, DownstreamChannelDescription desc)
 {
-  m_downChannelDescs[channel] = desc;
+  // The scheduler state is the CMTS's own and outlives the description.
+  DownstreamChannelDescription &dcd = m_downChannelDescs[channel];
+  desc.rings[0].swap (dcd.rings[0]);
+  desc.rings[1].swap (dcd.rings[1]);
+  desc.reservedWaits.swap (dcd.reservedWaits);
+  dcd = desc;
 }
 
-double
-CmtsDevice::TimeToMinislot(uint32_t channel, Time time)
+const DocsisMinislotClock &
+CmtsDevice::GetMinislotClock(uint32_t channel) const
 {
-  return time.ToDouble (Time::S)/ m_upChannelDescs[channel].timePerMinislot.ToDouble(Time::S);
+  return m_upChannelDescs[channel].clock;
 }
 
 Time
 CmtsDevice::MinislotToTime(uint32_t channel, uint32_t minislot)
 {
-  return Time::FromDouble (m_upChannelDescs[channel].timePerMinislot.ToDouble(Time::S) * minislot, Time::S); //TODO
+  return m_upChannelDescs[channel].clock.GetMinislotStart (minislot);
 }
 
 void
@@ -405,29 +805,51 @@ CmtsDevice::ForceSendMAP()
 void
 CmtsDevice::ForceSendMAP(uint32_t channel)
 {
+  Simulator::Cancel (m_upChannelDescs[channel].mapEvent);
   SendMAP(channel);
 }
 
 bool
-CmtsDevice::Receive(Ptr< Packet > packet, Ptr<CmDevice> sender)
+CmtsDevice::Receive(Ptr< Packet > packet, Ptr<CmDevice> sender, uint32_t channel)
 {
-  NS_LOG_FUNCTION (this << packet << sender);
+  NS_LOG_FUNCTION (this << packet << sender << channel);
   m_receiveTrace(packet);
+  m_snifferTrace(packet, m_hfc->GetUpstreamPhyOverhead (channel));
+
+  TrackedGrant grant;
+  if (!FindTrackedGrant (channel, packet, sender, grant))
+    {
+      ProcessFrame (packet, m_hfc->GetUpstreamPhyOverhead (channel));
+      return true;
+    }
+
+  if (grant.type == MAPHeader::kInitialManteinance || grant.type == MAPHeader::kStationManteinance)
+    {
+      ProcessRangingRequest (packet, sender, grant, channel);
+      return true;
+    }
+
+  SidState &state = m_sids[grant.sid];
+  uint32_t granted = (grant.end - grant.start) * m_hfc->GetUpstreamMinislotSize (channel, sender->GetHandle ());
+  if (state.bucket.IsShaping () && granted > packet->GetSize ())
+    state.bucket.Refund (granted - packet->GetSize ());
 
-  uint16_t protocol = 0;
-  Address address;
-  return m_rxCallback(this, packet, protocol, address);
+  // Bursts in grants to a bonded SID are segments, not MAC frames.
+  if (state.channels.size () > 1)
+    ProcessSegment (packet, grant.sid, m_hfc->GetUpstreamPhyOverhead (channel));
+  else
+    ProcessFrame (packet, m_hfc->GetUpstreamPhyOverhead (channel));
+  return true;
 }
 
 Time
 CmtsDevice::CalculateMaxRTT()
 {
   Time maxTimeDistance;
-  for (std::map< Address, Ptr<CmDevice> >::const_iterator pair = m_connectedDevices.begin (); pair != m_connectedDevices.end (); pair++)
+  for (std::vector<CmState>::const_iterator state = m_cms.begin (); state != m_cms.end (); state++)
     {
-      Ptr<CmDevice> cmDevice = pair->second;
-      if (cmDevice->GetTimeDistanceToCMTS () > maxTimeDistance)
-        maxTimeDistance = cmDevice->GetTimeDistanceToCMTS ();
+      if (state->active && state->cm->GetTimeDistanceToCMTS () > maxTimeDistance)
+        maxTimeDistance = state->cm->GetTimeDistanceToCMTS ();
     }
 
   return Time::FromDouble (maxTimeDistance.GetDouble ()* 2, maxTimeDistance.GetResolution ());
@@ -436,25 +858,31 @@ CmtsDevice::CalculateMaxRTT()
 Time
 CmtsDevice::LatestMomentToSendMAP(Time startOfMAP)
 {
-  DataRate minDataRate = m_hfc->GetUpstreamDataRate (0);
-  for (uint32_t channel = 1; channel < m_hfc->GetUpstreamChannelsAmount (); channel++)
-    if (minDataRate < m_hfc->GetUpstreamDataRate (channel))
-      minDataRate = m_hfc->GetUpstreamDataRate (channel);
-
-  Time maxMAPTxTime = Time::FromDouble (minDataRate.CalculateTxTime (MacManagementMessageHeader::MAX_MMM_PACKET_SIZE), Time::S);
-  return startOfMAP - maxMAPTxTime - CalculateMaxRTT ();
+  uint32_t slowest = 0;
+  for (uint32_t channel = 1; channel < m_hfc->GetDownstreamChannelsAmount (); channel++)
+    if (m_hfc->GetDownstreamDataRate (channel) < m_hfc->GetDownstreamDataRate (slowest))
+      slowest = channel;
+
+  // The MAP goes to the head of the downstream queue, but it may still have
+  // to wait for the frame that is already on the wire and for the MAPs of
+  // the other upstream channels.
+  Time maxMAPTxTime = m_hfc->GetDownstreamTxTime (slowest, MacManagementMessageHeader::MAX_MMM_PACKET_SIZE * m_upChannelDescs.size ());
+  Time maxFrameTxTime = m_hfc->GetDownstreamTxTime (slowest, m_mtu + MacManagementMessageHeader::MAX_MMM_PACKET_SIZE);
+  return startOfMAP - maxMAPTxTime - maxFrameTxTime - m_maxRTT;
 }
 
 void
-CmtsDevice::TransmitStart(Ptr< Packet > packet, Ptr<CmDevice> destiny, uint32_t channel)
+CmtsDevice::TransmitStart(Ptr< Packet > packet, Ptr<CmDevice> destiny, uint32_t channel, uint32_t group)
 {
   NS_LOG_FUNCTION (this << packet << destiny << channel);
   m_transmitStartTrace(packet);
+  m_snifferTrace(packet, m_hfc->GetDownstreamPhyOverhead (channel));
 
-  Time txTime = Seconds (m_hfc->GetUpstreamDataRate(channel).CalculateTxTime(packet->GetSize()));
+  // Frames to a CM go on its profile, broadcasts on profile A.
+  Time txTime = m_hfc->GetDownstreamTxTime (channel, packet->GetSize (), destiny ? destiny->GetHandle () : Hfc::kNoHandle);
 
   Simulator::Schedule(txTime, &CmtsDevice::TransmitComplete, this, channel);
-  m_hfc->DownTransmitStart(channel, packet, destiny, txTime);
+  m_hfc->DownTransmitStart(channel, packet, destiny, txTime, group);
 
   m_lastPackets[channel] = packet;
 }
@@ -467,39 +895,278 @@ CmtsDevice::TransmitComplete(uint32_t channel)
 
   m_lastPackets[channel] = NULL;
 
+  TransmitNext (channel);
+}
+
+void
+CmtsDevice::TransmitNext(uint32_t channel)
+{
+  // Management messages and frames placed on the channel go ahead of the
+  // service flows.
   if (!m_packetQueues[channel].empty())
     {
-      PacketAddress &pa = m_packetQueues[channel].front();
+      PacketAddress pa = m_packetQueues[channel].front();
+      m_packetQueues[channel].pop_front();
+
+      TransmitStart(pa.packet, pa.destiny, pa.channel, pa.group);
+      return;
+    }
 
-      TransmitStart(m_packetQueues[pa.packet, m_connectedDevices[pa.address], pa.channel);
+  FlowId flow;
+  if (!PickFlow (channel, flow))
+    return;
 
-      Time packetSizeInTime = Seconds (m_hfc->GetUpstreamDataRate(pa.channel).CalculateTxTime(pa.packet->GetSize()));
-      m_packetQueuesTransmissionEndTime[pa.channel] += packetSizeInTime;
+  CmState &state = m_cms[flow.handle];
+  DownServiceStruct &service = state.downstreamServices[flow.reference];
+  TransmitStart (BuildFrame (service.Dequeue (), &service, channel), state.cm, channel, 0);
+}
 
-      m_packetQueues[channel].pop_front();
+bool
+CmtsDevice::DownServiceStruct::IsEmpty() const
+{
+  return dualQueue ? dualQueue->IsEmpty () : packets.empty ();
+}
+
+uint32_t
+CmtsDevice::DownServiceStruct::GetNPackets() const
+{
+  return dualQueue ? dualQueue->GetNPackets () : packets.size ();
+}
+
+uint32_t
+CmtsDevice::DownServiceStruct::GetHeadBytes() const
+{
+  return dualQueue ? dualQueue->Peek ()->GetSize () : packets.front ().bytes;
+}
+
+Ptr<Packet>
+CmtsDevice::DownServiceStruct::Dequeue()
+{
+  if (dualQueue)
+    return dualQueue->Dequeue ();
+  Ptr<Packet> packet = packets.front ().packet;
+  packets.pop_front ();
+  return packet;
+}
+
+void
+CmtsDevice::ConfigureFlow(DownServiceStruct &service, const DocsisServiceFlow &flow)
+{
+  service.bucket.Configure (flow.maxSustainedRate, flow.maxTrafficBurst, flow.peakRate);
+  service.reservedBucket.Configure (flow.minReservedRate, 0);
+  service.quantum = m_quantum * (std::min (flow.trafficPriority, (uint8_t) 7) + 1);
+
+  // A flow keeps its dual queue while frames wait in it.
+  if (flow.lowLatency && !service.dualQueue && service.IsEmpty ())
+    service.dualQueue = CreateObject<DocsisDualQueue> ();
+  else if (!flow.lowLatency && service.dualQueue && service.dualQueue->IsEmpty ())
+    service.dualQueue = 0;
+  if (service.dualQueue && flow.latencyTarget.IsStrictlyPositive ())
+    service.dualQueue->SetAttribute ("Target", TimeValue (flow.latencyTarget));
+}
+
+void
+CmtsDevice::ActivateFlow(uint32_t handle, uint32_t reference)
+{
+  DownServiceStruct &service = m_cms[handle].downstreamServices[reference];
+  uint32_t ring = service.reservedBucket.IsShaping () ? 0 : 1;
+  FlowId flow = { handle, reference };
+
+  for (std::vector<uint32_t>::const_iterator channel = service.channels.begin (); channel != service.channels.end (); channel++)
+    {
+      if (!(service.listed[ring] & (1u << *channel)))
+        {
+          service.listed[ring] |= 1u << *channel;
+          m_downChannelDescs[*channel].rings[ring].push_back (flow);
+        }
+      if (!m_lastPackets[*channel])
+        TransmitNext (*channel);
+    }
+}
+
+void
+CmtsDevice::ReleaseFlow(uint32_t handle, uint32_t reference)
+{
+  NS_LOG_FUNCTION (this << handle << reference);
+  DownServiceStruct &service = m_cms[handle].downstreamServices[reference];
+  service.throttled = false;
+  if (!service.IsEmpty ())
+    ActivateFlow (handle, reference);
+}
+
+bool
+CmtsDevice::PickFlow(uint32_t channel, FlowId &picked)
+{
+  DownstreamChannelDescription &dcd = m_downChannelDescs[channel];
+  uint32_t bit = 1u << channel;
+  Time now = Simulator::Now ();
+
+  // Flows back under their reserved rate rejoin the first ring.
+  while (!dcd.reservedWaits.empty () && dcd.reservedWaits.front ().time <= now)
+    {
+      FlowId flow = dcd.reservedWaits.front ().flow;
+      std::pop_heap (dcd.reservedWaits.begin (), dcd.reservedWaits.end (), std::greater<ReservedWait> ());
+      dcd.reservedWaits.pop_back ();
+
+      DownServiceStruct &service = m_cms[flow.handle].downstreamServices[flow.reference];
+      service.waiting &= ~bit;
+      if (!service.IsEmpty () && !service.throttled && !(service.listed[0] & bit))
+        {
+          service.listed[0] |= bit;
+          dcd.rings[0].push_back (flow);
+        }
+    }
+
+  for (;;)
+    {
+      uint32_t ring = dcd.rings[0].empty () ? 1 : 0;
+      if (dcd.rings[ring].empty ())
+        return false;
+
+      FlowId flow = dcd.rings[ring].front ();
+      DownServiceStruct &service = m_cms[flow.handle].downstreamServices[flow.reference];
+      if (service.IsEmpty () || service.throttled)
+        {
+          dcd.rings[ring].pop_front ();
+          service.listed[ring] &= ~bit;
+          if (service.IsEmpty ())
+            service.deficit = 0;
+          continue;
+        }
+
+      // Past its maximum rate, the flow sits out until it has the tokens.
+      uint32_t bytes = service.GetHeadBytes ();
+      Time delay = service.bucket.IsShaping () ? service.bucket.GetDelay (bytes, now) : Time (0);
+      if (delay.IsStrictlyPositive ())
+        {
+          dcd.rings[ring].pop_front ();
+          service.listed[ring] &= ~bit;
+          service.throttled = true;
+          service.release = Simulator::Schedule (delay, &CmtsDevice::ReleaseFlow, this, flow.handle, flow.reference);
+          continue;
+        }
+
+      if (ring == 0)
+        {
+          dcd.rings[0].pop_front ();
+          service.listed[0] &= ~bit;
+
+          // Past its reserved rate, the flow competes for the excess until
+          // it is back under it.
+          Time reservedDelay = service.reservedBucket.GetDelay (bytes, now);
+          if (reservedDelay.IsStrictlyPositive ())
+            {
+              if (!(service.waiting & bit))
+                {
+                  ReservedWait wait;
+                  wait.time = now + reservedDelay;
+                  wait.flow = flow;
+                  dcd.reservedWaits.push_back (wait);
+                  std::push_heap (dcd.reservedWaits.begin (), dcd.reservedWaits.end (), std::greater<ReservedWait> ());
+                  service.waiting |= bit;
+                }
+              if (!(service.listed[1] & bit))
+                {
+                  service.listed[1] |= bit;
+                  dcd.rings[1].push_back (flow);
+                }
+              continue;
+            }
+
+          service.reservedBucket.Consume (bytes);
+          if (service.GetNPackets () > 1)
+            {
+              service.listed[0] |= bit;
+              dcd.rings[0].push_back (flow);
+            }
+        }
+      else
+        {
+          if (service.deficit < bytes)
+            {
+              service.deficit += service.quantum;
+              dcd.rings[1].pop_front ();
+              dcd.rings[1].push_back (flow);
+              continue;
+            }
+
+          service.deficit -= bytes;
+          if (service.GetNPackets () == 1)
+            {
+              dcd.rings[1].pop_front ();
+              service.listed[1] &= ~bit;
+              service.deficit = 0;
+            }
+        }
+
+      if (service.bucket.IsShaping ())
+        service.bucket.Consume (bytes);
+      picked = flow;
+      return true;
     }
 }
 
+void
+CmtsDevice::ScheduleMAP(uint32_t channel, uint32_t mapStart)
+{
+  UpstreamChannelDescription &ucd = m_upChannelDescs[channel];
+  ucd.lastMinislotGrantSent = mapStart - 1;
+
+  Time sendTime = LatestMomentToSendMAP (MinislotToTime (channel, mapStart));
+  Time delay = sendTime > Simulator::Now () ? sendTime - Simulator::Now () : Seconds (0);
+  ucd.mapEvent = Simulator::Schedule (delay, &CmtsDevice::SendMAP, this, channel);
+}
+
 void
 CmtsDevice::SendMAP(uint32_t channel)
 {
+  NS_LOG_FUNCTION (this << channel);
   UpstreamChannelDescription &ucd = m_upChannelDescs[channel];
-  MAPHeader mh;
 
-  mh.SetupMAP (channel, 0, ucd.lastMinislotGrantSent+1, ucd.lastMinislotRequestReceived, 0,0,0,0);
+  // When the MAP is late, skip ahead to the first minislot every CM can
+  // still reach.
+  uint32_t mapStart = ucd.lastMinislotGrantSent+1;
+  Time lead = MinislotToTime (channel, mapStart) - LatestMomentToSendMAP (MinislotToTime (channel, mapStart));
+  uint32_t earliest = ucd.clock.GetNextMinislot (Simulator::Now () + lead);
+  if ((int32_t) (earliest - mapStart) > 0)
+    mapStart = earliest;
+
+  uint32_t mapLength = ucd.clock.GetMinislotsWithin (m_mapInterval);
+  if (mapLength == 0)
+    mapLength = 1;
+
+  BuildGrants (channel, mapStart, mapLength);
+
+  // Every request that reached the CMTS before now has been processed. A
+  // contention request older than this without a grant has collided.
+  uint32_t ackTime = ucd.clock.GetMinislot (Simulator::Now ()) - 1;
+
+  MAPHeader mh;
+  mh.SetupMAP (channel, 0, mapStart, ackTime, m_rangingBackoffStart, m_rangingBackoffEnd, m_dataBackoffStart, m_dataBackoffEnd);
 
   uint16_t slotNbr = 0;
-  while (ucd.grants.size () > 0)
+  for (std::vector<Grant>::const_iterator grant = ucd.grants.begin (); grant != ucd.grants.end (); grant++)
     {
       MAPHeader::InformationElement ie;
-      Grant grant = *ucd.grants.begin ();
 
-      ie.m_offset = slotNbr; slotNbr += grant.slots;
-      ie.m_sid = grant.sid;
-      ie.m_type = grant.type;
+      ie.m_offset = slotNbr; slotNbr += grant->slots;
+      ie.m_sid = grant->sid;
+      ie.m_type = grant->type;
 
       mh.AddIE (ie);
-      ucd.grants.pop_front ();
+
+      // The CMTS times the RNG-REQs against their maintenance region.
+      bool maintenance = grant->type == MAPHeader::kInitialManteinance || grant->type == MAPHeader::kStationManteinance;
+      bool data = grant->type == MAPHeader::kShortDataGrant || grant->type == MAPHeader::kLargeDataGrant;
+      if (maintenance || (grant->type != MAPHeader::kRequest && (m_sids[grant->sid].channels.size () > 1 || (data && m_sids[grant->sid].bucket.IsShaping ()))))
+        {
+          TrackedGrant trackedGrant;
+          trackedGrant.sid = grant->sid;
+          trackedGrant.start = mapStart + ie.m_offset;
+          trackedGrant.end = trackedGrant.start + grant->slots;
+          trackedGrant.type = grant->type;
+          ucd.trackedGrants.push_back (trackedGrant);
+        }
     }
 
   MAPHeader::InformationElement nullIE;
@@ -507,6 +1174,949 @@ CmtsDevice::SendMAP(uint32_t channel)
   nullIE.m_sid = 0;
   nullIE.m_type = MAPHeader::kNull;
   mh.AddIE (nullIE);
+
+  // Zero length grants after the null IE tell a CM its request is queued, so
+  // it does not retry it.
+  for (std::vector<uint16_t>::const_iterator sid = ucd.grantsPending.begin (); sid != ucd.grantsPending.end (); sid++)
+    {
+      MAPHeader::InformationElement ie;
+      ie.m_offset = slotNbr;
+      ie.m_sid = *sid;
+      ie.m_type = MAPHeader::kShortDataGrant;
+      mh.AddIE (ie);
+    }
+
+  Ptr<Packet> packet = Create<Packet> ();
+  packet->AddHeader (mh);
+
+  MacManagementMessageHeader mmmh;
+  mmmh.Setup (m_address, Mac48Address::GetBroadcast (), mh.GetSerializedSize () + 6, MacManagementMessageHeader::kMAP);
+  packet->AddHeader (mmmh);
+
+  DocsisHeader dh;
+  dh.setupMSHManagement (m_hfc->GetDownstreamPhyOverhead (0), packet->GetSize (), kDownstream);
+  packet->AddHeader (dh);
+
+  EnqueueManagement (packet, 0, GetMapGroup (channel));
+
+  ScheduleMAP (channel, mapStart + mapLength);
+}
+
+void
+CmtsDevice::BuildGrants(uint32_t channel, uint32_t mapStart, uint32_t mapLength)
+{
+  UpstreamChannelDescription &ucd = m_upChannelDescs[channel];
+  ucd.grants.clear ();
+  ucd.grantsPending.clear ();
+
+  // UGS and PGS grants keep their place in the MAP, and everything else is
+  // laid out around them.
+  FindPeriodicGrants (channel, mapStart, mapLength);
+
+  uint32_t maxGrants = MAPHeader::MAX_INFORMATION_ELEMENTS - 1;	// Leave room for the null IE
+  // Request opportunities are sized for the larger queue depth based request.
+  DocsisHeader request;
+  request.setupMSHRequestQD (m_hfc->GetUpstreamPhyOverhead (channel), 0, 0, kUpstream);
+  uint32_t requestSize = BytesToMinislots (channel, request.GetSerializedSize (), Hfc::kNoHandle);
+  uint32_t used = 0;
+  Grant grant;
+
+  // Contention request region.
+  for (uint32_t i = 0; i < m_contentionRequests && HasRoomForGrant (ucd, maxGrants) && MakeRoom (channel, mapStart, mapLength, used, requestSize); i++)
+    {
+      grant.sid = MAPHeader::BROADCAST_SID; grant.slots = requestSize; grant.type = MAPHeader::kRequest;
+      ucd.grants.push_back (grant);
+      used += requestSize;
+    }
+
+  // Initial maintenance, only while some CM still has to range. The region
+  // spans the longest round trip past the RNG-REQ, so a CM that does not
+  // know its offset yet still lands in it.
+  if (channel == 0 && m_initializingCms > 0 && Simulator::Now () >= ucd.nextInitialMaintenance && HasRoomForGrant (ucd, maxGrants))
+    {
+      uint32_t slots = ManagementMinislots (channel, RangingRequestHeader ().GetSerializedSize ()) +
+        ucd.clock.GetMinislotsCovering (m_maxRTT);
+      if (MakeRoom (channel, mapStart, mapLength, used, slots))
+        {
+          grant.sid = MAPHeader::BROADCAST_SID; grant.slots = slots; grant.type = MAPHeader::kInitialManteinance;
+          ucd.grants.push_back (grant);
+          used += slots;
+          ucd.nextInitialMaintenance = Simulator::Now () + m_initialRangingInterval;
+        }
+    }
+
+  // Station maintenance and REG-REQ grants owed to ranging SIDs.
+  std::vector<Grant>::iterator owed = ucd.maintenance.begin ();
+  for (; owed != ucd.maintenance.end () && HasRoomForGrant (ucd, maxGrants) && MakeRoom (channel, mapStart, mapLength, used, owed->slots); owed++)
+    {
+      if (!m_sids[owed->sid].active) continue;
+      ucd.grants.push_back (*owed);
+      used += owed->slots;
+    }
+  ucd.maintenance.erase (ucd.maintenance.begin (), owed);
+
+  // Unicast polls.
+  for (std::vector<uint16_t>::const_iterator sid = ucd.periodicSids.begin (); sid != ucd.periodicSids.end () && HasRoomForGrant (ucd, maxGrants); sid++)
+    {
+      SidState &state = m_sids[*sid];
+      if (state.mode == kRealTimePolling && ++state.mapsSincePoll >= m_pollingInterval)
+        {
+          if (!MakeRoom (channel, mapStart, mapLength, used, requestSize)) break;
+          grant.sid = *sid; grant.slots = requestSize; grant.type = MAPHeader::kRequest;
+          ucd.grants.push_back (grant);
+          used += requestSize;
+          state.mapsSincePoll = 0;
+        }
+    }
+
+  // Requested bandwidth, served round robin over the backlogged SIDs. A SID
+  // whose grant does not fit keeps its place for the next MAP.
+  for (size_t rounds = ucd.backlog.size (); rounds > 0 && used < mapLength && HasRoomForGrant (ucd, maxGrants); rounds--)
+    {
+      uint16_t sid = ucd.backlog.front ();
+      SidState &state = m_sids[sid];
+      if (!state.active || state.pendingMinislots == 0)
+        {
+          ucd.backlog.pop_front ();
+          state.backlogged &= ~(1u << channel);
+          continue;
+        }
+
+      // Bonded SIDs take their share on every channel of the group. A MAP
+      // may be shorter than the largest grant, so the grant is held to what
+      // the MAP has left.
+      uint32_t slots = std::min (std::min (state.pendingMinislots, m_maxGrantSize), mapLength - used);
+      if (!state.channels.empty ())
+        slots = std::min (slots, state.bondedShare);
+      if (state.bucket.IsShaping ())
+        slots = ConformingMinislots (channel, state, slots);
+      if (!MakeRoom (channel, mapStart, mapLength, used, slots)) break;
+      ucd.backlog.pop_front ();
+      if (slots == 0)
+        {
+          // Out of tokens, the SID waits at the back.
+          ucd.backlog.push_back (sid);
+          continue;
+        }
+
+      // The short data grant IUC covers small bursts such as TCP ACKs.
+      grant.sid = sid; grant.slots = slots;
+      uint32_t minislotSize = m_hfc->GetUpstreamMinislotSize (channel, state.cm->GetHandle ());
+      grant.type = slots * minislotSize < 256 ? MAPHeader::kShortDataGrant : MAPHeader::kLargeDataGrant;
+      ucd.grants.push_back (grant);
+      used += slots;
+
+      if (state.bucket.IsShaping ())
+        state.bucket.Consume (slots * minislotSize);
+      state.pendingMinislots -= slots;
+      if (state.pendingMinislots > 0)
+        ucd.backlog.push_back (sid);
+      else
+        state.backlogged &= ~(1u << channel);
+    }
+
+  while (ucd.nextPeriodic != ucd.lastPeriodic)
+    PlacePeriodicGrant (channel, mapStart, used);
+
+  // SIDs still waiting for bandwidth get a grant pending IE.
+  for (std::deque<uint16_t>::const_iterator sid = ucd.backlog.begin (); sid != ucd.backlog.end () && ucd.grants.size () + ucd.grantsPending.size () < maxGrants; sid++)
+    if (m_sids[*sid].active && m_sids[*sid].pendingMinislots > 0)
+      ucd.grantsPending.push_back (*sid);
+
+  // Whatever is left becomes extra contention request opportunities.
+  while (used + requestSize <= mapLength && ucd.grants.size () + ucd.grantsPending.size () < maxGrants)
+    {
+      grant.sid = MAPHeader::BROADCAST_SID; grant.slots = requestSize; grant.type = MAPHeader::kRequest;
+      ucd.grants.push_back (grant);
+      used += requestSize;
+    }
+}
+
+bool
+CmtsDevice::HasRoomForGrant(const UpstreamChannelDescription &ucd, uint32_t maxGrants) const
+{
+  // Every periodic grant still to be placed may need a filler ahead of it.
+  return ucd.grants.size () + 2 * (ucd.lastPeriodic - ucd.nextPeriodic) < maxGrants;
+}
+
+bool
+CmtsDevice::MakeRoom(uint32_t channel, uint32_t mapStart, uint32_t mapLength, uint32_t &used, uint32_t slots)
+{
+  // Places the periodic grants due before the end of the slots, so that
+  // they fit at the cursor.
+  UpstreamChannelDescription &ucd = m_upChannelDescs[channel];
+  for (;;)
+    {
+      uint32_t limit = ucd.nextPeriodic != ucd.lastPeriodic ? ucd.nextPeriodic->offset : mapLength;
+      if (used + slots <= limit)
+        return true;
+      if (ucd.nextPeriodic == ucd.lastPeriodic)
+        return false;
+      PlacePeriodicGrant (channel, mapStart, used);
+    }
+}
+
+void
+CmtsDevice::PlacePeriodicGrant(uint32_t channel, uint32_t mapStart, uint32_t &used)
+{
+  UpstreamChannelDescription &ucd = m_upChannelDescs[channel];
+  const PeriodicGrant &periodic = *ucd.nextPeriodic++;
+  Grant grant;
+
+  // The slots left ahead of the grant become a request opportunity, or an
+  // idle grant to the null SID when a request would not fit.
+  if (used < periodic.offset)
+    {
+      DocsisHeader request;
+      request.setupMSHRequestQD (m_hfc->GetUpstreamPhyOverhead (channel), 0, 0, kUpstream);
+      grant.slots = periodic.offset - used;
+      bool fits = grant.slots >= BytesToMinislots (channel, request.GetSerializedSize (), Hfc::kNoHandle);
+      grant.sid = fits ? MAPHeader::BROADCAST_SID : 0;
+      grant.type = fits ? MAPHeader::kRequest : MAPHeader::kShortDataGrant;
+      ucd.grants.push_back (grant);
+    }
+
+  grant.sid = periodic.sid; grant.slots = periodic.slots; grant.type = MAPHeader::kUnsolicitedGrant;
+  ucd.grants.push_back (grant);
+  used = periodic.offset + periodic.slots;
+  m_periodicGrantTrace (periodic.sid, MinislotToTime (channel, mapStart + periodic.offset), ucd.clock.GetDuration (periodic.jitter));
+}
+
+void
+CmtsDevice::FindPeriodicGrants(uint32_t channel, uint32_t mapStart, uint32_t mapLength)
+{
+  UpstreamChannelDescription &ucd = m_upChannelDescs[channel];
+  if (!ucd.patternValid || ucd.patternMapLength != mapLength)
+    BuildGrantPattern (channel, mapStart, mapLength);
+
+  // A MAP that starts off the phases, after the CMTS skipped ahead, gets
+  // its grants laid out on its own.
+  if (!ucd.patternPhases.empty ())
+    {
+      uint32_t period = (ucd.patternPhases.size () - 1) * mapLength;
+      uint32_t position = (mapStart - ucd.patternStart) % period;
+      if (position % mapLength == 0)
+        {
+          uint32_t phase = position / mapLength;
+          const PeriodicGrant *first = ucd.pattern.empty () ? 0 : &ucd.pattern[0];
+          ucd.nextPeriodic = first + ucd.patternPhases[phase];
+          ucd.lastPeriodic = first + ucd.patternPhases[phase + 1];
+          return;
+        }
+    }
+
+  LayOutPeriodicGrants (channel, mapStart, mapLength, ucd.periodic);
+  ucd.nextPeriodic = ucd.periodic.empty () ? 0 : &ucd.periodic[0];
+  ucd.lastPeriodic = ucd.nextPeriodic + ucd.periodic.size ();
+}
+
+void
+CmtsDevice::BuildGrantPattern(uint32_t channel, uint32_t mapStart, uint32_t mapLength)
+{
+  NS_LOG_FUNCTION (this << channel << mapStart << mapLength);
+  UpstreamChannelDescription &ucd = m_upChannelDescs[channel];
+  ucd.patternValid = true;
+  ucd.patternStart = mapStart;
+  ucd.patternMapLength = mapLength;
+  ucd.pattern.clear ();
+  ucd.patternPhases.clear ();
+
+  // New flows get their first grant in this MAP, one after the other.
+  uint32_t anchor = mapStart;
+  uint64_t period = mapLength;
+  for (std::vector<uint16_t>::const_iterator sid = ucd.periodicSids.begin (); sid != ucd.periodicSids.end (); sid++)
+    {
+      SidState &state = m_sids[*sid];
+      if (state.mode == kRealTimePolling) continue;
+
+      uint32_t interval = GrantIntervalMinislots (channel, state, mapLength);
+      uint32_t slots = state.grantBytes ? BytesToMinislots (channel, state.grantBytes, state.cm->GetHandle ()) : m_ugsGrantSize;
+      if (!state.grantAnchored)
+        {
+          state.grantAnchored = true;
+          state.grantAnchor = anchor;
+          anchor += slots;
+        }
+
+      uint64_t a = period, b = interval;
+      while (b != 0)
+        {
+          uint64_t r = a % b;
+          a = b;
+          b = r;
+        }
+      period = std::min (period / a * interval, (uint64_t) kMaxPatternMaps * mapLength + 1);
+    }
+
+  // Intervals with no short common period are laid out MAP by MAP.
+  if (period > (uint64_t) kMaxPatternMaps * mapLength)
+    return;
+
+  for (uint32_t phase = 0; phase < period / mapLength; phase++)
+    {
+      ucd.patternPhases.push_back (ucd.pattern.size ());
+      LayOutPeriodicGrants (channel, mapStart + phase * mapLength, mapLength, ucd.periodic);
+      ucd.pattern.insert (ucd.pattern.end (), ucd.periodic.begin (), ucd.periodic.end ());
+    }
+  ucd.patternPhases.push_back (ucd.pattern.size ());
+}
+
+static bool
+EarlierGrant (const CmtsDevice::PeriodicGrant &a, const CmtsDevice::PeriodicGrant &b)
+{
+  return a.offset < b.offset;
+}
+
+void
+CmtsDevice::LayOutPeriodicGrants(uint32_t channel, uint32_t mapStart, uint32_t mapLength, std::vector<PeriodicGrant> &grants)
+{
+  UpstreamChannelDescription &ucd = m_upChannelDescs[channel];
+  grants.clear ();
+
+  PeriodicGrant periodic;
+  periodic.jitter = 0;
+  for (std::vector<uint16_t>::const_iterator sid = ucd.periodicSids.begin (); sid != ucd.periodicSids.end (); sid++)
+    {
+      const SidState &state = m_sids[*sid];
+      if (state.mode == kRealTimePolling || !state.grantAnchored) continue;
+
+      int64_t interval = GrantIntervalMinislots (channel, state, mapLength);
+      periodic.sid = *sid;
+      periodic.slots = state.grantBytes ? BytesToMinislots (channel, state.grantBytes, state.cm->GetHandle ()) : m_ugsGrantSize;
+
+      // The first nominal grant at or after the start of the MAP. Minislot
+      // numbers wrap, so the anchor is told apart from the MAP by distance.
+      int64_t distance = (int32_t) (mapStart - state.grantAnchor);
+      int64_t periods = distance > 0 ? (distance + interval - 1) / interval : -(-distance / interval);
+      for (int64_t offset = periods * interval - distance; offset < mapLength; offset += interval)
+        {
+          periodic.offset = offset;
+          grants.push_back (periodic);
+        }
+    }
+
+  // Grants that would overlap go one after the other, in the order their
+  // flows were admitted, and those past the end of the MAP or past the IEs
+  // the MAP can spare are not given.
+  std::stable_sort (grants.begin (), grants.end (), EarlierGrant);
+  uint32_t end = 0;
+  std::vector<PeriodicGrant>::iterator kept = grants.begin ();
+  for (std::vector<PeriodicGrant>::iterator grant = grants.begin (); grant != grants.end (); grant++)
+    {
+      uint32_t start = std::max ((uint32_t) grant->offset, end);
+      if (start + grant->slots > mapLength || kept - grants.begin () >= (int) kMaxPeriodicGrants)
+        {
+          NS_LOG_LOGIC ("No room for the periodic grant of SID " << grant->sid);
+          continue;
+        }
+      grant->jitter = start - grant->offset;
+      grant->offset = start;
+      end = start + grant->slots;
+      *kept++ = *grant;
+    }
+  grants.erase (kept, grants.end ());
+}
+
+uint32_t
+CmtsDevice::GrantIntervalMinislots(uint32_t channel, const SidState &state, uint32_t mapLength)
+{
+  // Intervals are rounded to a grid shared by every flow of the channel, so
+  // that intervals multiple of one another stay so and their grants do not
+  // drift into each other.
+  if (state.grantInterval.IsZero ())
+    return mapLength;
+  uint32_t grid = std::max (mapLength / kGrantGridsPerMap, (uint32_t) 1);
+  const DocsisMinislotClock &clock = m_upChannelDescs[channel].clock;
+  Time halfGrid = NanoSeconds (clock.GetDuration (grid).GetNanoSeconds () / 2);
+  uint32_t grids = clock.GetMinislotsWithin (state.grantInterval + halfGrid) / grid;
+  return std::max (grids, (uint32_t) 1) * grid;
+}
+
+void
+CmtsDevice::ConfigurePeriodicGrants(uint16_t sid, const DocsisServiceFlow &flow)
+{
+  SidState &state = m_sids[sid];
+  if (state.mode != kUnsolicitedGrant && state.mode != kProactiveGrant) return;
+  if (state.grantInterval == flow.grantInterval && state.grantBytes == flow.grantSize) return;
+
+  state.grantInterval = flow.grantInterval;
+  state.grantBytes = flow.grantSize;
+  state.grantAnchored = false;
+  m_upChannelDescs[state.channel].patternValid = false;
+}
+
+uint16_t
+CmtsDevice::AllocateSid(Ptr<CmDevice> cm, uint32_t channel, DocsisUpstreamChannelMode mode)
+{
+  // Released SIDs are given out again oldest first, before any new one.
+  uint16_t sid;
+  if (!m_freeSids.empty ())
+    {
+      sid = m_freeSids.front ();
+      m_freeSids.pop_front ();
+    }
+  else if (m_nextSid < MAPHeader::BROADCAST_SID - 1)
+    sid = m_nextSid++;
+  else
+    {
+      NS_LOG_WARN ("Out of SIDs.");
+      return 0;
+    }
+
+  if (m_sids.size () <= sid)
+    m_sids.resize (sid + 1);
+
+  // A backlog may still hold the SID from its last owner, and the
+  // scheduler keeps the bits in step with it.
+  SidState &state = m_sids[sid];
+  uint32_t backlogged = state.backlogged;
+  state = SidState ();
+  state.backlogged = backlogged;
+  state.active = true;
+  state.channel = channel;
+  state.mode = mode;
+  state.cm = cm;
+
+  if (mode == kUnsolicitedGrant || mode == kRealTimePolling || mode == kProactiveGrant)
+    {
+      m_upChannelDescs[channel].periodicSids.push_back (sid);
+      m_upChannelDescs[channel].patternValid = false;
+    }
+
+  return sid;
+}
+
+void
+CmtsDevice::ReleaseSid(uint16_t sid)
+{
+  if (sid >= m_sids.size () || !m_sids[sid].active) return;
+
+  SidState &state = m_sids[sid];
+  std::vector<uint16_t> &periodicSids = m_upChannelDescs[state.channel].periodicSids;
+  if (std::find (periodicSids.begin (), periodicSids.end (), sid) != periodicSids.end ())
+    {
+      periodicSids.erase (std::remove (periodicSids.begin (), periodicSids.end (), sid), periodicSids.end ());
+      m_upChannelDescs[state.channel].patternValid = false;
+    }
+
+  // Stale backlog entries are dropped by the scheduler.
+  state.active = false;
+  state.pendingMinislots = 0;
+  state.cm = 0;
+  state.reassembly = 0;
+  state.segments.clear ();
+  state.stream = 0;
+  m_freeSids.push_back (sid);
+}
+
+void
+CmtsDevice::AdmitServiceFlows(uint32_t handle)
+{
+  CmState &state = m_cms[handle];
+  Ptr<CmDevice> cm = state.cm;
+
+  // Flows are admitted in reference order, so the ones past the services
+  // already held are new.
+  const std::vector<DocsisServiceFlow> &upstreamFlows = cm->GetUpstreamServiceFlows ();
+  std::list<UpServiceStruct>::const_iterator admitted = state.upstreamServices.begin ();
+  for (uint32_t reference = 0; reference < state.upstreamServices.size (); reference++, admitted++)
+    {
+      const DocsisServiceFlow &flow = upstreamFlows[reference];
+      m_sids[admitted->serviceId].bucket.Configure (flow.maxSustainedRate, flow.maxTrafficBurst, flow.peakRate);
+      ConfigurePeriodicGrants (admitted->serviceId, flow);
+    }
+  for (uint32_t reference = state.upstreamServices.size (); reference < upstreamFlows.size (); reference++)
+    {
+      const DocsisServiceFlow &flow = upstreamFlows[reference];
+      UpServiceStruct service;
+      service.mode = flow.mode;
+      if (reference == 0 && state.rangingSid != 0 && m_sids[state.rangingSid].channel == service.channel)
+        {
+          // The CM goes on with the SID it ranged on as its primary SID.
+          service.serviceId = state.rangingSid;
+          state.rangingSid = 0;
+          m_sids[service.serviceId].mode = service.mode;
+          if (service.mode == kUnsolicitedGrant || service.mode == kRealTimePolling || service.mode == kProactiveGrant)
+            {
+              m_upChannelDescs[service.channel].periodicSids.push_back (service.serviceId);
+              m_upChannelDescs[service.channel].patternValid = false;
+            }
+        }
+      else
+        service.serviceId = AllocateSid (cm, service.channel, service.mode);
+      // Flows keep their reference order, so none is admitted past one
+      // that found no SID.
+      if (service.serviceId == 0) break;
+      state.upstreamServices.push_back (service);
+      cm->AddUpstreamService (service.serviceId, service.channel, m_upChannelDescs[service.channel].clock, service.mode, reference);
+
+      SidState &sidState = m_sids[service.serviceId];
+      sidState.bucket.Configure (flow.maxSustainedRate, flow.maxTrafficBurst, flow.peakRate);
+      ConfigurePeriodicGrants (service.serviceId, flow);
+      for (uint32_t channel = 0; channel < m_upstreamBondingGroupSize && channel < m_upChannelDescs.size () && m_upstreamBondingGroupSize > 1; channel++)
+        {
+          sidState.channels.push_back (channel);
+          cm->SetUpstreamMinislotClock (channel, m_upChannelDescs[channel].clock);
+        }
+      cm->SetUpstreamBondingGroup (service.serviceId, sidState.channels);
+    }
+
+  const std::vector<DocsisServiceFlow> &downstreamFlows = cm->GetDownstreamServiceFlows ();
+  for (uint32_t reference = 0; reference < state.downstreamServices.size (); reference++)
+    ConfigureFlow (state.downstreamServices[reference], downstreamFlows[reference]);
+  for (uint32_t reference = state.downstreamServices.size (); reference < downstreamFlows.size (); reference++)
+    {
+      DownServiceStruct service;
+      ConfigureFlow (service, downstreamFlows[reference]);
+      service.dsid = m_nextDsid++ & 0xFFFFF;
+      for (uint32_t channel = 0; channel < m_bondingGroupSize && channel < m_hfc->GetDownstreamChannelsAmount (); channel++)
+        service.channels.push_back (channel);
+      state.downstreamServices.push_back (service);
+    }
+
+  state.downstreamClassifier = cm->GetDownstreamClassifier ();
+}
+
+void
+CmtsDevice::RegisterCm(uint32_t handle)
+{
+  NS_LOG_FUNCTION (this << handle);
+  CmState &state = m_cms[handle];
+  state.registered = true;
+
+  AdmitServiceFlows (handle);
+
+  // MAPs only go to the CMs with a flow on their upstream channel.
+  if (state.upstreamServices.empty ()) return;
+  const UpServiceStruct &primary = state.upstreamServices.front ();
+  const SidState &sidState = m_sids[primary.serviceId];
+  m_hfc->JoinGroup (GetMapGroup (primary.channel), handle);
+  for (std::vector<uint32_t>::const_iterator channel = sidState.channels.begin (); channel != sidState.channels.end (); channel++)
+    m_hfc->JoinGroup (GetMapGroup (*channel), handle);
+}
+
+void
+CmtsDevice::ProcessRangingRequest(Ptr<Packet> packet, Ptr<CmDevice> sender, const TrackedGrant &grant, uint32_t channel)
+{
+  // How far from the start of its region the burst arrived, which is what
+  // the CM has to add to its offset.
+  Time txTime = m_hfc->GetUpstreamTxTime (channel, packet->GetSize (), sender->GetHandle ());
+  Time error = Simulator::Now () - txTime - MinislotToTime (channel, grant.start);
+
+  DocsisHeader dh (m_hfc->GetUpstreamPhyOverhead (channel));
+  packet->RemoveHeader (dh);
+  if (!dh.IsManagementPacket ()) return;
+
+  MacManagementMessageHeader mmmh;
+  packet->RemoveHeader (mmmh);
+  if (mmmh.GetType () != MacManagementMessageHeader::kRangingRequest) return;
+
+  std::tr1::unordered_map< Mac48Address, uint32_t, Mac48AddressHash >::iterator entry = m_cmsByAddress.find (mmmh.GetSource ());
+  if (entry == m_cmsByAddress.end ()) return;
+  CmState &state = m_cms[entry->second];
+  if (state.registered) return;
+
+  NS_LOG_FUNCTION (this << entry->second << error);
+  if (state.rangingSid == 0)
+    state.rangingSid = AllocateSid (state.cm, channel, kBestEffort);
+  if (state.rangingSid == 0) return;
+
+  // Within tolerance the CM goes on to register, otherwise it is polled in
+  // station maintenance until it is.
+  Grant next;
+  next.sid = state.rangingSid;
+  RangingResponseHeader::RangingStatus status;
+  if (Abs (error) <= m_rangingTolerance)
+    {
+      status = RangingResponseHeader::kSuccess;
+      next.slots = ManagementMinislots (channel, RegistrationRequestHeader ().GetSerializedSize ());
+      next.type = MAPHeader::kShortDataGrant;
+    }
+  else
+    {
+      status = RangingResponseHeader::kContinue;
+      next.slots = ManagementMinislots (channel, RangingRequestHeader ().GetSerializedSize ());
+      next.type = MAPHeader::kStationManteinance;
+    }
+  m_upChannelDescs[channel].maintenance.push_back (next);
+
+  RangingResponseHeader rsp;
+  rsp.Setup (state.rangingSid, channel, (int32_t) error.GetNanoSeconds (), status);
+  Ptr<Packet> response = Create<Packet> ();
+  response->AddHeader (rsp);
+  SendManagement (response, MacManagementMessageHeader::kRangingResponse, state);
+}
+
+void
+CmtsDevice::ProcessManagement(Ptr<Packet> packet)
+{
+  MacManagementMessageHeader mmmh;
+  packet->RemoveHeader (mmmh);
+  if (mmmh.GetType () != MacManagementMessageHeader::kRegistrationRequest) return;
+
+  RegistrationRequestHeader reg;
+  packet->RemoveHeader (reg);
+
+  std::tr1::unordered_map< Mac48Address, uint32_t, Mac48AddressHash >::iterator entry = m_cmsByAddress.find (mmmh.GetSource ());
+  if (entry == m_cmsByAddress.end ()) return;
+  CmState &state = m_cms[entry->second];
+
+  // The CM is provisioned from its own configuration, and its temporary
+  // SID becomes the SID of its primary flow. A repeated REG-REQ is only
+  // answered again.
+  if (!state.registered)
+    {
+      if (reg.GetSid () != state.rangingSid) return;
+      m_initializingCms--;
+      RegisterCm (entry->second);
+      if (state.rangingSid != 0)
+        {
+          ReleaseSid (state.rangingSid);
+          state.rangingSid = 0;
+        }
+    }
+
+  RegistrationResponseHeader rsp;
+  rsp.Setup (reg.GetSid (), 0);
+  Ptr<Packet> response = Create<Packet> ();
+  response->AddHeader (rsp);
+  SendManagement (response, MacManagementMessageHeader::kRegistrationResponse, state);
+}
+
+uint32_t
+CmtsDevice::ConformingMinislots(uint32_t channel, SidState &state, uint32_t slots)
+{
+  uint32_t minislotSize = m_hfc->GetUpstreamMinislotSize (channel, state.cm->GetHandle ());
+  uint32_t bytes = state.bucket.GetConformingBytes (Simulator::Now ());
+  if (bytes >= slots * minislotSize)
+    return slots;
+
+  // A grant smaller than a full size frame would mostly carry fragment
+  // overhead, so the SID waits until its bucket holds one.
+  if (bytes < kMaxFrameBytes)
+    return 0;
+  return bytes / minislotSize;
+}
+
+void
+CmtsDevice::ProcessRequest(uint16_t sid, uint32_t minislots)
+{
+  NS_LOG_FUNCTION (this << sid << minislots);
+  if (sid >= m_sids.size () || !m_sids[sid].active) return;
+
+  SidState &state = m_sids[sid];
+  // A request states everything the CM still needs, so a CM that repeats
+  // a request it believes was lost is not granted twice.
+  state.pendingMinislots = minislots;
+  if (minislots == 0) return;
+
+  if (state.channels.empty ())
+    {
+      if (!(state.backlogged & (1u << state.channel)))
+        {
+          state.backlogged |= 1u << state.channel;
+          m_upChannelDescs[state.channel].backlog.push_back (sid);
+        }
+      return;
+    }
+
+  state.bondedShare = (minislots + state.channels.size () - 1) / state.channels.size ();
+  for (std::vector<uint32_t>::const_iterator channel = state.channels.begin (); channel != state.channels.end (); channel++)
+    if (!(state.backlogged & (1u << *channel)))
+      {
+        state.backlogged |= 1u << *channel;
+        m_upChannelDescs[*channel].backlog.push_back (sid);
+      }
+}
+
+void
+CmtsDevice::ProcessFrame(Ptr<Packet> packet, uint32_t phyOverhead)
+{
+  DocsisHeader dh (phyOverhead);
+  packet->RemoveHeader (dh);
+
+  if (dh.IsRequestPacket ())
+    ProcessRequest (dh.GetRequestSid (), dh.GetRequestedMinislots ());
+  else if (dh.IsDataPacket ())
+    {
+      const DocsisHeader::ExtendedHeader::ExtendedHeaderElement *piggyback = dh.findExtendedHeader (DocsisHeader::kEHRequest);
+      if (piggyback)
+        ProcessRequest (piggyback->m_sid, piggyback->m_minislots);
+
+      ProcessData (packet);
+    }
+  else if (dh.IsConcatenationPacket ())
+    ProcessConcatenation (packet);
+  else if (dh.IsManagementPacket ())
+    ProcessManagement (packet);
+  else if (dh.IsFragmentationPacket ())
+    ProcessFragment (packet, dh);
+}
+
+void
+CmtsDevice::ProcessConcatenation(Ptr<Packet> packet)
+{
+  // The frames inside carry no PHY overhead of their own.
+  while (packet->GetSize () > 0)
+    {
+      DocsisHeader dh;
+      packet->PeekHeader (dh);
+      uint32_t length = dh.GetSerializedSize () + dh.GetLength ();
+      if (length > packet->GetSize ()) break;
+
+      ProcessFrame (packet->CreateFragment (0, length), 0);
+      packet->RemoveAtStart (length);
+    }
+}
+
+void
+CmtsDevice::ProcessFragment(Ptr<Packet> packet, const DocsisHeader &dh)
+{
+  const DocsisHeader::ExtendedHeader::ExtendedHeaderElement *ehe = dh.findExtendedHeader (DocsisHeader::kUpstreamPrivacy);
+  if (!ehe || ehe->m_sid >= m_sids.size () || !m_sids[ehe->m_sid].active) return;
+
+  if (ehe->m_minislots > 0)
+    ProcessRequest (ehe->m_sid, ehe->m_minislots);
+
+  SidState &state = m_sids[ehe->m_sid];
+  packet->RemoveAtEnd (4);	// Fragment CRC
+
+  if (ehe->m_firstFragment)
+    state.reassembly = packet;
+  else if (!state.reassembly || ehe->m_fragmentSequence != state.nextFragment)
+    {
+      // A fragment went missing, the frame is lost.
+      state.reassembly = 0;
+      return;
+    }
+  else
+    state.reassembly->AddAtEnd (packet);
+  state.nextFragment = (ehe->m_fragmentSequence + 1) & 0x0F;
+
+  if (ehe->m_lastFragment)
+    {
+      Ptr<Packet> frame = state.reassembly;
+      state.reassembly = 0;
+      ProcessFrame (frame, 0);
+    }
+}
+
+bool
+CmtsDevice::FindTrackedGrant(uint32_t channel, Ptr<const Packet> packet, Ptr<CmDevice> sender, TrackedGrant &grant)
+{
+  std::deque<TrackedGrant> &grants = m_upChannelDescs[channel].trackedGrants;
+  if (grants.empty ()) return false;
+
+  // The burst started at the beginning of its grant.
+  Time txTime = m_hfc->GetUpstreamTxTime (channel, packet->GetSize (), sender->GetHandle ());
+  uint32_t start = m_upChannelDescs[channel].clock.GetNearestMinislot (Simulator::Now () - txTime);
+
+  while (!grants.empty () && (int32_t) (grants.front ().end - start) <= 0)
+    grants.pop_front ();
+
+  if (grants.empty () || (int32_t) (grants.front ().start - start) > 0) return false;
+  grant = grants.front ();
+  grants.pop_front ();
+  return grant.sid == MAPHeader::BROADCAST_SID || (grant.sid < m_sids.size () && m_sids[grant.sid].active);
+}
+
+void
+CmtsDevice::ProcessSegment(Ptr<Packet> packet, uint16_t sid, uint32_t phyOverhead)
+{
+  SegmentHeader sh (phyOverhead);
+  packet->RemoveHeader (sh);
+  NS_LOG_FUNCTION (this << sid << sh.GetSequence () << packet->GetSize ());
+
+  if (sh.GetRequest () > 0)
+    ProcessRequest (sid, sh.GetRequest ());
+
+  SidState &state = m_sids[sid];
+  uint32_t offset = (sh.GetSequence () - state.nextSegment) & 0x1FFF;
+  if (offset >= 0x1000) return;	// Its place in the stream was already given up
+
+  BufferedSegment segment;
+  segment.payload = packet;
+  segment.pointerValid = sh.IsPointerValid ();
+  segment.pointer = sh.GetPointer ();
+  state.segments[state.nextSegment + offset] = segment;
+
+  // Segments arrive in grant order per channel, not across channels. A gap
+  // that outlives this many later segments is a lost segment.
+  if (state.segments.size () > m_maxSegmentsOutOfOrder && state.segments.begin ()->first != state.nextSegment)
+    {
+      state.nextSegment = state.segments.begin ()->first;
+      state.stream = 0;
+      state.streamSynced = false;
+    }
+
+  while (!state.segments.empty () && state.segments.begin ()->first == state.nextSegment)
+    {
+      BufferedSegment next = state.segments.begin ()->second;
+      state.segments.erase (state.segments.begin ());
+      state.nextSegment++;
+
+      // After a loss, the pointer shows where the next whole frame starts.
+      if (!state.streamSynced)
+        {
+          if (!next.pointerValid || next.pointer > next.payload->GetSize ()) continue;
+          next.payload->RemoveAtStart (next.pointer);
+          state.streamSynced = true;
+        }
+
+      if (!state.stream)
+        state.stream = next.payload;
+      else
+        state.stream->AddAtEnd (next.payload);
+      ProcessSegmentStream (sid);
+    }
+}
+
+void
+CmtsDevice::ProcessSegmentStream(uint16_t sid)
+{
+  // Hand up every frame the stream holds whole so far.
+  Ptr<Packet> stream = m_sids[sid].stream;
+  while (stream->GetSize () >= 6)
+    {
+      uint8_t start[2];
+      stream->CopyData (start, 2);
+      uint32_t headerLength = 6 + ((start[0] & 0x01) ? start[1] : 0);	// EHDR_ON, EH_LEN
+      if (stream->GetSize () < headerLength) break;
+
+      DocsisHeader dh;
+      stream->PeekHeader (dh);
+      uint32_t length = dh.GetSerializedSize () + dh.GetLength ();
+      if (length > stream->GetSize ()) break;
+
+      ProcessFrame (stream->CreateFragment (0, length), 0);
+      stream->RemoveAtStart (length);
+    }
+}
+
+void
+CmtsDevice::ProcessData(Ptr<Packet> packet)
+{
+  PDUHeader pduh;
+  packet->RemoveHeader (pduh);
+  packet->RemoveAtEnd (4);
+
+  uint16_t protocol = pduh.GetTypeLength ();
+  if (protocol <= 1500)
+    {
+      uint32_t padlen = packet->GetSize () - protocol;
+      if (padlen > 0) packet->RemoveAtEnd (padlen);
+
+      LlcSnapHeader llc;
+      packet->RemoveHeader (llc);
+      protocol = llc.GetType ();
+    }
+
+  if (!m_rxCallback.IsNull ())
+    m_rxCallback(this, packet, protocol, pduh.GetSource ());
+}
+
+void
+CmtsDevice::EnqueueManagement(Ptr<Packet> packet, uint32_t channel, uint32_t group, Ptr<CmDevice> destiny)
+{
+  // Management messages jump ahead of queued data.
+  PacketAddress pa;
+  pa.packet = packet;
+  pa.address = Mac48Address::GetBroadcast ();
+  pa.destiny = destiny;
+  pa.channel = channel;
+  pa.group = group;
+
+  if (!m_lastPackets[channel])
+    TransmitStart (packet, destiny, channel, group);
+  else
+    m_packetQueues[channel].push_front (pa);
+}
+
+void
+CmtsDevice::SendManagement(Ptr<Packet> message, MacManagementMessageHeader::MmmType type, const CmState &state)
+{
+  MacManagementMessageHeader mmmh;
+  mmmh.Setup (m_address, state.address, message->GetSize () + 6, type);
+  message->AddHeader (mmmh);
+
+  DocsisHeader dh;
+  dh.setupMSHManagement (m_hfc->GetDownstreamPhyOverhead (0), message->GetSize (), kDownstream);
+  message->AddHeader (dh);
+
+  EnqueueManagement (message, 0, Hfc::kAllCms, state.cm);
+}
+
+uint32_t
+CmtsDevice::GetMapGroup(uint32_t channel)
+{
+  while (m_mapGroups.size () <= channel)
+    m_mapGroups.push_back (m_hfc->CreateGroup ());
+  return m_mapGroups[channel];
+}
+
+bool
+CmtsDevice::HasCm(Mac48Address address) const
+{
+  return m_cmsByAddress.find (address) != m_cmsByAddress.end ();
+}
+
+std::vector<Mac48Address>
+CmtsDevice::GetCmAddresses(void) const
+{
+  std::vector<Mac48Address> addresses;
+  addresses.reserve (m_cmsByAddress.size ());
+  for (std::tr1::unordered_map< Mac48Address, uint32_t, Mac48AddressHash >::const_iterator entry = m_cmsByAddress.begin (); entry != m_cmsByAddress.end (); entry++)
+    addresses.push_back (entry->first);
+  return addresses;
+}
+
+void
+CmtsDevice::AddCmChangeCallback(Callback<void, Ptr<CmtsDevice>, Mac48Address, bool> callback)
+{
+  m_cmChangeCallbacks.ConnectWithoutContext (callback);
+}
+
+CmtsDevice::CmState *
+CmtsDevice::LookupCm(Mac48Address address)
+{
+  std::tr1::unordered_map< Mac48Address, uint32_t, Mac48AddressHash >::iterator entry = m_cmsByAddress.find (address);
+  if (entry == m_cmsByAddress.end ())
+    return NULL;
+
+  return &m_cms[entry->second];
+}
+
+uint32_t
+CmtsDevice::ManagementMinislots(uint32_t channel, uint32_t messageBytes)
+{
+  DocsisHeader dh;
+  dh.setupMSHManagement (m_hfc->GetUpstreamPhyOverhead (channel), 0, kUpstream);
+  MacManagementMessageHeader mmmh;
+  return BytesToMinislots (channel, dh.GetSerializedSize () + mmmh.GetSerializedSize () + messageBytes, Hfc::kNoHandle);
+}
+
+uint32_t
+CmtsDevice::BytesToMinislots(uint32_t channel, uint32_t bytes, uint32_t handle)
+{
+  return m_upChannelDescs[channel].clock.GetMinislotsCovering (m_hfc->GetUpstreamTxTime (channel, bytes, handle));
+}
+
+void
+CmtsDevice::SetupUpstreamChannels()
+{
+  if (!m_hfc) return;
+
+  NS_ASSERT_MSG (m_hfc->GetUpstreamChannelsAmount () <= 32, "At most 32 upstream channels are supported.");
+  m_upChannelDescs.resize (m_hfc->GetUpstreamChannelsAmount ());
+  for (uint32_t channel = 0; channel < m_upChannelDescs.size (); channel++)
+    {
+      UpstreamChannelDescription &ucd = m_upChannelDescs[channel];
+      if (!ucd.clock.IsValid ())
+        ucd.clock = DocsisMinislotClock (DocsisMinislotClock::GetTicksCovering (m_hfc->GetUpstreamTxTime (channel, m_hfc->GetUpstreamMinislotSize (channel))),
+                                         m_initialTimestamp);
+      ucd.grants.reserve (MAPHeader::MAX_INFORMATION_ELEMENTS);
+      ucd.grantsPending.reserve (MAPHeader::MAX_INFORMATION_ELEMENTS);
+    }
 }
 
 }
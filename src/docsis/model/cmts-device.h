@@ -21,8 +21,13 @@
 #define CMTS_DEVICE_H
 
 #include <map>
+#include <deque>
+#include <tr1/unordered_map>
 #include "docsis-enums.h"
 #include "mac-management-message.h"
+#include "docsis-service-flow.h"
+#include "docsis-dual-queue.h"
+#include "docsis-minislot-clock.h"
 #include "ns3/net-device.h"
 #include "ns3/node.h"
 #include "ns3/mac48-address.h"
@@ -33,12 +38,22 @@ namespace ns3 {
 
 class Hfc;
 class CmDevice;
+class DocsisHeader;
 
 struct PacketAddress
 {
+  PacketAddress() : channel(0), group(0) {}
   Ptr<Packet> packet;
   Address address;
+  Ptr<CmDevice> destiny;	// Resolved when queued, null for broadcasts
   uint32_t channel;
+  uint32_t group;	// Hfc broadcast group of a broadcast, 0 for every CM
+};
+
+class Mac48AddressHash : public std::unary_function<Mac48Address, size_t>
+{
+public:
+  size_t operator() (Mac48Address const &address) const;
 };
 
 class CmtsDevice : public NetDevice
@@ -55,29 +70,173 @@ public:
     MAPHeader::IEType type;
   };
 
+  struct TrackedGrant
+  {
+    uint16_t sid;
+    uint32_t start;	// Minislots
+    uint32_t end;
+    MAPHeader::IEType type;
+  };
+
+  // A UGS or PGS grant, as laid out in a MAP: it starts offset minislots
+  // into the MAP, jitter minislots after its nominal start.
+  struct PeriodicGrant
+  {
+    uint16_t sid;
+    uint16_t slots;
+    uint16_t offset;
+    uint16_t jitter;
+  };
+
   struct UpstreamChannelDescription
   {
-    Time timePerMinislot;
+    UpstreamChannelDescription() : lastMinislotGrantSent(0), nextInitialMaintenance(0), patternValid(false),
+                                   patternStart(0), patternMapLength(0), nextPeriodic(0), lastPeriodic(0) {}
+    DocsisMinislotClock clock;	// Handed to the CMs on the channel with the UCD
 
-    std::list<Grant> grants;
+    // Scheduler state. The containers keep their capacity between MAPs so
+    // building a MAP does not allocate.
+    std::vector<Grant> grants;
+    std::vector<uint16_t> grantsPending;
+    std::vector<uint16_t> periodicSids;
+    std::deque<uint16_t> backlog;
+    std::deque<TrackedGrant> trackedGrants;	// Maintenance regions, and data grants to bonded or rate limited SIDs, in MAP order
+    std::vector<Grant> maintenance;	// Station maintenance and REG-REQ grants owed to ranging SIDs
     uint32_t lastMinislotGrantSent;
-    uint32_t lastMinislotRequestReceived;
+    Time nextInitialMaintenance;
+    EventId mapEvent;
+
+    // Periodic grants of the UGS and PGS flows, laid out once for every MAP
+    // of their common period, and reused by the MAPs that follow until a
+    // flow or the minislot timing changes. Each phase is one MAP long.
+    bool patternValid;
+    std::vector<PeriodicGrant> pattern;
+    std::vector<uint32_t> patternPhases;	// First grant of every phase, and the end; empty when the period is too long to cache
+    uint32_t patternStart;	// Minislot where the first phase starts
+    uint32_t patternMapLength;
+    std::vector<PeriodicGrant> periodic;	// The grants of a MAP off the pattern
+    const PeriodicGrant *nextPeriodic;	// Still to be placed in the MAP being built
+    const PeriodicGrant *lastPeriodic;
+  };
+  // A downstream service flow, by the handle of its CM and its reference.
+  struct FlowId
+  {
+    uint32_t handle;
+    uint32_t reference;
+  };
+  struct ReservedWait
+  {
+    Time time;	// When the flow is back under its minimum reserved rate
+    FlowId flow;
+    bool operator> (const ReservedWait &other) const { return time > other.time; }
   };
   struct DownstreamChannelDescription
   {
+    // Scheduler state. The first ring holds the flows still under their
+    // minimum reserved rate, served round robin ahead of the second, which
+    // shares what is left by deficit round robin. Entries are dropped
+    // lazily, once they come up.
+    std::deque<FlowId> rings[2];
+    std::vector<ReservedWait> reservedWaits;	// A min-heap by time
   };
 
   struct UpServiceStruct
   {
-    UpServiceStruct() : serviceId(0), channel(0), mode(kUnsolicitedGrant) {}
+    UpServiceStruct() : serviceId(0), channel(0), mode(kBestEffort) {}
     uint32_t serviceId;
     uint32_t channel;
     DocsisUpstreamChannelMode mode;
   };
+  struct BufferedSegment
+  {
+    Ptr<Packet> payload;
+    bool pointerValid;
+    uint16_t pointer;
+  };
+  struct SidState
+  {
+    SidState() : active(false), channel(0), mode(kBestEffort), pendingMinislots(0), backlogged(0), mapsSincePoll(0), nextFragment(0),
+                 bondedShare(0), nextSegment(0), streamSynced(true), grantInterval(0), grantBytes(0), grantAnchored(false), grantAnchor(0) {}
+    bool active;
+    uint32_t channel;
+    DocsisUpstreamChannelMode mode;
+    uint32_t pendingMinislots;
+    uint32_t backlogged;	// Channels whose backlog holds the SID, as a bit mask
+    uint32_t mapsSincePoll;
+    Ptr<CmDevice> cm;
+    Ptr<Packet> reassembly;
+    uint8_t nextFragment;
+
+    // Upstream bonding: the SID is granted on every channel of the group,
+    // and the segments are put back into one stream of MAC frames.
+    std::vector<uint32_t> channels;
+    uint32_t bondedShare;	// Minislots granted per channel and MAP
+    uint32_t nextSegment;	// Sequence numbers, extended past their 13 bits
+    std::map<uint32_t, BufferedSegment> segments;
+    Ptr<Packet> stream;
+    bool streamSynced;
+
+    // Rate shaping: grants take their minislots out of the bucket, and
+    // what the burst leaves unused is given back when it arrives.
+    DocsisTokenBucket bucket;
+
+    // UGS and PGS: the nominal grants are grantInterval apart, one of them
+    // at the anchor minislot, which is set when the flow is first laid out.
+    Time grantInterval;
+    uint32_t grantBytes;
+    bool grantAnchored;
+    uint32_t grantAnchor;
+  };
+  struct FlowPacket
+  {
+    Ptr<Packet> packet;	// With its PDU header, without the DOCSIS one
+    uint32_t bytes;	// As charged to the token buckets and the deficit
+  };
   struct DownServiceStruct{
-    DownServiceStruct() : serviceId(0), channel(0) {}
+    DownServiceStruct() : serviceId(0), channel(0), dsid(0), nextSequence(0), quantum(0), deficit(0), waiting(0), throttled(false)
+    {
+      listed[0] = listed[1] = 0;
+    }
     uint32_t serviceId;
     uint32_t channel;
+    uint32_t dsid;
+    std::vector<uint32_t> channels;	// Bonding group
+    uint16_t nextSequence;
+
+    // Downstream scheduling: packets wait here until a channel of the
+    // bonding group picks the flow. A flow past its maximum rate leaves the
+    // rings, and a single event puts it back once the bucket has the tokens.
+    // Low latency flows queue in dualQueue instead of packets, which the
+    // accessors below hide from the scheduler.
+    std::deque<FlowPacket> packets;
+    Ptr<DocsisDualQueue> dualQueue;
+    DocsisTokenBucket bucket;	// Maximum sustained and peak rates
+    DocsisTokenBucket reservedBucket;	// Minimum reserved rate
+    uint32_t quantum;	// Bytes per round, by traffic priority
+    uint32_t deficit;
+    uint32_t listed[2];	// Channels whose ring holds the flow, as bit masks
+    uint32_t waiting;	// Channels where the flow waits in reservedWaits
+    bool throttled;
+    EventId release;
+
+    bool IsEmpty() const;
+    uint32_t GetNPackets() const;
+    uint32_t GetHeadBytes() const;
+    Ptr<Packet> Dequeue();
+  };
+  // Everything the CMTS keeps per attached CM, indexed by the handle the
+  // Hfc gave it.
+  struct CmState
+  {
+    CmState() : active(false), registered(false), rangingSid(0) {}
+    bool active;
+    bool registered;	// Service flows are only admitted once it is
+    uint16_t rangingSid;	// Temporary SID while the CM ranges and registers
+    Ptr<CmDevice> cm;
+    Mac48Address address;
+    std::list<UpServiceStruct> upstreamServices;	// In flow reference order
+    std::vector<DownServiceStruct> downstreamServices;	// Indexed by flow reference
+    DocsisClassifier downstreamClassifier;
   };
 
   void AddLinkChangeCallback (Callback<void> callback);
@@ -107,33 +266,107 @@ public:
 
   void Attach(Ptr<Hfc> channel);
   void Deattach();
-  void CmAttached(Ptr<CmDevice> cm);
-  void CmDeattached(Ptr<CmDevice> cm);
+  void CmAttached(Ptr<CmDevice> cm, uint32_t handle);
+  void ReserveCms(uint32_t cms);
+  void CmDeattached(Ptr<CmDevice> cm, uint32_t handle);
   void CmChangedAddress(Ptr<CmDevice> cm, Address old_address);
+  void CmChangedTimeDistance(Ptr<CmDevice> cm);
+  void CmChangedServiceFlows(Ptr<CmDevice> cm);
+  void CmChangedProfile(Ptr<CmDevice> cm, uint32_t channel);
+  bool HasCm(Mac48Address address) const;
+  std::vector<Mac48Address> GetCmAddresses(void) const;
+  // Told of every CM that attaches, true, or leaves, false, by its address.
+  void AddCmChangeCallback(Callback<void, Ptr<CmtsDevice>, Mac48Address, bool> callback);
+  // The dual queue of an admitted low latency downstream flow, null for
+  // other flows.
+  Ptr<DocsisDualQueue> GetDownstreamQueue(Mac48Address cm, uint32_t reference);
 
 #define TEMPLATE_SELECTOR_T uint32_t, Ptr<Hfc>, std::vector< std::list< PacketAddress > >, std::list<DownServiceStruct>
 typedef Callback< TEMPLATE_SELECTOR_T > selector_t;
   void RegisterChannelSelector(selector_t selector);
   void SetUpstreamChannelDescription(uint32_t channel, UpstreamChannelDescription desc);
+  void UpstreamPhyProfileChanged(uint32_t channel);
   void SetDownstreamChannelDescription(uint32_t channel, DownstreamChannelDescription desc);
 
-  double TimeToMinislot(uint32_t channel, Time time);
+  const DocsisMinislotClock &GetMinislotClock(uint32_t channel) const;
   Time MinislotToTime(uint32_t channel, uint32_t minislot);
   void ForceSendMAP();
   void ForceSendMAP(uint32_t channel);
-  bool Receive(Ptr<Packet> packet, Ptr<CmDevice> sender);
+  bool Receive(Ptr<Packet> packet, Ptr<CmDevice> sender, uint32_t channel);
+
+protected:
+  virtual void DoInitialize (void);
+  virtual void DoDispose (void);
 
 private:
   Time CalculateMaxRTT();
   Time LatestMomentToSendMAP(Time startOfMAP);
 
-  void TransmitStart(Ptr< Packet > packet, Ptr<CmDevice> destiny, uint32_t channel);
+  void TransmitStart(Ptr< Packet > packet, Ptr<CmDevice> destiny, uint32_t channel, uint32_t group);
   void TransmitComplete(uint32_t channel);
   void SendMAP(uint32_t channel);
+  void ScheduleMAP(uint32_t channel, uint32_t mapStart);
+  void BuildGrants(uint32_t channel, uint32_t mapStart, uint32_t mapLength);
+  void FindPeriodicGrants(uint32_t channel, uint32_t mapStart, uint32_t mapLength);
+  void BuildGrantPattern(uint32_t channel, uint32_t mapStart, uint32_t mapLength);
+  void LayOutPeriodicGrants(uint32_t channel, uint32_t mapStart, uint32_t mapLength, std::vector<PeriodicGrant> &grants);
+  void ConfigurePeriodicGrants(uint16_t sid, const DocsisServiceFlow &flow);
+  uint32_t GrantIntervalMinislots(uint32_t channel, const SidState &state, uint32_t mapLength);
+  bool MakeRoom(uint32_t channel, uint32_t mapStart, uint32_t mapLength, uint32_t &used, uint32_t slots);
+  void PlacePeriodicGrant(uint32_t channel, uint32_t mapStart, uint32_t &used);
+  bool HasRoomForGrant(const UpstreamChannelDescription &ucd, uint32_t maxGrants) const;
+  uint16_t AllocateSid(Ptr<CmDevice> cm, uint32_t channel, DocsisUpstreamChannelMode mode);
+  void ReleaseSid(uint16_t sid);
+  void AdmitServiceFlows(uint32_t handle);
+  void RegisterCm(uint32_t handle);
+  void ProcessRangingRequest(Ptr<Packet> packet, Ptr<CmDevice> sender, const TrackedGrant &grant, uint32_t channel);
+  void ProcessManagement(Ptr<Packet> packet);
+  void SendManagement(Ptr<Packet> message, MacManagementMessageHeader::MmmType type, const CmState &state);
+  uint32_t ManagementMinislots(uint32_t channel, uint32_t messageBytes);
+  void ProcessRequest(uint16_t sid, uint32_t minislots);
+  uint32_t ConformingMinislots(uint32_t channel, SidState &state, uint32_t slots);
+  void ProcessFrame(Ptr<Packet> packet, uint32_t phyOverhead);
+  void ProcessConcatenation(Ptr<Packet> packet);
+  void ProcessFragment(Ptr<Packet> packet, const DocsisHeader &dh);
+  bool FindTrackedGrant(uint32_t channel, Ptr<const Packet> packet, Ptr<CmDevice> sender, TrackedGrant &grant);
+  void ProcessSegment(Ptr<Packet> packet, uint16_t sid, uint32_t phyOverhead);
+  void ProcessSegmentStream(uint16_t sid);
+  void ProcessData(Ptr<Packet> packet);
+  Ptr<Packet> BuildPdu(Ptr<Packet> packet, Mac48Address dest, uint16_t protocolNumber);
+  Ptr<Packet> BuildFrame(Ptr<Packet> pdu, DownServiceStruct *service, uint32_t channel);
+  void TransmitNext(uint32_t channel);
+  void ConfigureFlow(DownServiceStruct &service, const DocsisServiceFlow &flow);
+  void ActivateFlow(uint32_t handle, uint32_t reference);
+  void ReleaseFlow(uint32_t handle, uint32_t reference);
+  bool PickFlow(uint32_t channel, FlowId &picked);
+  void EnqueueManagement(Ptr<Packet> packet, uint32_t channel, uint32_t group, Ptr<CmDevice> destiny = 0);
+  uint32_t GetMapGroup(uint32_t channel);
+  CmState *LookupCm(Mac48Address address);
+  uint32_t BytesToMinislots(uint32_t channel, uint32_t bytes, uint32_t handle);
+  void SetupUpstreamChannels();
 
-  uint32_t m_downstreamOverhead;
   bool m_useLLC;
   Time m_startupTime;
+  Time m_mapInterval;
+  uint64_t m_initialTimestamp;
+  uint32_t m_contentionRequests;
+  uint32_t m_ugsGrantSize;
+  uint32_t m_pollingInterval;
+  uint32_t m_maxGrantSize;
+  uint8_t m_dataBackoffStart;
+  uint8_t m_dataBackoffEnd;
+  uint32_t m_bondingGroupSize;
+  uint32_t m_upstreamBondingGroupSize;
+  uint32_t m_maxSegmentsOutOfOrder;
+  uint32_t m_maxFlowPackets;
+  uint32_t m_quantum;
+  Time m_initialRangingInterval;
+  uint8_t m_rangingBackoffStart;
+  uint8_t m_rangingBackoffEnd;
+  Time m_rangingTolerance;
+  uint32_t m_initializingCms;	// Attached but not registered
+  Time m_maxRTT;
+  bool m_started;
 
   uint32_t m_deviceIndex;
   uint32_t m_mtu;
@@ -141,22 +374,29 @@ private:
   Mac48Address m_address;
   Ptr<Hfc> m_hfc;
   TracedCallback<> m_linkChangeCallbacks;
+  TracedCallback< Ptr<CmtsDevice>, Mac48Address, bool > m_cmChangeCallbacks;
   ReceiveCallback m_rxCallback;
-  std::vector< std::list< PacketAddress > > m_packetQueues;
-  std::vector< Time > m_packetQueuesTransmissionEndTime;
+  std::vector< std::list< PacketAddress > > m_packetQueues;	// Frames that bypass the service flows
   std::vector< UpstreamChannelDescription > m_upChannelDescs;
   std::vector< DownstreamChannelDescription > m_downChannelDescs;
-  std::map< Address, Ptr<CmDevice> > m_connectedDevices;
-  std::map< Address, std::list<UpServiceStruct> > m_upstreamServices;
-  std::map< Address, std::list<DownServiceStruct> > m_downstreamServices;
+  std::vector< CmState > m_cms;
+  std::tr1::unordered_map< Mac48Address, uint32_t, Mac48AddressHash > m_cmsByAddress;
   std::vector< Ptr<Packet> > m_lastPackets;
+  std::vector< SidState > m_sids;
+  std::vector< uint32_t > m_mapGroups;	// Per upstream channel, the CMs its MAPs go to
+  uint16_t m_nextSid;
+  std::deque<uint16_t> m_freeSids;	// Released, in the order they were
+  uint32_t m_nextDsid;
 
   selector_t m_channelSelector;
 
   TracedCallback< Ptr<const Packet> > m_sendTrace;
+  TracedCallback< Ptr<const Packet> > m_dropTrace;
   TracedCallback< Ptr<const Packet> > m_transmitStartTrace;
   TracedCallback< Ptr<const Packet> > m_transmitCompleteTrace;
   TracedCallback< Ptr<const Packet> > m_receiveTrace;
+  TracedCallback< Ptr<const Packet>, uint32_t > m_snifferTrace;
+  TracedCallback< uint16_t, Time, Time > m_periodicGrantTrace;
   TracedCallback< Ptr<const Hfc> > m_attachTrace;
   TracedCallback< Ptr<const Hfc> > m_deattachTrace;
   TracedCallback< Address > m_addressChangeTrace;
@@ -0,0 +1,388 @@
+/* -*- Mode:C++; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/*
+ * Copyright (c) 2013 Martín Javier Di Liscia
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * Author: Martín Javier Di Liscia
+ */
+#include "docsis-dual-queue.h"
+#include "docsis-header.h"
+#include "ns3/log.h"
+#include "ns3/simulator.h"
+#include "ns3/uinteger.h"
+#include "ns3/double.h"
+#include "ns3/node.h"
+#include "ns3/ipv4-header.h"
+#include "ns3/llc-snap-header.h"
+
+NS_LOG_COMPONENT_DEFINE ("DocsisDualQueue");
+
+namespace ns3 {
+
+NS_OBJECT_ENSURE_REGISTERED (DocsisDualQueue);
+
+static const uint32_t kPduHeaderSize = 14;
+static const uint32_t kLlcSnapSize = 8;
+static const uint8_t kNqbDscp = 45;
+static const uint32_t kMaxFrameSize = 1522;
+
+TypeId
+DocsisDualQueue::GetTypeId (void)
+{
+  static TypeId tid = TypeId ("ns3::DocsisDualQueue")
+    .SetParent<Queue> ()
+    .AddConstructor<DocsisDualQueue> ()
+    .AddAttribute ("MaxBytes",
+                   "Bytes both queues hold together before they drop at the tail",
+                   UintegerValue (150000),
+                   MakeUintegerAccessor (&DocsisDualQueue::m_maxBytes),
+                   MakeUintegerChecker<uint32_t> ())
+    .AddAttribute ("Target",
+                   "Queuing delay the base probability controller aims at",
+                   TimeValue (MilliSeconds (10)),
+                   MakeTimeAccessor (&DocsisDualQueue::m_target),
+                   MakeTimeChecker ())
+    .AddAttribute ("UpdateInterval",
+                   "Time between base probability updates",
+                   TimeValue (MilliSeconds (16)),
+                   MakeTimeAccessor (&DocsisDualQueue::m_updateInterval),
+                   MakeTimeChecker ())
+    .AddAttribute ("Alpha",
+                   "Weight of the distance to the target, per second",
+                   DoubleValue (0.16),
+                   MakeDoubleAccessor (&DocsisDualQueue::m_alpha),
+                   MakeDoubleChecker<double> (0))
+    .AddAttribute ("Beta",
+                   "Weight of the delay trend, per second",
+                   DoubleValue (3.2),
+                   MakeDoubleAccessor (&DocsisDualQueue::m_beta),
+                   MakeDoubleChecker<double> (0))
+    .AddAttribute ("Coupling",
+                   "Factor k between the base probability and the coupled marking probability of L",
+                   DoubleValue (2),
+                   MakeDoubleAccessor (&DocsisDualQueue::m_coupling),
+                   MakeDoubleChecker<double> (0))
+    .AddAttribute ("RampMinThreshold",
+                   "Sojourn time of L frames where their native marking starts",
+                   TimeValue (MicroSeconds (475)),
+                   MakeTimeAccessor (&DocsisDualQueue::m_rampMin),
+                   MakeTimeChecker ())
+    .AddAttribute ("RampRange",
+                   "Sojourn time over the threshold at which every L frame is marked",
+                   TimeValue (MicroSeconds (525)),
+                   MakeTimeAccessor (&DocsisDualQueue::m_rampRange),
+                   MakeTimeChecker ())
+    .AddAttribute ("LowLatencyWeight",
+                   "Share of the departures, out of 256, the L queue gets while both queues hold frames",
+                   UintegerValue (230),
+                   MakeUintegerAccessor (&DocsisDualQueue::m_weight),
+                   MakeUintegerChecker<uint32_t> (0, 256))
+    .AddAttribute ("AgingRate",
+                   "Bytes per second the congestion score of a microflow drains at",
+                   DoubleValue (125000),
+                   MakeDoubleAccessor (&DocsisDualQueue::m_agingRate),
+                   MakeDoubleChecker<double> (0))
+    .AddAttribute ("CriticalScore",
+                   "Congestion score past which the L frames of a microflow are sanctioned",
+                   DoubleValue (4000),
+                   MakeDoubleAccessor (&DocsisDualQueue::m_criticalScore),
+                   MakeDoubleChecker<double> (0))
+    .AddTraceSource ("LowLatencySojourn",
+                     "Time a frame spent in the L queue",
+                     MakeTraceSourceAccessor (&DocsisDualQueue::m_lowLatencySojournTrace))
+    .AddTraceSource ("ClassicSojourn",
+                     "Time a frame spent in the classic queue",
+                     MakeTraceSourceAccessor (&DocsisDualQueue::m_classicSojournTrace))
+    .AddTraceSource ("Mark",
+                     "A frame has been marked CE",
+                     MakeTraceSourceAccessor (&DocsisDualQueue::m_markTrace))
+    .AddTraceSource ("Sanction",
+                     "An L frame has been sent to the classic queue by queue protection",
+                     MakeTraceSourceAccessor (&DocsisDualQueue::m_sanctionTrace))
+  ;
+
+  return tid;
+}
+
+DocsisDualQueue::DocsisDualQueue () : m_bytesInQueue (0), m_classicBytes (0), m_baseProbability (0), m_qdelayOld (0),
+                                      m_nextUpdate (0), m_credit (0)
+{
+  NS_LOG_FUNCTION (this);
+  m_rng = CreateObject<UniformRandomVariable> ();
+}
+
+DocsisDualQueue::~DocsisDualQueue ()
+{
+  NS_LOG_FUNCTION (this);
+}
+
+uint32_t
+DocsisDualQueue::GetLowLatencyPackets (void) const
+{
+  return m_low.size ();
+}
+
+uint32_t
+DocsisDualQueue::GetClassicPackets (void) const
+{
+  return m_classic.size ();
+}
+
+double
+DocsisDualQueue::GetBaseProbability (void)
+{
+  CatchUp ();
+  return m_baseProbability;
+}
+
+int64_t
+DocsisDualQueue::AssignStreams (int64_t stream)
+{
+  m_rng->SetStream (stream);
+  return 1;
+}
+
+DocsisDualQueue::Fields
+DocsisDualQueue::Parse (Ptr<const Packet> p)
+{
+  Fields fields;
+  fields.ip = false;
+  fields.ecn = 0;
+  fields.dscp = 0;
+  fields.flowHash = 0;
+
+  // Read the fields straight from the bytes, as the classifier does.
+  uint8_t buffer[kPduHeaderSize + kLlcSnapSize + 64];
+  uint32_t length = p->CopyData (buffer, sizeof (buffer));
+  if (length < kPduHeaderSize)
+    return fields;
+
+  uint32_t offset = kPduHeaderSize;
+  uint16_t ethertype = (uint16_t) (buffer[12] << 8 | buffer[13]);
+  if (ethertype <= 1500)
+    {
+      offset += kLlcSnapSize;
+      if (length < offset)
+        return fields;
+      ethertype = (uint16_t) (buffer[offset - 2] << 8 | buffer[offset - 1]);
+    }
+  const uint8_t *ip = buffer + offset;
+  if (ethertype != 0x800 || length < offset + 20 || (ip[0] >> 4) != 4)
+    return fields;
+
+  fields.ip = true;
+  fields.ecn = ip[1] & 0x03;
+  fields.dscp = ip[1] >> 2;
+
+  // A microflow is its addresses, protocol and ports.
+  uint32_t headerLength = (ip[0] & 0x0F) * 4;
+  uint32_t hash = 2166136261u;
+  for (uint32_t i = 12; i < 20; i++)
+    hash = (hash ^ ip[i]) * 16777619u;
+  hash = (hash ^ ip[9]) * 16777619u;
+  if ((ip[9] == 6 || ip[9] == 17) && length >= offset + headerLength + 4)
+    for (uint32_t i = headerLength; i < headerLength + 4; i++)
+      hash = (hash ^ ip[i]) * 16777619u;
+  fields.flowHash = hash;
+  return fields;
+}
+
+bool
+DocsisDualQueue::DoEnqueue (Ptr<Packet> p)
+{
+  NS_LOG_FUNCTION (this << p);
+  CatchUp ();
+
+  uint32_t size = p->GetSize ();
+  if (m_bytesInQueue + size > m_maxBytes)
+    {
+      Drop (p);
+      return false;
+    }
+
+  Fields fields = Parse (p);
+  bool low = fields.ip && (fields.ecn == Ipv4Header::ECT1 || fields.ecn == Ipv4Header::CE || fields.dscp == kNqbDscp);
+  if (low && Sanction (fields, size))
+    {
+      NS_LOG_LOGIC ("Sanctioned microflow " << fields.flowHash);
+      m_sanctionTrace (p);
+      low = false;
+    }
+
+  if (!low && m_classicBytes >= 2 * kMaxFrameSize && m_baseProbability > 0
+      && m_rng->GetValue () < m_baseProbability * m_baseProbability)
+    {
+      // Classic flows see the square of the base probability, which
+      // balances their rate with that of scalable flows marked linearly.
+      if (!fields.ip || fields.ecn == Ipv4Header::NotECT)
+        {
+          Drop (p);
+          return false;
+        }
+      MarkCe (p);
+    }
+
+  Item item;
+  item.packet = p;
+  item.arrival = Simulator::Now ();
+  (low ? m_low : m_classic).push_back (item);
+  m_bytesInQueue += size;
+  if (!low)
+    m_classicBytes += size;
+  return true;
+}
+
+Ptr<Packet>
+DocsisDualQueue::DoDequeue (void)
+{
+  NS_LOG_FUNCTION (this);
+  if (m_low.empty () && m_classic.empty ())
+    return 0;
+
+  CatchUp ();
+  bool low = ServeLowLatency ();
+  bool contended = !m_low.empty () && !m_classic.empty ();
+  std::deque<Item> &queue = low ? m_low : m_classic;
+  Item item = queue.front ();
+  queue.pop_front ();
+
+  uint32_t size = item.packet->GetSize ();
+  m_bytesInQueue -= size;
+  if (!low)
+    m_classicBytes -= size;
+
+  // Every byte sent from one queue earns the other its weight, so the
+  // shares hold whatever the frame sizes.
+  if (!contended)
+    m_credit = 0;
+  else if (low)
+    m_credit -= (int64_t) size * (256 - m_weight);
+  else
+    m_credit += (int64_t) size * m_weight;
+
+  Time sojourn = Simulator::Now () - item.arrival;
+  if (low)
+    {
+      m_lowLatencySojournTrace (sojourn);
+      double p = std::max (GetRampProbability (sojourn), std::min (1.0, m_coupling * m_baseProbability));
+      if (p > 0 && m_rng->GetValue () < p)
+        MarkCe (item.packet);
+    }
+  else
+    m_classicSojournTrace (sojourn);
+
+  return item.packet;
+}
+
+Ptr<const Packet>
+DocsisDualQueue::DoPeek (void) const
+{
+  if (m_low.empty () && m_classic.empty ())
+    return 0;
+  return ServeLowLatency () ? m_low.front ().packet : m_classic.front ().packet;
+}
+
+bool
+DocsisDualQueue::ServeLowLatency (void) const
+{
+  if (m_low.empty ())
+    return false;
+  return m_classic.empty () || m_credit >= 0;
+}
+
+Time
+DocsisDualQueue::GetSojourn (const std::deque<Item> &queue) const
+{
+  return queue.empty () ? Time (0) : Simulator::Now () - queue.front ().arrival;
+}
+
+double
+DocsisDualQueue::GetRampProbability (Time sojourn) const
+{
+  if (sojourn <= m_rampMin)
+    return 0;
+  if (!m_rampRange.IsStrictlyPositive ())
+    return 1;
+  return std::min (1.0, (sojourn - m_rampMin).GetSeconds () / m_rampRange.GetSeconds ());
+}
+
+bool
+DocsisDualQueue::Sanction (const Fields &fields, uint32_t size)
+{
+  // The score counts the bytes the flow added while the L queue was
+  // building, so a flow that paces itself keeps it near zero.
+  Time now = Simulator::Now ();
+  Bucket &bucket = m_buckets[fields.flowHash % kBuckets];
+  double drained = (now - bucket.update).GetSeconds () * m_agingRate;
+  bucket.score = std::max (0.0, bucket.score - drained) + GetRampProbability (GetSojourn (m_low)) * size;
+  bucket.update = now;
+  return bucket.score > m_criticalScore;
+}
+
+void
+DocsisDualQueue::CatchUp (void)
+{
+  // As in DocsisPieQueue, the updates due since the last look all see the
+  // same queue, and past a few dozen of them the rest are skipped.
+  Time now = Simulator::Now ();
+  for (uint32_t updates = 0; m_nextUpdate <= now; updates++)
+    {
+      if (updates == 64)
+        {
+          int64_t behind = (now - m_nextUpdate).GetInteger () / m_updateInterval.GetInteger ();
+          m_nextUpdate += TimeStep (behind * m_updateInterval.GetInteger ());
+        }
+      else
+        {
+          double qdelay = std::max (GetSojourn (m_low), GetSojourn (m_classic)).GetSeconds ();
+          m_baseProbability += m_alpha * (qdelay - m_target.GetSeconds ()) + m_beta * (qdelay - m_qdelayOld);
+          m_baseProbability = std::max (0.0, std::min (1.0, m_baseProbability));
+          m_qdelayOld = qdelay;
+        }
+      m_nextUpdate += m_updateInterval;
+    }
+}
+
+bool
+DocsisDualQueue::MarkCe (Ptr<Packet> p)
+{
+  Fields fields = Parse (p);
+  if (!fields.ip || fields.ecn == Ipv4Header::NotECT)
+    return false;
+  if (fields.ecn == Ipv4Header::CE)
+    return true;
+
+  PDUHeader pdu;
+  p->RemoveHeader (pdu);
+  LlcSnapHeader llc;
+  bool useLlc = pdu.GetTypeLength () <= 1500;
+  if (useLlc)
+    p->RemoveHeader (llc);
+  Ipv4Header ip;
+  p->RemoveHeader (ip);
+
+  ip.SetEcn (Ipv4Header::CE);
+  if (Node::ChecksumEnabled ())
+    ip.EnableChecksum ();
+
+  p->AddHeader (ip);
+  if (useLlc)
+    p->AddHeader (llc);
+  p->AddHeader (pdu);
+  m_markTrace (p);
+  return true;
+}
+
+}
@@ -0,0 +1,140 @@
+/* -*- Mode:C++; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/*
+ * Copyright (c) 2013 Martín Javier Di Liscia
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * Author: Martín Javier Di Liscia
+ */
+#ifndef DOCSIS_DUAL_QUEUE_H
+#define DOCSIS_DUAL_QUEUE_H
+
+#include <deque>
+#include "ns3/queue.h"
+#include "ns3/nstime.h"
+#include "ns3/traced-callback.h"
+#include "ns3/random-variable-stream.h"
+
+namespace ns3 {
+
+/**
+ * \brief Low Latency DOCSIS dual queue of a service flow
+ *
+ * Frames marked ECT(1) or CE, and frames with the Non Queue Building DSCP,
+ * go to the low latency (L) queue; the rest go to the classic (C) queue.
+ * The frames are expected to start with a PDUHeader, optionally followed by
+ * an LLC/SNAP header, before the IPv4 header.
+ *
+ * The queues share a coupled AQM, as in DualPI2 (RFC 9332): a PI controller
+ * on the queuing delay gives a base probability p', classic frames are
+ * dropped, or marked when ECN capable, with p'^2 on arrival, and L frames
+ * are marked CE on departure with the larger of k p' and a ramp on their
+ * own sojourn time. A weighted round robin shares the link between the
+ * queues, favouring L.
+ *
+ * Queue protection keeps a congestion score per microflow, hashed into a
+ * few buckets: every L frame adds its size times the ramp probability of
+ * the L queue, and the score drains at AgingRate. Frames of a flow whose
+ * score is above CriticalScore are sanctioned, that is, sent to the
+ * classic queue, so a flow that builds a queue cannot hurt the latency of
+ * the rest.
+ *
+ * The base probability is updated every UpdateInterval, lazily as in
+ * DocsisPieQueue.
+ */
+class DocsisDualQueue : public Queue
+{
+public:
+  static TypeId GetTypeId (void);
+  DocsisDualQueue ();
+  virtual ~DocsisDualQueue ();
+
+  uint32_t GetLowLatencyPackets (void) const;
+  uint32_t GetClassicPackets (void) const;
+  double GetBaseProbability (void);
+  int64_t AssignStreams (int64_t stream);
+
+private:
+  struct Item
+  {
+    Ptr<Packet> packet;
+    Time arrival;
+  };
+  // Fields of the IPv4 header a decision takes, read from the frame bytes.
+  struct Fields
+  {
+    bool ip;
+    uint8_t ecn;
+    uint8_t dscp;
+    uint32_t flowHash;
+  };
+  struct Bucket
+  {
+    Bucket () : score (0) {}
+    double score;	// Bytes of congestion caused
+    Time update;
+  };
+
+  static const uint32_t kBuckets = 32;
+
+  virtual bool DoEnqueue (Ptr<Packet> p);
+  virtual Ptr<Packet> DoDequeue (void);
+  virtual Ptr<const Packet> DoPeek (void) const;
+
+  static Fields Parse (Ptr<const Packet> p);
+  bool Sanction (const Fields &fields, uint32_t size);
+  bool ServeLowLatency (void) const;
+  Time GetSojourn (const std::deque<Item> &queue) const;
+  double GetRampProbability (Time sojourn) const;
+  void CatchUp (void);
+  bool MarkCe (Ptr<Packet> p);
+
+  std::deque<Item> m_low;
+  std::deque<Item> m_classic;
+  uint32_t m_bytesInQueue;
+  uint32_t m_classicBytes;
+  uint32_t m_maxBytes;
+
+  // Coupled AQM
+  Time m_target;
+  Time m_updateInterval;
+  double m_alpha;
+  double m_beta;
+  double m_coupling;
+  Time m_rampMin;
+  Time m_rampRange;
+  double m_baseProbability;
+  double m_qdelayOld;	// Seconds
+  Time m_nextUpdate;
+
+  // Inter-queue scheduler
+  uint32_t m_weight;	// Share of L out of 256, while both queues hold frames
+  int64_t m_credit;	// L goes while not negative
+
+  // Queue protection
+  Bucket m_buckets[kBuckets];
+  double m_agingRate;	// Bytes per second
+  double m_criticalScore;	// Bytes
+
+  TracedCallback<Time> m_lowLatencySojournTrace;
+  TracedCallback<Time> m_classicSojournTrace;
+  TracedCallback<Ptr<const Packet> > m_markTrace;
+  TracedCallback<Ptr<const Packet> > m_sanctionTrace;
+
+  Ptr<UniformRandomVariable> m_rng;
+};
+
+}
+
+#endif /* DOCSIS_DUAL_QUEUE_H */
@@ -36,9 +36,25 @@ enum DocsisUpstreamChannelMode
 	kUnsolicitedGrant,
 	kRealTimePolling,
 	kBestEffort,
+	kProactiveGrant,	// Periodic grants without requests, and requests for the excess
 	DocsisUpstreamChannelModeCount
 };
 
+enum DocsisRequestStrategy
+{
+	kRequestHeadOfLine,	// A request frame for every packet
+	kRequestPiggyback,	// Requests for the next packet ride on data frames
+	kRequestQueueDepth,	// Requests cover the whole queue, using QDB frames when needed
+	DocsisRequestStrategyCount
+};
+
+enum DocsisInitialization
+{
+	kFastStart,	// Ranged analytically and registered on attach
+	kFullInitialization,	// Ranges and registers through MAC management messages
+	DocsisInitializationCount
+};
+
 enum DocsisChannelDirection
 {
 	kUpstream,
@@ -0,0 +1,234 @@
+/* -*- Mode:C++; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/*
+ * Copyright (c) 2013 Martín Javier Di Liscia
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * Author: Martín Javier Di Liscia
+ */
+#include "docsis-error-model.h"
+#include "ns3/log.h"
+#include "ns3/packet.h"
+#include "ns3/uinteger.h"
+#include "ns3/double.h"
+#include <cmath>
+
+NS_LOG_COMPONENT_DEFINE ("DocsisCodewordErrorModel");
+
+namespace ns3 {
+
+NS_OBJECT_ENSURE_REGISTERED (DocsisCodewordErrorModel);
+
+// The tables span the SNRs where the codeword error rate goes from one to
+// nothing for every modulation in use.
+static const double kMaxTableSnr = 60;
+
+TypeId
+DocsisCodewordErrorModel::GetTypeId (void)
+{
+  static TypeId tid = TypeId ("ns3::DocsisCodewordErrorModel")
+    .SetParent<ErrorModel> ()
+    .AddConstructor<DocsisCodewordErrorModel> ()
+    .AddAttribute ("SymbolBits",
+                   "Bits per Reed-Solomon symbol",
+                   UintegerValue (7),
+                   MakeUintegerAccessor (&DocsisCodewordErrorModel::SetSymbolBits, &DocsisCodewordErrorModel::GetSymbolBits),
+                   MakeUintegerChecker<uint32_t> (1, 16))
+    .AddAttribute ("DataSymbols",
+                   "Reed-Solomon symbols of data in every codeword",
+                   UintegerValue (122),
+                   MakeUintegerAccessor (&DocsisCodewordErrorModel::SetDataSymbols, &DocsisCodewordErrorModel::GetDataSymbols),
+                   MakeUintegerChecker<uint32_t> (1))
+    .AddAttribute ("CorrectableSymbols",
+                   "Symbol errors a codeword corrects, T",
+                   UintegerValue (3),
+                   MakeUintegerAccessor (&DocsisCodewordErrorModel::SetCorrectableSymbols, &DocsisCodewordErrorModel::GetCorrectableSymbols),
+                   MakeUintegerChecker<uint32_t> ())
+    .AddAttribute ("SnrStep",
+                   "Resolution of the codeword error rate tables, in dB",
+                   DoubleValue (0.1),
+                   MakeDoubleAccessor (&DocsisCodewordErrorModel::SetSnrStep, &DocsisCodewordErrorModel::GetSnrStep),
+                   MakeDoubleChecker<double> (0.001, 1))
+  ;
+
+  return tid;
+}
+
+DocsisCodewordErrorModel::DocsisCodewordErrorModel () : m_symbolBits (7), m_dataSymbols (122), m_correctableSymbols (3), m_snrStep (0.1),
+                                                        m_modulationOrder (64), m_snr (kMaxTableSnr)
+{
+  NS_LOG_FUNCTION (this);
+  m_rng = CreateObject<UniformRandomVariable> ();
+}
+
+DocsisCodewordErrorModel::~DocsisCodewordErrorModel ()
+{
+  NS_LOG_FUNCTION (this);
+}
+
+void
+DocsisCodewordErrorModel::SetReception (uint32_t modulationOrder, double snr)
+{
+  m_modulationOrder = modulationOrder;
+  m_snr = snr;
+}
+
+double
+DocsisCodewordErrorModel::GetCodewordErrorRate (uint32_t modulationOrder, double snr)
+{
+  const std::vector<double> &table = GetTable (modulationOrder);
+  if (snr <= 0)
+    return table.front ();
+
+  // Linear between the two closest entries.
+  double position = snr / m_snrStep;
+  uint32_t index = (uint32_t) position;
+  if (index + 1 >= table.size ())
+    return table.back ();
+  double fraction = position - index;
+  return table[index] + (table[index + 1] - table[index]) * fraction;
+}
+
+double
+DocsisCodewordErrorModel::GetFrameErrorRate (uint32_t modulationOrder, double snr, uint32_t bytes)
+{
+  double cer = GetCodewordErrorRate (modulationOrder, snr);
+  if (cer <= 0)
+    return 0;
+
+  uint32_t codewordBits = m_dataSymbols * m_symbolBits;
+  uint32_t codewords = (bytes * 8 + codewordBits - 1) / codewordBits;
+  return 1 - std::pow (1 - cer, (double) codewords);
+}
+
+int64_t
+DocsisCodewordErrorModel::AssignStreams (int64_t stream)
+{
+  m_rng->SetStream (stream);
+  return 1;
+}
+
+bool
+DocsisCodewordErrorModel::IsCorrupt (uint32_t bytes)
+{
+  double fer = GetFrameErrorRate (m_modulationOrder, m_snr, bytes);
+  return fer > 0 && m_rng->GetValue () < fer;
+}
+
+bool
+DocsisCodewordErrorModel::DoCorrupt (Ptr<Packet> p)
+{
+  return IsCorrupt (p->GetSize ());
+}
+
+void
+DocsisCodewordErrorModel::DoReset (void)
+{
+}
+
+const std::vector<double> &
+DocsisCodewordErrorModel::GetTable (uint32_t modulationOrder)
+{
+  std::map< uint32_t, std::vector<double> >::iterator entry = m_tables.find (modulationOrder);
+  if (entry != m_tables.end ())
+    return entry->second;
+
+  std::vector<double> &table = m_tables[modulationOrder];
+  uint32_t entries = (uint32_t) std::ceil (kMaxTableSnr / m_snrStep) + 1;
+  table.reserve (entries);
+  for (uint32_t i = 0; i < entries; i++)
+    table.push_back (ComputeCodewordErrorRate (modulationOrder, i * m_snrStep));
+  return table;
+}
+
+double
+DocsisCodewordErrorModel::ComputeCodewordErrorRate (uint32_t modulationOrder, double snr) const
+{
+  // Symbol error rate of square M-QAM in AWGN, as two independent
+  // sqrt(M)-PAM rails. Odd powers of two are approximated alike.
+  double m = modulationOrder;
+  double linear = std::pow (10.0, snr / 10);
+  double rail = (1 - 1 / std::sqrt (m)) * erfc (std::sqrt (1.5 * linear / (m - 1)));
+  double ser = 1 - (1 - rail) * (1 - rail);
+
+  // Any QAM symbol error ruins the FEC symbols it carries bits of.
+  double bitsPerQam = std::log (m) / std::log (2.0);
+  double fecSymbolError = 1 - std::pow (1 - ser, std::max (1.0, m_symbolBits / bitsPerQam));
+
+  // The codeword survives up to T symbol errors out of its K + 2T symbols.
+  uint32_t n = m_dataSymbols + 2 * m_correctableSymbols;
+  double survive = 0;
+  double term = std::pow (1 - fecSymbolError, (double) n);	// No errors
+  for (uint32_t errors = 0; errors <= m_correctableSymbols && errors <= n; errors++)
+    {
+      survive += term;
+      if (fecSymbolError >= 1) break;
+      term *= (double) (n - errors) / (errors + 1) * fecSymbolError / (1 - fecSymbolError);
+    }
+  return std::min (1.0, std::max (0.0, 1 - survive));
+}
+
+void
+DocsisCodewordErrorModel::SetSymbolBits (uint32_t bits)
+{
+  m_symbolBits = bits;
+  m_tables.clear ();
+}
+
+uint32_t
+DocsisCodewordErrorModel::GetSymbolBits (void) const
+{
+  return m_symbolBits;
+}
+
+void
+DocsisCodewordErrorModel::SetDataSymbols (uint32_t symbols)
+{
+  m_dataSymbols = symbols;
+  m_tables.clear ();
+}
+
+uint32_t
+DocsisCodewordErrorModel::GetDataSymbols (void) const
+{
+  return m_dataSymbols;
+}
+
+void
+DocsisCodewordErrorModel::SetCorrectableSymbols (uint32_t symbols)
+{
+  m_correctableSymbols = symbols;
+  m_tables.clear ();
+}
+
+uint32_t
+DocsisCodewordErrorModel::GetCorrectableSymbols (void) const
+{
+  return m_correctableSymbols;
+}
+
+void
+DocsisCodewordErrorModel::SetSnrStep (double step)
+{
+  m_snrStep = step;
+  m_tables.clear ();
+}
+
+double
+DocsisCodewordErrorModel::GetSnrStep (void) const
+{
+  return m_snrStep;
+}
+
+}
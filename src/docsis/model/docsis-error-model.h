@@ -0,0 +1,103 @@
+/* -*- Mode:C++; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/*
+ * Copyright (c) 2013 Martín Javier Di Liscia
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * Author: Martín Javier Di Liscia
+ */
+#ifndef DOCSIS_ERROR_MODEL_H
+#define DOCSIS_ERROR_MODEL_H
+
+#include <map>
+#include <vector>
+#include "ns3/error-model.h"
+#include "ns3/random-variable-stream.h"
+
+namespace ns3 {
+
+/**
+ * \brief Frame losses from the codeword error rate of a QAM channel with
+ * Reed-Solomon FEC
+ *
+ * The Hfc tells the model the modulation and SNR a frame is received with
+ * before it asks whether the frame is corrupt. A QAM symbol error ruins the
+ * FEC symbols it carries, and a codeword is lost once more FEC symbols are
+ * wrong than the code corrects. A frame is lost when any of its codewords
+ * is.
+ *
+ * The codeword error rate against the SNR is tabulated once per
+ * modulation, in SnrStep steps, so a frame costs a table lookup rather
+ * than an erfc evaluation. The defaults are the J.83 Annex B downstream
+ * code, RS(128,122) over 7-bit symbols; upstream channels configure their
+ * own codeword size and correction capability.
+ */
+class DocsisCodewordErrorModel : public ErrorModel
+{
+public:
+  static TypeId GetTypeId (void);
+  DocsisCodewordErrorModel ();
+  virtual ~DocsisCodewordErrorModel ();
+
+  /**
+   * \param modulationOrder constellation points of the channel
+   * \param snr dB, at the receiver
+   *
+   * Applies to the frames asked about from then on.
+   */
+  void SetReception (uint32_t modulationOrder, double snr);
+
+  using ErrorModel::IsCorrupt;
+  /**
+   * \param bytes size of the frame
+   *
+   * Draws whether a frame is lost without the frame itself, for the
+   * broadcasts every receiver shares.
+   */
+  bool IsCorrupt (uint32_t bytes);
+
+  double GetCodewordErrorRate (uint32_t modulationOrder, double snr);
+  double GetFrameErrorRate (uint32_t modulationOrder, double snr, uint32_t bytes);
+  int64_t AssignStreams (int64_t stream);
+
+private:
+  virtual bool DoCorrupt (Ptr<Packet> p);
+  virtual void DoReset (void);
+
+  const std::vector<double> &GetTable (uint32_t modulationOrder);
+  double ComputeCodewordErrorRate (uint32_t modulationOrder, double snr) const;
+
+  void SetSymbolBits (uint32_t bits);
+  uint32_t GetSymbolBits (void) const;
+  void SetDataSymbols (uint32_t symbols);
+  uint32_t GetDataSymbols (void) const;
+  void SetCorrectableSymbols (uint32_t symbols);
+  uint32_t GetCorrectableSymbols (void) const;
+  void SetSnrStep (double step);
+  double GetSnrStep (void) const;
+
+  uint32_t m_symbolBits;	// Bits per FEC symbol
+  uint32_t m_dataSymbols;	// FEC symbols of data per codeword
+  uint32_t m_correctableSymbols;	// Parity is twice as many
+  double m_snrStep;	// dB
+  std::map< uint32_t, std::vector<double> > m_tables;	// By modulation order, from 0 dB up
+
+  uint32_t m_modulationOrder;
+  double m_snr;
+  Ptr<UniformRandomVariable> m_rng;
+};
+
+}
+
+#endif /* DOCSIS_ERROR_MODEL_H */
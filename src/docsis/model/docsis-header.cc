@@ -20,14 +20,21 @@
 #include "docsis.h"
 #include "docsis-header.h"
 #include "mac-management-message.h"
+#include "ns3/address-utils.h"
 
 namespace ns3 {
   // ************* DocsisHeader *************************************
-  DocsisHeader::DocsisHeader() : m_phyOverhead(0)
+  DocsisHeader::DocsisHeader() : m_packetDirection(kDownstream), m_phyOverhead(0), m_fcType(kPacketPDU),
+                                 m_macType(kTiming), m_extendedHeaderPresent(false), m_extendedHeaderLength(0),
+                                 m_frameCount(0), m_requestedSlots(0), m_qdbRequestedSlots(0), m_headerLength(0),
+                                 m_concatenatedPackets(0)
   {
   }
 
-  DocsisHeader::DocsisHeader(size_t phyOverhead) : m_phyOverhead(phyOverhead)
+  DocsisHeader::DocsisHeader(size_t phyOverhead) : m_packetDirection(kDownstream), m_phyOverhead(phyOverhead), m_fcType(kPacketPDU),
+                                                   m_macType(kTiming), m_extendedHeaderPresent(false), m_extendedHeaderLength(0),
+                                                   m_frameCount(0), m_requestedSlots(0), m_qdbRequestedSlots(0), m_headerLength(0),
+                                                   m_concatenatedPackets(0)
   {
   }
 
@@ -36,22 +43,23 @@ namespace ns3 {
     uint32_t readBytes = 0;
 
 
-    uint8_t buffer[m_phyOverhead];
-    start.Read(buffer, m_phyOverhead);	//PHY Overhead
+    start.Next(m_phyOverhead);	//PHY Overhead
     readBytes += m_phyOverhead;
 
 
-    buffer[0] = start.ReadU8();	//FC
-    m_fcType = (FrameControlType)(buffer[0] >> 6);
-    m_macType = (MacHeaderType)((buffer[0] & 0x3E) >> 1);
-    m_extendedHeaderPresent = (buffer[0] & 0x1) == 1;
+    uint8_t fc = start.ReadU8();	//FC
+    m_fcType = (FrameControlType)(fc >> 6);
+    m_macType = (MacHeaderType)((fc & 0x3E) >> 1);
+    m_extendedHeaderPresent = (fc & 0x1) == 1;
     readBytes++;
 
 
+    m_extendedHeaderLength = 0;
+    m_extendedHeader.Clear();
     if (m_fcType == kMacSpecific && m_macType == kRequest)
       m_requestedSlots = start.ReadU8();
     else if (m_fcType == kMacSpecific && m_macType == kQdbRequest)
-      m_qdbRequestedSlots = start.ReadU16();
+      m_qdbRequestedSlots = start.ReadNtohU16();
     else if (m_fcType == kMacSpecific && m_macType == kConcatenation)
       m_concatenatedPackets = start.ReadU8();
     else
@@ -63,14 +71,14 @@ namespace ns3 {
       readBytes++;
 
 
-    m_headerLength = start.ReadU16() - m_extendedHeaderLength;	//LEN
+    m_headerLength = start.ReadNtohU16() - m_extendedHeaderLength;	//LEN
     readBytes += 2;
 
     if (m_extendedHeaderPresent)
       readBytes += m_extendedHeader.Deserialize(m_extendedHeaderLength, start); // EHDR
 
 
-    start.ReadU16();	//HCS
+    start.ReadNtohU16();	//HCS
     readBytes += 2;
 
 
@@ -79,24 +87,26 @@ namespace ns3 {
 
   uint32_t DocsisHeader::GetSerializedSize (void) const
   {
+    // m_headerLength is the length of the PDU that follows the header, so it
+    // does not take part in the header size.
     uint32_t size=0;
 
     switch(m_fcType) {
       case kPacketPDU:
       case kIsolationPacketPDU:
-        size = 6+m_headerLength+m_extendedHeaderLength;
+        size = 6+m_extendedHeaderLength;
         break;
 
       case kMacSpecific:
         switch(m_macType) {
           case kTiming:
           case kFragmentation:
-          case kConcatenation:
-            size = 6+m_headerLength;
+          case kMacManagement:
+            size = 6+m_extendedHeaderLength;
             break;
 
-          case kMacManagement:
-            size = 6+m_headerLength+m_extendedHeaderLength;
+          case kConcatenation:
+            size = 6;
             break;
 
           case kRequest:
@@ -113,7 +123,7 @@ namespace ns3 {
         size = 0;
       }
 
-    return size;
+    return m_phyOverhead+size;
   }
 
   void DocsisHeader::Print (std::ostream &os) const
@@ -130,18 +140,18 @@ namespace ns3 {
     if (m_fcType == kMacSpecific && m_macType == kRequest)
       start.WriteU8(m_requestedSlots);
     else if (m_fcType == kMacSpecific && m_macType == kQdbRequest)
-      start.WriteU16(m_qdbRequestedSlots);
+      start.WriteHtonU16(m_qdbRequestedSlots);
     else if (m_fcType == kMacSpecific && m_macType == kConcatenation)
       start.WriteU8(m_concatenatedPackets);
     else
       start.WriteU8(m_extendedHeaderLength);
 
-    start.WriteU16(m_headerLength+m_extendedHeaderLength);	//LEN
+    start.WriteHtonU16(m_headerLength+m_extendedHeaderLength);	//LEN
 
     if (m_extendedHeaderPresent)
       m_extendedHeader.Serialize(start); // EHDR
 
-    start.WriteU16(0);	//HCS
+    start.WriteHtonU16(0);	//HCS
   }
 
   TypeId DocsisHeader::GetTypeId (void)
@@ -165,6 +175,7 @@ namespace ns3 {
     m_fcType = kPacketPDU;
     m_extendedHeaderPresent = false;
     m_extendedHeaderLength = 0;
+    m_extendedHeader.Clear();
     m_headerLength = pduLength;
   }
 
@@ -175,6 +186,7 @@ namespace ns3 {
     m_fcType = kIsolationPacketPDU;
     m_extendedHeaderPresent = false;
     m_extendedHeaderLength = 0;
+    m_extendedHeader.Clear();
     m_headerLength = pduLength;
   }
 
@@ -186,6 +198,7 @@ namespace ns3 {
     m_macType = kTiming;
     m_extendedHeaderPresent = false;
     m_extendedHeaderLength = 0;
+    m_extendedHeader.Clear();
     m_headerLength = pduLength;
   }
 
@@ -197,6 +210,7 @@ namespace ns3 {
     m_macType = kMacManagement;
     m_extendedHeaderPresent = false;
     m_extendedHeaderLength = 0;
+    m_extendedHeader.Clear();
     m_headerLength = macMsgLength;
   }
 
@@ -209,6 +223,7 @@ namespace ns3 {
     m_requestedSlots = count;
     m_extendedHeaderPresent = false;
     m_extendedHeaderLength = 0;
+    m_extendedHeader.Clear();
     m_headerLength = sid;
   }
 
@@ -220,6 +235,7 @@ namespace ns3 {
     m_macType = kFragmentation;
     m_extendedHeaderPresent = false;
     m_extendedHeaderLength = 0;
+    m_extendedHeader.Clear();
     m_headerLength = partialPduLength;
 
     addExtendedHeader(ehe);
@@ -233,7 +249,8 @@ namespace ns3 {
     m_macType = kQdbRequest;
     m_extendedHeaderPresent = false;
     m_extendedHeaderLength = 0;
-    m_requestedSlots = bytesMultiples;
+    m_extendedHeader.Clear();
+    m_qdbRequestedSlots = bytesMultiples;
     m_headerLength = sid;
   }
 
@@ -245,33 +262,55 @@ namespace ns3 {
     m_macType = kConcatenation;
     m_extendedHeaderPresent = false;
     m_extendedHeaderLength = 0;
+    m_extendedHeader.Clear();
     m_concatenatedPackets = packets;
 
     m_headerLength = packetsSize;
   }
 
   void DocsisHeader::addExtendedHeader(ExtendedHeader::ExtendedHeaderElement ehe) {
+    NS_ASSERT_MSG (m_extendedHeader.count < ExtendedHeader::MAX_ELEMENTS, "Too many extended header elements.");
     m_extendedHeaderPresent = true;
 
+    // LEN covers the extended header, but it is added on serialization.
     m_extendedHeaderLength += ehe.m_length + 1;
-    m_headerLength += ehe.m_length + 1;
 
-    m_extendedHeader.elements.push_back(ehe);
+    m_extendedHeader.elements[m_extendedHeader.count++] = ehe;
   }
 
-  void DocsisHeader::ExtendedHeader::Serialize(Buffer::Iterator start) const {
-    for (std::list<ExtendedHeaderElement>::const_iterator iter = elements.begin();
-         iter != elements.end(); iter++) {
+  const DocsisHeader::ExtendedHeader::ExtendedHeaderElement* DocsisHeader::findExtendedHeader(ExtendedHeaderType type) const {
+    for (uint8_t i = 0; i < m_extendedHeader.count; i++)
+      if (m_extendedHeader.elements[i].m_type == type)
+        return &m_extendedHeader.elements[i];
+
+    return NULL;
+  }
+
+  void DocsisHeader::ExtendedHeader::Clear(void) {
+    count = 0;
+    extra.clear();
+  }
+
+  void DocsisHeader::ExtendedHeader::Serialize(Buffer::Iterator &start) const {
+    for (const ExtendedHeaderElement *iter = elements; iter != elements + count; iter++) {
         start.WriteU8( ((uint8_t)iter->m_type<<4) + iter->m_length );
 
         switch (iter->m_type) {
           case kEHRequest:
             start.WriteU8(iter->m_minislots);
-            start.WriteU16(iter->m_sid);
+            start.WriteHtonU16(iter->m_sid);
             break;
 
           case kAckRequest:
-            start.WriteU16(iter->m_sid);
+            start.WriteHtonU16(iter->m_sid);
+            break;
+
+          case kUpstreamPrivacy:
+            // BP_UP as used by fragmentation headers, with privacy disabled.
+            start.WriteU8(0);
+            start.WriteHtonU16(iter->m_sid & 0x3FFF);
+            start.WriteU8(iter->m_minislots);
+            start.WriteU8(((iter->m_firstFragment?1:0) << 5) + ((iter->m_lastFragment?1:0) << 4) + (iter->m_fragmentSequence & 0x0F));
             break;
 
           case kUpstreamServiceFlow:
@@ -284,34 +323,43 @@ namespace ns3 {
               start.WriteU8(iter->m_traficPriority << 5);
             else if (iter->m_length == 3) {
                 start.WriteU8((iter->m_traficPriority << 5) + (iter->m_sid >> 16));
-                start.WriteU16(iter->m_sid & 0xFFFF);
+                start.WriteHtonU16(iter->m_sid & 0xFFFF);
               } else if (iter->m_length == 5) {
-                start.WriteU8((iter->m_traficPriority << 5) + ((iter->m_sequenceChangeCount?0:1) << 4) + (iter->m_sid >> 16));
-                start.WriteU16(iter->m_sid & 0xFFFF);
-                start.WriteU16(iter->m_packetSequenceNumber);
+                start.WriteU8((iter->m_traficPriority << 5) + ((iter->m_sequenceChangeCount?1:0) << 4) + (iter->m_sid >> 16));
+                start.WriteHtonU16(iter->m_sid & 0xFFFF);
+                start.WriteHtonU16(iter->m_packetSequenceNumber);
               }
             break;
 
           default:
-            for(uint8_t i=0; i<iter->m_length; i++)
-              start.WriteU8(0);
+            start.WriteU8(0, iter->m_length);
           }
       }
+
+    if (!extra.empty())
+      start.Write(&extra[0], extra.size());
   }
 
   uint32_t DocsisHeader::ExtendedHeader::GetSerializedSize(void) const {
     uint32_t size = 0;
-    for (std::list<ExtendedHeaderElement>::const_iterator iter = elements.begin();
-         iter != elements.end(); iter++)
-      size += iter->m_length + 1;
+    for (uint8_t i = 0; i < count; i++)
+      size += elements[i].m_length + 1;
 
-    return size;
+    return size + extra.size();
   }
 
-  uint32_t DocsisHeader::ExtendedHeader::Deserialize(uint8_t ehLength, Buffer::Iterator start) {
+  uint32_t DocsisHeader::ExtendedHeader::Deserialize(uint8_t ehLength, Buffer::Iterator &start) {
     uint32_t readLength = 0;
 
     while (ehLength > 0) {
+        if (count == MAX_ELEMENTS) {
+            // EH_LEN and LEN still count them, so the header keeps its size.
+            extra.resize(ehLength);
+            start.Read(&extra[0], ehLength);
+            readLength += ehLength;
+            break;
+          }
+
         ExtendedHeaderElement ehe;
 
         uint8_t buffer = start.ReadU8();
@@ -324,11 +372,21 @@ namespace ns3 {
         switch(ehe.m_type) {
           case kEHRequest:
             ehe.m_minislots = start.ReadU8();
-            ehe.m_sid = start.ReadU16();
+            ehe.m_sid = start.ReadNtohU16();
             break;
 
           case kAckRequest:
-            ehe.m_sid = start.ReadU16();
+            ehe.m_sid = start.ReadNtohU16();
+            break;
+
+          case kUpstreamPrivacy:
+            start.ReadU8();
+            ehe.m_sid = start.ReadNtohU16() & 0x3FFF;
+            ehe.m_minislots = start.ReadU8();
+            buffer = start.ReadU8();
+            ehe.m_firstFragment = (buffer & 0x20) > 0;
+            ehe.m_lastFragment = (buffer & 0x10) > 0;
+            ehe.m_fragmentSequence = buffer & 0x0F;
             break;
 
           case kUpstreamServiceFlow:
@@ -344,23 +402,23 @@ namespace ns3 {
             else if (ehe.m_length == 3) {
                 buffer = start.ReadU8();
                 ehe.m_traficPriority = buffer >> 5;
-                ehe.m_sid = ((buffer & 0x0F) << 16) + start.ReadU16();
+                ehe.m_sid = ((buffer & 0x0F) << 16) + start.ReadNtohU16();
               } else if (ehe.m_length == 5) {
                 buffer = start.ReadU8();
                 ehe.m_traficPriority = buffer >> 5;
                 ehe.m_sequenceChangeCount = (buffer & 0x10) > 0;
-                ehe.m_sid = ((buffer & 0x0F) << 16) + start.ReadU16();
-                ehe.m_packetSequenceNumber = start.ReadU16();
+                ehe.m_sid = ((buffer & 0x0F) << 16) + start.ReadNtohU16();
+                ehe.m_packetSequenceNumber = start.ReadNtohU16();
               }
             break;
 
           default:
-            for(uint8_t i=0; i<ehe.m_length; i++)
-              start.ReadU8();
+            start.Next(ehe.m_length);
           }
 
         readLength += ehe.m_length;
         ehLength -= ehe.m_length+1;
+        elements[count++] = ehe;
       }
 
     return readLength;
@@ -375,22 +433,39 @@ namespace ns3 {
   }
 
   bool DocsisHeader::IsRequestPacket() const {
-    return m_fcType == kMacSpecific && m_macType == kRequest;
+    return m_fcType == kMacSpecific && (m_macType == kRequest || m_macType == kQdbRequest);
+  }
+
+  bool DocsisHeader::IsConcatenationPacket() const {
+    return m_fcType == kMacSpecific && m_macType == kConcatenation;
+  }
+
+  bool DocsisHeader::IsFragmentationPacket() const {
+    return m_fcType == kMacSpecific && m_macType == kFragmentation;
+  }
+
+  uint16_t DocsisHeader::GetRequestSid() const {
+    // Request frames carry the SID in the LEN field.
+    return m_headerLength;
+  }
+
+  uint16_t DocsisHeader::GetRequestedMinislots() const {
+    // Queue depth based requests are counted in minislots as well, but have
+    // a 16 bit field.
+    return m_macType == kQdbRequest ? m_qdbRequestedSlots : m_requestedSlots;
+  }
+
+  uint16_t DocsisHeader::GetLength() const {
+    return m_headerLength;
   }
 
   // ************* PDUHeader ****************************************
   uint32_t
   PDUHeader::Deserialize(Buffer::Iterator start)
   {
-    uint8_t buffer[6];
-
-    start.Read (buffer, 6);
-    m_destination.CopyFrom(buffer);
-
-    start.Read (buffer, 6);
-    m_source.CopyFrom(buffer);
-
-    m_type_length = start.ReadU16 ();
+    ReadFrom (start, m_destination);
+    ReadFrom (start, m_source);
+    m_type_length = start.ReadNtohU16 ();
 
     return 14;
   }
@@ -410,15 +485,9 @@ namespace ns3 {
   void
   PDUHeader::Serialize (Buffer::Iterator start) const
   {
-    uint8_t buffer[6];
-
-    m_destination.CopyTo (buffer);
-    start.Write (buffer, 6);
-
-    m_source.CopyTo (buffer);
-    start.Write (buffer, 6);
-
-    start.WriteU16 (m_type_length);
+    WriteTo (start, m_destination);
+    WriteTo (start, m_source);
+    start.WriteHtonU16 (m_type_length);
   }
 
   TypeId
@@ -464,4 +533,114 @@ namespace ns3 {
     return m_type_length;
   }
 
+  // ************* SegmentHeader ************************************
+  SegmentHeader::SegmentHeader() : m_phyOverhead(0), m_pointerValid(false), m_pointer(0), m_sequence(0),
+                                   m_sidCluster(0), m_request(0)
+  {
+  }
+
+  SegmentHeader::SegmentHeader(size_t phyOverhead) : m_phyOverhead(phyOverhead), m_pointerValid(false), m_pointer(0),
+                                                     m_sequence(0), m_sidCluster(0), m_request(0)
+  {
+  }
+
+  uint32_t
+  SegmentHeader::Deserialize(Buffer::Iterator start)
+  {
+    start.Next (m_phyOverhead);	// PHY Overhead
+
+    uint16_t pointer = start.ReadNtohU16 ();
+    m_pointerValid = (pointer & 0x8000) != 0;
+    m_pointer = pointer & 0x3FFF;
+
+    uint16_t sequence = start.ReadNtohU16 ();
+    m_sequence = sequence >> 3;
+    m_sidCluster = sequence & 0x07;
+
+    m_request = start.ReadNtohU16 () & 0x3FFF;
+    start.ReadNtohU16 ();	// HCS
+
+    return GetSerializedSize ();
+  }
+
+  uint32_t
+  SegmentHeader::GetSerializedSize (void) const
+  {
+    return m_phyOverhead + 8;
+  }
+
+  void
+  SegmentHeader::Print (std::ostream &os) const
+  {
+    os << "seq=" << m_sequence << " pointer=" << (m_pointerValid ? (int) m_pointer : -1) << " request=" << m_request;
+  }
+
+  void
+  SegmentHeader::Serialize (Buffer::Iterator start) const
+  {
+    start.WriteU8 (0, m_phyOverhead);	// PHY Overhead
+
+    start.WriteHtonU16 ((m_pointerValid ? 0x8000 : 0) | (m_pointer & 0x3FFF));	// PFV, R, pointer
+    start.WriteHtonU16 (((m_sequence & 0x1FFF) << 3) | (m_sidCluster & 0x07));
+    start.WriteHtonU16 (m_request & 0x3FFF);
+    start.WriteHtonU16 (0);	// HCS
+  }
+
+  TypeId
+  SegmentHeader::GetTypeId (void)
+  {
+    static TypeId tid = TypeId ("ns3::SegmentHeader")
+        .SetParent<Header> ()
+        .AddConstructor<SegmentHeader> ();
+
+    return tid;
+  }
+
+  TypeId
+  SegmentHeader::GetInstanceTypeId (void) const
+  {
+    return GetTypeId();
+  }
+
+  void
+  SegmentHeader::Setup(size_t overheadSize, bool pointerValid, uint16_t pointer, uint16_t sequence, uint8_t sidCluster, uint16_t request)
+  {
+    m_phyOverhead = overheadSize;
+    m_pointerValid = pointerValid;
+    m_pointer = pointer;
+    m_sequence = sequence;
+    m_sidCluster = sidCluster;
+    m_request = request;
+  }
+
+  bool
+  SegmentHeader::IsPointerValid() const
+  {
+    return m_pointerValid;
+  }
+
+  uint16_t
+  SegmentHeader::GetPointer() const
+  {
+    return m_pointer;
+  }
+
+  uint16_t
+  SegmentHeader::GetSequence() const
+  {
+    return m_sequence;
+  }
+
+  uint8_t
+  SegmentHeader::GetSidCluster() const
+  {
+    return m_sidCluster;
+  }
+
+  uint16_t
+  SegmentHeader::GetRequest() const
+  {
+    return m_request;
+  }
+
 }
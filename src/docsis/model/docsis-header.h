@@ -23,6 +23,7 @@
 #include "ns3/header.h"
 #include "ns3/mac48-address.h"
 #include "docsis-enums.h"
+#include <vector>
 
 namespace ns3 {
   class DocsisHeader : public Header {
@@ -62,8 +63,17 @@ namespace ns3 {
       ExtendedHeaderTypeCount
     };
 
+    // The elements are kept inline, so that copying a header, which
+    // AddHeader and RemoveHeader do on every frame, allocates nothing.
     struct ExtendedHeader {
+      // Frames of the model carry two elements at most. Received frames with
+      // more parse the first ones and keep the rest as they came.
+      static const uint8_t MAX_ELEMENTS = 4;
+
       struct ExtendedHeaderElement {
+        ExtendedHeaderElement() : m_type(kNull), m_length(0), m_sid(0), m_minislots(0), m_queueIndicator(false), m_activeGrants(0),
+                                  m_traficPriority(0), m_sequenceChangeCount(false), m_packetSequenceNumber(0),
+                                  m_firstFragment(false), m_lastFragment(false), m_fragmentSequence(0) {}
         ExtendedHeaderType m_type;
         uint8_t m_length;	// In bytes
         uint32_t m_sid;
@@ -73,11 +83,19 @@ namespace ns3 {
         uint8_t m_traficPriority;
         bool m_sequenceChangeCount;
         uint16_t m_packetSequenceNumber;
+        bool m_firstFragment;
+        bool m_lastFragment;
+        uint8_t m_fragmentSequence;
       };
-      std::list<ExtendedHeaderElement> elements;
+      ExtendedHeader() : count(0) {}
+
+      ExtendedHeaderElement elements[MAX_ELEMENTS];
+      uint8_t count;
+      std::vector<uint8_t> extra;	// Elements past MAX_ELEMENTS, raw
 
-      void Serialize (Buffer::Iterator start) const;
-      uint32_t Deserialize (uint8_t ehLength, Buffer::Iterator start);
+      void Clear (void);
+      void Serialize (Buffer::Iterator &start) const;
+      uint32_t Deserialize (uint8_t ehLength, Buffer::Iterator &start);
       uint32_t GetSerializedSize (void) const;
     };
 
@@ -103,10 +121,17 @@ namespace ns3 {
     void setupMSHConcatenation(size_t overheadSize, uint8_t packets, uint16_t packetsSize, DocsisChannelDirection direction);
 
     void addExtendedHeader(ExtendedHeader::ExtendedHeaderElement ehe);
+    const ExtendedHeader::ExtendedHeaderElement* findExtendedHeader(ExtendedHeaderType type) const;
 
     bool IsDataPacket() const;
     bool IsManagementPacket() const;
     bool IsRequestPacket() const;
+    bool IsConcatenationPacket() const;
+    bool IsFragmentationPacket() const;
+
+    uint16_t GetRequestSid() const;
+    uint16_t GetRequestedMinislots() const;
+    uint16_t GetLength() const;
 
   private:
     DocsisChannelDirection m_packetDirection;
@@ -145,6 +170,41 @@ namespace ns3 {
     Mac48Address m_destination;
     uint16_t m_type_length;
   };
+
+  // Heads every segment sent on a bonded upstream (continuous concatenation
+  // and fragmentation). Segments cut the queued MAC frames as one stream of
+  // bytes, the pointer gives where the first frame starting in the segment
+  // begins.
+  class SegmentHeader : public Header
+  {
+  public:
+    SegmentHeader();
+    SegmentHeader(size_t phyOverhead);
+
+    virtual uint32_t Deserialize (Buffer::Iterator start);
+    virtual uint32_t GetSerializedSize (void) const;
+    virtual void Print (std::ostream &os) const;
+    virtual void Serialize (Buffer::Iterator start) const;
+
+    static TypeId GetTypeId (void);
+    virtual TypeId GetInstanceTypeId (void) const;
+
+    void Setup(size_t overheadSize, bool pointerValid, uint16_t pointer, uint16_t sequence, uint8_t sidCluster, uint16_t request);
+
+    bool IsPointerValid() const;
+    uint16_t GetPointer() const;
+    uint16_t GetSequence() const;
+    uint8_t GetSidCluster() const;
+    uint16_t GetRequest() const;
+
+  private:
+    size_t m_phyOverhead;
+    bool m_pointerValid;
+    uint16_t m_pointer;	// 14 bits
+    uint16_t m_sequence;	// 13 bits
+    uint8_t m_sidCluster;	// 3 bits
+    uint16_t m_request;	// 14 bits, in minislots
+  };
 }
 
 #endif /* DOCSIS_HEADER_H */
@@ -0,0 +1,158 @@
+/* -*- Mode:C++; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/*
+ * Copyright (c) 2013 Martín Javier Di Liscia
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * Author: Martín Javier Di Liscia
+ */
+#include "docsis-minislot-clock.h"
+#include "ns3/simulator.h"
+
+namespace ns3 {
+
+// A tick is 3125/32 ns.
+static const int64_t kNanoSecondsPerTickNum = 3125;
+static const int64_t kNanoSecondsPerTickDen = 32;
+
+// Division rounding towards minus infinity, for counts before the start.
+static int64_t
+FloorDivide (int64_t a, int64_t b)
+{
+  return a >= 0 ? a / b : -((-a + b - 1) / b);
+}
+
+DocsisMinislotClock::DocsisMinislotClock ()
+  : m_ticksPerMinislot (0), m_initialTimestamp (0)
+{
+}
+
+DocsisMinislotClock::DocsisMinislotClock (uint32_t ticksPerMinislot, uint64_t initialTimestamp)
+  : m_ticksPerMinislot (ticksPerMinislot), m_initialTimestamp (initialTimestamp)
+{
+}
+
+uint32_t
+DocsisMinislotClock::GetTicksCovering (Time duration)
+{
+  int64_t ticks = -FloorDivide (-duration.GetNanoSeconds () * kNanoSecondsPerTickDen, kNanoSecondsPerTickNum);
+  return ticks > 0 ? ticks : 1;
+}
+
+bool
+DocsisMinislotClock::IsValid (void) const
+{
+  return m_ticksPerMinislot > 0;
+}
+
+uint32_t
+DocsisMinislotClock::GetTicksPerMinislot (void) const
+{
+  return m_ticksPerMinislot;
+}
+
+uint64_t
+DocsisMinislotClock::GetInitialTimestamp (void) const
+{
+  return m_initialTimestamp;
+}
+
+uint32_t
+DocsisMinislotClock::GetTimestamp (Time time) const
+{
+  return (uint32_t) GetCount (time);
+}
+
+uint32_t
+DocsisMinislotClock::GetMinislot (Time time) const
+{
+  return (uint32_t) (GetCount (time) / m_ticksPerMinislot);
+}
+
+uint32_t
+DocsisMinislotClock::GetNextMinislot (Time time) const
+{
+  // The tick of a time is the one at or before it, so a time past a
+  // minislot start by less than a tick still counts as after it.
+  uint64_t count = GetCount (time);
+  uint64_t minislot = (count + m_ticksPerMinislot - 1) / m_ticksPerMinislot;
+  if (minislot * m_ticksPerMinislot == count && GetTime (count - m_initialTimestamp) < time)
+    minislot++;
+  return (uint32_t) minislot;
+}
+
+uint32_t
+DocsisMinislotClock::GetNearestMinislot (Time time) const
+{
+  return (uint32_t) ((GetCount (time) + m_ticksPerMinislot / 2) / m_ticksPerMinislot);
+}
+
+Time
+DocsisMinislotClock::GetMinislotStart (uint32_t minislot) const
+{
+  uint64_t now = GetCount (Simulator::Now ()) / m_ticksPerMinislot;
+  int64_t full = (int64_t) now + (int32_t) (minislot - (uint32_t) now);
+  return GetTime (full * m_ticksPerMinislot - (int64_t) m_initialTimestamp);
+}
+
+Time
+DocsisMinislotClock::GetDuration (uint32_t minislots) const
+{
+  return GetTime ((int64_t) minislots * m_ticksPerMinislot);
+}
+
+uint32_t
+DocsisMinislotClock::GetMinislotsWithin (Time duration) const
+{
+  return GetTicks (duration) / m_ticksPerMinislot;
+}
+
+uint32_t
+DocsisMinislotClock::GetMinislotsCovering (Time duration) const
+{
+  return (GetTicksCovering (duration) + m_ticksPerMinislot - 1) / m_ticksPerMinislot;
+}
+
+bool
+DocsisMinislotClock::operator == (const DocsisMinislotClock &other) const
+{
+  return m_ticksPerMinislot == other.m_ticksPerMinislot && m_initialTimestamp == other.m_initialTimestamp;
+}
+
+bool
+DocsisMinislotClock::operator != (const DocsisMinislotClock &other) const
+{
+  return !(*this == other);
+}
+
+int64_t
+DocsisMinislotClock::GetTicks (Time time)
+{
+  return FloorDivide (time.GetNanoSeconds () * kNanoSecondsPerTickDen, kNanoSecondsPerTickNum);
+}
+
+Time
+DocsisMinislotClock::GetTime (int64_t ticks)
+{
+  int64_t ns = -FloorDivide (-ticks * kNanoSecondsPerTickNum, kNanoSecondsPerTickDen);
+  return ns >= 0 ? NanoSeconds (ns) : Seconds (0) - NanoSeconds (-ns);
+}
+
+uint64_t
+DocsisMinislotClock::GetCount (Time time) const
+{
+  return m_initialTimestamp + GetTicks (time);
+}
+
+}
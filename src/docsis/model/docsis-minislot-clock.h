@@ -0,0 +1,101 @@
+/* -*- Mode:C++; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/*
+ * Copyright (c) 2013 Martín Javier Di Liscia
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * Author: Martín Javier Di Liscia
+ */
+#ifndef DOCSIS_MINISLOT_CLOCK_H
+#define DOCSIS_MINISLOT_CLOCK_H
+
+#include "ns3/nstime.h"
+
+namespace ns3 {
+
+/**
+ * \brief Upstream minislot timing, as the CMTS and its CMs share it
+ *
+ * Upstream time is counted in ticks of the 10.24 MHz DOCSIS master clock,
+ * whose 32 lower bits are the DOCSIS timestamp, and a minislot lasts a
+ * whole number of ticks. The count starts at an initial timestamp, and
+ * minislot 0 starts at tick 0 of the count.
+ *
+ * Minislot numbers are 32 bits, as the MAPs carry them, and wrap. A
+ * minislot number is taken to be the one nearest to the present, so the
+ * conversions hold across the wrap for minislots within 2^31 of now.
+ *
+ * Conversions are integer arithmetic from the absolute tick count, so they
+ * do not drift, and the CMTS and every CM get the same time out of the
+ * same minislot. Times fall on the nanosecond at or after their tick.
+ */
+class DocsisMinislotClock
+{
+public:
+  DocsisMinislotClock ();
+  /**
+   * \param ticksPerMinislot duration of a minislot
+   * \param initialTimestamp ticks counted when the simulation starts,
+   * extended past the 32 bits of the timestamp
+   */
+  DocsisMinislotClock (uint32_t ticksPerMinislot, uint64_t initialTimestamp = 0);
+
+  /**
+   * \returns the ticks that cover the duration, which makes a minislot at
+   * least that long
+   */
+  static uint32_t GetTicksCovering (Time duration);
+
+  bool IsValid (void) const;
+  uint32_t GetTicksPerMinislot (void) const;
+  uint64_t GetInitialTimestamp (void) const;
+  uint32_t GetTimestamp (Time time) const;
+
+  /**
+   * \returns the minislot in course at the time
+   */
+  uint32_t GetMinislot (Time time) const;
+  /**
+   * \returns the first minislot that starts at or after the time
+   */
+  uint32_t GetNextMinislot (Time time) const;
+  /**
+   * \returns the minislot whose start is nearest to the time
+   */
+  uint32_t GetNearestMinislot (Time time) const;
+  /**
+   * \returns when the minislot starts, taking the minislot number nearest
+   * to now
+   */
+  Time GetMinislotStart (uint32_t minislot) const;
+
+  Time GetDuration (uint32_t minislots) const;
+  uint32_t GetMinislotsWithin (Time duration) const;
+  uint32_t GetMinislotsCovering (Time duration) const;
+
+  bool operator == (const DocsisMinislotClock &other) const;
+  bool operator != (const DocsisMinislotClock &other) const;
+
+private:
+  static int64_t GetTicks (Time time);
+  static Time GetTime (int64_t ticks);
+  uint64_t GetCount (Time time) const;
+
+  uint32_t m_ticksPerMinislot;	// 0 until the channel timing is known
+  uint64_t m_initialTimestamp;
+};
+
+}
+
+#endif /* DOCSIS_MINISLOT_CLOCK_H */
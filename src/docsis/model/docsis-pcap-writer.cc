@@ -0,0 +1,167 @@
+/* -*- Mode:C++; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/*
+ * Copyright (c) 2013 Martín Javier Di Liscia
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * Author: Martín Javier Di Liscia
+ */
+#include "docsis-pcap-writer.h"
+#include "ns3/log.h"
+#include "ns3/uinteger.h"
+#include "ns3/simulator.h"
+#include "ns3/abort.h"
+#include "ns3/trace-helper.h"
+#include <string.h>
+#include <algorithm>
+
+NS_LOG_COMPONENT_DEFINE ("DocsisPcapWriter");
+
+namespace ns3 {
+
+NS_OBJECT_ENSURE_REGISTERED (DocsisPcapWriter);
+
+TypeId
+DocsisPcapWriter::GetTypeId (void)
+{
+  static TypeId tid = TypeId ("ns3::DocsisPcapWriter")
+    .SetParent<Object> ()
+    .AddConstructor<DocsisPcapWriter> ()
+    .AddAttribute ("BufferSize",
+                   "Bytes of records kept in memory before they are written to the file",
+                   UintegerValue (256 * 1024),
+                   MakeUintegerAccessor (&DocsisPcapWriter::m_bufferSize),
+                   MakeUintegerChecker<uint32_t> ())
+    .AddAttribute ("SnapLen",
+                   "Bytes recorded of every frame at most",
+                   UintegerValue (65535),
+                   MakeUintegerAccessor (&DocsisPcapWriter::m_snapLen),
+                   MakeUintegerChecker<uint32_t> ())
+  ;
+  return tid;
+}
+
+DocsisPcapWriter::DocsisPcapWriter () : m_file (NULL), m_bufferSize (256 * 1024), m_snapLen (65535)
+{
+}
+
+DocsisPcapWriter::~DocsisPcapWriter ()
+{
+  Close ();
+}
+
+void
+DocsisPcapWriter::DoDispose (void)
+{
+  Close ();
+  Object::DoDispose ();
+}
+
+void
+DocsisPcapWriter::Open (std::string filename)
+{
+  NS_LOG_FUNCTION (this << filename);
+  Close ();
+
+  m_file = fopen (filename.c_str (), "wb");
+  NS_ABORT_MSG_UNLESS (m_file, "Unable to open " << filename);
+  // The records are buffered here already.
+  setvbuf (m_file, NULL, _IONBF, 0);
+  m_buffer.reserve (m_bufferSize + m_snapLen + 16);
+
+  // Host byte order, which readers tell by the magic number.
+  AppendU32 (0xa1b2c3d4);
+  AppendU16 (2);	// Version 2.4
+  AppendU16 (4);
+  AppendU32 (0);	// Time zone correction
+  AppendU32 (0);	// Timestamp accuracy
+  AppendU32 (m_snapLen);
+  AppendU32 (PcapHelper::DLT_DOCSIS);
+}
+
+void
+DocsisPcapWriter::Close (void)
+{
+  if (!m_file)
+    return;
+
+  Flush ();
+  fclose (m_file);
+  m_file = NULL;
+}
+
+bool
+DocsisPcapWriter::IsOpen (void) const
+{
+  return m_file != NULL;
+}
+
+void
+DocsisPcapWriter::Write (Ptr<const Packet> packet, uint32_t phyOverhead)
+{
+  NS_LOG_FUNCTION (this << packet << phyOverhead);
+  if (!m_file)
+    return;
+
+  uint32_t length = packet->GetSize () > phyOverhead ? packet->GetSize () - phyOverhead : 0;
+  uint32_t included = std::min (length, m_snapLen);
+  uint64_t us = Simulator::Now ().GetMicroSeconds ();
+
+  AppendU32 (us / 1000000);
+  AppendU32 (us % 1000000);
+  AppendU32 (included);
+  AppendU32 (length);
+
+  if (included > 0)
+    {
+      // The PHY overhead is copied out with the frame and then dropped, which
+      // is cheaper than fragmenting the packet.
+      size_t offset = m_buffer.size ();
+      m_buffer.resize (offset + phyOverhead + included);
+      packet->CopyData (&m_buffer[offset], phyOverhead + included);
+      m_buffer.erase (m_buffer.begin () + offset, m_buffer.begin () + offset + phyOverhead);
+    }
+
+  if (m_buffer.size () >= m_bufferSize)
+    Flush ();
+}
+
+void
+DocsisPcapWriter::Flush (void)
+{
+  if (!m_file || m_buffer.empty ())
+    return;
+
+  size_t written = fwrite (&m_buffer[0], 1, m_buffer.size (), m_file);
+  NS_ABORT_MSG_UNLESS (written == m_buffer.size (), "Unable to write the capture");
+  m_buffer.clear ();
+}
+
+void
+DocsisPcapWriter::AppendU16 (uint16_t value)
+{
+  size_t offset = m_buffer.size ();
+  m_buffer.resize (offset + 2);
+  memcpy (&m_buffer[offset], &value, 2);
+}
+
+void
+DocsisPcapWriter::AppendU32 (uint32_t value)
+{
+  size_t offset = m_buffer.size ();
+  m_buffer.resize (offset + 4);
+  memcpy (&m_buffer[offset], &value, 4);
+}
+
+}
@@ -0,0 +1,77 @@
+/* -*- Mode:C++; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/*
+ * Copyright (c) 2013 Martín Javier Di Liscia
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * Author: Martín Javier Di Liscia
+ */
+#ifndef DOCSIS_PCAP_WRITER_H
+#define DOCSIS_PCAP_WRITER_H
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include "ns3/object.h"
+#include "ns3/packet.h"
+#include "ns3/nstime.h"
+
+namespace ns3 {
+
+/**
+ * \brief Writes DOCSIS MAC frames to a DLT_DOCSIS (143) pcap file
+ *
+ * Records go to a memory buffer that is written out with a single fwrite
+ * when it fills up, so tracing every device of a large segment does not
+ * take a system call per frame. Whatever is still buffered is written on
+ * Flush, and when the writer is disposed or destroyed.
+ *
+ * Frames are recorded from their MAC header on; the PHY overhead the
+ * devices put in front of it is skipped.
+ */
+class DocsisPcapWriter : public Object
+{
+public:
+  static TypeId GetTypeId (void);
+  DocsisPcapWriter ();
+  virtual ~DocsisPcapWriter ();
+
+  /**
+   * Creates the file and writes the pcap file header.
+   */
+  void Open (std::string filename);
+  void Close (void);
+  bool IsOpen (void) const;
+
+  /**
+   * \param packet a frame, as it is sent on the channel
+   * \param phyOverhead bytes of PHY overhead packet begins with
+   */
+  void Write (Ptr<const Packet> packet, uint32_t phyOverhead);
+  void Flush (void);
+
+private:
+  virtual void DoDispose (void);
+  void AppendU16 (uint16_t value);
+  void AppendU32 (uint32_t value);
+
+  FILE *m_file;
+  std::vector<uint8_t> m_buffer;
+  uint32_t m_bufferSize;	// Bytes buffered before they are written out
+  uint32_t m_snapLen;
+};
+
+}
+
+#endif /* DOCSIS_PCAP_WRITER_H */
@@ -0,0 +1,275 @@
+/* -*- Mode:C++; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/*
+ * Copyright (c) 2013 Martín Javier Di Liscia
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * Author: Martín Javier Di Liscia
+ */
+#include "docsis-pie-queue.h"
+#include "ns3/log.h"
+#include "ns3/simulator.h"
+#include "ns3/uinteger.h"
+#include "ns3/double.h"
+
+NS_LOG_COMPONENT_DEFINE ("DocsisPieQueue");
+
+namespace ns3 {
+
+NS_OBJECT_ENSURE_REGISTERED (DocsisPieQueue);
+
+TypeId
+DocsisPieQueue::GetTypeId (void)
+{
+  static TypeId tid = TypeId ("ns3::DocsisPieQueue")
+    .SetParent<Queue> ()
+    .AddConstructor<DocsisPieQueue> ()
+    .AddAttribute ("MaxBytes",
+                   "Bytes the queue holds before it drops at the tail",
+                   UintegerValue (150000),
+                   MakeUintegerAccessor (&DocsisPieQueue::m_maxBytes),
+                   MakeUintegerChecker<uint32_t> ())
+    .AddAttribute ("LatencyTarget",
+                   "Queuing latency the service flow is configured to aim at",
+                   TimeValue (MilliSeconds (10)),
+                   MakeTimeAccessor (&DocsisPieQueue::m_latencyTarget),
+                   MakeTimeChecker ())
+    .AddAttribute ("MaxSustainedRate",
+                   "Maximum sustained rate of the service flow, 0 to measure the departure rate instead",
+                   DataRateValue (DataRate (0)),
+                   MakeDataRateAccessor (&DocsisPieQueue::m_maxSustainedRate),
+                   MakeDataRateChecker ())
+    .AddAttribute ("UpdateInterval",
+                   "Time between drop probability updates",
+                   TimeValue (MilliSeconds (16)),
+                   MakeTimeAccessor (&DocsisPieQueue::m_updateInterval),
+                   MakeTimeChecker ())
+    .AddAttribute ("MaxBurst",
+                   "How long a burst is let through before drops start",
+                   TimeValue (MilliSeconds (142)),
+                   MakeTimeAccessor (&DocsisPieQueue::m_maxBurst),
+                   MakeTimeChecker ())
+    .AddAttribute ("Alpha",
+                   "Weight of the distance to the latency target, per second",
+                   DoubleValue (0.25),
+                   MakeDoubleAccessor (&DocsisPieQueue::m_alpha),
+                   MakeDoubleChecker<double> (0))
+    .AddAttribute ("Beta",
+                   "Weight of the latency trend, per second",
+                   DoubleValue (2.5),
+                   MakeDoubleAccessor (&DocsisPieQueue::m_beta),
+                   MakeDoubleChecker<double> (0))
+    .AddAttribute ("MeanPacketSize",
+                   "Packet size the drop probability applies to as is, larger packets are dropped more often",
+                   UintegerValue (1024),
+                   MakeUintegerAccessor (&DocsisPieQueue::m_meanPacketSize),
+                   MakeUintegerChecker<uint32_t> (1))
+    .AddAttribute ("DequeueThreshold",
+                   "Bytes a departure rate measurement spans",
+                   UintegerValue (16384),
+                   MakeUintegerAccessor (&DocsisPieQueue::m_dequeueThreshold),
+                   MakeUintegerChecker<uint32_t> (1))
+  ;
+
+  return tid;
+}
+
+DocsisPieQueue::DocsisPieQueue () : m_bytesInQueue (0), m_dropProbability (0), m_accumulatedProbability (0), m_qdelayOld (0),
+                                    m_burstAllowance (0), m_nextUpdate (0), m_measuring (false), m_measuredBytes (0),
+                                    m_departureRate (0)
+{
+  NS_LOG_FUNCTION (this);
+  m_rng = CreateObject<UniformRandomVariable> ();
+}
+
+DocsisPieQueue::~DocsisPieQueue ()
+{
+  NS_LOG_FUNCTION (this);
+}
+
+double
+DocsisPieQueue::GetDropProbability (void)
+{
+  CatchUp ();
+  return m_dropProbability;
+}
+
+Time
+DocsisPieQueue::GetQueueDelay (void)
+{
+  return Seconds (EstimateQueueDelay ());
+}
+
+int64_t
+DocsisPieQueue::AssignStreams (int64_t stream)
+{
+  m_rng->SetStream (stream);
+  return 1;
+}
+
+bool
+DocsisPieQueue::DoEnqueue (Ptr<Packet> p)
+{
+  NS_LOG_FUNCTION (this << p);
+  CatchUp ();
+
+  if (m_bytesInQueue + p->GetSize () > m_maxBytes || DropEarly (p->GetSize ()))
+    {
+      Drop (p);
+      return false;
+    }
+
+  m_packets.push_back (p);
+  m_bytesInQueue += p->GetSize ();
+  return true;
+}
+
+Ptr<Packet>
+DocsisPieQueue::DoDequeue (void)
+{
+  NS_LOG_FUNCTION (this);
+  if (m_packets.empty ())
+    return 0;
+
+  CatchUp ();
+  Ptr<Packet> p = m_packets.front ();
+  m_packets.pop_front ();
+
+  // Departures come in bursts, one per grant. Measuring over a threshold
+  // of bytes averages the rate across several of them.
+  if (!m_measuring && m_bytesInQueue >= m_dequeueThreshold)
+    {
+      m_measuring = true;
+      m_measurementStart = Simulator::Now ();
+      m_measuredBytes = 0;
+    }
+  m_bytesInQueue -= p->GetSize ();
+  if (m_measuring)
+    {
+      m_measuredBytes += p->GetSize ();
+      Time interval = Simulator::Now () - m_measurementStart;
+      if (m_measuredBytes >= m_dequeueThreshold && interval.IsStrictlyPositive ())
+        {
+          double rate = m_measuredBytes / interval.GetSeconds ();
+          m_departureRate = m_departureRate > 0 ? 0.5 * m_departureRate + 0.5 * rate : rate;
+          m_measuring = false;
+        }
+    }
+
+  return p;
+}
+
+Ptr<const Packet>
+DocsisPieQueue::DoPeek (void) const
+{
+  if (m_packets.empty ())
+    return 0;
+  return m_packets.front ();
+}
+
+double
+DocsisPieQueue::EstimateQueueDelay (void) const
+{
+  double rate = m_maxSustainedRate.GetBitRate () > 0 ? m_maxSustainedRate.GetBitRate () / 8.0 : m_departureRate;
+  if (rate <= 0)
+    return 0;
+  return m_bytesInQueue / rate;
+}
+
+void
+DocsisPieQueue::CatchUp (void)
+{
+  // The queue only changes when packets come or go, so every update due
+  // since the last one sees the same latency. After a few dozen of them
+  // the state has settled, and the rest are skipped.
+  Time now = Simulator::Now ();
+  for (uint32_t updates = 0; m_nextUpdate <= now; updates++)
+    {
+      if (updates == 64)
+        {
+          int64_t behind = (now - m_nextUpdate).GetInteger () / m_updateInterval.GetInteger ();
+          m_nextUpdate += TimeStep (behind * m_updateInterval.GetInteger ());
+        }
+      else
+        CalculateDropProbability ();
+      m_nextUpdate += m_updateInterval;
+    }
+}
+
+void
+DocsisPieQueue::CalculateDropProbability (void)
+{
+  double qdelay = EstimateQueueDelay ();
+  double target = m_latencyTarget.GetSeconds ();
+  double p = m_alpha * (qdelay - target) + m_beta * (qdelay - m_qdelayOld);
+
+  // Small probabilities move in small steps, so light congestion is not
+  // overreacted to.
+  if (m_dropProbability < 0.000001)
+    p /= 2048;
+  else if (m_dropProbability < 0.00001)
+    p /= 512;
+  else if (m_dropProbability < 0.0001)
+    p /= 128;
+  else if (m_dropProbability < 0.001)
+    p /= 32;
+  else if (m_dropProbability < 0.01)
+    p /= 8;
+  else if (m_dropProbability < 0.1)
+    p /= 2;
+  else if (p > 0.02)
+    p = 0.02;
+
+  m_dropProbability += p;
+  if (qdelay > 0.25)
+    m_dropProbability += 0.02;
+  if (qdelay == 0 && m_qdelayOld == 0)
+    m_dropProbability *= 0.98;
+  m_dropProbability = std::max (0.0, std::min (1.0, m_dropProbability));
+
+  if (m_dropProbability == 0 && qdelay < target / 2 && m_qdelayOld < target / 2)
+    m_burstAllowance = m_maxBurst;
+  else if (m_burstAllowance > m_updateInterval)
+    m_burstAllowance -= m_updateInterval;
+  else
+    m_burstAllowance = Time (0);
+
+  m_qdelayOld = qdelay;
+}
+
+bool
+DocsisPieQueue::DropEarly (uint32_t size)
+{
+  if (m_burstAllowance.IsStrictlyPositive ())
+    return false;
+  if (m_qdelayOld < m_latencyTarget.GetSeconds () / 2 && m_dropProbability < 0.2)
+    return false;
+  if (m_bytesInQueue <= 2 * m_meanPacketSize)
+    return false;
+
+  // Larger packets take a larger share of the drops, and the accumulated
+  // probability keeps drops from bunching up or spreading too far apart.
+  double p = std::min (1.0, m_dropProbability * size / m_meanPacketSize);
+  m_accumulatedProbability += p;
+  if (m_accumulatedProbability < 0.85)
+    return false;
+  if (m_accumulatedProbability >= 8.5 || m_rng->GetValue () < p)
+    {
+      m_accumulatedProbability = 0;
+      return true;
+    }
+  return false;
+}
+
+}
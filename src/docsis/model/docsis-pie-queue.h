@@ -0,0 +1,94 @@
+/* -*- Mode:C++; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/*
+ * Copyright (c) 2013 Martín Javier Di Liscia
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * Author: Martín Javier Di Liscia
+ */
+#ifndef DOCSIS_PIE_QUEUE_H
+#define DOCSIS_PIE_QUEUE_H
+
+#include <deque>
+#include "ns3/queue.h"
+#include "ns3/nstime.h"
+#include "ns3/data-rate.h"
+#include "ns3/random-variable-stream.h"
+
+namespace ns3 {
+
+/**
+ * \brief DOCSIS-PIE active queue management for the CM upstream (RFC 8034)
+ *
+ * Packets are dropped on arrival with a probability driven by how far the
+ * estimated queuing latency is from the target. The latency is the queued
+ * bytes over the service flow's maximum sustained rate when one is
+ * configured, as the DOCSIS variant does; otherwise it is measured from the
+ * departures, averaged over enough bytes to span several grants.
+ *
+ * The drop probability is updated every UpdateInterval, but lazily: the
+ * updates due are run when a packet arrives or leaves, so an idle queue
+ * schedules no events.
+ */
+class DocsisPieQueue : public Queue
+{
+public:
+  static TypeId GetTypeId (void);
+  DocsisPieQueue ();
+  virtual ~DocsisPieQueue ();
+
+  double GetDropProbability (void);
+  Time GetQueueDelay (void);
+  int64_t AssignStreams (int64_t stream);
+
+private:
+  virtual bool DoEnqueue (Ptr<Packet> p);
+  virtual Ptr<Packet> DoDequeue (void);
+  virtual Ptr<const Packet> DoPeek (void) const;
+
+  void CatchUp (void);
+  void CalculateDropProbability (void);
+  bool DropEarly (uint32_t size);
+  double EstimateQueueDelay (void) const;
+
+  std::deque< Ptr<Packet> > m_packets;
+  uint32_t m_bytesInQueue;
+  uint32_t m_maxBytes;
+  Time m_latencyTarget;
+  Time m_updateInterval;
+  Time m_maxBurst;
+  double m_alpha;
+  double m_beta;
+  DataRate m_maxSustainedRate;
+  uint32_t m_meanPacketSize;
+  uint32_t m_dequeueThreshold;
+
+  double m_dropProbability;
+  double m_accumulatedProbability;
+  double m_qdelayOld;	// Seconds
+  Time m_burstAllowance;
+  Time m_nextUpdate;
+
+  // Departure rate measurement, used without a configured rate.
+  bool m_measuring;
+  Time m_measurementStart;
+  uint32_t m_measuredBytes;
+  double m_departureRate;	// Bytes per second
+
+  Ptr<UniformRandomVariable> m_rng;
+};
+
+}
+
+#endif /* DOCSIS_PIE_QUEUE_H */
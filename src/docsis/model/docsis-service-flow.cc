@@ -0,0 +1,332 @@
+/* -*- Mode:C++; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/*
+ * Copyright (c) 2013 Martín Javier Di Liscia
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * Author: Martín Javier Di Liscia
+ */
+#include "docsis-service-flow.h"
+#include "ns3/log.h"
+#include <algorithm>
+
+NS_LOG_COMPONENT_DEFINE ("DocsisServiceFlow");
+
+namespace ns3 {
+
+static const uint16_t kIpv4 = 0x0800;
+static const double kMaxFrameBytes = 1522;
+
+const uint16_t DocsisClassifierRule::kAnyProtocol;
+
+DocsisTokenBucket::DocsisTokenBucket ()
+  : m_rate (0), m_burst (0), m_tokens (0), m_peakRate (0), m_peakTokens (0)
+{
+}
+
+void
+DocsisTokenBucket::Configure (DataRate rate, uint32_t burst, DataRate peakRate)
+{
+  bool wasShaping = IsShaping ();
+  m_rate = rate.GetBitRate () / 8.0;
+  m_burst = std::max ((double) burst, kMaxFrameBytes);
+  m_peakRate = peakRate.GetBitRate () / 8.0;
+
+  // A flow starts out with full buckets.
+  if (!wasShaping)
+    {
+      m_tokens = m_burst;
+      m_peakTokens = kMaxFrameBytes;
+    }
+  m_tokens = std::min (m_tokens, m_burst);
+}
+
+bool
+DocsisTokenBucket::IsShaping (void) const
+{
+  return m_rate > 0;
+}
+
+uint32_t
+DocsisTokenBucket::GetConformingBytes (Time now)
+{
+  Refill (now);
+  double tokens = m_peakRate > 0 ? std::min (m_tokens, m_peakTokens) : m_tokens;
+  return (uint32_t) std::max (tokens, 0.0);
+}
+
+Time
+DocsisTokenBucket::GetDelay (uint32_t bytes, Time now)
+{
+  Refill (now);
+
+  // Frames larger than a bucket go once it is full.
+  double wait = (std::min ((double) bytes, m_burst) - m_tokens) / m_rate;
+  if (m_peakRate > 0)
+    wait = std::max (wait, (std::min ((double) bytes, kMaxFrameBytes) - m_peakTokens) / m_peakRate);
+  return wait > 0 ? Seconds (wait) : Time (0);
+}
+
+void
+DocsisTokenBucket::Consume (uint32_t bytes)
+{
+  m_tokens -= bytes;
+  m_peakTokens -= bytes;
+}
+
+void
+DocsisTokenBucket::Refund (uint32_t bytes)
+{
+  m_tokens = std::min (m_burst, m_tokens + bytes);
+  m_peakTokens = std::min (kMaxFrameBytes, m_peakTokens + bytes);
+}
+
+void
+DocsisTokenBucket::Refill (Time now)
+{
+  double elapsed = (now - m_lastRefill).GetSeconds ();
+  m_lastRefill = now;
+  m_tokens = std::min (m_burst, m_tokens + elapsed * m_rate);
+  m_peakTokens = std::min (kMaxFrameBytes, m_peakTokens + elapsed * m_peakRate);
+}
+
+DocsisClassifierRule::DocsisClassifierRule ()
+  : priority (0), flow (0), ethertype (0), protocol (kAnyProtocol), source (Ipv4Address::GetAny ()), sourceMask (Ipv4Mask::GetZero ()),
+    destination (Ipv4Address::GetAny ()), destinationMask (Ipv4Mask::GetZero ()), sourcePortStart (0), sourcePortEnd (0xFFFF),
+    destinationPortStart (0), destinationPortEnd (0xFFFF), dscpLow (0), dscpHigh (63)
+{
+}
+
+static bool
+UsesIpHeader (const DocsisClassifierRule &rule)
+{
+  return rule.protocol != DocsisClassifierRule::kAnyProtocol || rule.sourceMask.Get () != 0 || rule.destinationMask.Get () != 0 ||
+         rule.sourcePortStart != 0 || rule.sourcePortEnd != 0xFFFF || rule.destinationPortStart != 0 || rule.destinationPortEnd != 0xFFFF ||
+         rule.dscpLow != 0 || rule.dscpHigh < 63;
+}
+
+bool
+DocsisClassifier::Key::operator== (const Key &other) const
+{
+  return source == other.source && destination == other.destination && ethertype == other.ethertype && sourcePort == other.sourcePort &&
+         destinationPort == other.destinationPort && protocol == other.protocol && dscp == other.dscp;
+}
+
+DocsisClassifier::Key
+DocsisClassifier::Key::Masked (const Key &mask) const
+{
+  Key masked;
+  masked.source = source & mask.source;
+  masked.destination = destination & mask.destination;
+  masked.ethertype = ethertype & mask.ethertype;
+  masked.sourcePort = sourcePort & mask.sourcePort;
+  masked.destinationPort = destinationPort & mask.destinationPort;
+  masked.protocol = protocol & mask.protocol;
+  masked.dscp = dscp & mask.dscp;
+  return masked;
+}
+
+size_t
+DocsisClassifier::KeyHash::operator() (const Key &key) const
+{
+  size_t hash = key.source;
+  hash = hash * 31 + key.destination;
+  hash = hash * 31 + ((uint32_t) key.sourcePort << 16 | key.destinationPort);
+  hash = hash * 31 + ((uint32_t) key.ethertype << 16 | (uint32_t) key.protocol << 8 | key.dscp);
+  return hash;
+}
+
+DocsisClassifier::DocsisClassifier () : m_compiled (true)
+{
+}
+
+void
+DocsisClassifier::AddRule (const DocsisClassifierRule &rule)
+{
+  m_rules.push_back (rule);
+  m_compiled = false;
+}
+
+uint32_t
+DocsisClassifier::GetNRules (void) const
+{
+  return m_rules.size ();
+}
+
+uint32_t
+DocsisClassifier::Classify (Ptr<const Packet> packet, uint16_t protocol)
+{
+  if (m_rules.empty ())
+    return 0;
+  if (!m_compiled)
+    Compile ();
+
+  Key key = Parse (packet, protocol);
+  uint32_t best = m_rules.size ();
+  for (std::vector<Tuple>::const_iterator tuple = m_tuples.begin (); tuple != m_tuples.end (); tuple++)
+    {
+      if (best != m_rules.size () && tuple->maxPriority < m_rules[best].priority)
+        break;
+
+      RuleTable::const_iterator rule = tuple->rules.find (key.Masked (tuple->mask));
+      if (rule != tuple->rules.end () && Better (rule->second, best))
+        best = rule->second;
+    }
+
+  for (std::vector<uint32_t>::const_iterator rule = m_ranges.begin (); rule != m_ranges.end (); rule++)
+    if (Better (*rule, best) && Matches (m_rules[*rule], key))
+      best = *rule;
+
+  return best == m_rules.size () ? 0 : m_rules[best].flow;
+}
+
+DocsisClassifier::Key
+DocsisClassifier::Parse (Ptr<const Packet> packet, uint16_t protocol)
+{
+  Key key;
+  key.ethertype = protocol;
+  if (protocol != kIpv4)
+    return key;
+
+  // Read the fields straight from the bytes, the headers are not needed.
+  uint8_t buffer[64];
+  uint32_t length = packet->CopyData (buffer, sizeof (buffer));
+  if (length < 20 || (buffer[0] >> 4) != 4)
+    return key;
+
+  uint32_t headerLength = (buffer[0] & 0x0F) * 4;
+  key.dscp = buffer[1] >> 2;
+  key.protocol = buffer[9];
+  key.source = (uint32_t) buffer[12] << 24 | (uint32_t) buffer[13] << 16 | (uint32_t) buffer[14] << 8 | buffer[15];
+  key.destination = (uint32_t) buffer[16] << 24 | (uint32_t) buffer[17] << 16 | (uint32_t) buffer[18] << 8 | buffer[19];
+
+  // Only the first fragment carries the ports.
+  bool firstFragment = ((buffer[6] & 0x1F) | buffer[7]) == 0;
+  if ((key.protocol == 6 || key.protocol == 17) && firstFragment && length >= headerLength + 4)
+    {
+      key.sourcePort = (uint16_t) (buffer[headerLength] << 8 | buffer[headerLength + 1]);
+      key.destinationPort = (uint16_t) (buffer[headerLength + 2] << 8 | buffer[headerLength + 3]);
+    }
+  return key;
+}
+
+void
+DocsisClassifier::Compile (void)
+{
+  NS_LOG_FUNCTION (this << m_rules.size ());
+  m_tuples.clear ();
+  m_ranges.clear ();
+
+  for (uint32_t index = 0; index < m_rules.size (); index++)
+    {
+      const DocsisClassifierRule &rule = m_rules[index];
+      bool ip = UsesIpHeader (rule);
+      if ((ip && rule.ethertype != 0 && rule.ethertype != kIpv4) || rule.dscpLow > rule.dscpHigh)
+        continue;	// Matches nothing
+
+      bool sourcePortRange = rule.sourcePortStart != rule.sourcePortEnd && (rule.sourcePortStart != 0 || rule.sourcePortEnd != 0xFFFF);
+      bool destinationPortRange = rule.destinationPortStart != rule.destinationPortEnd && (rule.destinationPortStart != 0 || rule.destinationPortEnd != 0xFFFF);
+      if (sourcePortRange || destinationPortRange)
+        {
+          m_ranges.push_back (index);
+          continue;
+        }
+
+      Key mask, value;
+      if (ip || rule.ethertype != 0)
+        {
+          mask.ethertype = 0xFFFF;
+          value.ethertype = ip ? kIpv4 : rule.ethertype;
+        }
+      if (rule.protocol != DocsisClassifierRule::kAnyProtocol)
+        {
+          mask.protocol = 0xFF;
+          value.protocol = rule.protocol;
+        }
+      mask.source = rule.sourceMask.Get ();
+      value.source = rule.source.Get () & mask.source;
+      mask.destination = rule.destinationMask.Get ();
+      value.destination = rule.destination.Get () & mask.destination;
+      if (rule.sourcePortStart == rule.sourcePortEnd)
+        {
+          mask.sourcePort = 0xFFFF;
+          value.sourcePort = rule.sourcePortStart;
+        }
+      if (rule.destinationPortStart == rule.destinationPortEnd)
+        {
+          mask.destinationPort = 0xFFFF;
+          value.destinationPort = rule.destinationPortStart;
+        }
+      uint8_t dscpHigh = std::min (rule.dscpHigh, (uint8_t) 63);
+      if (rule.dscpLow != 0 || dscpHigh != 63)
+        mask.dscp = 0x3F;
+
+      std::vector<Tuple>::iterator tuple = m_tuples.begin ();
+      while (tuple != m_tuples.end () && !(tuple->mask == mask))
+        tuple++;
+      if (tuple == m_tuples.end ())
+        {
+          m_tuples.push_back (Tuple ());
+          tuple = m_tuples.end () - 1;
+          tuple->mask = mask;
+          tuple->maxPriority = 0;
+        }
+      tuple->maxPriority = std::max (tuple->maxPriority, rule.priority);
+
+      for (uint32_t dscp = mask.dscp ? rule.dscpLow : 0; dscp <= (mask.dscp ? dscpHigh : 0u); dscp++)
+        {
+          value.dscp = dscp;
+          RuleTable::iterator entry = tuple->rules.find (value);
+          if (entry == tuple->rules.end ())
+            tuple->rules[value] = index;
+          else if (Better (index, entry->second))
+            entry->second = index;
+        }
+    }
+
+  // Probing the tables that may hold the highest priorities first lets the
+  // search stop early.
+  for (uint32_t i = 1; i < m_tuples.size (); i++)
+    for (uint32_t j = i; j > 0 && m_tuples[j].maxPriority > m_tuples[j - 1].maxPriority; j--)
+      std::swap (m_tuples[j], m_tuples[j - 1]);
+
+  m_compiled = true;
+}
+
+bool
+DocsisClassifier::Matches (const DocsisClassifierRule &rule, const Key &key) const
+{
+  if (rule.ethertype != 0 && key.ethertype != rule.ethertype)
+    return false;
+  if (UsesIpHeader (rule) && key.ethertype != kIpv4)
+    return false;
+
+  return (rule.protocol == DocsisClassifierRule::kAnyProtocol || key.protocol == rule.protocol) &&
+         (key.source & rule.sourceMask.Get ()) == (rule.source.Get () & rule.sourceMask.Get ()) &&
+         (key.destination & rule.destinationMask.Get ()) == (rule.destination.Get () & rule.destinationMask.Get ()) &&
+         key.sourcePort >= rule.sourcePortStart && key.sourcePort <= rule.sourcePortEnd &&
+         key.destinationPort >= rule.destinationPortStart && key.destinationPort <= rule.destinationPortEnd &&
+         key.dscp >= rule.dscpLow && key.dscp <= rule.dscpHigh;
+}
+
+bool
+DocsisClassifier::Better (uint32_t rule, uint32_t than) const
+{
+  // Among rules of the same priority, the first added wins.
+  if (than >= m_rules.size ())
+    return true;
+  return m_rules[rule].priority > m_rules[than].priority || (m_rules[rule].priority == m_rules[than].priority && rule < than);
+}
+
+}
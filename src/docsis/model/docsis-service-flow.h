@@ -0,0 +1,198 @@
+/* -*- Mode:C++; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/*
+ * Copyright (c) 2013 Martín Javier Di Liscia
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * Author: Martín Javier Di Liscia
+ */
+#ifndef DOCSIS_SERVICE_FLOW_H
+#define DOCSIS_SERVICE_FLOW_H
+
+#include <vector>
+#include <tr1/unordered_map>
+#include "docsis-enums.h"
+#include "ns3/packet.h"
+#include "ns3/nstime.h"
+#include "ns3/data-rate.h"
+#include "ns3/ipv4-address.h"
+
+namespace ns3 {
+
+/**
+ * \brief Parameters of a service flow, as a CM configuration file lists them
+ */
+struct DocsisServiceFlow
+{
+  DocsisServiceFlow () : mode (kBestEffort), trafficPriority (0), maxSustainedRate (0), maxTrafficBurst (3044), peakRate (0),
+                         minReservedRate (0), latencyTarget (0), lowLatency (false), grantInterval (0), grantSize (0) {}
+  DocsisUpstreamChannelMode mode;	// Upstream only
+  uint8_t trafficPriority;	// 0 to 7, weighs the downstream share of the flow
+  DataRate maxSustainedRate;	// 0 for no rate limit
+  uint32_t maxTrafficBurst;	// Bytes, never below 1522
+  DataRate peakRate;	// 0 for no peak rate limit
+  DataRate minReservedRate;	// Downstream only, 0 for none
+  Time latencyTarget;	// For an AQM queue of the flow, 0 keeps the queue's own
+  bool lowLatency;	// Queues the frames in a DocsisDualQueue, L4S and classic
+  Time grantInterval;	// UGS and PGS, 0 for a grant every MAP
+  uint32_t grantSize;	// UGS and PGS, bytes per grant, 0 for the CMTS's UgsGrantSize
+};
+
+/**
+ * \brief Token buckets enforcing the rate limits of a service flow
+ *
+ * Bytes may go when they fit within the maximum sustained rate bucket,
+ * Max Traffic Burst deep, and within the peak rate bucket, one maximum
+ * size frame deep. The buckets are refilled lazily, from the time elapsed
+ * since the last look, so a shaped flow costs no events of its own.
+ */
+class DocsisTokenBucket
+{
+public:
+  DocsisTokenBucket ();
+
+  /**
+   * \param rate sustained rate, 0 to stop shaping
+   * \param burst depth of the sustained rate bucket, never below 1522 bytes
+   * \param peakRate 0 for no peak rate
+   *
+   * The buckets keep their tokens, so a change of rates does not hand out
+   * a fresh burst.
+   */
+  void Configure (DataRate rate, uint32_t burst, DataRate peakRate = DataRate (0));
+  bool IsShaping (void) const;
+
+  uint32_t GetConformingBytes (Time now);
+  /**
+   * \returns how long until bytes fit in the buckets, zero when they
+   * already do
+   */
+  Time GetDelay (uint32_t bytes, Time now);
+  /**
+   * Takes bytes out of the buckets, as refilled by the last look.
+   */
+  void Consume (uint32_t bytes);
+  /**
+   * Gives back bytes consumed but not used, as far as the buckets hold them.
+   */
+  void Refund (uint32_t bytes);
+
+private:
+  void Refill (Time now);
+
+  double m_rate;	// Bytes per second, 0 when not shaping
+  double m_burst;	// Bytes
+  double m_tokens;
+  double m_peakRate;	// Bytes per second, 0 without a peak rate
+  double m_peakTokens;
+  Time m_lastRefill;
+};
+
+/**
+ * \brief Packet classifier rule, as a CM configuration file lists it
+ *
+ * A rule matches a packet when all of its criteria do, and criteria left at
+ * their defaults match anything. Criteria on the IP header only match IPv4
+ * packets, and the ports only match TCP and UDP.
+ */
+struct DocsisClassifierRule
+{
+  DocsisClassifierRule ();
+
+  static const uint16_t kAnyProtocol = 256;
+
+  uint8_t priority;	// The highest priority matching rule wins
+  uint32_t flow;	// Reference of the service flow the packets go to
+  uint16_t ethertype;	// 0 for any
+  uint16_t protocol;	// IP protocol
+  Ipv4Address source;
+  Ipv4Mask sourceMask;
+  Ipv4Address destination;
+  Ipv4Mask destinationMask;
+  uint16_t sourcePortStart;
+  uint16_t sourcePortEnd;
+  uint16_t destinationPortStart;
+  uint16_t destinationPortEnd;
+  uint8_t dscpLow;
+  uint8_t dscpHigh;
+};
+
+/**
+ * \brief Maps packets onto service flows with a set of classifier rules
+ *
+ * The rules are compiled into one hash table per combination of criteria
+ * in use (tuple space search), so a packet costs a probe per combination
+ * rather than a test per rule. Tables are probed by decreasing priority and
+ * the search stops once no remaining rule can win. DSCP ranges are expanded
+ * into their values; port ranges other than a single port or any port are
+ * matched one rule at a time.
+ */
+class DocsisClassifier
+{
+public:
+  DocsisClassifier ();
+
+  void AddRule (const DocsisClassifierRule &rule);
+  uint32_t GetNRules (void) const;
+
+  /**
+   * \param packet frame payload, starting at the IP header for IPv4
+   * \param protocol ethertype of the payload
+   * \returns the flow reference of the rule that matches, or 0, the
+   * primary service flow, when none does
+   */
+  uint32_t Classify (Ptr<const Packet> packet, uint16_t protocol);
+
+private:
+  struct Key
+  {
+    Key () : source (0), destination (0), ethertype (0), sourcePort (0), destinationPort (0), protocol (0), dscp (0) {}
+    bool operator== (const Key &other) const;
+    Key Masked (const Key &mask) const;
+
+    uint32_t source;
+    uint32_t destination;
+    uint16_t ethertype;
+    uint16_t sourcePort;
+    uint16_t destinationPort;
+    uint8_t protocol;
+    uint8_t dscp;
+  };
+  class KeyHash : public std::unary_function<Key, size_t>
+  {
+  public:
+    size_t operator() (const Key &key) const;
+  };
+  typedef std::tr1::unordered_map<Key, uint32_t, KeyHash> RuleTable;	// To rule indexes
+  struct Tuple
+  {
+    Key mask;
+    uint8_t maxPriority;
+    RuleTable rules;
+  };
+
+  static Key Parse (Ptr<const Packet> packet, uint16_t protocol);
+  void Compile (void);
+  bool Matches (const DocsisClassifierRule &rule, const Key &key) const;
+  bool Better (uint32_t rule, uint32_t than) const;
+
+  std::vector<DocsisClassifierRule> m_rules;
+  std::vector<Tuple> m_tuples;	// By decreasing priority
+  std::vector<uint32_t> m_ranges;	// Rules with port ranges
+  bool m_compiled;
+};
+
+}
+
+#endif /* DOCSIS_SERVICE_FLOW_H */
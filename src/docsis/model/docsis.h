@@ -26,6 +26,13 @@
 #include "hfc.h"
 #include "cm-device.h"
 #include "cmts-device.h"
+#include "cmts-chassis.h"
+#include "docsis-pie-queue.h"
+#include "docsis-dual-queue.h"
+#include "docsis-service-flow.h"
+#include "docsis-error-model.h"
+#include "docsis-pcap-writer.h"
+#include "docsis-minislot-clock.h"
 
 namespace ns3 {
 
@@ -20,31 +20,85 @@
 #include "hfc.h"
 #include "cmts-device.h"
 #include "cm-device.h"
-#include <algorithm>
+#include "docsis-error-model.h"
+#include "mac-management-message.h"
 #include <assert.h>
+#include <algorithm>
+#include <cmath>
 #include "ns3/simulator.h"
-
-#define Mbps *1048576
+#include "ns3/pointer.h"
+#include "ns3/double.h"
 
 namespace ns3 {
 
 NS_OBJECT_ENSURE_REGISTERED (Hfc);
 
+// Marks the CMs that take the SNR of the channel.
+static const double kNoSnr = -1000;
+
 TypeId
 Hfc::GetTypeId (void)
 {
 	static TypeId tid = TypeId("ns3::Hfc")
 		.SetParent<Channel> ()
 		.AddConstructor<Hfc> ()
+		.AddAttribute ("BroadcastDelayGranularity",
+		               "CMs whose propagation delays fall within this window get a broadcast in one event, at the largest of their delays",
+		               TimeValue (MicroSeconds (1)),
+		               MakeTimeAccessor (&Hfc::m_broadcastGranularity),
+		               MakeTimeChecker ())
+		.AddAttribute ("UpstreamErrorModel",
+		               "Decides which upstream bursts are lost to RF impairments, none when null",
+		               PointerValue (),
+		               MakePointerAccessor (&Hfc::SetUpstreamErrorModel, &Hfc::GetUpstreamErrorModel),
+		               MakePointerChecker<ErrorModel> ())
+		.AddAttribute ("DownstreamErrorModel",
+		               "Decides which downstream frames a CM loses to RF impairments, none when null",
+		               PointerValue (),
+		               MakePointerAccessor (&Hfc::SetDownstreamErrorModel, &Hfc::GetDownstreamErrorModel),
+		               MakePointerChecker<ErrorModel> ())
+		.AddAttribute ("UpstreamSnr",
+		               "SNR, in dB, the CMTS receives the CMs with, unless a CM has its own",
+		               DoubleValue (35),
+		               MakeDoubleAccessor (&Hfc::m_upstreamSnr),
+		               MakeDoubleChecker<double> ())
+		.AddAttribute ("DownstreamSnr",
+		               "SNR, in dB, the CMs receive the downstream channels with, unless a CM has its own",
+		               DoubleValue (40),
+		               MakeDoubleAccessor (&Hfc::m_downstreamSnr),
+		               MakeDoubleChecker<double> ())
+		.AddTraceSource ("UpstreamCollision",
+		                 "An upstream burst was lost because it overlapped another one at the CMTS",
+		                 MakeTraceSourceAccessor (&Hfc::m_upstreamCollisionTrace))
+		.AddTraceSource ("UpstreamCorrupt",
+		                 "An upstream burst was lost to the upstream error model",
+		                 MakeTraceSourceAccessor (&Hfc::m_upstreamCorruptTrace))
+		.AddTraceSource ("DownstreamCorrupt",
+		                 "A CM lost a downstream frame to the downstream error model",
+		                 MakeTraceSourceAccessor (&Hfc::m_downstreamCorruptTrace))
 		;
 	
 	return tid;
 }
 
-Hfc::Hfc () : m_cmts(NULL), m_upstreamChannelsAmount(1), m_downstreamChannelsAmount(1), m_stubDataRate(40 Mbps)
+Hfc::Hfc () : m_cmts(NULL), m_groups(1), m_upstreamChannelsAmount(1), m_downstreamChannelsAmount(1),
+             m_upstreamProfiles(1), m_downstreamProfiles(1), m_upstreamRates(1), m_downstreamRates(1),
+             m_upstreamBursts(1), m_nextBurstId(0), m_upstreamSnr(35), m_downstreamSnr(40),
+             m_burstNoise(1)
 {
-	m_upstreamChannelState = new DocsisChannelStatus[m_upstreamChannelsAmount];
-	m_downstreamChannelState = new DocsisChannelStatus[m_downstreamChannelsAmount];
+	m_cmSnr[kUpstream].resize(1);
+	m_cmSnr[kDownstream].resize(1);
+	m_cmProfile[kUpstream].resize(1);
+	m_cmProfile[kDownstream].resize(1);
+
+	// SC-QAM defaults: 64-QAM at 5.12 Msym/s upstream, 256-QAM Annex B
+	// downstream.
+	m_downstreamProfiles[0] = PhyProfile(256, 5360537, 0.0967, 0, 0);
+	m_upstreamRates[0].assign(1, ComputeRate(m_upstreamProfiles[0]));
+	m_downstreamRates[0].assign(1, ComputeRate(m_downstreamProfiles[0]));
+
+	m_upstreamChannelState = new DocsisChannelStatus[m_upstreamChannelsAmount]();
+	m_downstreamChannelState = new DocsisChannelStatus[m_downstreamChannelsAmount]();
 	m_upstreamChannelEvent = new EventId[m_upstreamChannelsAmount];
 	m_downstreamChannelEvent = new EventId[m_downstreamChannelsAmount];
 }
@@ -66,17 +120,32 @@ Hfc::GetNDevices (void) const
 	return 0;
 }
 
-void
+const uint32_t Hfc::kNoHandle;
+
+uint32_t
 Hfc::Attach(Ptr<CmDevice> device)
 {
 	assert(m_cmts != NULL);
 
-	std::list< Ptr<CmDevice> >::iterator deviceIterator= std::find(m_cmList.begin(), m_cmList.end(), device);
-	if (deviceIterator != m_cmList.end())
-		return;
+	uint32_t handle = device->GetHandle();
+	if (handle < m_cms.size() && m_cms[handle] == device)
+		return handle;
+
+	if (m_freeHandles.empty())
+	{
+		handle = m_cms.size();
+		m_cms.push_back(device);
+	}
+	else
+	{
+		handle = m_freeHandles.back();
+		m_freeHandles.pop_back();
+		m_cms[handle] = device;
+	}
 
-	m_cmList.push_front(device);
-	m_cmts->CmAttached(device);
+	m_deliveryPlan = NULL;
+	m_cmts->CmAttached(device, handle);
+	return handle;
 }
 
 void
@@ -93,43 +162,320 @@ Hfc::Attach(Ptr<CmtsDevice> device)
 void
 Hfc::Deattach(Ptr<CmDevice> device)
 {
-	std::list< Ptr<CmDevice> >::iterator deviceIterator = std::find(m_cmList.begin(), m_cmList.end(), device);
-	if (deviceIterator != m_cmList.end())
+	uint32_t handle = device->GetHandle();
+	if (handle >= m_cms.size() || m_cms[handle] != device)
 		return;
-	else
-		m_cmList.erase(deviceIterator);
+
+	m_cms[handle] = NULL;
+	m_freeHandles.push_back(handle);
+	for (uint32_t direction = 0; direction < ChannelDirectionCount; direction++)
+	{
+		for (uint32_t channel = 0; channel < m_cmProfile[direction].size(); channel++)
+		{
+			if (handle < m_cmProfile[direction][channel].size())
+				m_cmProfile[direction][channel][handle] = 0;
+		}
+	}
+	m_deliveryPlan = NULL;
+	for (uint32_t group = 1; group < m_groups.size(); group++)
+		LeaveGroup(group, handle);
 
 	if (m_cmts != NULL)
-		m_cmts->CmDeattached(device);
+		m_cmts->CmDeattached(device, handle);
 }
 
 void
 Hfc::Deattach(Ptr<CmtsDevice> device)
 {
+	// Deattaching a CM frees its slot, so walk the slots by index. The
+	// CMTS still hears of every CM, to forget its state.
+	for (uint32_t handle = 0; handle < m_cms.size(); handle++)
+	{
+		if (m_cms[handle])
+			m_cms[handle]->Deattach();
+	}
+
 	m_cmts = NULL;
+}
 
-	for(std::list< Ptr<CmDevice> >::iterator deviceIterator = m_cmList.begin(); deviceIterator != m_cmList.end(); deviceIterator++)
+void
+Hfc::ReserveCms(uint32_t cms)
+{
+	// Free handles are given out first.
+	uint32_t handles = m_cms.size();
+	if (cms > m_freeHandles.size())
+		handles += cms - m_freeHandles.size();
+
+	m_cms.reserve(handles);
+	for (uint32_t group = 1; group < m_groups.size(); group++)
+		m_groups[group].reserve(handles);
+	for (uint32_t direction = 0; direction < ChannelDirectionCount; direction++)
 	{
-		(*deviceIterator)->Deattach();
+		for (uint32_t channel = 0; channel < m_cmProfile[direction].size(); channel++)
+			m_cmProfile[direction][channel].reserve(handles);
+		for (uint32_t channel = 0; channel < m_cmSnr[direction].size(); channel++)
+			m_cmSnr[direction][channel].reserve(handles);
 	}
 }
 
+uint32_t
+Hfc::CreateGroup()
+{
+	m_groups.push_back(std::vector<bool>());
+	return m_groups.size() - 1;
+}
+
+void
+Hfc::JoinGroup(uint32_t group, uint32_t handle)
+{
+	NS_ASSERT_MSG(group > kAllCms && group < m_groups.size(), "Unknown broadcast group.");
+	if (m_groups[group].size() <= handle)
+		m_groups[group].resize(handle + 1, false);
+	m_groups[group][handle] = true;
+}
+
+void
+Hfc::LeaveGroup(uint32_t group, uint32_t handle)
+{
+	if (handle < m_groups[group].size())
+		m_groups[group][handle] = false;
+}
+
+bool
+Hfc::InGroup(uint32_t group, uint32_t handle) const
+{
+	return group == kAllCms || (handle < m_groups[group].size() && m_groups[group][handle]);
+}
+
 void
 Hfc::CmChangedAddress(Ptr<CmDevice> device, Address old_address)
 {
-	m_cmts->CmChangedAddress(device, old_address);
+	if (m_cmts)
+		m_cmts->CmChangedAddress(device, old_address);
+}
+
+void
+Hfc::CmChangedTimeDistance(Ptr<CmDevice> device)
+{
+	m_deliveryPlan = NULL;
+	if (m_cmts)
+		m_cmts->CmChangedTimeDistance(device);
+}
+
+void
+Hfc::CmChangedServiceFlows(Ptr<CmDevice> device)
+{
+	if (m_cmts)
+		m_cmts->CmChangedServiceFlows(device);
 }
 
 DataRate
-Hfc::GetUpstreamDataRate(int channel)
+Hfc::GetUpstreamDataRate(int channel, uint32_t handle)
 {
-	return m_stubDataRate;
+	return GetRate(kUpstream, channel, handle).dataRate;
 }
 
 DataRate
-Hfc::GetDownstreamDataRate(int channel)
+Hfc::GetDownstreamDataRate(int channel, uint32_t handle)
+{
+	return GetRate(kDownstream, channel, handle).dataRate;
+}
+
+uint32_t
+Hfc::GetUpstreamPhyOverhead(uint32_t channel)
 {
-	return m_stubDataRate;
+	return m_upstreamProfiles[channel].preamble;
+}
+
+uint32_t
+Hfc::GetDownstreamPhyOverhead(uint32_t channel)
+{
+	return m_downstreamProfiles[channel].preamble;
+}
+
+uint32_t
+Hfc::GetUpstreamMinislotSize(uint32_t channel, uint32_t handle)
+{
+	return GetRate(kUpstream, channel, handle).minislotSize;
+}
+
+Time
+Hfc::GetUpstreamTxTime(uint32_t channel, uint32_t bytes, uint32_t handle)
+{
+	return Seconds(bytes * GetRate(kUpstream, channel, handle).secondsPerByte);
+}
+
+Time
+Hfc::GetDownstreamTxTime(uint32_t channel, uint32_t bytes, uint32_t handle)
+{
+	return Seconds(bytes * GetRate(kDownstream, channel, handle).secondsPerByte);
+}
+
+const Hfc::ChannelRate &
+Hfc::GetRate(DocsisChannelDirection direction, uint32_t channel, uint32_t handle) const
+{
+	const std::vector<uint8_t> &profiles = m_cmProfile[direction][channel];
+	uint32_t profile = handle < profiles.size() ? profiles[handle] : 0;
+	return (direction == kUpstream ? m_upstreamRates : m_downstreamRates)[channel][profile];
+}
+
+Hfc::PhyProfile
+Hfc::GetUpstreamPhyProfile(uint32_t channel)
+{
+	return m_upstreamProfiles[channel];
+}
+
+Hfc::PhyProfile
+Hfc::GetDownstreamPhyProfile(uint32_t channel)
+{
+	return m_downstreamProfiles[channel];
+}
+
+void
+Hfc::SetUpstreamPhyProfile(uint32_t channel, PhyProfile profile)
+{
+	NS_ASSERT_MSG(channel < m_upstreamChannelsAmount, "Selected upstream channel is out of range.");
+	NS_ASSERT_MSG(profile.minislotSize > 0, "Upstream channels need a minislot size.");
+
+	m_upstreamProfiles[channel] = profile;
+	m_upstreamRates[channel].assign(1, ComputeRate(profile));
+	m_cmProfile[kUpstream][channel].clear();
+
+	// The minislot duration follows the new rate.
+	if (m_cmts)
+		m_cmts->UpstreamPhyProfileChanged(channel);
+}
+
+void
+Hfc::SetDownstreamPhyProfile(uint32_t channel, PhyProfile profile)
+{
+	NS_ASSERT_MSG(channel < m_downstreamChannelsAmount, "Selected downstream channel is out of range.");
+
+	m_downstreamProfiles[channel] = profile;
+	m_downstreamRates[channel].assign(1, ComputeRate(profile));
+	m_cmProfile[kDownstream][channel].clear();
+}
+
+void
+Hfc::SetUpstreamOfdmChannel(uint32_t channel, const OfdmChannel &ofdm)
+{
+	NS_ASSERT_MSG(channel < m_upstreamChannelsAmount, "Selected upstream channel is out of range.");
+
+	m_upstreamRates[channel] = ComputeOfdmRates(ofdm, true);
+	const ChannelRate &a = m_upstreamRates[channel][0];
+	m_upstreamProfiles[channel] = PhyProfile(a.modulationOrder, 1 / (1 / ofdm.subcarrierSpacing + ofdm.cyclicPrefix.GetSeconds()),
+	                                         ofdm.fecOverhead, a.minislotSize, ofdm.preamble);
+	m_cmProfile[kUpstream][channel].clear();
+
+	if (m_cmts)
+		m_cmts->UpstreamPhyProfileChanged(channel);
+}
+
+void
+Hfc::SetDownstreamOfdmChannel(uint32_t channel, const OfdmChannel &ofdm)
+{
+	NS_ASSERT_MSG(channel < m_downstreamChannelsAmount, "Selected downstream channel is out of range.");
+
+	m_downstreamRates[channel] = ComputeOfdmRates(ofdm, false);
+	m_downstreamProfiles[channel] = PhyProfile(m_downstreamRates[channel][0].modulationOrder,
+	                                           1 / (1 / ofdm.subcarrierSpacing + ofdm.cyclicPrefix.GetSeconds()),
+	                                           ofdm.fecOverhead, 0, ofdm.preamble);
+	m_cmProfile[kDownstream][channel].clear();
+}
+
+uint32_t
+Hfc::GetProfilesAmount(DocsisChannelDirection direction, uint32_t channel) const
+{
+	return (direction == kUpstream ? m_upstreamRates : m_downstreamRates)[channel].size();
+}
+
+void
+Hfc::SetCmProfile(Ptr<CmDevice> cm, DocsisChannelDirection direction, uint32_t channel, uint32_t profile)
+{
+	NS_ASSERT_MSG(channel < m_cmProfile[direction].size(), "Selected channel is out of range.");
+	NS_ASSERT_MSG(profile < GetProfilesAmount(direction, channel), "The channel has no such profile.");
+	uint32_t handle = cm->GetHandle();
+	NS_ASSERT_MSG(handle < m_cms.size() && m_cms[handle] == cm, "The CM is not attached to the channel.");
+
+	std::vector<uint8_t> &profiles = m_cmProfile[direction][channel];
+	if (profiles.size() <= handle)
+		profiles.resize(handle + 1, 0);
+	profiles[handle] = profile;
+
+	// Grants sized in bytes take a different number of minislots.
+	if (direction == kUpstream && m_cmts)
+		m_cmts->CmChangedProfile(cm, channel);
+}
+
+uint32_t
+Hfc::GetCmProfile(uint32_t handle, DocsisChannelDirection direction, uint32_t channel) const
+{
+	const std::vector<uint8_t> &profiles = m_cmProfile[direction][channel];
+	return handle < profiles.size() ? profiles[handle] : 0;
+}
+
+Hfc::ChannelRate
+Hfc::ComputeRate(const PhyProfile &profile)
+{
+	uint32_t bitsPerSymbol = 0;
+	for (uint32_t order = profile.modulationOrder; order > 1; order >>= 1)
+		bitsPerSymbol++;
+	NS_ASSERT_MSG(profile.modulationOrder == (1u << bitsPerSymbol) && bitsPerSymbol > 0, "Modulation order must be a power of two.");
+	NS_ASSERT_MSG(profile.fecOverhead >= 0 && profile.fecOverhead < 1, "FEC overhead must be a fraction of the raw rate.");
+
+	ChannelRate rate;
+	rate.dataRate = DataRate((uint64_t) (profile.symbolRate * bitsPerSymbol * (1 - profile.fecOverhead)));
+	NS_ASSERT_MSG(rate.dataRate.GetBitRate() > 0, "The profile leaves no capacity.");
+	rate.secondsPerByte = 8.0 / rate.dataRate.GetBitRate();
+	rate.minislotSize = profile.minislotSize;
+	rate.modulationOrder = profile.modulationOrder;
+	return rate;
+}
+
+std::vector<Hfc::ChannelRate>
+Hfc::ComputeOfdmRates(const OfdmChannel &ofdm, bool upstream)
+{
+	NS_ASSERT_MSG(!ofdm.profiles.empty() && ofdm.profiles.size() <= 16, "OFDM channels take from 1 to 16 profiles.");
+	NS_ASSERT_MSG(ofdm.subcarrierSpacing > 0 && ofdm.subcarriersPerMinislot > 0, "The channel has no subcarriers.");
+	NS_ASSERT_MSG(ofdm.fecOverhead >= 0 && ofdm.fecOverhead < 1, "FEC overhead must be a fraction of the raw rate.");
+	double symbolTime = 1 / ofdm.subcarrierSpacing + ofdm.cyclicPrefix.GetSeconds();
+
+	std::vector<ChannelRate> rates(ofdm.profiles.size());
+	uint32_t loadedMinislots = 0;
+	for (uint32_t profile = 0; profile < ofdm.profiles.size(); profile++)
+	{
+		const std::vector<uint8_t> &loading = ofdm.profiles[profile];
+		NS_ASSERT_MSG(loading.size() == ofdm.profiles[0].size(), "Every profile loads the same minislots.");
+		uint32_t bits = 0;
+		uint32_t mostBits = 0;
+		for (uint32_t minislot = 0; minislot < loading.size(); minislot++)
+		{
+			NS_ASSERT_MSG(loading[minislot] <= 14, "Subcarriers carry up to 16384-QAM.");
+			bits += loading[minislot] * ofdm.subcarriersPerMinislot;
+			mostBits = std::max(mostBits, (uint32_t) loading[minislot]);
+			if (profile == 0 && loading[minislot] > 0)
+				loadedMinislots++;
+		}
+
+		ChannelRate &rate = rates[profile];
+		rate.dataRate = DataRate((uint64_t) (bits / symbolTime * (1 - ofdm.fecOverhead) + 0.5));
+		NS_ASSERT_MSG(rate.dataRate.GetBitRate() > 0, "The profile leaves no capacity.");
+		rate.secondsPerByte = 8.0 / rate.dataRate.GetBitRate();
+		rate.modulationOrder = 1u << mostBits;
+	}
+	if (!upstream)
+		return rates;
+
+	// Upstream minislots are laid end to end in time, as on an SC-QAM
+	// channel: the frame of every loaded minislot of profile A, shared out
+	// among them. The other profiles fit what their rate allows in the same
+	// time.
+	double minislotTime = ofdm.symbolsPerFrame * symbolTime / loadedMinislots;
+	rates[0].minislotSize = (uint32_t) (minislotTime / rates[0].secondsPerByte + 1e-6);
+	NS_ASSERT_MSG(rates[0].minislotSize > 0, "Profile A minislots carry no whole byte.");
+	for (uint32_t profile = 1; profile < rates.size(); profile++)
+		rates[profile].minislotSize = (uint32_t) (rates[0].minislotSize * rates[0].secondsPerByte / rates[profile].secondsPerByte + 1e-6);
+	return rates;
 }
 
 uint32_t
@@ -149,9 +495,18 @@ Hfc::SetUpstreamChannelsAmount(uint32_t amount)
 {
 	m_upstreamChannelsAmount = amount;
 	delete[] m_upstreamChannelState;
-	m_upstreamChannelState = new DocsisChannelStatus[amount];
+	m_upstreamChannelState = new DocsisChannelStatus[amount]();
 	delete[] m_upstreamChannelEvent;
 	m_upstreamChannelEvent = new EventId[amount];
+	m_upstreamBursts.clear();
+	m_upstreamBursts.resize(amount);
+	m_burstNoise.resize(amount);
+	m_cmSnr[kUpstream].resize(amount);
+	m_cmProfile[kUpstream].resize(amount);
+
+	// New channels get the profile of the first one.
+	m_upstreamProfiles.resize(amount, m_upstreamProfiles[0]);
+	m_upstreamRates.resize(amount, m_upstreamRates[0]);
 }
 
 void
@@ -159,9 +514,14 @@ Hfc::SetDownstreamChannelsAmount(uint32_t amount)
 {
 	m_downstreamChannelsAmount = amount;
 	delete[] m_downstreamChannelState;
-	m_downstreamChannelState = new DocsisChannelStatus[amount];
+	m_downstreamChannelState = new DocsisChannelStatus[amount]();
 	delete[] m_downstreamChannelEvent;
 	m_downstreamChannelEvent = new EventId[amount];
+
+	m_downstreamProfiles.resize(amount, m_downstreamProfiles[0]);
+	m_downstreamRates.resize(amount, m_downstreamRates[0]);
+	m_cmSnr[kDownstream].resize(amount);
+	m_cmProfile[kDownstream].resize(amount);
 }
 
 void
@@ -169,24 +529,74 @@ Hfc::UpTransmitStart(uint32_t channel, Ptr<Packet> p, Ptr<CmDevice> cm, Time txT
 {
 	NS_ASSERT_MSG(channel < m_upstreamChannelsAmount, "Selected upstream channel is out of range.");
 
-	if (m_upstreamChannelState[channel] != kIdle)
+	// Collisions happen at the CMTS receiver, so they are resolved once the
+	// burst has propagated there.
+	Simulator::Schedule(cm->GetTimeDistanceToCMTS(), &Hfc::UpReceiveStart, this, channel, p, cm, txTime);
+}
+
+void
+Hfc::UpReceiveStart(uint32_t channel, Ptr<Packet> p, Ptr<CmDevice> cm, Time txTime)
+{
+	UpstreamBurst burst;
+	burst.id = m_nextBurstId++;
+	burst.end = Now() + txTime;
+	burst.collided = false;
+
+	// Only the bursts still on the wire are checked, which keeps collision
+	// resolution proportional to the overlapping bursts and not to the CMs.
+	// Minislot boundaries are rounded to the nanosecond, so bursts that just
+	// touch do not collide.
+	std::vector<UpstreamBurst> &bursts = m_upstreamBursts[channel];
+	for(std::vector<UpstreamBurst>::iterator other = bursts.begin(); other != bursts.end(); other++)
 	{
-		// TODO: busy channel handling.
+		if (other->end > Now() + NanoSeconds(1))
+		{
+			other->collided = true;
+			burst.collided = true;
+		}
 	}
+	bursts.push_back(burst);
 
 	m_upstreamChannelState[channel] = kBusy;
-	m_upstreamChannelEvent[channel] = Simulator::Schedule(txTime, &Hfc::UpTransmitEnd, this, channel, p, cm);
+	Simulator::ScheduleWithContext(m_cmts->GetNode()->GetId(), txTime, &Hfc::UpTransmitEnd, this, channel, p, cm, burst.id);
 }
 
 void
-Hfc::UpTransmitEnd(uint32_t channel, Ptr<Packet> p, Ptr<CmDevice> cm)
+Hfc::UpTransmitEnd(uint32_t channel, Ptr<Packet> p, Ptr<CmDevice> cm, uint64_t burstId)
 {
-	m_upstreamChannelState[channel] = kIdle;
-	Simulator::ScheduleWithContext(m_cmts->GetNode()->GetId(), Now(), &CmtsDevice::Receive, m_cmts, p, cm);
+	std::vector<UpstreamBurst> &bursts = m_upstreamBursts[channel];
+	bool collided = false;
+	for(std::vector<UpstreamBurst>::iterator burst = bursts.begin(); burst != bursts.end(); burst++)
+	{
+		if (burst->id == burstId)
+		{
+			collided = burst->collided;
+			*burst = bursts.back();
+			bursts.pop_back();
+			break;
+		}
+	}
+
+	if (bursts.empty())
+		m_upstreamChannelState[channel] = kIdle;
+
+	if (collided)
+	{
+		m_upstreamCollisionTrace(p, channel);
+		return;
+	}
+
+	if (m_upstreamErrorModel && IsCorrupt(kUpstream, channel, cm->GetHandle(), p, Now() - GetUpstreamTxTime(channel, p->GetSize(), cm->GetHandle())))
+	{
+		m_upstreamCorruptTrace(p, channel);
+		return;
+	}
+
+	m_cmts->Receive(p, cm, channel);
 }
 
 void
-Hfc::DownTransmitStart(uint32_t channel, Ptr<Packet> p, Ptr<CmDevice> cm, Time txTime)
+Hfc::DownTransmitStart(uint32_t channel, Ptr<Packet> p, Ptr<CmDevice> cm, Time txTime, uint32_t group)
 {
 	NS_ASSERT_MSG(channel < m_downstreamChannelsAmount, "Selected downstream channel is out of range.");
 
@@ -196,14 +606,215 @@ Hfc::DownTransmitStart(uint32_t channel, Ptr<Packet> p, Ptr<CmDevice> cm, Time t
 	}
 
 	m_downstreamChannelState[channel] = kBusy;
-	m_downstreamChannelEvent[channel] = Simulator::Schedule(txTime, &Hfc::DownTransmitEnd, this, channel, p, cm);
+	m_downstreamChannelEvent[channel] = Simulator::Schedule(txTime, &Hfc::DownTransmitEnd, this, channel, p, cm, group);
 }
 
 void
-Hfc::DownTransmitEnd(uint32_t channel, Ptr<Packet> p, Ptr<CmDevice> cm)
+Hfc::DownTransmitEnd(uint32_t channel, Ptr<Packet> p, Ptr<CmDevice> cm, uint32_t group)
 {
 	m_downstreamChannelState[channel] = kIdle;
-	Simulator::ScheduleWithContext(cm->GetNode()->GetId(), Now(), &CmDevice::Receive, cm, p, channel);
+
+	// A null destination means the frame is broadcast to the group.
+	if (cm)
+	{
+		if (m_downstreamErrorModel && IsCorrupt(kDownstream, channel, cm->GetHandle(), p, Now()))
+		{
+			m_downstreamCorruptTrace(p, channel);
+			return;
+		}
+		Simulator::ScheduleWithContext(cm->GetNode()->GetId(), cm->GetTimeDistanceToCMTS(), &CmDevice::Receive, cm, p, channel, (ParsedMAP *) 0);
+		return;
+	}
+
+	// Every receiver shares the one packet, and windows with nobody in the
+	// group take no event at all. A window is delivered in the context of
+	// its first CM, since ns-3 can only switch context with an event: the
+	// CMs schedule their own events with the context of their node, and a
+	// data frame only takes an event of its own to reach the stack of a
+	// node other than the first (see CmDevice::ProcessData). MAPs, the bulk
+	// of the broadcasts, take none.
+	Ptr<DeliveryPlan> plan = GetDeliveryPlan();
+	for (uint32_t window = 0; window + 1 < plan->windows.size(); window++)
+	{
+		uint32_t first = plan->windows[window];
+		uint32_t end = plan->windows[window + 1];
+		uint32_t i = first;
+		while (i < end && !InGroup(group, plan->handles[i]))
+			i++;
+		if (i == end) continue;
+
+		Simulator::ScheduleWithContext(plan->cms[i]->GetNode()->GetId(), plan->delays[window], &Hfc::DeliverWindow, this,
+		                               channel, p, plan, window, group);
+	}
+}
+
+void
+Hfc::DeliverWindow(uint32_t channel, Ptr<const Packet> p, Ptr<DeliveryPlan> plan, uint32_t window, uint32_t group)
+{
+	// Filled by the first CM, if the frame is a MAP.
+	ParsedMAP map;
+	for (uint32_t i = plan->windows[window]; i < plan->windows[window + 1]; i++)
+	{
+		// The CM may have left since the frame went out.
+		uint32_t handle = plan->handles[i];
+		if (handle >= m_cms.size() || m_cms[handle] != plan->cms[i] || !InGroup(group, handle))
+			continue;
+		if (m_downstreamErrorModel && IsCorrupt(kDownstream, channel, handle, p, Now()))
+		{
+			m_downstreamCorruptTrace(p, channel);
+			continue;
+		}
+		plan->cms[i]->Receive(p, channel, &map);
+	}
+}
+
+Ptr<Hfc::DeliveryPlan>
+Hfc::GetDeliveryPlan()
+{
+	if (m_deliveryPlan)
+		return m_deliveryPlan;
+
+	std::vector< std::pair<Time, uint32_t> > order;
+	order.reserve(m_cms.size() - m_freeHandles.size());
+	for (uint32_t handle = 0; handle < m_cms.size(); handle++)
+	{
+		if (m_cms[handle])
+			order.push_back(std::make_pair(m_cms[handle]->GetTimeDistanceToCMTS(), handle));
+	}
+	std::sort(order.begin(), order.end());
+
+	m_deliveryPlan = Create<DeliveryPlan> ();
+	m_deliveryPlan->cms.reserve(order.size());
+	m_deliveryPlan->handles.reserve(order.size());
+	Time windowStart;
+	for (uint32_t i = 0; i < order.size(); i++)
+	{
+		if (i == 0 || order[i].first > windowStart + m_broadcastGranularity)
+		{
+			windowStart = order[i].first;
+			m_deliveryPlan->windows.push_back(i);
+			m_deliveryPlan->delays.push_back(windowStart);
+		}
+		m_deliveryPlan->delays.back() = order[i].first;
+		m_deliveryPlan->cms.push_back(m_cms[order[i].second]);
+		m_deliveryPlan->handles.push_back(order[i].second);
+	}
+	m_deliveryPlan->windows.push_back(order.size());
+
+	return m_deliveryPlan;
+}
+
+void
+Hfc::SetUpstreamErrorModel(Ptr<ErrorModel> model)
+{
+	m_upstreamErrorModel = model;
+	m_upstreamCer = DynamicCast<DocsisCodewordErrorModel> (model);
+}
+
+Ptr<ErrorModel>
+Hfc::GetUpstreamErrorModel(void) const
+{
+	return m_upstreamErrorModel;
+}
+
+void
+Hfc::SetDownstreamErrorModel(Ptr<ErrorModel> model)
+{
+	m_downstreamErrorModel = model;
+	m_downstreamCer = DynamicCast<DocsisCodewordErrorModel> (model);
+}
+
+Ptr<ErrorModel>
+Hfc::GetDownstreamErrorModel(void) const
+{
+	return m_downstreamErrorModel;
+}
+
+void
+Hfc::SetCmSnr(Ptr<CmDevice> cm, DocsisChannelDirection direction, uint32_t channel, double snr)
+{
+	NS_ASSERT_MSG(channel < m_cmSnr[direction].size(), "Selected channel is out of range.");
+	uint32_t handle = cm->GetHandle();
+	NS_ASSERT_MSG(handle < m_cms.size() && m_cms[handle] == cm, "The CM is not attached to the channel.");
+
+	std::vector<double> &snrs = m_cmSnr[direction][channel];
+	if (snrs.size() <= handle)
+		snrs.resize(handle + 1, kNoSnr);
+	snrs[handle] = snr;
+}
+
+double
+Hfc::GetCmSnr(uint32_t handle, DocsisChannelDirection direction, uint32_t channel) const
+{
+	const std::vector<double> &snrs = m_cmSnr[direction][channel];
+	if (handle < snrs.size() && snrs[handle] != kNoSnr)
+		return snrs[handle];
+	return direction == kUpstream ? m_upstreamSnr : m_downstreamSnr;
+}
+
+void
+Hfc::SetUpstreamBurstNoise(uint32_t channel, double burstsPerSecond, Time meanDuration, double depth)
+{
+	NS_ASSERT_MSG(channel < m_upstreamChannelsAmount, "Selected upstream channel is out of range.");
+
+	BurstNoise &noise = m_burstNoise[channel];
+	noise.rate = burstsPerSecond;
+	noise.meanDuration = meanDuration;
+	noise.depth = depth;
+	noise.start = noise.end = Now();
+	// Created on demand so that plants without noise take no stream.
+	if (!m_noiseRng)
+		m_noiseRng = CreateObject<UniformRandomVariable> ();
+}
+
+int64_t
+Hfc::AssignStreams(int64_t stream)
+{
+	if (!m_noiseRng)
+		m_noiseRng = CreateObject<UniformRandomVariable> ();
+	int64_t currentStream = stream;
+	m_noiseRng->SetStream(currentStream++);
+	if (m_upstreamCer)
+		currentStream += m_upstreamCer->AssignStreams(currentStream);
+	if (m_downstreamCer)
+		currentStream += m_downstreamCer->AssignStreams(currentStream);
+	return currentStream - stream;
+}
+
+bool
+Hfc::IsCorrupt(DocsisChannelDirection direction, uint32_t channel, uint32_t handle, Ptr<const Packet> p, Time start)
+{
+	Ptr<DocsisCodewordErrorModel> cer = direction == kUpstream ? m_upstreamCer : m_downstreamCer;
+	if (cer)
+	{
+		double snr = GetCmSnr(handle, direction, channel);
+		if (direction == kUpstream)
+			snr -= GetBurstNoiseDepth(channel, start, Now());
+		cer->SetReception(GetRate(direction, channel, handle).modulationOrder, snr);
+		return cer->IsCorrupt(p->GetSize());
+	}
+
+	// Other error models decide without the reception conditions, and may
+	// change the frame they are handed, so they get a copy of it.
+	return (direction == kUpstream ? m_upstreamErrorModel : m_downstreamErrorModel)->IsCorrupt(p->Copy());
+}
+
+double
+Hfc::GetBurstNoiseDepth(uint32_t channel, Time start, Time end)
+{
+	BurstNoise &noise = m_burstNoise[channel];
+	if (noise.rate <= 0)
+		return 0;
+
+	// The bursts are drawn as the frames reach them, so the noise takes no
+	// events. Frames come in time order, and the noise that ended before
+	// one started is of no use to the next.
+	while (noise.end <= start)
+	{
+		noise.start = noise.end + Seconds(-std::log(1 - m_noiseRng->GetValue()) / noise.rate);
+		noise.end = noise.start + Seconds(-std::log(1 - m_noiseRng->GetValue()) * noise.meanDuration.GetSeconds());
+	}
+	return noise.start < end ? noise.depth : 0;
 }
 
 DocsisChannelStatus
@@ -27,16 +27,55 @@
 #include "ns3/event-id.h"
 #include "ns3/packet.h"
 #include "ns3/address.h"
-#include <list>
+#include "ns3/traced-callback.h"
+#include "ns3/nstime.h"
+#include "ns3/simple-ref-count.h"
+#include "ns3/error-model.h"
+#include "ns3/random-variable-stream.h"
+#include <vector>
 
 namespace ns3 {
 
 class CmDevice;
 class CmtsDevice;
+class DocsisCodewordErrorModel;
 
 class Hfc : public Channel
 {
 public:
+	// What a channel is configured with. The effective data rate is the raw
+	// symbol rate times the bits per symbol, less the FEC overhead.
+	struct PhyProfile
+	{
+		PhyProfile() : modulationOrder(64), symbolRate(5120000), fecOverhead(0.1), minislotSize(16), preamble(8) {}
+		PhyProfile(uint32_t order, double symbols, double fec, uint32_t minislot, uint32_t preambleBytes) :
+			modulationOrder(order), symbolRate(symbols), fecOverhead(fec), minislotSize(minislot), preamble(preambleBytes) {}
+		uint32_t modulationOrder;	// Constellation points, 64 for 64-QAM
+		double symbolRate;	// Symbols per second
+		double fecOverhead;	// Fraction of the raw rate spent on FEC and framing
+		uint32_t minislotSize;	// Bytes, upstream only
+		uint32_t preamble;	// Bytes of PHY overhead on every burst or frame
+	};
+
+	// A DOCSIS 3.1 OFDM downstream or OFDMA upstream channel. Subcarriers are
+	// grouped in minislots that share a bit loading, and every modulation
+	// profile gives the bits per subcarrier of each minislot, 0 for those it
+	// leaves out. Profile 0 is profile A: broadcasts, MAPs, contention and
+	// the CMs not given another profile use it, so it should be the most
+	// robust one. Frames are sent at the rate of their CM's profile, and
+	// upstream minislots carry as many bytes as that rate fits in them.
+	struct OfdmChannel
+	{
+		OfdmChannel() : subcarrierSpacing(50000), cyclicPrefix(NanoSeconds(1250)), subcarriersPerMinislot(8), symbolsPerFrame(6),
+		                fecOverhead(0.12), preamble(0) {}
+		double subcarrierSpacing;	// Hz, 25 kHz or 50 kHz
+		Time cyclicPrefix;
+		uint32_t subcarriersPerMinislot;	// 8 at 50 kHz, 16 at 25 kHz
+		uint32_t symbolsPerFrame;	// Upstream, the symbols a minislot spans
+		double fecOverhead;	// Fraction of the raw rate spent on LDPC, pilots and framing
+		uint32_t preamble;	// Bytes of PHY overhead on every burst or frame
+		std::vector< std::vector<uint8_t> > profiles;	// By profile, bits per subcarrier of every minislot
+	};
 
 	static TypeId GetTypeId (void);
 	Hfc ();
@@ -45,15 +84,54 @@ public:
 	Ptr<NetDevice> GetDevice (uint32_t i ) const;
 	uint32_t GetNDevices (void) const;
 
-	void Attach(Ptr<CmDevice> device);
+	// Handles index the attached CMs and stay the same until the CM leaves
+	// the channel. A freed handle may be given to the next CM that attaches.
+	static const uint32_t kNoHandle = 0xFFFFFFFF;
+
+	uint32_t Attach(Ptr<CmDevice> device);
 	void Attach(Ptr<CmtsDevice> device);
 	void Deattach(Ptr<CmDevice> device);
 	void Deattach(Ptr<CmtsDevice> device);
+	// Makes room for that many more CMs, so attaching them in bulk does not
+	// grow the per-handle state one CM at a time.
+	void ReserveCms(uint32_t cms);
+
+	// Broadcast audiences, one bit per CM handle. kAllCms holds every
+	// attached CM and needs no joining.
+	static const uint32_t kAllCms = 0;
+
+	uint32_t CreateGroup();
+	void JoinGroup(uint32_t group, uint32_t handle);
+	void LeaveGroup(uint32_t group, uint32_t handle);
 
 	void CmChangedAddress(Ptr<CmDevice> device, Address old_address);
+	void CmChangedTimeDistance(Ptr<CmDevice> device);
+	void CmChangedServiceFlows(Ptr<CmDevice> device);
 
-	DataRate GetUpstreamDataRate(int channel);
-	DataRate GetDownstreamDataRate(int channel);
+	// Rates and tx times are those of the modulation profile the CM with
+	// the handle is on, profile A without a handle.
+	DataRate GetUpstreamDataRate(int channel, uint32_t handle = kNoHandle);
+	DataRate GetDownstreamDataRate(int channel, uint32_t handle = kNoHandle);
+	uint32_t GetUpstreamPhyOverhead(uint32_t channel);
+	uint32_t GetDownstreamPhyOverhead(uint32_t channel);
+	uint32_t GetUpstreamMinislotSize(uint32_t channel, uint32_t handle = kNoHandle);
+	Time GetUpstreamTxTime(uint32_t channel, uint32_t bytes, uint32_t handle = kNoHandle);
+	Time GetDownstreamTxTime(uint32_t channel, uint32_t bytes, uint32_t handle = kNoHandle);
+
+	// An OFDM channel reports the PhyProfile of its profile A, with the
+	// OFDM symbol rate.
+	PhyProfile GetUpstreamPhyProfile(uint32_t channel);
+	PhyProfile GetDownstreamPhyProfile(uint32_t channel);
+	void SetUpstreamPhyProfile(uint32_t channel, PhyProfile profile);
+	void SetDownstreamPhyProfile(uint32_t channel, PhyProfile profile);
+	void SetUpstreamOfdmChannel(uint32_t channel, const OfdmChannel &ofdm);
+	void SetDownstreamOfdmChannel(uint32_t channel, const OfdmChannel &ofdm);
+	uint32_t GetProfilesAmount(DocsisChannelDirection direction, uint32_t channel) const;
+
+	// Every CM starts on profile A of every channel, and goes back to it
+	// when the channel is configured again.
+	void SetCmProfile(Ptr<CmDevice> cm, DocsisChannelDirection direction, uint32_t channel, uint32_t profile);
+	uint32_t GetCmProfile(uint32_t handle, DocsisChannelDirection direction, uint32_t channel) const;
 
 	uint32_t GetUpstreamChannelsAmount();
 	uint32_t GetDownstreamChannelsAmount();
@@ -62,23 +140,114 @@ public:
 
 
 	void UpTransmitStart(uint32_t channel, Ptr<Packet> p, Ptr<CmDevice> cm, Time txTime);
-	void UpTransmitEnd(uint32_t channel, Ptr<Packet> p, Ptr<CmDevice> cm);
-	void DownTransmitStart(uint32_t channel, Ptr<Packet> p, Ptr<CmDevice> cm, Time txTime);
-	void DownTransmitEnd(uint32_t channel, Ptr<Packet> p, Ptr<CmDevice> cm);
+	void UpTransmitEnd(uint32_t channel, Ptr<Packet> p, Ptr<CmDevice> cm, uint64_t burstId);
+	void DownTransmitStart(uint32_t channel, Ptr<Packet> p, Ptr<CmDevice> cm, Time txTime, uint32_t group = kAllCms);
+	void DownTransmitEnd(uint32_t channel, Ptr<Packet> p, Ptr<CmDevice> cm, uint32_t group);
 
 	DocsisChannelStatus GetUpstreamChannelStatus(uint32_t channel);
 	DocsisChannelStatus GetDownstreamChannelStatus(uint32_t channel);
 
+	// RF impairments. Frames that survive the collisions go through the
+	// error model of their direction, if any. A DocsisCodewordErrorModel is
+	// told the modulation of the channel and the SNR of the CM on it, which
+	// is the UpstreamSnr or DownstreamSnr attribute unless the CM was given
+	// its own. Upstream burst noise takes its depth off the SNR of every
+	// burst it overlaps.
+	void SetUpstreamErrorModel(Ptr<ErrorModel> model);
+	Ptr<ErrorModel> GetUpstreamErrorModel(void) const;
+	void SetDownstreamErrorModel(Ptr<ErrorModel> model);
+	Ptr<ErrorModel> GetDownstreamErrorModel(void) const;
+	void SetCmSnr(Ptr<CmDevice> cm, DocsisChannelDirection direction, uint32_t channel, double snr);
+	double GetCmSnr(uint32_t handle, DocsisChannelDirection direction, uint32_t channel) const;
+	// Bursts arrive as a Poisson process, with exponential durations.
+	void SetUpstreamBurstNoise(uint32_t channel, double burstsPerSecond, Time meanDuration, double depth);
+	int64_t AssignStreams(int64_t stream);
+
 private:
+	struct UpstreamBurst
+	{
+		uint64_t id;
+		Time end;
+		bool collided;
+	};
+	// Derived from the profile once, since every frame needs its tx time.
+	// OFDM channels have one per modulation profile.
+	struct ChannelRate
+	{
+		ChannelRate() : dataRate(0), secondsPerByte(0), minislotSize(0), modulationOrder(0) {}
+		DataRate dataRate;
+		double secondsPerByte;
+		uint32_t minislotSize;	// Upstream, bytes a minislot carries
+		uint32_t modulationOrder;	// Of the most loaded subcarriers
+	};
+
+	struct BurstNoise
+	{
+		BurstNoise() : rate(0), depth(0) {}
+		double rate;	// Bursts per second, 0 for none
+		Time meanDuration;
+		double depth;	// dB
+		Time start;	// Of the burst in course or the next one
+		Time end;
+	};
+
+	// The attached CMs sorted by distance and cut in windows no wider than
+	// the broadcast granularity, so a broadcast takes one event per window
+	// instead of one per CM. Dropped when a CM comes, goes or moves and
+	// rebuilt by the next broadcast, so CMs attached in bulk build it once;
+	// deliveries already scheduled keep the plan they were made with.
+	struct DeliveryPlan : public SimpleRefCount<DeliveryPlan>
+	{
+		std::vector< Ptr<CmDevice> > cms;
+		std::vector<uint32_t> handles;
+		std::vector<uint32_t> windows;	// First CM of each window, then cms.size()
+		std::vector<Time> delays;	// Per window, the largest delay in it
+	};
+
+	static ChannelRate ComputeRate(const PhyProfile &profile);
+	static std::vector<ChannelRate> ComputeOfdmRates(const OfdmChannel &ofdm, bool upstream);
+	const ChannelRate &GetRate(DocsisChannelDirection direction, uint32_t channel, uint32_t handle) const;
+	Ptr<DeliveryPlan> GetDeliveryPlan();
+	bool InGroup(uint32_t group, uint32_t handle) const;
+	void DeliverWindow(uint32_t channel, Ptr<const Packet> p, Ptr<DeliveryPlan> plan, uint32_t window, uint32_t group);
+
+	void UpReceiveStart(uint32_t channel, Ptr<Packet> p, Ptr<CmDevice> cm, Time txTime);
+	bool IsCorrupt(DocsisChannelDirection direction, uint32_t channel, uint32_t handle, Ptr<const Packet> p, Time start);
+	double GetBurstNoiseDepth(uint32_t channel, Time start, Time end);
+
 	Ptr<CmtsDevice> m_cmts;
-	std::list< Ptr<CmDevice> > m_cmList;
+	std::vector< Ptr<CmDevice> > m_cms;	// Indexed by handle, null when the handle is free
+	std::vector<uint32_t> m_freeHandles;
+	std::vector< std::vector<bool> > m_groups;	// Indexed by group, then by handle
+	Ptr<DeliveryPlan> m_deliveryPlan;
+	Time m_broadcastGranularity;
 	uint32_t m_upstreamChannelsAmount;
 	uint32_t m_downstreamChannelsAmount;
-	DataRate m_stubDataRate;
+	std::vector<PhyProfile> m_upstreamProfiles;
+	std::vector<PhyProfile> m_downstreamProfiles;
+	std::vector< std::vector<ChannelRate> > m_upstreamRates;	// By channel, then by modulation profile
+	std::vector< std::vector<ChannelRate> > m_downstreamRates;
+	std::vector< std::vector<uint8_t> > m_cmProfile[ChannelDirectionCount];	// By channel, then by handle
 	DocsisChannelStatus *m_upstreamChannelState;
 	DocsisChannelStatus *m_downstreamChannelState;
 	EventId *m_upstreamChannelEvent;
 	EventId *m_downstreamChannelEvent;
+	std::vector< std::vector<UpstreamBurst> > m_upstreamBursts;
+	uint64_t m_nextBurstId;
+
+	Ptr<ErrorModel> m_upstreamErrorModel;
+	Ptr<ErrorModel> m_downstreamErrorModel;
+	Ptr<DocsisCodewordErrorModel> m_upstreamCer;	// The error models, when they are codeword error models
+	Ptr<DocsisCodewordErrorModel> m_downstreamCer;
+	double m_upstreamSnr;	// dB
+	double m_downstreamSnr;
+	std::vector< std::vector<double> > m_cmSnr[ChannelDirectionCount];	// By channel, then by handle, kNoSnr when not given
+	std::vector<BurstNoise> m_burstNoise;	// Per upstream channel
+	Ptr<UniformRandomVariable> m_noiseRng;
+
+	TracedCallback< Ptr<const Packet>, uint32_t > m_upstreamCollisionTrace;
+	TracedCallback< Ptr<const Packet>, uint32_t > m_upstreamCorruptTrace;
+	TracedCallback< Ptr<const Packet>, uint32_t > m_downstreamCorruptTrace;
 };
 
 }
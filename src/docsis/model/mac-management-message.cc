@@ -18,6 +18,7 @@
  * Author: Martín Javier Di Liscia
  */
 
+#include <algorithm>
 #include "ns3/log.h"
 #include "mac-management-message.h"
 
@@ -35,13 +36,13 @@ namespace ns3 {
     start.Read (buffer, 6);
     m_sourceAddress.CopyFrom (buffer);
 
-    m_length = start.ReadU16();
-    start.ReadU16(); start.ReadU8();
+    m_length = start.ReadNtohU16();
+    start.ReadNtohU16(); start.ReadU8();
     m_version = start.ReadU8();
     m_type = (MmmType)start.ReadU8();
     start.ReadU8();
 
-    return 18;
+    return 20;
   }
 
   uint32_t MacManagementMessageHeader::GetSerializedSize (void) const {
@@ -61,8 +62,8 @@ namespace ns3 {
     m_sourceAddress.CopyTo (buffer);
     start.Write (buffer, 6);
 
-    start.WriteU16(m_length);
-    start.WriteU16(0x0000); // DSAP & SSAP
+    start.WriteHtonU16(m_length);
+    start.WriteHtonU16(0x0000); // DSAP & SSAP
     start.WriteU8(0x03);	// Control
     start.WriteU8(m_version);
     start.WriteU8((uint8_t)m_type);
@@ -82,6 +83,15 @@ namespace ns3 {
     return GetTypeId();
   }
 
+  void MacManagementMessageHeader::Setup(Mac48Address source, Mac48Address destination, uint16_t length, MmmType type)
+  {
+    m_sourceAddress = source;
+    m_destinationAddress = destination;
+    m_length = length;
+    m_version = 1;
+    m_type = type;
+  }
+
   bool MacManagementMessageHeader::IsMAPPacket(void) const
   {
     return m_type == kMAP;
@@ -89,42 +99,271 @@ namespace ns3 {
 
   bool MacManagementMessageHeader::IsValidDestination(Mac48Address address) const
   {
-    return address == m_destinationAddress;
+    return address == m_destinationAddress || m_destinationAddress.IsBroadcast ();
+  }
+
+  MacManagementMessageHeader::MmmType MacManagementMessageHeader::GetType(void) const
+  {
+    return m_type;
+  }
+
+  Mac48Address MacManagementMessageHeader::GetSource(void) const
+  {
+    return m_sourceAddress;
+  }
+
+  // ************* RangingRequestHeader *****************************
+  RangingRequestHeader::RangingRequestHeader () : m_sid(0), m_downstreamChannelId(0)
+  {
+  }
+
+  uint32_t RangingRequestHeader::Deserialize (Buffer::Iterator start) {
+    m_sid = start.ReadNtohU16();
+    m_downstreamChannelId = start.ReadU8();
+    start.ReadU8();
+
+    return 4;
+  }
+
+  uint32_t RangingRequestHeader::GetSerializedSize (void) const {
+    return 4;
+  }
+
+  void RangingRequestHeader::Print (std::ostream &os) const {
+    os << "sid=" << m_sid;
+  }
+
+  void RangingRequestHeader::Serialize (Buffer::Iterator start) const {
+    start.WriteHtonU16(m_sid);
+    start.WriteU8(m_downstreamChannelId);
+    start.WriteU8(0);	// Pending till complete
+  }
+
+  TypeId RangingRequestHeader::GetTypeId (void) {
+    static TypeId tid = TypeId ("ns3::RangingRequestHeader")
+        .SetParent<Header> ()
+        .AddConstructor<RangingRequestHeader> ();
+
+    return tid;
+  }
+
+  TypeId RangingRequestHeader::GetInstanceTypeId (void) const
+  {
+    return GetTypeId();
+  }
+
+  void RangingRequestHeader::SetSid(uint16_t sid)
+  {
+    m_sid = sid;
+  }
+
+  uint16_t RangingRequestHeader::GetSid(void) const
+  {
+    return m_sid;
+  }
+
+  // ************* RangingResponseHeader ****************************
+  RangingResponseHeader::RangingResponseHeader () : m_sid(0), m_ucId(0), m_status(kContinue), m_timingAdjust(0)
+  {
+  }
+
+  uint32_t RangingResponseHeader::Deserialize (Buffer::Iterator start) {
+    m_sid = start.ReadNtohU16();
+    m_ucId = start.ReadU8();
+    m_status = (RangingStatus)start.ReadU8();
+    m_timingAdjust = (int32_t)start.ReadNtohU32();
+
+    return 8;
+  }
+
+  uint32_t RangingResponseHeader::GetSerializedSize (void) const {
+    return 8;
+  }
+
+  void RangingResponseHeader::Print (std::ostream &os) const {
+    os << "sid=" << m_sid << " status=" << (uint32_t)m_status << " adjust=" << m_timingAdjust << "ns";
+  }
+
+  void RangingResponseHeader::Serialize (Buffer::Iterator start) const {
+    start.WriteHtonU16(m_sid);
+    start.WriteU8(m_ucId);
+    start.WriteU8((uint8_t)m_status);
+    start.WriteHtonU32((uint32_t)m_timingAdjust);
+  }
+
+  TypeId RangingResponseHeader::GetTypeId (void) {
+    static TypeId tid = TypeId ("ns3::RangingResponseHeader")
+        .SetParent<Header> ()
+        .AddConstructor<RangingResponseHeader> ();
+
+    return tid;
+  }
+
+  TypeId RangingResponseHeader::GetInstanceTypeId (void) const
+  {
+    return GetTypeId();
+  }
+
+  void RangingResponseHeader::Setup(uint16_t sid, uint8_t ucId, int32_t timingAdjust, RangingStatus status)
+  {
+    m_sid = sid;
+    m_ucId = ucId;
+    m_timingAdjust = timingAdjust;
+    m_status = status;
+  }
+
+  uint16_t RangingResponseHeader::GetSid(void) const
+  {
+    return m_sid;
+  }
+
+  int32_t RangingResponseHeader::GetTimingAdjust(void) const
+  {
+    return m_timingAdjust;
+  }
+
+  RangingResponseHeader::RangingStatus RangingResponseHeader::GetStatus(void) const
+  {
+    return m_status;
+  }
+
+  // ************* RegistrationRequestHeader ************************
+  RegistrationRequestHeader::RegistrationRequestHeader () : m_sid(0)
+  {
+  }
+
+  uint32_t RegistrationRequestHeader::Deserialize (Buffer::Iterator start) {
+    m_sid = start.ReadNtohU16();
+    return 2;
+  }
+
+  uint32_t RegistrationRequestHeader::GetSerializedSize (void) const {
+    return 2;
+  }
+
+  void RegistrationRequestHeader::Print (std::ostream &os) const {
+    os << "sid=" << m_sid;
+  }
+
+  void RegistrationRequestHeader::Serialize (Buffer::Iterator start) const {
+    start.WriteHtonU16(m_sid);
+  }
+
+  TypeId RegistrationRequestHeader::GetTypeId (void) {
+    static TypeId tid = TypeId ("ns3::RegistrationRequestHeader")
+        .SetParent<Header> ()
+        .AddConstructor<RegistrationRequestHeader> ();
+
+    return tid;
+  }
+
+  TypeId RegistrationRequestHeader::GetInstanceTypeId (void) const
+  {
+    return GetTypeId();
+  }
+
+  void RegistrationRequestHeader::SetSid(uint16_t sid)
+  {
+    m_sid = sid;
+  }
+
+  uint16_t RegistrationRequestHeader::GetSid(void) const
+  {
+    return m_sid;
+  }
+
+  // ************* RegistrationResponseHeader ***********************
+  RegistrationResponseHeader::RegistrationResponseHeader () : m_sid(0), m_response(0)
+  {
+  }
+
+  uint32_t RegistrationResponseHeader::Deserialize (Buffer::Iterator start) {
+    m_sid = start.ReadNtohU16();
+    m_response = start.ReadU8();
+    return 3;
+  }
+
+  uint32_t RegistrationResponseHeader::GetSerializedSize (void) const {
+    return 3;
+  }
+
+  void RegistrationResponseHeader::Print (std::ostream &os) const {
+    os << "sid=" << m_sid << " response=" << (uint32_t)m_response;
+  }
+
+  void RegistrationResponseHeader::Serialize (Buffer::Iterator start) const {
+    start.WriteHtonU16(m_sid);
+    start.WriteU8(m_response);
+  }
+
+  TypeId RegistrationResponseHeader::GetTypeId (void) {
+    static TypeId tid = TypeId ("ns3::RegistrationResponseHeader")
+        .SetParent<Header> ()
+        .AddConstructor<RegistrationResponseHeader> ();
+
+    return tid;
+  }
+
+  TypeId RegistrationResponseHeader::GetInstanceTypeId (void) const
+  {
+    return GetTypeId();
+  }
+
+  void RegistrationResponseHeader::Setup(uint16_t sid, uint8_t response)
+  {
+    m_sid = sid;
+    m_response = response;
+  }
+
+  uint16_t RegistrationResponseHeader::GetSid(void) const
+  {
+    return m_sid;
+  }
+
+  uint8_t RegistrationResponseHeader::GetResponse(void) const
+  {
+    return m_response;
   }
 
   // ************* MAPHeader ****************************************
+  MAPHeader::MAPHeader () : m_ucId(0), m_ucdCount(0), m_startTime(0), m_ackTime(0), m_rangingStart(0), m_rangingEnd(0),
+                            m_dataStart(0), m_dataEnd(0), m_ieCount(0), m_nullIndex(MAX_INFORMATION_ELEMENTS)
+  {
+  }
+
   uint32_t MAPHeader::Deserialize (Buffer::Iterator start) {
     m_ucId = start.ReadU8();
     m_ucdCount = start.ReadU8();
     uint8_t elementCount = start.ReadU8();
     start.ReadU8();
 
-    m_startTime = start.ReadU32();
-    m_ackTime = start.ReadU32();
+    m_startTime = start.ReadNtohU32();
+    m_ackTime = start.ReadNtohU32();
 
     m_rangingStart = start.ReadU8();
     m_rangingEnd = start.ReadU8();
     m_dataStart = start.ReadU8();
     m_dataEnd = start.ReadU8();
 
-    m_ies.clear();
+    m_ieCount = 0;
+    m_nullIndex = MAX_INFORMATION_ELEMENTS;
     for(uint8_t i=0; i < elementCount; i++) {
         InformationElement ie;
-        ie.m_sid = start.ReadU16();
-        ie.m_offset = start.ReadU16();
+        ie.m_sid = start.ReadNtohU16();
+        ie.m_offset = start.ReadNtohU16();
 
         ie.m_type = (IEType)( ((ie.m_sid & 0x3)<<2) + (ie.m_offset>>14) );
         ie.m_sid = ie.m_sid>>2;
         ie.m_offset &= 0x3FFF;
 
-        m_ies.push_back(ie);
+        AddIE(ie);
       }
 
     return 16 + elementCount*4;
   }
 
   uint32_t MAPHeader::GetSerializedSize (void) const {
-    return 16 + m_ies.size()*4;
+    return 16 + m_ieCount*4;
   }
 
   void MAPHeader::Print (std::ostream &os) const {
@@ -134,20 +373,20 @@ namespace ns3 {
   void MAPHeader::Serialize (Buffer::Iterator start) const {
     start.WriteU8(m_ucId);
     start.WriteU8(m_ucdCount);
-    start.WriteU8((uint8_t)m_ies.size ());
+    start.WriteU8((uint8_t)m_ieCount);
     start.WriteU8(0);
 
-    start.WriteU32(m_startTime);
-    start.WriteU32(m_ackTime);
+    start.WriteHtonU32(m_startTime);
+    start.WriteHtonU32(m_ackTime);
 
     start.WriteU8(m_rangingStart);
     start.WriteU8(m_rangingEnd);
     start.WriteU8(m_dataStart);
     start.WriteU8(m_dataEnd);
 
-    for(InfoElementIterator ie=m_ies.begin(); ie != m_ies.end(); ie++) {
-        start.WriteU16( (ie->m_sid<<2) + ((uint8_t)(ie->m_type)>>2) );
-        start.WriteU16( ie->m_offset + ( ((uint8_t)(ie->m_type)&0x03) << 14) );
+    for(InfoElementIterator ie=InfoElementBegin(); ie != InfoElementEnd(); ie++) {
+        start.WriteHtonU16( (ie->m_sid<<2) + ((uint8_t)(ie->m_type)>>2) );
+        start.WriteHtonU16( ie->m_offset + ( ((uint8_t)(ie->m_type)&0x03) << 14) );
       }
   }
 
@@ -176,25 +415,49 @@ namespace ns3 {
     m_dataStart = dataStart;
     m_dataEnd = dataEnd;
 
-    m_ies.clear ();
+    m_ieCount = 0;
+    m_nullIndex = MAX_INFORMATION_ELEMENTS;
   }
 
   void
   MAPHeader::AddIE(InformationElement ie)
   {
-    m_ies.push_back (ie);
+    NS_ASSERT_MSG (m_ieCount < MAX_INFORMATION_ELEMENTS, "Too many information elements in a MAP.");
+    if (ie.m_type == kNull && m_nullIndex == MAX_INFORMATION_ELEMENTS)
+      m_nullIndex = m_ieCount;
+
+    m_ies[m_ieCount++] = ie;
   }
 
   MAPHeader::InfoElementIterator
   MAPHeader::InfoElementBegin() const
   {
-    return m_ies.begin ();
+    return m_ies;
   }
 
   MAPHeader::InfoElementIterator
   MAPHeader::InfoElementEnd() const
   {
-    return m_ies.end ();
+    return m_ies + m_ieCount;
+  }
+
+  uint32_t
+  MAPHeader::GetNInformationElements() const
+  {
+    return m_ieCount;
+  }
+
+  const MAPHeader::InformationElement &
+  MAPHeader::GetInformationElement(uint32_t index) const
+  {
+    NS_ASSERT (index < m_ieCount);
+    return m_ies[index];
+  }
+
+  uint32_t
+  MAPHeader::GetNullInformationElement() const
+  {
+    return m_nullIndex < m_ieCount ? m_nullIndex : m_ieCount;
   }
 
   uint8_t
@@ -209,9 +472,76 @@ namespace ns3 {
     return m_startTime;
   }
 
+  uint32_t
+  MAPHeader::GetAckTime() const
+  {
+    return m_ackTime;
+  }
+
+  uint8_t
+  MAPHeader::GetRangingBackoffStart() const
+  {
+    return m_rangingStart;
+  }
+
+  uint8_t
+  MAPHeader::GetRangingBackoffEnd() const
+  {
+    return m_rangingEnd;
+  }
+
+  uint8_t
+  MAPHeader::GetDataBackoffStart() const
+  {
+    return m_dataStart;
+  }
+
+  uint8_t
+  MAPHeader::GetDataBackoffEnd() const
+  {
+    return m_dataEnd;
+  }
+
   uint32_t
   MAPHeader::GetSlotNumber(InformationElement infoElement) const
   {
     return m_startTime + infoElement.m_offset;
   }
+
+  // ************* MAPIndex ****************************************
+  namespace {
+    struct PositionOrder
+    {
+      PositionOrder(const MAPHeader &map) : m_map(map) {}
+      bool operator() (uint8_t a, uint8_t b) const
+      {
+        uint16_t sidA = m_map.GetInformationElement (a).m_sid, sidB = m_map.GetInformationElement (b).m_sid;
+        return sidA < sidB || (sidA == sidB && a < b);
+      }
+      const MAPHeader &m_map;
+    };
+  }
+
+  MAPIndex::MAPIndex () : m_count(0)
+  {
+  }
+
+  void
+  MAPIndex::Build(const MAPHeader &map)
+  {
+    m_count = map.GetNInformationElements ();
+    for (uint32_t i = 0; i < m_count; i++)
+      m_positions[i] = i;
+    std::sort (m_positions, m_positions + m_count, PositionOrder (map));
+    for (uint32_t i = 0; i < m_count; i++)
+      m_sids[i] = map.GetInformationElement (m_positions[i]).m_sid;
+  }
+
+  void
+  MAPIndex::FindInformationElements(uint16_t sid, const uint8_t *&first, const uint8_t *&last) const
+  {
+    std::pair<const uint16_t *, const uint16_t *> range = std::equal_range (m_sids, m_sids + m_count, sid);
+    first = m_positions + (range.first - m_sids);
+    last = m_positions + (range.second - m_sids);
+  }
 }
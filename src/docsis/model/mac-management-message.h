@@ -32,6 +32,10 @@ namespace ns3 {
     enum MmmType {
       kGenericUCD = 2,
       kMAP = 3,
+      kRangingRequest = 4,
+      kRangingResponse = 5,
+      kRegistrationRequest = 6,
+      kRegistrationResponse = 7,
       kUCCRequest = 8,
       kUCCResponse = 9,
       k23UCD = 29,
@@ -48,8 +52,12 @@ namespace ns3 {
     static TypeId GetTypeId (void);
     virtual TypeId GetInstanceTypeId (void) const;
 
+    void Setup(Mac48Address source, Mac48Address destination, uint16_t length, MmmType type);
+
     bool IsMAPPacket(void) const;
     bool IsValidDestination(Mac48Address address) const;
+    MmmType GetType(void) const;
+    Mac48Address GetSource(void) const;
 
   private:
     Mac48Address m_destinationAddress;
@@ -59,8 +67,108 @@ namespace ns3 {
     MmmType m_type;
   };
 
+  // RNG-REQ, sent in initial maintenance with SID 0 until the CMTS gives
+  // the CM a temporary SID, then in station maintenance.
+  class RangingRequestHeader : public Header {
+  public:
+    RangingRequestHeader ();
+
+    virtual uint32_t Deserialize (Buffer::Iterator start);
+    virtual uint32_t GetSerializedSize (void) const;
+    virtual void Print (std::ostream &os) const;
+    virtual void Serialize (Buffer::Iterator start) const;
+
+    static TypeId GetTypeId (void);
+    virtual TypeId GetInstanceTypeId (void) const;
+
+    void SetSid(uint16_t sid);
+    uint16_t GetSid(void) const;
+
+  private:
+    uint16_t m_sid;
+    uint8_t m_downstreamChannelId;
+  };
+
+  // RNG-RSP. The timing adjust is in nanoseconds rather than in units of
+  // 1/10.24 MHz, so a ranged CM lands on the minislot grid as exactly as
+  // the collision model checks it.
+  class RangingResponseHeader : public Header {
+  public:
+    enum RangingStatus {
+      kContinue = 1,
+      kAbort = 2,
+      kSuccess = 3
+    };
+
+    RangingResponseHeader ();
+
+    virtual uint32_t Deserialize (Buffer::Iterator start);
+    virtual uint32_t GetSerializedSize (void) const;
+    virtual void Print (std::ostream &os) const;
+    virtual void Serialize (Buffer::Iterator start) const;
+
+    static TypeId GetTypeId (void);
+    virtual TypeId GetInstanceTypeId (void) const;
+
+    void Setup(uint16_t sid, uint8_t ucId, int32_t timingAdjust, RangingStatus status);
+    uint16_t GetSid(void) const;
+    int32_t GetTimingAdjust(void) const;
+    RangingStatus GetStatus(void) const;
+
+  private:
+    uint16_t m_sid;
+    uint8_t m_ucId;
+    RangingStatus m_status;
+    int32_t m_timingAdjust;	// Nanoseconds, positive to transmit earlier
+  };
+
+  // REG-REQ and REG-RSP. The configuration the CM would send is read from
+  // the CM itself, so the messages only carry the temporary SID.
+  class RegistrationRequestHeader : public Header {
+  public:
+    RegistrationRequestHeader ();
+
+    virtual uint32_t Deserialize (Buffer::Iterator start);
+    virtual uint32_t GetSerializedSize (void) const;
+    virtual void Print (std::ostream &os) const;
+    virtual void Serialize (Buffer::Iterator start) const;
+
+    static TypeId GetTypeId (void);
+    virtual TypeId GetInstanceTypeId (void) const;
+
+    void SetSid(uint16_t sid);
+    uint16_t GetSid(void) const;
+
+  private:
+    uint16_t m_sid;
+  };
+
+  class RegistrationResponseHeader : public Header {
+  public:
+    RegistrationResponseHeader ();
+
+    virtual uint32_t Deserialize (Buffer::Iterator start);
+    virtual uint32_t GetSerializedSize (void) const;
+    virtual void Print (std::ostream &os) const;
+    virtual void Serialize (Buffer::Iterator start) const;
+
+    static TypeId GetTypeId (void);
+    virtual TypeId GetInstanceTypeId (void) const;
+
+    void Setup(uint16_t sid, uint8_t response);
+    uint16_t GetSid(void) const;
+    uint8_t GetResponse(void) const;
+
+  private:
+    uint16_t m_sid;
+    uint8_t m_response;	// 0 when the registration is accepted
+  };
+
   class MAPHeader : public Header {
   public:
+    static const uint16_t BROADCAST_SID = 0x3FFF;
+    static const uint32_t MAX_INFORMATION_ELEMENTS = 255;
+
     enum IEType {
       kRequest = 0,
       kReqData,
@@ -81,8 +189,9 @@ namespace ns3 {
       uint16_t m_offset;
     };
 
-    typedef std::list<InformationElement> InfoElementList;
-    typedef std::list<InformationElement>::const_iterator InfoElementIterator;
+    typedef const InformationElement *InfoElementIterator;
+
+    MAPHeader ();
 
     virtual uint32_t Deserialize (Buffer::Iterator start);
     virtual uint32_t GetSerializedSize (void) const;
@@ -97,8 +206,16 @@ namespace ns3 {
 
     InfoElementIterator InfoElementBegin() const;
     InfoElementIterator InfoElementEnd() const;
+    uint32_t GetNInformationElements() const;
+    const InformationElement &GetInformationElement(uint32_t index) const;
+    uint32_t GetNullInformationElement() const;
     uint8_t GetUpstreamChannelId() const;
     uint32_t GetStartTime() const;
+    uint32_t GetAckTime() const;
+    uint8_t GetRangingBackoffStart() const;
+    uint8_t GetRangingBackoffEnd() const;
+    uint8_t GetDataBackoffStart() const;
+    uint8_t GetDataBackoffEnd() const;
     uint32_t GetSlotNumber(InformationElement infoElement) const;
 
   private:
@@ -111,7 +228,39 @@ namespace ns3 {
     uint8_t m_dataStart;
     uint8_t m_dataEnd;
 
-    InfoElementList m_ies;
+    // IEs live inline so building or parsing a MAP does not allocate.
+    InformationElement m_ies[MAX_INFORMATION_ELEMENTS];
+    uint32_t m_ieCount;
+    uint32_t m_nullIndex;	// MAX_INFORMATION_ELEMENTS until a null IE is added
+  };
+
+  /**
+   * The IEs of one MAP sorted by SID, then by position, so each SID finds
+   * its own without a scan. The MAP keeps its IEs in time order, as they
+   * go on the wire; the index is built once for it and only read after.
+   */
+  class MAPIndex {
+  public:
+    MAPIndex ();
+
+    void Build(const MAPHeader &map);
+    // The positions of the IEs of the SID, in MAP order.
+    void FindInformationElements(uint16_t sid, const uint8_t *&first, const uint8_t *&last) const;
+
+  private:
+    uint8_t m_positions[MAPHeader::MAX_INFORMATION_ELEMENTS];
+    uint16_t m_sids[MAPHeader::MAX_INFORMATION_ELEMENTS];	// The SID of each position above
+    uint32_t m_count;
+  };
+
+  // A MAP parsed and indexed once for every CM a broadcast reaches at the
+  // same time. Whoever delivers the broadcast owns it, so it lasts as long
+  // as that delivery and no longer.
+  struct ParsedMAP {
+    ParsedMAP () : valid(false) {}
+    bool valid;
+    MAPHeader map;
+    MAPIndex index;
   };
 }
 #endif
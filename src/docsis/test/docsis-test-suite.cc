@@ -2,16 +2,55 @@
 
 // Include a header file from your module to test.
 #include "ns3/docsis.h"
+#include "ns3/docsis-helper.h"
 
 // An essential include is test.h
 #include "ns3/test.h"
 #include "ns3/simulator.h"
+#include "ns3/enum.h"
+#include "ns3/uinteger.h"
+#include "ns3/double.h"
+#include "ns3/socket.h"
+#include "ns3/udp-socket-factory.h"
+#include "ns3/inet-socket-address.h"
+#include "ns3/drop-tail-queue.h"
+#include "ns3/ipv4-header.h"
+#include "ns3/udp-header.h"
+#include "ns3/tcp-header.h"
+#include "ns3/pcap-file.h"
+#include "ns3/trace-helper.h"
+#include <algorithm>
 
 
 // Do not put your test classes in namespace ns3.  You may find it useful
 // to use the using directive to access the ns3 namespace directly
 using namespace ns3;
 
+// Attaches a CMTS and a CM to the plant, each on a node of its own, as most
+// cases wire them. The devices and the plant are created by the case, so it
+// can configure them before they attach.
+static void
+ConnectDevices (Ptr<CmtsDevice> cmts, Ptr<CmDevice> cm, Ptr<Hfc> channel, Time distance = Time (0))
+{
+  cmts->Attach (channel);
+  cmts->SetAddress (Mac48Address::Allocate ());
+  cm->Attach (channel);
+  cm->SetAddress (Mac48Address::Allocate ());
+  cm->SetTimeDistanceToCMTS (distance);
+
+  CreateObject<Node> ()->AddDevice (cmts);
+  CreateObject<Node> ()->AddDevice (cm);
+}
+
+// Runs the simulation until the time given and tears it down.
+static void
+RunSimulation (Time stop)
+{
+  Simulator::Stop (stop);
+  Simulator::Run ();
+  Simulator::Destroy ();
+}
+
 // This is an example TestCase.
 class DocsisTestCase1 : public TestCase
 {
@@ -71,11 +110,2500 @@ DocsisTestCase1::DoRun (void)
 
 	  Simulator::Schedule (Seconds (1.0), &DocsisTestCase1::SendOnePacket, this, devA, devB->GetAddress());
 
+	  Simulator::Stop (Seconds (2.0));
 	  Simulator::Run ();
 
 	  Simulator::Destroy ();
 }
 
+// Sends packets from the CM to the CMTS, which have to go through the
+// request/grant cycle driven by the CMTS upstream scheduler.
+class DocsisUpstreamTestCase : public TestCase
+{
+public:
+  DocsisUpstreamTestCase ();
+
+private:
+  virtual void DoRun (void);
+  void SendOnePacket (Ptr<NetDevice> device, Address address);
+  bool Receive (Ptr<NetDevice> device, Ptr<const Packet> packet, uint16_t protocol, const Address &source);
+
+  uint32_t m_received;
+  Time m_sentTime;
+  Time m_delay;
+};
+
+DocsisUpstreamTestCase::DocsisUpstreamTestCase ()
+  : TestCase ("Docsis upstream request-grant cycle"), m_received (0)
+{
+}
+
+void
+DocsisUpstreamTestCase::SendOnePacket (Ptr<NetDevice> device, Address address)
+{
+  m_sentTime = Simulator::Now ();
+  Ptr<Packet> p = Create<Packet> (100);
+  device->Send (p, address, 0x800);
+}
+
+bool
+DocsisUpstreamTestCase::Receive (Ptr<NetDevice> device, Ptr<const Packet> packet, uint16_t protocol, const Address &source)
+{
+  m_received++;
+  m_delay = Simulator::Now () - m_sentTime;
+  NS_TEST_EXPECT_MSG_EQ (packet->GetSize (), 100, "Payload size changed on the way upstream");
+  NS_TEST_EXPECT_MSG_EQ (protocol, 0x800, "Protocol number lost on the way upstream");
+  return true;
+}
+
+void
+DocsisUpstreamTestCase::DoRun (void)
+{
+  Ptr<CmtsDevice> cmts = CreateObject<CmtsDevice> ();
+  Ptr<CmDevice> cm = CreateObject<CmDevice> ();
+  Ptr<Hfc> channel = CreateObject<Hfc> ();
+
+  ConnectDevices (cmts, cm, channel, MicroSeconds (100));
+  cmts->SetReceiveCallback (MakeCallback (&DocsisUpstreamTestCase::Receive, this));
+
+  Simulator::Schedule (Seconds (1.0), &DocsisUpstreamTestCase::SendOnePacket, this, cm, cmts->GetAddress ());
+  Simulator::Schedule (Seconds (1.5), &DocsisUpstreamTestCase::SendOnePacket, this, cm, cmts->GetAddress ());
+
+  RunSimulation (Seconds (2.0));
+
+  NS_TEST_ASSERT_MSG_EQ (m_received, 2, "Upstream packets were not delivered");
+  // A request has to reach the CMTS and a MAP carrying the grant has to come
+  // back, so the delay spans at least one MAP interval.
+  NS_TEST_ASSERT_MSG_GT (m_delay, MilliSeconds (2), "Packet skipped the request/grant cycle");
+  NS_TEST_ASSERT_MSG_LT (m_delay, MilliSeconds (20), "Request/grant cycle took too long");
+}
+
+// Many CMs request bandwidth in the same MAP, so some contention requests
+// collide and have to be retried after backing off.
+class DocsisContentionTestCase : public TestCase
+{
+public:
+  DocsisContentionTestCase ();
+
+private:
+  virtual void DoRun (void);
+  void SendOnePacket (Ptr<NetDevice> device, Address address);
+  bool Receive (Ptr<NetDevice> device, Ptr<const Packet> packet, uint16_t protocol, const Address &source);
+  void Collision (Ptr<const Packet> packet, uint32_t channel);
+
+  uint32_t m_received;
+  uint32_t m_collisions;
+};
+
+DocsisContentionTestCase::DocsisContentionTestCase ()
+  : TestCase ("Docsis upstream contention backoff"), m_received (0), m_collisions (0)
+{
+}
+
+void
+DocsisContentionTestCase::SendOnePacket (Ptr<NetDevice> device, Address address)
+{
+  Ptr<Packet> p = Create<Packet> (100);
+  device->Send (p, address, 0x800);
+}
+
+bool
+DocsisContentionTestCase::Receive (Ptr<NetDevice> device, Ptr<const Packet> packet, uint16_t protocol, const Address &source)
+{
+  m_received++;
+  return true;
+}
+
+void
+DocsisContentionTestCase::Collision (Ptr<const Packet> packet, uint32_t channel)
+{
+  m_collisions++;
+}
+
+void
+DocsisContentionTestCase::DoRun (void)
+{
+  const uint32_t nCms = 20;
+
+  Ptr<Hfc> channel = CreateObject<Hfc> ();
+  channel->TraceConnectWithoutContext ("UpstreamCollision", MakeCallback (&DocsisContentionTestCase::Collision, this));
+
+  Ptr<Node> cmtsNode = CreateObject<Node> ();
+  Ptr<CmtsDevice> cmts = CreateObject<CmtsDevice> ();
+  cmts->Attach (channel);
+  cmts->SetAddress (Mac48Address::Allocate ());
+  cmtsNode->AddDevice (cmts);
+  cmts->SetReceiveCallback (MakeCallback (&DocsisContentionTestCase::Receive, this));
+
+  for (uint32_t i = 0; i < nCms; i++)
+    {
+      Ptr<Node> node = CreateObject<Node> ();
+      Ptr<CmDevice> cm = CreateObject<CmDevice> ();
+      cm->Attach (channel);
+      cm->SetAddress (Mac48Address::Allocate ());
+      cm->SetTimeDistanceToCMTS (MicroSeconds (10 + 5 * i));
+      node->AddDevice (cm);
+
+      Simulator::Schedule (Seconds (1.0), &DocsisContentionTestCase::SendOnePacket, this, cm, cmts->GetAddress ());
+    }
+
+  RunSimulation (Seconds (2.0));
+
+  NS_TEST_ASSERT_MSG_GT (m_collisions, 0, "Simultaneous contention requests did not collide");
+  NS_TEST_ASSERT_MSG_EQ (m_received, nCms, "Not every CM got its packet through after backing off");
+}
+
+// A burst of packets drains faster when requests are piggybacked or cover
+// the whole queue than when every packet needs its own request frame.
+class DocsisRequestStrategyTestCase : public TestCase
+{
+public:
+  DocsisRequestStrategyTestCase ();
+
+private:
+  virtual void DoRun (void);
+  Time RunBurst (DocsisRequestStrategy strategy);
+  void SendBurst (Ptr<NetDevice> device, Address address);
+  bool Receive (Ptr<NetDevice> device, Ptr<const Packet> packet, uint16_t protocol, const Address &source);
+
+  uint32_t m_received;
+  Time m_lastReceived;
+};
+
+DocsisRequestStrategyTestCase::DocsisRequestStrategyTestCase ()
+  : TestCase ("Docsis upstream request strategies"), m_received (0)
+{
+}
+
+void
+DocsisRequestStrategyTestCase::SendBurst (Ptr<NetDevice> device, Address address)
+{
+  for (uint32_t i = 0; i < 10; i++)
+    device->Send (Create<Packet> (1000), address, 0x800);
+}
+
+bool
+DocsisRequestStrategyTestCase::Receive (Ptr<NetDevice> device, Ptr<const Packet> packet, uint16_t protocol, const Address &source)
+{
+  m_received++;
+  m_lastReceived = Simulator::Now ();
+  NS_TEST_EXPECT_MSG_EQ (packet->GetSize (), 1000, "Payload size changed on the way upstream");
+  return true;
+}
+
+Time
+DocsisRequestStrategyTestCase::RunBurst (DocsisRequestStrategy strategy)
+{
+  m_received = 0;
+
+  Ptr<CmtsDevice> cmts = CreateObject<CmtsDevice> ();
+  Ptr<CmDevice> cm = CreateObject<CmDevice> ();
+  Ptr<Hfc> channel = CreateObject<Hfc> ();
+
+  ConnectDevices (cmts, cm, channel, MicroSeconds (100));
+  cm->SetAttribute ("RequestStrategy", EnumValue (strategy));
+  cmts->SetReceiveCallback (MakeCallback (&DocsisRequestStrategyTestCase::Receive, this));
+
+  Simulator::Schedule (Seconds (1.0), &DocsisRequestStrategyTestCase::SendBurst, this, cm, cmts->GetAddress ());
+
+  RunSimulation (Seconds (2.0));
+
+  NS_TEST_EXPECT_MSG_EQ (m_received, 10, "Burst was not delivered");
+  return m_lastReceived - Seconds (1.0);
+}
+
+void
+DocsisRequestStrategyTestCase::DoRun (void)
+{
+  Time headOfLine = RunBurst (kRequestHeadOfLine);
+  Time piggyback = RunBurst (kRequestPiggyback);
+  Time queueDepth = RunBurst (kRequestQueueDepth);
+
+  NS_TEST_ASSERT_MSG_LT (piggyback, headOfLine, "Piggybacked requests did not shorten the burst");
+  NS_TEST_ASSERT_MSG_LT (queueDepth, piggyback, "Queue depth requests did not shorten the burst");
+}
+
+// Small packets are packed into concatenated bursts, and a packet larger
+// than any grant is split in fragments the CMTS puts back together.
+class DocsisConcatenationTestCase : public TestCase
+{
+public:
+  DocsisConcatenationTestCase ();
+
+private:
+  virtual void DoRun (void);
+  void Run (uint32_t packets, uint32_t size, uint32_t maxGrantSize, bool twoFlows = false);
+  void SendBurst (Ptr<NetDevice> device, Address address, uint32_t packets, uint32_t size);
+  bool Receive (Ptr<NetDevice> device, Ptr<const Packet> packet, uint16_t protocol, const Address &source);
+  void TxBegin (Ptr<const Packet> packet);
+
+  uint32_t m_received;
+  uint32_t m_bursts;
+  uint32_t m_size;
+  bool m_twoFlows;
+};
+
+DocsisConcatenationTestCase::DocsisConcatenationTestCase ()
+  : TestCase ("Docsis upstream concatenation and fragmentation"), m_received (0), m_bursts (0), m_size (0), m_twoFlows (false)
+{
+}
+
+void
+DocsisConcatenationTestCase::SendBurst (Ptr<NetDevice> device, Address address, uint32_t packets, uint32_t size)
+{
+  std::vector<uint8_t> payload (size);
+  for (uint32_t i = 0; i < size; i++)
+    payload[i] = i & 0xFF;
+
+  // With two flows, every other packet goes to the second one.
+  for (uint32_t i = 0; i < packets; i++)
+    device->Send (Create<Packet> (&payload[0], size), address, m_twoFlows && i % 2 ? 0x86DD : 0x800);
+}
+
+bool
+DocsisConcatenationTestCase::Receive (Ptr<NetDevice> device, Ptr<const Packet> packet, uint16_t protocol, const Address &source)
+{
+  m_received++;
+  NS_TEST_EXPECT_MSG_EQ (packet->GetSize (), m_size, "Payload size changed on the way upstream");
+
+  std::vector<uint8_t> payload (packet->GetSize ());
+  packet->CopyData (&payload[0], payload.size ());
+  for (uint32_t i = 0; i < payload.size (); i++)
+    if (payload[i] != (i & 0xFF))
+      {
+        NS_TEST_EXPECT_MSG_EQ ((uint32_t) payload[i], (i & 0xFF), "Payload corrupted at byte " << i);
+        break;
+      }
+  return true;
+}
+
+void
+DocsisConcatenationTestCase::TxBegin (Ptr<const Packet> packet)
+{
+  m_bursts++;
+}
+
+void
+DocsisConcatenationTestCase::Run (uint32_t packets, uint32_t size, uint32_t maxGrantSize, bool twoFlows)
+{
+  m_received = 0;
+  m_bursts = 0;
+  m_size = size;
+  m_twoFlows = twoFlows;
+
+  Ptr<CmtsDevice> cmts = CreateObject<CmtsDevice> ();
+  Ptr<CmDevice> cm = CreateObject<CmDevice> ();
+  Ptr<Hfc> channel = CreateObject<Hfc> ();
+
+  cmts->SetAttribute ("MaxGrantSize", UintegerValue (maxGrantSize));
+  ConnectDevices (cmts, cm, channel, MicroSeconds (100));
+  cm->SetAttribute ("RequestStrategy", EnumValue (kRequestQueueDepth));
+  cm->TraceConnectWithoutContext ("PhyTxBegin", MakeCallback (&DocsisConcatenationTestCase::TxBegin, this));
+  if (twoFlows)
+    {
+      DocsisClassifierRule rule;
+      rule.ethertype = 0x86DD;
+      rule.flow = cm->AddUpstreamServiceFlow (DocsisServiceFlow ());
+      cm->AddUpstreamClassifier (rule);
+    }
+
+  cmts->SetReceiveCallback (MakeCallback (&DocsisConcatenationTestCase::Receive, this));
+
+  Simulator::Schedule (Seconds (1.0), &DocsisConcatenationTestCase::SendBurst, this, cm, cmts->GetAddress (), packets, size);
+
+  RunSimulation (Seconds (2.0));
+}
+
+void
+DocsisConcatenationTestCase::DoRun (void)
+{
+  // TCP ACK sized packets: one request and a few concatenated bursts.
+  Run (20, 40, 255);
+  NS_TEST_ASSERT_MSG_EQ (m_received, 20, "Concatenated packets were not delivered");
+  NS_TEST_ASSERT_MSG_LT (m_bursts, 10u, "Small packets were not concatenated");
+
+  // Grants of 20 minislots cannot carry a 1000 byte packet in one piece.
+  Run (2, 1000, 20);
+  NS_TEST_ASSERT_MSG_EQ (m_received, 2, "Fragmented packets were not reassembled");
+  NS_TEST_ASSERT_MSG_GT (m_bursts, 6u, "Large packets were not fragmented");
+
+  // The fragments of two flows are numbered apart and reassembled per SID.
+  Run (6, 1000, 20, true);
+  NS_TEST_ASSERT_MSG_EQ (m_received, 6, "Fragments of two flows at once were not reassembled");
+}
+
+// Frames striped over a bonded downstream arrive out of order, and the CM
+// has to hand them up in sequence.
+class DocsisDownstreamBondingTestCase : public TestCase
+{
+public:
+  DocsisDownstreamBondingTestCase ();
+
+private:
+  virtual void DoRun (void);
+  Time Run (uint32_t bondedChannels);
+  void SendBurst (Ptr<NetDevice> device, Address address);
+  bool Receive (Ptr<NetDevice> device, Ptr<const Packet> packet, uint16_t protocol, const Address &source);
+
+  uint32_t m_received;
+  uint32_t m_outOfOrder;
+  Time m_lastReceived;
+};
+
+DocsisDownstreamBondingTestCase::DocsisDownstreamBondingTestCase ()
+  : TestCase ("Docsis downstream bonding resequencing"), m_received (0), m_outOfOrder (0)
+{
+}
+
+void
+DocsisDownstreamBondingTestCase::SendBurst (Ptr<NetDevice> device, Address address)
+{
+  // Mixed sizes make the frames overtake each other on the bonded channels.
+  for (uint32_t i = 0; i < 200; i++)
+    {
+      uint8_t payload[1400];
+      payload[0] = i >> 8;
+      payload[1] = i & 0xFF;
+      device->Send (Create<Packet> (payload, i % 2 ? 64 : 1400), address, 0x800);
+    }
+}
+
+bool
+DocsisDownstreamBondingTestCase::Receive (Ptr<NetDevice> device, Ptr<const Packet> packet, uint16_t protocol, const Address &source)
+{
+  uint8_t payload[2];
+  packet->CopyData (payload, 2);
+  if ((uint32_t) ((payload[0] << 8) | payload[1]) != m_received)
+    m_outOfOrder++;
+
+  m_received++;
+  m_lastReceived = Simulator::Now ();
+  return true;
+}
+
+Time
+DocsisDownstreamBondingTestCase::Run (uint32_t bondedChannels)
+{
+  m_received = 0;
+  m_outOfOrder = 0;
+
+  Ptr<CmtsDevice> cmts = CreateObject<CmtsDevice> ();
+  Ptr<CmDevice> cm = CreateObject<CmDevice> ();
+  Ptr<Hfc> channel = CreateObject<Hfc> ();
+  channel->SetDownstreamChannelsAmount (4);
+
+  cmts->SetAttribute ("DownstreamBondingGroupSize", UintegerValue (bondedChannels));
+  ConnectDevices (cmts, cm, channel, MicroSeconds (100));
+  cm->SetReceiveCallback (MakeCallback (&DocsisDownstreamBondingTestCase::Receive, this));
+
+  Simulator::Schedule (Seconds (1.0), &DocsisDownstreamBondingTestCase::SendBurst, this, cmts, cm->GetAddress ());
+
+  RunSimulation (Seconds (2.0));
+
+  NS_TEST_EXPECT_MSG_EQ (m_received, 200, "Downstream frames were lost");
+  NS_TEST_EXPECT_MSG_EQ (m_outOfOrder, 0, "Downstream frames were handed up out of order");
+  return m_lastReceived - Seconds (1.0);
+}
+
+void
+DocsisDownstreamBondingTestCase::DoRun (void)
+{
+  Time single = Run (1);
+  Time bonded = Run (4);
+
+  NS_TEST_ASSERT_MSG_LT (bonded + bonded, single, "Bonding four channels did not speed up the downstream");
+}
+
+// A CM bonded over several upstream channels sends its queue as segments on
+// all of them, and the CMTS puts the frames back together in order.
+class DocsisUpstreamBondingTestCase : public TestCase
+{
+public:
+  DocsisUpstreamBondingTestCase ();
+
+private:
+  virtual void DoRun (void);
+  Time Run (uint32_t bondedChannels);
+  void SendBurst (Ptr<NetDevice> device, Address address);
+  bool Receive (Ptr<NetDevice> device, Ptr<const Packet> packet, uint16_t protocol, const Address &source);
+  void TxBegin (Ptr<const Packet> packet);
+
+  uint32_t m_received;
+  uint32_t m_outOfOrder;
+  uint32_t m_corrupted;
+  uint32_t m_segments;
+  Time m_lastReceived;
+};
+
+DocsisUpstreamBondingTestCase::DocsisUpstreamBondingTestCase ()
+  : TestCase ("Docsis upstream bonding segment reassembly"), m_received (0), m_outOfOrder (0), m_corrupted (0), m_segments (0)
+{
+}
+
+void
+DocsisUpstreamBondingTestCase::SendBurst (Ptr<NetDevice> device, Address address)
+{
+  for (uint32_t i = 0; i < 100; i++)
+    {
+      uint32_t size = i % 3 ? 1400 : 100;
+      std::vector<uint8_t> payload (size);
+      for (uint32_t j = 0; j < size; j++)
+        payload[j] = (i + j) & 0xFF;
+      device->Send (Create<Packet> (&payload[0], size), address, 0x800);
+    }
+}
+
+bool
+DocsisUpstreamBondingTestCase::Receive (Ptr<NetDevice> device, Ptr<const Packet> packet, uint16_t protocol, const Address &source)
+{
+  std::vector<uint8_t> payload (packet->GetSize ());
+  packet->CopyData (&payload[0], payload.size ());
+  if (payload[0] != (m_received & 0xFF))
+    m_outOfOrder++;
+  if (packet->GetSize () != (m_received % 3 ? 1400u : 100u))
+    m_corrupted++;
+  else
+    for (uint32_t j = 0; j < payload.size (); j++)
+      if (payload[j] != ((payload[0] + j) & 0xFF))
+        {
+          m_corrupted++;
+          break;
+        }
+
+  m_received++;
+  m_lastReceived = Simulator::Now ();
+  return true;
+}
+
+void
+DocsisUpstreamBondingTestCase::TxBegin (Ptr<const Packet> packet)
+{
+  m_segments++;
+}
+
+Time
+DocsisUpstreamBondingTestCase::Run (uint32_t bondedChannels)
+{
+  m_received = 0;
+  m_outOfOrder = 0;
+  m_corrupted = 0;
+  m_segments = 0;
+
+  Ptr<CmtsDevice> cmts = CreateObject<CmtsDevice> ();
+  Ptr<CmDevice> cm = CreateObject<CmDevice> ();
+  Ptr<Hfc> channel = CreateObject<Hfc> ();
+  channel->SetUpstreamChannelsAmount (4);
+
+  cmts->SetAttribute ("UpstreamBondingGroupSize", UintegerValue (bondedChannels));
+  ConnectDevices (cmts, cm, channel, MicroSeconds (100));
+  cm->SetAttribute ("RequestStrategy", EnumValue (kRequestQueueDepth));
+  cm->TraceConnectWithoutContext ("PhyTxBegin", MakeCallback (&DocsisUpstreamBondingTestCase::TxBegin, this));
+  cmts->SetReceiveCallback (MakeCallback (&DocsisUpstreamBondingTestCase::Receive, this));
+
+  Simulator::Schedule (Seconds (1.0), &DocsisUpstreamBondingTestCase::SendBurst, this, cm, cmts->GetAddress ());
+
+  RunSimulation (Seconds (2.0));
+
+  NS_TEST_EXPECT_MSG_EQ (m_received, 100, "Upstream frames were lost");
+  NS_TEST_EXPECT_MSG_EQ (m_outOfOrder, 0, "Upstream frames were handed up out of order");
+  NS_TEST_EXPECT_MSG_EQ (m_corrupted, 0, "Upstream frames were not reassembled correctly");
+  return m_lastReceived - Seconds (1.0);
+}
+
+void
+DocsisUpstreamBondingTestCase::DoRun (void)
+{
+  Time single = Run (1);
+  Time bonded = Run (4);
+
+  NS_TEST_ASSERT_MSG_LT (bonded + bonded, single, "Bonding four channels did not speed up the upstream");
+}
+
+// Channels built from different PHY profiles have different capacities, and
+// the CMTS minislot clock follows the upstream profile.
+class DocsisPhyProfileTestCase : public TestCase
+{
+public:
+  DocsisPhyProfileTestCase ();
+
+private:
+  virtual void DoRun (void);
+  Time Run (uint32_t modulationOrder);
+  void SendBurst (Ptr<NetDevice> device, Address address);
+  bool Receive (Ptr<NetDevice> device, Ptr<const Packet> packet, uint16_t protocol, const Address &source);
+
+  uint32_t m_received;
+  Time m_lastReceived;
+};
+
+DocsisPhyProfileTestCase::DocsisPhyProfileTestCase ()
+  : TestCase ("Docsis per channel PHY profiles"), m_received (0)
+{
+}
+
+void
+DocsisPhyProfileTestCase::SendBurst (Ptr<NetDevice> device, Address address)
+{
+  for (uint32_t i = 0; i < 100; i++)
+    device->Send (Create<Packet> (1400), address, 0x800);
+}
+
+bool
+DocsisPhyProfileTestCase::Receive (Ptr<NetDevice> device, Ptr<const Packet> packet, uint16_t protocol, const Address &source)
+{
+  m_received++;
+  m_lastReceived = Simulator::Now ();
+  return true;
+}
+
+Time
+DocsisPhyProfileTestCase::Run (uint32_t modulationOrder)
+{
+  m_received = 0;
+
+  Ptr<CmtsDevice> cmts = CreateObject<CmtsDevice> ();
+  Ptr<CmDevice> cm = CreateObject<CmDevice> ();
+  Ptr<Hfc> channel = CreateObject<Hfc> ();
+  channel->SetDownstreamPhyProfile (0, Hfc::PhyProfile (modulationOrder, 5360537, 0.0967, 0, 0));
+
+  ConnectDevices (cmts, cm, channel, MicroSeconds (100));
+  cm->SetReceiveCallback (MakeCallback (&DocsisPhyProfileTestCase::Receive, this));
+
+  Simulator::Schedule (Seconds (1.0), &DocsisPhyProfileTestCase::SendBurst, this, cmts, cm->GetAddress ());
+
+  RunSimulation (Seconds (2.0));
+
+  NS_TEST_EXPECT_MSG_EQ (m_received, 100, "Downstream frames were lost");
+  return m_lastReceived - Seconds (1.0);
+}
+
+void
+DocsisPhyProfileTestCase::DoRun (void)
+{
+  Ptr<Hfc> channel = CreateObject<Hfc> ();
+  channel->SetUpstreamChannelsAmount (2);
+  channel->SetUpstreamPhyProfile (1, Hfc::PhyProfile (16, 2560000, 0.1, 32, 16));
+
+  // 64-QAM at 5.12 Msym/s with 10% FEC, and 16-QAM at 2.56 Msym/s.
+  NS_TEST_ASSERT_MSG_EQ (channel->GetUpstreamDataRate (0).GetBitRate (), 27648000, "Wrong 64-QAM upstream rate");
+  NS_TEST_ASSERT_MSG_EQ (channel->GetUpstreamDataRate (1).GetBitRate (), 9216000, "Wrong 16-QAM upstream rate");
+  NS_TEST_ASSERT_MSG_EQ (channel->GetUpstreamPhyOverhead (1), 16, "The preamble does not come from the profile");
+  NS_TEST_ASSERT_MSG_EQ_TOL (channel->GetUpstreamTxTime (1, 1152).GetSeconds (), 0.001, 1e-9, "Wrong upstream tx time");
+
+  // The CMTS takes the minislot duration from the profile, rounded up to
+  // whole timestamp ticks, and follows it when the profile changes.
+  Ptr<CmtsDevice> cmts = CreateObject<CmtsDevice> ();
+  cmts->Attach (channel);
+  NS_TEST_ASSERT_MSG_EQ_TOL (cmts->MinislotToTime (1, 1).GetSeconds (), channel->GetUpstreamTxTime (1, 32).GetSeconds (), 1e-7, "Minislot does not match the profile");
+  channel->SetUpstreamPhyProfile (1, Hfc::PhyProfile (64, 5120000, 0.1, 32, 16));
+  NS_TEST_ASSERT_MSG_EQ_TOL (cmts->MinislotToTime (1, 1).GetSeconds (), channel->GetUpstreamTxTime (1, 32).GetSeconds (), 1e-7, "Minislot did not follow the profile");
+  cmts->Dispose ();
+
+  // The same burst over 64-QAM and 256-QAM downstreams. MAPs and
+  // propagation add a little on top of the 8/6 capacity ratio.
+  Time qam64 = Run (64);
+  Time qam256 = Run (256);
+  NS_TEST_ASSERT_MSG_EQ_TOL (qam64.GetSeconds () / qam256.GetSeconds (), 8.0 / 6, 0.1, "Capacity does not follow the modulation order");
+}
+
+// The helper builds a whole segment, and the devices carry IP traffic both
+// ways once the internet stack is on.
+class DocsisHelperTestCase : public TestCase
+{
+public:
+  DocsisHelperTestCase ();
+
+private:
+  virtual void DoRun (void);
+  void Send (Ptr<Socket> socket, Ipv4Address destination);
+  void Receive (Ptr<Socket> socket);
+
+  uint32_t m_received;
+};
+
+DocsisHelperTestCase::DocsisHelperTestCase ()
+  : TestCase ("Docsis helper builds an IP capable segment"), m_received (0)
+{
+}
+
+void
+DocsisHelperTestCase::Send (Ptr<Socket> socket, Ipv4Address destination)
+{
+  socket->SendTo (Create<Packet> (500), 0, InetSocketAddress (destination, 9));
+}
+
+void
+DocsisHelperTestCase::Receive (Ptr<Socket> socket)
+{
+  while (socket->Recv ())
+    m_received++;
+}
+
+void
+DocsisHelperTestCase::DoRun (void)
+{
+  NodeContainer cmtsNode;
+  cmtsNode.Create (1);
+  NodeContainer cmNodes;
+  cmNodes.Create (50);
+
+  Ptr<UniformRandomVariable> distance = CreateObject<UniformRandomVariable> ();
+  distance->SetAttribute ("Min", DoubleValue (1));
+  distance->SetAttribute ("Max", DoubleValue (10));
+
+  DocsisHelper docsis;
+  docsis.SetChannelsAmount (2, 2);
+  docsis.SetDistance (distance, MicroSeconds (5));
+  NetDeviceContainer devices = docsis.Install (cmtsNode.Get (0), cmNodes);
+  docsis.AssignStreams (devices, 1);
+
+  NS_TEST_ASSERT_MSG_EQ (devices.GetN (), 51, "Wrong number of devices");
+  NS_TEST_ASSERT_MSG_NE (DynamicCast<CmtsDevice> (devices.Get (0)), 0, "The CMTS does not come first");
+  for (uint32_t i = 1; i < devices.GetN (); i++)
+    {
+      Ptr<CmDevice> cm = DynamicCast<CmDevice> (devices.Get (i));
+      NS_TEST_ASSERT_MSG_EQ (cm->GetNode (), cmNodes.Get (i - 1), "CMs are not in node order");
+      NS_TEST_ASSERT_MSG_EQ (cm->GetChannel (), devices.Get (0)->GetChannel (), "CM is not on the CMTS channel");
+      NS_TEST_EXPECT_MSG_GT (cm->GetTimeDistanceToCMTS (), MicroSeconds (4), "CM is closer than the distance distribution allows");
+      NS_TEST_EXPECT_MSG_LT (cm->GetTimeDistanceToCMTS (), MicroSeconds (51), "CM is farther than the distance distribution allows");
+    }
+
+  Ipv4InterfaceContainer interfaces = docsis.InstallInternetStack (devices, "10.1.0.0", "255.255.0.0");
+  NS_TEST_ASSERT_MSG_EQ (interfaces.GetN (), 51, "Not every device got an address");
+
+  TypeId udp = UdpSocketFactory::GetTypeId ();
+  Ptr<Socket> cmtsSocket = Socket::CreateSocket (cmtsNode.Get (0), udp);
+  cmtsSocket->Bind (InetSocketAddress (Ipv4Address::GetAny (), 9));
+  cmtsSocket->SetRecvCallback (MakeCallback (&DocsisHelperTestCase::Receive, this));
+  Ptr<Socket> cmSocket = Socket::CreateSocket (cmNodes.Get (7), udp);
+  cmSocket->Bind (InetSocketAddress (Ipv4Address::GetAny (), 9));
+  cmSocket->SetRecvCallback (MakeCallback (&DocsisHelperTestCase::Receive, this));
+
+  Simulator::Schedule (Seconds (0.1), &DocsisHelperTestCase::Send, this, cmSocket, interfaces.GetAddress (0));
+  Simulator::Schedule (Seconds (0.2), &DocsisHelperTestCase::Send, this, cmtsSocket, interfaces.GetAddress (8));
+
+  RunSimulation (Seconds (0.3));
+
+  NS_TEST_ASSERT_MSG_EQ (m_received, 2, "UDP datagrams did not make it across the segment");
+}
+
+// CMs are found by handle and by MAC address while they come and go.
+class DocsisCmRegistryTestCase : public TestCase
+{
+public:
+  DocsisCmRegistryTestCase ();
+
+private:
+  virtual void DoRun (void);
+};
+
+DocsisCmRegistryTestCase::DocsisCmRegistryTestCase ()
+  : TestCase ("Docsis CM registry handles attach, deattach and address changes")
+{
+}
+
+void
+DocsisCmRegistryTestCase::DoRun (void)
+{
+  Ptr<Node> cmtsNode = CreateObject<Node> ();
+  NodeContainer cmNodes;
+  cmNodes.Create (1000);
+
+  DocsisHelper docsis;
+  NetDeviceContainer devices = docsis.Install (cmtsNode, cmNodes);
+  Ptr<CmtsDevice> cmts = DynamicCast<CmtsDevice> (devices.Get (0));
+  Ptr<Hfc> hfc = DynamicCast<Hfc> (cmts->GetChannel ());
+
+  for (uint32_t i = 1; i < devices.GetN (); i++)
+    NS_TEST_ASSERT_MSG_EQ (DynamicCast<CmDevice> (devices.Get (i))->GetHandle (), i - 1, "Handles are not dense");
+
+  Ptr<CmDevice> cm = DynamicCast<CmDevice> (devices.Get (500));
+  Ptr<CmDevice> neighbour = DynamicCast<CmDevice> (devices.Get (501));
+  Address address = cm->GetAddress ();
+  NS_TEST_ASSERT_MSG_EQ (cmts->Send (Create<Packet> (100), address, 0x0800), true, "Attached CM not found");
+  NS_TEST_ASSERT_MSG_EQ (cmts->Send (Create<Packet> (100), Mac48Address ("00:00:00:00:ff:ff"), 0x0800), false, "Unknown address accepted");
+
+  cm->Deattach ();
+  NS_TEST_ASSERT_MSG_EQ (cm->GetHandle (), Hfc::kNoHandle, "Deattached CM kept its handle");
+  NS_TEST_ASSERT_MSG_EQ (cmts->Send (Create<Packet> (100), address, 0x0800), false, "Deattached CM still reachable");
+  NS_TEST_ASSERT_MSG_EQ (cmts->Send (Create<Packet> (100), neighbour->GetAddress (), 0x0800), true, "Neighbour lost on deattach");
+
+  cm->Deattach ();
+  NS_TEST_ASSERT_MSG_EQ (neighbour->GetHandle (), 500, "Deattaching twice disturbed another CM");
+
+  cm->Attach (hfc);
+  NS_TEST_ASSERT_MSG_EQ (cm->GetHandle (), 499, "Freed handle not reused");
+  NS_TEST_ASSERT_MSG_EQ (cmts->Send (Create<Packet> (100), address, 0x0800), true, "Reattached CM not found");
+
+  Mac48Address renamed ("00:00:00:00:fe:fe");
+  cm->SetAddress (renamed);
+  NS_TEST_ASSERT_MSG_EQ (cmts->Send (Create<Packet> (100), renamed, 0x0800), true, "New address not registered");
+  NS_TEST_ASSERT_MSG_EQ (cmts->Send (Create<Packet> (100), address, 0x0800), false, "Old address still registered");
+
+  Simulator::Destroy ();
+}
+
+// A CMTS moved to another Hfc leaves the CMs of the last one behind, and
+// serves the CMs that follow it.
+class DocsisCmtsReattachTestCase : public TestCase
+{
+public:
+  DocsisCmtsReattachTestCase ();
+
+private:
+  virtual void DoRun (void);
+  void Move (Ptr<CmtsDevice> cmts, Ptr<CmDevice> cm, Ptr<Hfc> hfc);
+  bool Receive (Ptr<NetDevice> device, Ptr<const Packet> packet, uint16_t protocol, const Address &source);
+
+  uint32_t m_received;
+};
+
+DocsisCmtsReattachTestCase::DocsisCmtsReattachTestCase ()
+  : TestCase ("Docsis CMTS can be moved to another Hfc"), m_received (0)
+{
+}
+
+void
+DocsisCmtsReattachTestCase::Move (Ptr<CmtsDevice> cmts, Ptr<CmDevice> cm, Ptr<Hfc> hfc)
+{
+  cmts->Attach (hfc);
+  cm->Attach (hfc);
+}
+
+bool
+DocsisCmtsReattachTestCase::Receive (Ptr<NetDevice> device, Ptr<const Packet> packet, uint16_t protocol, const Address &source)
+{
+  m_received++;
+  return true;
+}
+
+void
+DocsisCmtsReattachTestCase::DoRun (void)
+{
+  Ptr<Node> cmtsNode = CreateObject<Node> ();
+  NodeContainer cmNodes;
+  cmNodes.Create (2);
+
+  DocsisHelper docsis;
+  NetDeviceContainer devices = docsis.Install (cmtsNode, cmNodes);
+  Ptr<CmtsDevice> cmts = DynamicCast<CmtsDevice> (devices.Get (0));
+  Ptr<CmDevice> moved = DynamicCast<CmDevice> (devices.Get (1));
+  Ptr<CmDevice> left = DynamicCast<CmDevice> (devices.Get (2));
+  Ptr<Hfc> first = DynamicCast<Hfc> (cmts->GetChannel ());
+  Ptr<Hfc> second = CreateObject<Hfc> ();
+  cmts->SetReceiveCallback (MakeCallback (&DocsisCmtsReattachTestCase::Receive, this));
+
+  Simulator::Schedule (Seconds (0.5), &DocsisCmtsReattachTestCase::Move, this, cmts, moved, second);
+  Simulator::Schedule (Seconds (1), &NetDevice::Send, moved, Create<Packet> (500), cmts->GetAddress (), 0x800);
+  Simulator::Schedule (Seconds (1), &NetDevice::Send, left, Create<Packet> (500), cmts->GetAddress (), 0x800);
+  Simulator::Stop (Seconds (1.5));
+  Simulator::Run ();
+
+  NS_TEST_EXPECT_MSG_EQ (cmts->GetChannel (), second, "The CMTS is not on the new Hfc");
+  NS_TEST_EXPECT_MSG_EQ (left->GetHandle (), Hfc::kNoHandle, "A CM stayed on the Hfc the CMTS left");
+  NS_TEST_EXPECT_MSG_EQ (cmts->Send (Create<Packet> (100), left->GetAddress (), 0x800), false, "The CMTS kept a CM of the old Hfc");
+  NS_TEST_EXPECT_MSG_EQ (cmts->Send (Create<Packet> (100), moved->GetAddress (), 0x800), true, "The CMTS lost the CM that moved");
+  NS_TEST_EXPECT_MSG_EQ (m_received, 1, "Only the CM that moved should reach the CMTS");
+
+  Simulator::Destroy ();
+}
+
+// A parsed MAP finds the IEs of one SID, in MAP order, without a scan.
+class DocsisMapLookupTestCase : public TestCase
+{
+public:
+  DocsisMapLookupTestCase ();
+
+private:
+  virtual void DoRun (void);
+};
+
+DocsisMapLookupTestCase::DocsisMapLookupTestCase ()
+  : TestCase ("Docsis MAP information elements are indexed by SID")
+{
+}
+
+void
+DocsisMapLookupTestCase::DoRun (void)
+{
+  uint16_t sids[] = { 7, MAPHeader::BROADCAST_SID, 3, 7, 9, 3, 0, 7 };
+  MAPHeader::IEType types[] = { MAPHeader::kLargeDataGrant, MAPHeader::kRequest, MAPHeader::kShortDataGrant, MAPHeader::kRequest,
+                                MAPHeader::kLargeDataGrant, MAPHeader::kUnsolicitedGrant, MAPHeader::kNull, MAPHeader::kShortDataGrant };
+
+  MAPHeader sent;
+  sent.SetupMAP (1, 0, 1000, 990, 0, 0, 2, 5);
+  uint16_t offset = 0;
+  for (uint32_t i = 0; i < 8; i++)
+    {
+      MAPHeader::InformationElement ie;
+      ie.m_sid = sids[i];
+      ie.m_type = types[i];
+      ie.m_offset = offset;
+      if (types[i] != MAPHeader::kNull) offset += 10 + i;
+      sent.AddIE (ie);
+    }
+
+  Ptr<Packet> packet = Create<Packet> ();
+  packet->AddHeader (sent);
+  MAPHeader mh;
+  packet->RemoveHeader (mh);
+
+  NS_TEST_ASSERT_MSG_EQ (mh.GetNInformationElements (), 8, "IEs lost on the wire");
+  NS_TEST_ASSERT_MSG_EQ (mh.GetNullInformationElement (), 6, "Wrong null IE");
+  NS_TEST_EXPECT_MSG_EQ (mh.GetInformationElement (2).m_sid, 3, "IEs reordered on the wire");
+
+  MAPIndex index;
+  index.Build (mh);
+  const uint8_t *first, *last;
+  index.FindInformationElements (7, first, last);
+  NS_TEST_ASSERT_MSG_EQ (last - first, 3, "Wrong number of IEs for SID 7");
+  NS_TEST_EXPECT_MSG_EQ ((uint32_t) first[0], 0, "IEs of SID 7 out of order");
+  NS_TEST_EXPECT_MSG_EQ ((uint32_t) first[1], 3, "IEs of SID 7 out of order");
+  NS_TEST_EXPECT_MSG_EQ ((uint32_t) first[2], 7, "IEs of SID 7 out of order");
+  NS_TEST_EXPECT_MSG_EQ (mh.GetSlotNumber (mh.GetInformationElement (first[1])), 1000 + 10 + 11 + 12, "Wrong slot for the unicast request");
+
+  index.FindInformationElements (3, first, last);
+  NS_TEST_ASSERT_MSG_EQ (last - first, 2, "Wrong number of IEs for SID 3");
+  NS_TEST_EXPECT_MSG_EQ (mh.GetInformationElement (first[1]).m_type, MAPHeader::kUnsolicitedGrant, "Wrong IE type after the round trip");
+
+  index.FindInformationElements (MAPHeader::BROADCAST_SID, first, last);
+  NS_TEST_ASSERT_MSG_EQ (last - first, 1, "Broadcast request not found");
+  NS_TEST_EXPECT_MSG_EQ ((uint32_t) first[0], 1, "Wrong broadcast request");
+
+  index.FindInformationElements (4, first, last);
+  NS_TEST_EXPECT_MSG_EQ (last - first, 0, "IEs found for an absent SID");
+}
+
+// A broadcast reaches its group in one event per delay window, and every
+// receiver sees the same packet.
+class DocsisBroadcastDeliveryTestCase : public TestCase
+{
+public:
+  DocsisBroadcastDeliveryTestCase ();
+
+private:
+  virtual void DoRun (void);
+  void Receive (std::string context, Ptr<const Packet> packet);
+
+  uint64_t m_uid;
+  std::vector<Time> m_receivedAt;
+  std::vector<const Packet *> m_received;
+};
+
+DocsisBroadcastDeliveryTestCase::DocsisBroadcastDeliveryTestCase ()
+  : TestCase ("Docsis broadcasts are delivered per delay window to their group"), m_uid (0)
+{
+}
+
+void
+DocsisBroadcastDeliveryTestCase::Receive (std::string context, Ptr<const Packet> packet)
+{
+  if (packet->GetUid () != m_uid) return;
+
+  uint32_t cm = atoi (context.c_str ());
+  m_receivedAt[cm] = Simulator::Now ();
+  m_received[cm] = PeekPointer (packet);
+}
+
+void
+DocsisBroadcastDeliveryTestCase::DoRun (void)
+{
+  Ptr<Node> cmtsNode = CreateObject<Node> ();
+  NodeContainer cmNodes;
+  cmNodes.Create (30);
+
+  DocsisHelper docsis;
+  docsis.SetChannelsAmount (1, 2);
+  NetDeviceContainer devices = docsis.Install (cmtsNode, cmNodes);
+  Ptr<Hfc> hfc = DynamicCast<Hfc> (devices.Get (0)->GetChannel ());
+  hfc->SetAttribute ("BroadcastDelayGranularity", TimeValue (MicroSeconds (1)));
+
+  // Three clusters of CMs; the first two are close enough to share a window.
+  uint32_t group = hfc->CreateGroup ();
+  m_receivedAt.resize (30);
+  m_received.resize (30, 0);
+  for (uint32_t i = 0; i < 30; i++)
+    {
+      Ptr<CmDevice> cm = DynamicCast<CmDevice> (devices.Get (i + 1));
+      cm->SetTimeDistanceToCMTS (i < 10 ? MicroSeconds (5) : i < 20 ? NanoSeconds (5500) : MicroSeconds (15));
+      if (i != 0 && i != 20)
+        hfc->JoinGroup (group, cm->GetHandle ());
+
+      std::ostringstream context;
+      context << i;
+      cm->TraceConnect ("MacRx", context.str (), MakeCallback (&DocsisBroadcastDeliveryTestCase::Receive, this));
+    }
+
+  // A management message nobody acts on, on the channel the MAPs do not use.
+  Ptr<Packet> packet = Create<Packet> ();
+  MacManagementMessageHeader mmmh;
+  mmmh.Setup (Mac48Address::ConvertFrom (devices.Get (0)->GetAddress ()), Mac48Address::GetBroadcast (), 6, MacManagementMessageHeader::kGenericUCD);
+  packet->AddHeader (mmmh);
+  DocsisHeader dh;
+  dh.setupMSHManagement (hfc->GetDownstreamPhyOverhead (1), packet->GetSize (), kDownstream);
+  packet->AddHeader (dh);
+  m_uid = packet->GetUid ();
+
+  Simulator::Schedule (MilliSeconds (1), &Hfc::DownTransmitStart, hfc, 1, packet, Ptr<CmDevice> (0), MicroSeconds (10), group);
+  RunSimulation (MilliSeconds (2));
+
+  Time sent = MilliSeconds (1) + MicroSeconds (10);
+  for (uint32_t i = 0; i < 30; i++)
+    {
+      if (i == 0 || i == 20)
+        {
+          NS_TEST_EXPECT_MSG_EQ (m_received[i], 0, "CM outside the group got the broadcast");
+          continue;
+        }
+      NS_TEST_EXPECT_MSG_EQ (m_received[i], m_received[1], "Receivers do not share the packet");
+      NS_TEST_EXPECT_MSG_EQ (m_receivedAt[i], sent + (i < 20 ? NanoSeconds (5500) : MicroSeconds (15)), "Broadcast delivered at the wrong time");
+    }
+}
+
+// Overloads the upstream of one CM and compares how long packets wait, at
+// the median, in a deep drop-tail queue and in a DOCSIS-PIE queue.
+class DocsisPieQueueTestCase : public TestCase
+{
+public:
+  DocsisPieQueueTestCase ();
+
+private:
+  virtual void DoRun (void);
+  Time RunWithQueue (Ptr<Queue> queue);
+  void SendPacket (Ptr<NetDevice> device, Address address);
+  void Enqueued (Ptr<const Packet> packet);
+  void Dequeued (Ptr<const Packet> packet);
+
+  std::map<uint64_t, Time> m_enqueuedAt;
+  std::vector<Time> m_sojourn;
+};
+
+DocsisPieQueueTestCase::DocsisPieQueueTestCase ()
+  : TestCase ("Docsis PIE keeps the upstream queuing latency near its target")
+{
+}
+
+void
+DocsisPieQueueTestCase::SendPacket (Ptr<NetDevice> device, Address address)
+{
+  device->Send (Create<Packet> (1000), address, 0x800);
+  Simulator::Schedule (MicroSeconds (250), &DocsisPieQueueTestCase::SendPacket, this, device, address);
+}
+
+void
+DocsisPieQueueTestCase::Enqueued (Ptr<const Packet> packet)
+{
+  m_enqueuedAt[packet->GetUid ()] = Simulator::Now ();
+}
+
+void
+DocsisPieQueueTestCase::Dequeued (Ptr<const Packet> packet)
+{
+  std::map<uint64_t, Time>::iterator it = m_enqueuedAt.find (packet->GetUid ());
+  if (it == m_enqueuedAt.end ()) return;
+
+  // Skip the start up, until the queue has filled.
+  if (it->second > Seconds (1))
+    m_sojourn.push_back (Simulator::Now () - it->second);
+  m_enqueuedAt.erase (it);
+}
+
+Time
+DocsisPieQueueTestCase::RunWithQueue (Ptr<Queue> queue)
+{
+  m_enqueuedAt.clear ();
+  m_sojourn.clear ();
+
+  Ptr<CmtsDevice> cmts = CreateObject<CmtsDevice> ();
+  Ptr<CmDevice> cm = CreateObject<CmDevice> ();
+  Ptr<Hfc> channel = CreateObject<Hfc> ();
+
+  cm->SetQueue (queue);
+  ConnectDevices (cmts, cm, channel);
+  cm->SetAttribute ("RequestStrategy", EnumValue (kRequestQueueDepth));
+
+  queue->TraceConnectWithoutContext ("Enqueue", MakeCallback (&DocsisPieQueueTestCase::Enqueued, this));
+  queue->TraceConnectWithoutContext ("Dequeue", MakeCallback (&DocsisPieQueueTestCase::Dequeued, this));
+
+  Simulator::Schedule (MilliSeconds (100), &DocsisPieQueueTestCase::SendPacket, this, cm, cmts->GetAddress ());
+  RunSimulation (Seconds (3));
+
+  NS_TEST_EXPECT_MSG_GT (m_sojourn.size (), 100, "Too few packets made it upstream");
+  if (m_sojourn.empty ()) return Time (0);
+  std::sort (m_sojourn.begin (), m_sojourn.end ());
+  return m_sojourn[m_sojourn.size () / 2];
+}
+
+void
+DocsisPieQueueTestCase::DoRun (void)
+{
+  Ptr<Queue> dropTail = CreateObject<DropTailQueue> ();
+  dropTail->SetAttribute ("MaxPackets", UintegerValue (100000));
+  Time dropTailDelay = RunWithQueue (dropTail);
+
+  Ptr<DocsisPieQueue> pie = CreateObject<DocsisPieQueue> ();
+  pie->SetAttribute ("MaxBytes", UintegerValue (100000000));
+  pie->AssignStreams (1);
+  Time pieDelay = RunWithQueue (pie);
+
+  // PIE is still dropping, but the link stays busy.
+  NS_TEST_EXPECT_MSG_GT (m_sojourn.size (), 2000, "PIE dropped more than the overload");
+  NS_TEST_EXPECT_MSG_GT (dropTailDelay, MilliSeconds (200), "Drop tail queue did not build up a standing queue");
+  NS_TEST_EXPECT_MSG_LT (pieDelay, MilliSeconds (20), "PIE let the queuing latency grow past its target");
+}
+
+// Builds an IPv4 packet the way the stack hands it to the device.
+static Ptr<Packet>
+CreateIpv4Packet (uint32_t size, uint8_t protocol, Ipv4Address source, uint16_t destinationPort, uint8_t dscp, uint8_t ecn = 0)
+{
+  Ptr<Packet> packet = Create<Packet> (size);
+  if (protocol == 17)
+    {
+      UdpHeader udp;
+      udp.SetSourcePort (1000);
+      udp.SetDestinationPort (destinationPort);
+      packet->AddHeader (udp);
+    }
+  else if (protocol == 6)
+    {
+      TcpHeader tcp;
+      tcp.SetSourcePort (1000);
+      tcp.SetDestinationPort (destinationPort);
+      packet->AddHeader (tcp);
+    }
+
+  Ipv4Header ip;
+  ip.SetSource (source);
+  ip.SetDestination (Ipv4Address ("10.2.0.1"));
+  ip.SetProtocol (protocol);
+  ip.SetTos (dscp << 2 | ecn);
+  ip.SetPayloadSize (packet->GetSize ());
+  packet->AddHeader (ip);
+  return packet;
+}
+
+class DocsisClassifierTestCase : public TestCase
+{
+public:
+  DocsisClassifierTestCase ();
+
+private:
+  virtual void DoRun (void);
+};
+
+DocsisClassifierTestCase::DocsisClassifierTestCase ()
+  : TestCase ("Docsis classifiers map packets onto service flows by priority")
+{
+}
+
+void
+DocsisClassifierTestCase::DoRun (void)
+{
+  DocsisClassifier classifier;
+  Ipv4Address host ("10.1.2.3");
+  NS_TEST_ASSERT_MSG_EQ (classifier.Classify (CreateIpv4Packet (100, 17, host, 5060, 0), 0x0800), 0, "Packet classified without rules");
+
+  DocsisClassifierRule sip;
+  sip.priority = 10; sip.flow = 1; sip.protocol = 17; sip.destinationPortStart = sip.destinationPortEnd = 5060;
+  classifier.AddRule (sip);
+
+  DocsisClassifierRule expedited;
+  expedited.priority = 20; expedited.flow = 2; expedited.dscpLow = expedited.dscpHigh = 46;
+  classifier.AddRule (expedited);
+
+  DocsisClassifierRule arp;
+  arp.flow = 3; arp.ethertype = 0x0806;
+  classifier.AddRule (arp);
+
+  DocsisClassifierRule subnet;
+  subnet.priority = 5; subnet.flow = 4; subnet.protocol = 6; subnet.source = Ipv4Address ("10.1.0.0"); subnet.sourceMask = Ipv4Mask ("255.255.0.0");
+  classifier.AddRule (subnet);
+
+  DocsisClassifierRule ports;
+  ports.priority = 15; ports.flow = 5; ports.destinationPortStart = 6000; ports.destinationPortEnd = 6010;
+  classifier.AddRule (ports);
+
+  DocsisClassifierRule dscpRange;
+  dscpRange.priority = 1; dscpRange.flow = 6; dscpRange.dscpLow = 8; dscpRange.dscpHigh = 15;
+  classifier.AddRule (dscpRange);
+
+  // Same priority as the SIP rule, added later, so it never wins over it.
+  DocsisClassifierRule late = sip;
+  late.flow = 7;
+  classifier.AddRule (late);
+
+  NS_TEST_EXPECT_MSG_EQ (classifier.Classify (CreateIpv4Packet (100, 17, host, 5060, 0), 0x0800), 1, "Port rule missed");
+  NS_TEST_EXPECT_MSG_EQ (classifier.Classify (CreateIpv4Packet (100, 17, host, 5060, 46), 0x0800), 2, "Higher priority DSCP rule lost");
+  NS_TEST_EXPECT_MSG_EQ (classifier.Classify (Create<Packet> (28), 0x0806), 3, "Ethertype rule missed");
+  NS_TEST_EXPECT_MSG_EQ (classifier.Classify (CreateIpv4Packet (100, 6, host, 80, 0), 0x0800), 4, "Subnet rule missed");
+  NS_TEST_EXPECT_MSG_EQ (classifier.Classify (CreateIpv4Packet (100, 6, Ipv4Address ("10.3.2.3"), 80, 0), 0x0800), 0, "Subnet rule matched outside its subnet");
+  NS_TEST_EXPECT_MSG_EQ (classifier.Classify (CreateIpv4Packet (100, 17, host, 80, 0), 0x0800), 0, "Protocol of the subnet rule ignored");
+  NS_TEST_EXPECT_MSG_EQ (classifier.Classify (CreateIpv4Packet (100, 17, host, 6005, 0), 0x0800), 5, "Port range rule missed");
+  NS_TEST_EXPECT_MSG_EQ (classifier.Classify (CreateIpv4Packet (100, 6, host, 6011, 0), 0x0800), 4, "Port range rule matched outside its range");
+  NS_TEST_EXPECT_MSG_EQ (classifier.Classify (CreateIpv4Packet (100, 17, host, 80, 12), 0x0800), 6, "DSCP range rule missed");
+  NS_TEST_EXPECT_MSG_EQ (classifier.Classify (Create<Packet> (100), 0x0806), 3, "IP rules matched a non IP frame");
+
+  // Later fragments carry no ports.
+  Ptr<Packet> fragment = CreateIpv4Packet (100, 17, host, 5060, 0);
+  Ipv4Header ip;
+  fragment->RemoveHeader (ip);
+  ip.SetFragmentOffset (8);
+  fragment->AddHeader (ip);
+  NS_TEST_EXPECT_MSG_EQ (classifier.Classify (fragment, 0x0800), 0, "Ports read from a later fragment");
+}
+
+// Voice and bulk data share a CM. Once the voice packets are classified onto
+// their own polled flow, they stop waiting behind the data queue.
+class DocsisServiceFlowTestCase : public TestCase
+{
+public:
+  DocsisServiceFlowTestCase ();
+
+private:
+  virtual void DoRun (void);
+  void RunVoice (bool classify);
+  void SendData (Ptr<NetDevice> device, Address address);
+  void SendVoice (Ptr<NetDevice> device, Address address);
+  bool Receive (Ptr<NetDevice> device, Ptr<const Packet> packet, uint16_t protocol, const Address &source);
+  bool ReceiveDownstream (Ptr<NetDevice> device, Ptr<const Packet> packet, uint16_t protocol, const Address &source);
+
+  std::map<uint32_t, Time> m_voiceSent;	// By payload size, unique per voice packet
+  Time m_worstVoiceDelay;
+  uint32_t m_voiceReceived;
+  uint32_t m_downstreamReceived;
+};
+
+DocsisServiceFlowTestCase::DocsisServiceFlowTestCase ()
+  : TestCase ("Docsis classified service flows isolate voice from bulk data")
+{
+}
+
+void
+DocsisServiceFlowTestCase::SendData (Ptr<NetDevice> device, Address address)
+{
+  device->Send (CreateIpv4Packet (1000, 17, Ipv4Address ("10.1.0.2"), 9, 0), address, 0x800);
+  Simulator::Schedule (MicroSeconds (250), &DocsisServiceFlowTestCase::SendData, this, device, address);
+}
+
+void
+DocsisServiceFlowTestCase::SendVoice (Ptr<NetDevice> device, Address address)
+{
+  uint32_t size = 160 + m_voiceSent.size ();
+  m_voiceSent[size] = Simulator::Now ();
+  device->Send (CreateIpv4Packet (size, 17, Ipv4Address ("10.1.0.2"), 5060, 46), address, 0x800);
+  Simulator::Schedule (MilliSeconds (20), &DocsisServiceFlowTestCase::SendVoice, this, device, address);
+}
+
+bool
+DocsisServiceFlowTestCase::Receive (Ptr<NetDevice> device, Ptr<const Packet> packet, uint16_t protocol, const Address &source)
+{
+  Ptr<Packet> copy = packet->Copy ();
+  Ipv4Header ip;
+  UdpHeader udp;
+  copy->RemoveHeader (ip);
+  copy->RemoveHeader (udp);
+  if (udp.GetDestinationPort () != 5060) return true;
+
+  std::map<uint32_t, Time>::iterator sent = m_voiceSent.find (copy->GetSize ());
+  if (sent == m_voiceSent.end ()) return true;
+  m_voiceReceived++;
+  if (sent->second > Seconds (1))
+    m_worstVoiceDelay = std::max (m_worstVoiceDelay, Simulator::Now () - sent->second);
+  return true;
+}
+
+bool
+DocsisServiceFlowTestCase::ReceiveDownstream (Ptr<NetDevice> device, Ptr<const Packet> packet, uint16_t protocol, const Address &source)
+{
+  m_downstreamReceived++;
+  return true;
+}
+
+void
+DocsisServiceFlowTestCase::RunVoice (bool classify)
+{
+  m_voiceSent.clear ();
+  m_worstVoiceDelay = Seconds (0);
+  m_voiceReceived = 0;
+  m_downstreamReceived = 0;
+
+  Ptr<CmtsDevice> cmts = CreateObject<CmtsDevice> ();
+  Ptr<CmDevice> cm = CreateObject<CmDevice> ();
+  Ptr<Hfc> channel = CreateObject<Hfc> ();
+
+  ConnectDevices (cmts, cm, channel);
+  cm->SetAttribute ("RequestStrategy", EnumValue (kRequestQueueDepth));
+  cmts->SetReceiveCallback (MakeCallback (&DocsisServiceFlowTestCase::Receive, this));
+  cm->SetReceiveCallback (MakeCallback (&DocsisServiceFlowTestCase::ReceiveDownstream, this));
+
+  if (classify)
+    {
+      // Added once the CM is registered, so the CMTS admits them on the fly.
+      DocsisServiceFlow voice;
+      voice.mode = kRealTimePolling;
+      DocsisClassifierRule rule;
+      rule.protocol = 17;
+      rule.destinationPortStart = rule.destinationPortEnd = 5060;
+      rule.flow = cm->AddUpstreamServiceFlow (voice);
+      cm->AddUpstreamClassifier (rule);
+
+      rule.flow = cm->AddDownstreamServiceFlow (DocsisServiceFlow ());
+      cm->AddDownstreamClassifier (rule);
+    }
+
+  Simulator::Schedule (MilliSeconds (100), &DocsisServiceFlowTestCase::SendData, this, cm, cmts->GetAddress ());
+  Simulator::Schedule (MilliSeconds (105), &DocsisServiceFlowTestCase::SendVoice, this, cm, cmts->GetAddress ());
+  for (uint32_t i = 0; i < 10; i++)
+    Simulator::Schedule (MilliSeconds (500 + i), &NetDevice::Send, cmts, CreateIpv4Packet (100, 17, Ipv4Address ("10.2.0.1"), 5060 + i % 2, 0), cm->GetAddress (), 0x800);
+  RunSimulation (Seconds (3));
+}
+
+void
+DocsisServiceFlowTestCase::DoRun (void)
+{
+  // Behind the data, voice only gets into the full queue when a grant has
+  // just made room, so how much of it is lost depends on the phase of the
+  // MAPs.
+  RunVoice (false);
+  NS_TEST_EXPECT_MSG_GT (m_voiceReceived, 0, "Voice packets were lost");
+  NS_TEST_EXPECT_MSG_EQ (m_downstreamReceived, 10, "Downstream packets were lost");
+  NS_TEST_EXPECT_MSG_GT (m_worstVoiceDelay, MilliSeconds (30), "Voice did not wait behind the data sharing its flow");
+
+  RunVoice (true);
+  NS_TEST_EXPECT_MSG_GT (m_voiceReceived, 100, "Voice packets were lost");
+  NS_TEST_EXPECT_MSG_EQ (m_downstreamReceived, 10, "Downstream packets were lost");
+  NS_TEST_EXPECT_MSG_LT (m_worstVoiceDelay, MilliSeconds (10), "Voice waited behind the data of another flow");
+}
+
+class DocsisRateShapingTestCase : public TestCase
+{
+public:
+  DocsisRateShapingTestCase ();
+
+private:
+  virtual void DoRun (void);
+  void Send (Ptr<NetDevice> device, Address address, Time interval, Time stop);
+  bool ReceiveUpstream (Ptr<NetDevice> device, Ptr<const Packet> packet, uint16_t protocol, const Address &source);
+  bool ReceiveDownstream (Ptr<NetDevice> device, Ptr<const Packet> packet, uint16_t protocol, const Address &source);
+
+  uint64_t m_upstreamBytes;	// Received in the measurement window
+  uint64_t m_downstreamBytes;
+  uint32_t m_burstReceived;
+};
+
+DocsisRateShapingTestCase::DocsisRateShapingTestCase ()
+  : TestCase ("Docsis token buckets hold service flows to their rate tier")
+{
+}
+
+void
+DocsisRateShapingTestCase::Send (Ptr<NetDevice> device, Address address, Time interval, Time stop)
+{
+  device->Send (CreateIpv4Packet (1000, 17, Ipv4Address ("10.1.0.2"), 9, 0), address, 0x800);
+  if (Simulator::Now () + interval < stop)
+    Simulator::Schedule (interval, &DocsisRateShapingTestCase::Send, this, device, address, interval, stop);
+}
+
+bool
+DocsisRateShapingTestCase::ReceiveUpstream (Ptr<NetDevice> device, Ptr<const Packet> packet, uint16_t protocol, const Address &source)
+{
+  if (Simulator::Now () >= Seconds (1) && Simulator::Now () < Seconds (3))
+    m_upstreamBytes += packet->GetSize ();
+  return true;
+}
+
+bool
+DocsisRateShapingTestCase::ReceiveDownstream (Ptr<NetDevice> device, Ptr<const Packet> packet, uint16_t protocol, const Address &source)
+{
+  if (Simulator::Now () < MilliSeconds (510))
+    m_burstReceived++;
+  if (Simulator::Now () >= Seconds (1.5) && Simulator::Now () < Seconds (3))
+    m_downstreamBytes += packet->GetSize ();
+  return true;
+}
+
+void
+DocsisRateShapingTestCase::DoRun (void)
+{
+  m_upstreamBytes = 0;
+  m_downstreamBytes = 0;
+  m_burstReceived = 0;
+
+  Ptr<CmtsDevice> cmts = CreateObject<CmtsDevice> ();
+  Ptr<CmDevice> cm = CreateObject<CmDevice> ();
+  Ptr<Hfc> channel = CreateObject<Hfc> ();
+
+  // The downstream tier is provisioned before registration, the upstream
+  // one changed afterwards.
+  DocsisServiceFlow downstream;
+  downstream.maxSustainedRate = DataRate ("8Mbps");
+  downstream.maxTrafficBurst = 20000;
+  cm->SetDownstreamServiceFlow (0, downstream);
+
+  ConnectDevices (cmts, cm, channel);
+  cm->SetAttribute ("RequestStrategy", EnumValue (kRequestQueueDepth));
+  cmts->SetReceiveCallback (MakeCallback (&DocsisRateShapingTestCase::ReceiveUpstream, this));
+  cm->SetReceiveCallback (MakeCallback (&DocsisRateShapingTestCase::ReceiveDownstream, this));
+
+  DocsisServiceFlow upstream;
+  upstream.maxSustainedRate = DataRate ("4Mbps");
+  cm->SetUpstreamServiceFlow (0, upstream);
+
+  // Both directions are offered 32 Mbps. A burst within the Max Traffic
+  // Burst goes through at the channel's pace.
+  Simulator::Schedule (MilliSeconds (100), &DocsisRateShapingTestCase::Send, this, cm, cmts->GetAddress (), MicroSeconds (250), Seconds (3));
+  for (uint32_t i = 0; i < 16; i++)
+    Simulator::Schedule (MilliSeconds (500), &NetDevice::Send, cmts, CreateIpv4Packet (1000, 17, Ipv4Address ("10.2.0.1"), 9, 0), cm->GetAddress (), 0x800);
+  Simulator::Schedule (Seconds (1), &DocsisRateShapingTestCase::Send, this, cmts, cm->GetAddress (), MicroSeconds (250), Seconds (3));
+  RunSimulation (Seconds (3));
+
+  // Grants are charged with their PHY and MAC overhead, so the upstream
+  // carries somewhat less than the rate in IP bytes.
+  double upstreamRate = m_upstreamBytes * 8 / 2.0;
+  double downstreamRate = m_downstreamBytes * 8 / 1.5;
+  NS_TEST_EXPECT_MSG_GT (upstreamRate, 3.4e6, "The upstream fell well short of its sustained rate");
+  NS_TEST_EXPECT_MSG_LT (upstreamRate, 4.1e6, "The upstream went past its sustained rate");
+  NS_TEST_EXPECT_MSG_GT (downstreamRate, 7.6e6, "The downstream fell well short of its sustained rate");
+  NS_TEST_EXPECT_MSG_LT (downstreamRate, 8.1e6, "The downstream went past its sustained rate");
+  NS_TEST_EXPECT_MSG_EQ (m_burstReceived, 16, "A burst within the Max Traffic Burst was held back");
+}
+
+// Four CMs overload the downstream. The one with a minimum reserved rate
+// gets it, and the rest is shared in proportion to the traffic priorities.
+class DocsisDownstreamSchedulerTestCase : public TestCase
+{
+public:
+  DocsisDownstreamSchedulerTestCase ();
+
+private:
+  virtual void DoRun (void);
+  void Send (Ptr<NetDevice> cmts, NetDeviceContainer cms);
+  bool Receive (Ptr<NetDevice> device, Ptr<const Packet> packet, uint16_t protocol, const Address &source);
+
+  std::map<Ptr<NetDevice>, double> m_rates;	// Bits per second over the measurement window
+};
+
+DocsisDownstreamSchedulerTestCase::DocsisDownstreamSchedulerTestCase ()
+  : TestCase ("Docsis downstream scheduler honors reserved rates and priorities")
+{
+}
+
+void
+DocsisDownstreamSchedulerTestCase::Send (Ptr<NetDevice> cmts, NetDeviceContainer cms)
+{
+  for (uint32_t i = 0; i < cms.GetN (); i++)
+    cmts->Send (CreateIpv4Packet (1000, 17, Ipv4Address ("10.2.0.1"), 9, 0), cms.Get (i)->GetAddress (), 0x800);
+  Simulator::Schedule (MicroSeconds (200), &DocsisDownstreamSchedulerTestCase::Send, this, cmts, cms);
+}
+
+bool
+DocsisDownstreamSchedulerTestCase::Receive (Ptr<NetDevice> device, Ptr<const Packet> packet, uint16_t protocol, const Address &source)
+{
+  if (Simulator::Now () >= Seconds (1) && Simulator::Now () < Seconds (3))
+    m_rates[device] += packet->GetSize () * 8 / 2.0;
+  return true;
+}
+
+void
+DocsisDownstreamSchedulerTestCase::DoRun (void)
+{
+  NodeContainer cmtsNode;
+  cmtsNode.Create (1);
+  NodeContainer cmNodes;
+  cmNodes.Create (4);
+
+  DocsisHelper docsis;
+  NetDeviceContainer devices = docsis.Install (cmtsNode.Get (0), cmNodes);
+  NetDeviceContainer cms;
+  for (uint32_t i = 1; i < devices.GetN (); i++)
+    {
+      cms.Add (devices.Get (i));
+      devices.Get (i)->SetReceiveCallback (MakeCallback (&DocsisDownstreamSchedulerTestCase::Receive, this));
+    }
+
+  DocsisServiceFlow priority;
+  priority.trafficPriority = 3;
+  DynamicCast<CmDevice> (cms.Get (1))->SetDownstreamServiceFlow (0, priority);
+  DocsisServiceFlow reserved;
+  reserved.minReservedRate = DataRate ("10Mbps");
+  DynamicCast<CmDevice> (cms.Get (2))->SetDownstreamServiceFlow (0, reserved);
+
+  // Every CM is offered 40 Mbps.
+  Simulator::Schedule (MilliSeconds (100), &DocsisDownstreamSchedulerTestCase::Send, this, devices.Get (0), cms);
+  RunSimulation (Seconds (3));
+
+  double base = m_rates[cms.Get (0)];
+  NS_TEST_EXPECT_MSG_GT (base, 1e6, "A best effort flow was starved");
+  NS_TEST_EXPECT_MSG_EQ_TOL (m_rates[cms.Get (3)] / base, 1, 0.05, "Flows of the same priority got unequal shares");
+  NS_TEST_EXPECT_MSG_EQ_TOL (m_rates[cms.Get (1)] / base, 4, 0.2, "The share did not follow the traffic priority");
+  NS_TEST_EXPECT_MSG_EQ_TOL (m_rates[cms.Get (2)] - base, 9.8e6, 0.3e6, "The reserved rate did not come on top of the fair share");
+}
+
+class DocsisInitializationTestCase : public TestCase
+{
+public:
+  DocsisInitializationTestCase ();
+
+private:
+  virtual void DoRun (void);
+  void Send (NetDeviceContainer cms, Address cmts);
+  void Collision (Ptr<const Packet> packet, uint32_t channel);
+  bool Receive (Ptr<NetDevice> device, Ptr<const Packet> packet, uint16_t protocol, const Address &source);
+
+  uint32_t m_collisions;
+  uint32_t m_received;
+};
+
+DocsisInitializationTestCase::DocsisInitializationTestCase ()
+  : TestCase ("Docsis CMs range and register before they go operational"), m_collisions (0), m_received (0)
+{
+}
+
+void
+DocsisInitializationTestCase::Send (NetDeviceContainer cms, Address cmts)
+{
+  for (uint32_t i = 0; i < cms.GetN (); i++)
+    cms.Get (i)->Send (CreateIpv4Packet (500, 17, Ipv4Address ("10.1.0.2"), 9, 0), cmts, 0x800);
+}
+
+void
+DocsisInitializationTestCase::Collision (Ptr<const Packet> packet, uint32_t channel)
+{
+  m_collisions++;
+}
+
+bool
+DocsisInitializationTestCase::Receive (Ptr<NetDevice> device, Ptr<const Packet> packet, uint16_t protocol, const Address &source)
+{
+  m_received++;
+  return true;
+}
+
+void
+DocsisInitializationTestCase::DoRun (void)
+{
+  const uint32_t nCms = 20;
+
+  NodeContainer cmtsNode;
+  cmtsNode.Create (1);
+  NodeContainer cmNodes;
+  cmNodes.Create (nCms);
+
+  // Every CM reboots at once, between 1 and 20 km from the CMTS.
+  DocsisHelper docsis;
+  docsis.SetCmAttribute ("Initialization", EnumValue (kFullInitialization));
+  Ptr<UniformRandomVariable> distance = CreateObject<UniformRandomVariable> ();
+  distance->SetAttribute ("Min", DoubleValue (1));
+  distance->SetAttribute ("Max", DoubleValue (20));
+  docsis.SetDistance (distance);
+  NetDeviceContainer devices = docsis.Install (cmtsNode.Get (0), cmNodes);
+  devices.Get (0)->SetReceiveCallback (MakeCallback (&DocsisInitializationTestCase::Receive, this));
+  devices.Get (0)->GetChannel ()->TraceConnectWithoutContext ("UpstreamCollision", MakeCallback (&DocsisInitializationTestCase::Collision, this));
+
+  NetDeviceContainer cms;
+  for (uint32_t i = 1; i < devices.GetN (); i++)
+    cms.Add (devices.Get (i));
+
+  NS_TEST_ASSERT_MSG_EQ (cms.Get (0)->IsLinkUp (), false, "The CM was up before it registered");
+  NS_TEST_ASSERT_MSG_EQ (cms.Get (0)->Send (CreateIpv4Packet (500, 17, Ipv4Address ("10.1.0.2"), 9, 0), devices.Get (0)->GetAddress (), 0x800),
+                         false, "The CM sent data before it registered");
+
+  Simulator::Schedule (Seconds (2), &DocsisInitializationTestCase::Send, this, cms, devices.Get (0)->GetAddress ());
+  Simulator::Stop (Seconds (2.5));
+  Simulator::Run ();
+
+  for (uint32_t i = 0; i < cms.GetN (); i++)
+    {
+      Ptr<CmDevice> cm = DynamicCast<CmDevice> (cms.Get (i));
+      NS_TEST_EXPECT_MSG_EQ (cm->GetInitState (), CmDevice::kOperational, "CM " << i << " did not register");
+      NS_TEST_EXPECT_MSG_EQ (cm->IsLinkUp (), true, "CM " << i << " did not bring its link up");
+      NS_TEST_EXPECT_MSG_EQ_TOL (cm->GetRangingOffset ().GetNanoSeconds (), cm->GetTimeDistanceToCMTS ().GetNanoSeconds (), 1,
+                                 "CM " << i << " ranged to the wrong offset");
+    }
+  NS_TEST_EXPECT_MSG_GT (m_collisions, 0, "The CMs did not contend for initial maintenance");
+  NS_TEST_EXPECT_MSG_EQ (m_received, nCms, "Data was lost once the CMs had registered");
+
+  Simulator::Destroy ();
+}
+
+// CMs that share a delivery window act on its broadcasts in the context of
+// their own node.
+class DocsisBroadcastContextTestCase : public TestCase
+{
+public:
+  DocsisBroadcastContextTestCase ();
+
+private:
+  virtual void DoRun (void);
+  void Send (NetDeviceContainer cms, Address cmts);
+  void Transmit (std::string context, Ptr<const Packet> packet);
+  bool Receive (Ptr<NetDevice> device, Ptr<const Packet> packet, uint16_t protocol, const Address &source);
+
+  uint32_t m_transmitted;
+  uint32_t m_received;
+  uint32_t m_wrongContext;
+};
+
+DocsisBroadcastContextTestCase::DocsisBroadcastContextTestCase ()
+  : TestCase ("Docsis CMs handle shared broadcasts in their own context"), m_transmitted (0), m_received (0), m_wrongContext (0)
+{
+}
+
+void
+DocsisBroadcastContextTestCase::Send (NetDeviceContainer cms, Address cmts)
+{
+  for (uint32_t i = 0; i < cms.GetN (); i++)
+    cms.Get (i)->Send (CreateIpv4Packet (500, 17, Ipv4Address ("10.1.0.2"), 9, 0), cmts, 0x800);
+}
+
+void
+DocsisBroadcastContextTestCase::Transmit (std::string context, Ptr<const Packet> packet)
+{
+  m_transmitted++;
+  if (Simulator::GetContext () != (uint32_t) atoi (context.c_str ()))
+    m_wrongContext++;
+}
+
+bool
+DocsisBroadcastContextTestCase::Receive (Ptr<NetDevice> device, Ptr<const Packet> packet, uint16_t protocol, const Address &source)
+{
+  m_received++;
+  if (Simulator::GetContext () != device->GetNode ()->GetId ())
+    m_wrongContext++;
+  return true;
+}
+
+void
+DocsisBroadcastContextTestCase::DoRun (void)
+{
+  NodeContainer cmtsNode;
+  cmtsNode.Create (1);
+  NodeContainer cmNodes;
+  cmNodes.Create (5);
+
+  // All the CMs are as far away, so each MAP reaches them in one event.
+  DocsisHelper docsis;
+  NetDeviceContainer devices = docsis.Install (cmtsNode.Get (0), cmNodes);
+  NetDeviceContainer cms;
+  for (uint32_t i = 1; i < devices.GetN (); i++)
+    {
+      std::ostringstream context;
+      context << devices.Get (i)->GetNode ()->GetId ();
+      devices.Get (i)->TraceConnect ("PhyTxBegin", context.str (), MakeCallback (&DocsisBroadcastContextTestCase::Transmit, this));
+      devices.Get (i)->SetReceiveCallback (MakeCallback (&DocsisBroadcastContextTestCase::Receive, this));
+      cms.Add (devices.Get (i));
+    }
+
+  Simulator::Schedule (Seconds (1), &DocsisBroadcastContextTestCase::Send, this, cms, devices.Get (0)->GetAddress ());
+  Simulator::Schedule (Seconds (1.1), &NetDevice::Send, devices.Get (0), CreateIpv4Packet (500, 17, Ipv4Address ("10.1.0.1"), 9, 0),
+                       devices.Get (0)->GetBroadcast (), 0x800);
+  RunSimulation (Seconds (1.2));
+
+  NS_TEST_ASSERT_MSG_GT (m_transmitted, 4, "The CMs did not transmit");
+  NS_TEST_ASSERT_MSG_EQ (m_received, 5, "The broadcast did not reach every CM");
+  NS_TEST_EXPECT_MSG_EQ (m_wrongContext, 0, "A CM ran in the context of another node");
+}
+
+// CMs that come and go through ranging hand their SIDs back, so the
+// 14-bit SID space outlasts far more of them than it holds. Ranging that
+// many takes a while, so this only runs with the extensive tests.
+class DocsisSidReuseTestCase : public TestCase
+{
+public:
+  DocsisSidReuseTestCase ();
+
+private:
+  virtual void DoRun (void);
+  void Cycle (NetDeviceContainer cms, Ptr<Hfc> hfc);
+
+  uint32_t m_registered;
+};
+
+DocsisSidReuseTestCase::DocsisSidReuseTestCase ()
+  : TestCase ("Docsis CMTS reuses the SIDs of CMs that leave"), m_registered (0)
+{
+}
+
+void
+DocsisSidReuseTestCase::Cycle (NetDeviceContainer cms, Ptr<Hfc> hfc)
+{
+  // A CM that registered goes away and comes back, to range again.
+  for (uint32_t i = 0; i < cms.GetN (); i++)
+    {
+      Ptr<CmDevice> cm = DynamicCast<CmDevice> (cms.Get (i));
+      if (cm->GetInitState () != CmDevice::kOperational) continue;
+      m_registered++;
+      cm->Deattach ();
+      cm->Attach (hfc);
+    }
+  Simulator::Schedule (MilliSeconds (1), &DocsisSidReuseTestCase::Cycle, this, cms, hfc);
+}
+
+void
+DocsisSidReuseTestCase::DoRun (void)
+{
+  const uint32_t nRegistrations = 8500;
+
+  NodeContainer cmtsNode;
+  cmtsNode.Create (1);
+  NodeContainer cmNodes;
+  cmNodes.Create (6);
+
+  // Every MAP offers initial maintenance, and the CMs back off enough for
+  // most of them to find it free.
+  DocsisHelper docsis;
+  docsis.SetCmtsAttribute ("InitialRangingInterval", TimeValue (Seconds (0)));
+  docsis.SetCmtsAttribute ("RangingBackoffStart", UintegerValue (3));
+  docsis.SetCmtsAttribute ("RangingTolerance", TimeValue (MicroSeconds (1000)));
+  docsis.SetCmAttribute ("Initialization", EnumValue (kFullInitialization));
+  NetDeviceContainer devices = docsis.Install (cmtsNode.Get (0), cmNodes);
+  Ptr<CmtsDevice> cmts = DynamicCast<CmtsDevice> (devices.Get (0));
+
+  NetDeviceContainer cms;
+  for (uint32_t i = 1; i < devices.GetN (); i++)
+    cms.Add (devices.Get (i));
+
+  Simulator::ScheduleNow (&DocsisSidReuseTestCase::Cycle, this, cms, DynamicCast<Hfc> (cmts->GetChannel ()));
+  while (m_registered < nRegistrations && Simulator::Now () < Seconds (200))
+    {
+      Simulator::Stop (Seconds (1));
+      Simulator::Run ();
+    }
+
+  NS_TEST_EXPECT_MSG_GT (m_registered, nRegistrations - 1, "CMs stopped registering once the SIDs ran out");
+  for (uint32_t i = 0; i < cms.GetN (); i++)
+    NS_TEST_EXPECT_MSG_EQ (cmts->Send (Create<Packet> (100), cms.Get (i)->GetAddress (), 0x800), true, "CM " << i << " was lost");
+
+  Simulator::Destroy ();
+}
+
+class DocsisErrorModelTestCase : public TestCase
+{
+public:
+  DocsisErrorModelTestCase ();
+
+private:
+  virtual void DoRun (void);
+  void Send (Ptr<NetDevice> cm, Address cmts);
+  void Corrupt (Ptr<const Packet> packet, uint32_t channel);
+  bool Receive (Ptr<NetDevice> device, Ptr<const Packet> packet, uint16_t protocol, const Address &source);
+
+  NetDeviceContainer m_cms;
+  uint32_t m_received[2];
+  uint32_t m_corrupt;
+};
+
+DocsisErrorModelTestCase::DocsisErrorModelTestCase ()
+  : TestCase ("Docsis RF impairments drop frames by the SNR of each CM"), m_corrupt (0)
+{
+  m_received[0] = m_received[1] = 0;
+}
+
+void
+DocsisErrorModelTestCase::Send (Ptr<NetDevice> cm, Address cmts)
+{
+  cm->Send (CreateIpv4Packet (500, 17, Ipv4Address ("10.1.0.2"), 9, 0), cmts, 0x800);
+}
+
+void
+DocsisErrorModelTestCase::Corrupt (Ptr<const Packet> packet, uint32_t channel)
+{
+  m_corrupt++;
+}
+
+bool
+DocsisErrorModelTestCase::Receive (Ptr<NetDevice> device, Ptr<const Packet> packet, uint16_t protocol, const Address &source)
+{
+  for (uint32_t i = 0; i < m_cms.GetN (); i++)
+    if (m_cms.Get (i)->GetAddress () == source)
+      m_received[i]++;
+  return true;
+}
+
+void
+DocsisErrorModelTestCase::DoRun (void)
+{
+  // The codeword error rate falls from all to nothing as the SNR grows, and
+  // denser constellations need more of it.
+  Ptr<DocsisCodewordErrorModel> model = CreateObject<DocsisCodewordErrorModel> ();
+  NS_TEST_ASSERT_MSG_EQ_TOL (model->GetCodewordErrorRate (64, 5), 1, 1e-3, "A codeword survived a 5 dB channel");
+  NS_TEST_ASSERT_MSG_EQ_TOL (model->GetCodewordErrorRate (64, 40), 0, 1e-12, "A codeword was lost on a 40 dB channel");
+  double last = 1;
+  for (double snr = 10; snr <= 35; snr += 0.5)
+    {
+      double cer = model->GetCodewordErrorRate (64, snr);
+      NS_TEST_ASSERT_MSG_EQ ((cer <= last), true, "The codeword error rate grew with the SNR at " << snr << " dB");
+      last = cer;
+    }
+  NS_TEST_ASSERT_MSG_GT (model->GetCodewordErrorRate (256, 24), model->GetCodewordErrorRate (16, 24), "256-QAM was as robust as 16-QAM");
+  // 1000 bytes take 8000 / (122 * 7) = 9.4, so 10 codewords.
+  double cer = model->GetCodewordErrorRate (64, 21);
+  NS_TEST_ASSERT_MSG_EQ_TOL (model->GetFrameErrorRate (64, 21, 1000), 1 - std::pow (1 - cer, 10), 1e-9, "Wrong frame error rate");
+
+  NodeContainer cmtsNode;
+  cmtsNode.Create (1);
+  NodeContainer cmNodes;
+  cmNodes.Create (2);
+
+  DocsisHelper docsis;
+  NetDeviceContainer devices = docsis.Install (cmtsNode.Get (0), cmNodes);
+  docsis.AssignStreams (devices, 1);
+  m_cms.Add (devices.Get (1));
+  m_cms.Add (devices.Get (2));
+  devices.Get (0)->SetReceiveCallback (MakeCallback (&DocsisErrorModelTestCase::Receive, this));
+
+  // The first CM is heard at 15 dB, the second at the 35 dB of the plant.
+  Ptr<Hfc> hfc = DynamicCast<Hfc> (devices.Get (0)->GetChannel ());
+  hfc->SetUpstreamErrorModel (CreateObject<DocsisCodewordErrorModel> ());
+  hfc->SetCmSnr (DynamicCast<CmDevice> (m_cms.Get (0)), kUpstream, 0, 15);
+  hfc->TraceConnectWithoutContext ("UpstreamCorrupt", MakeCallback (&DocsisErrorModelTestCase::Corrupt, this));
+
+  for (uint32_t i = 0; i < 20; i++)
+    {
+      Simulator::Schedule (MilliSeconds (10 * i), &DocsisErrorModelTestCase::Send, this, m_cms.Get (0), devices.Get (0)->GetAddress ());
+      Simulator::Schedule (MilliSeconds (10 * i), &DocsisErrorModelTestCase::Send, this, m_cms.Get (1), devices.Get (0)->GetAddress ());
+    }
+  Simulator::Stop (MilliSeconds (300));
+  Simulator::Run ();
+
+  NS_TEST_EXPECT_MSG_EQ (m_received[0], 0, "Frames got through a 15 dB upstream");
+  NS_TEST_EXPECT_MSG_EQ (m_received[1], 20, "Frames were lost on a clean upstream");
+  NS_TEST_EXPECT_MSG_GT (m_corrupt, 0, "The lost frames were not traced");
+
+  // Burst noise a third of the time takes the good CM under as well.
+  m_received[1] = 0;
+  m_corrupt = 0;
+  hfc->SetUpstreamBurstNoise (0, 100, MilliSeconds (5), 30);
+  for (uint32_t i = 0; i < 50; i++)
+    Simulator::Schedule (MilliSeconds (10 * i), &DocsisErrorModelTestCase::Send, this, m_cms.Get (1), devices.Get (0)->GetAddress ());
+  Simulator::Stop (MilliSeconds (600));
+  Simulator::Run ();
+
+  NS_TEST_EXPECT_MSG_GT (m_corrupt, 5, "Burst noise did not hit the upstream");
+  NS_TEST_EXPECT_MSG_GT (m_received[1], 20, "Frames outside the bursts were lost");
+
+  Simulator::Destroy ();
+}
+
+class DocsisPcapTestCase : public TestCase
+{
+public:
+  DocsisPcapTestCase ();
+
+private:
+  virtual void DoRun (void);
+  void Send (Ptr<NetDevice> cm, Address cmts);
+  void CountFrames (std::string filename, uint32_t &data, uint32_t &management);
+};
+
+DocsisPcapTestCase::DocsisPcapTestCase ()
+  : TestCase ("Docsis pcap traces hold the MAC frames of each device")
+{
+}
+
+void
+DocsisPcapTestCase::Send (Ptr<NetDevice> cm, Address cmts)
+{
+  cm->Send (CreateIpv4Packet (500, 17, Ipv4Address ("10.1.0.2"), 9, 0), cmts, 0x800);
+}
+
+void
+DocsisPcapTestCase::CountFrames (std::string filename, uint32_t &data, uint32_t &management)
+{
+  PcapFile file;
+  file.Open (filename, std::ios::in);
+  NS_TEST_ASSERT_MSG_EQ (file.Fail (), false, "The capture of " << filename << " was not written");
+  NS_TEST_ASSERT_MSG_EQ (file.GetDataLinkType (), PcapHelper::DLT_DOCSIS, "The capture is not DLT_DOCSIS");
+
+  data = management = 0;
+  uint8_t frame[65535];
+  uint32_t tsSec, tsUsec, inclLen, origLen, readLen;
+  while (true)
+    {
+      file.Read (frame, sizeof (frame), tsSec, tsUsec, inclLen, origLen, readLen);
+      if (file.Eof () || file.Fail ())
+        break;
+
+      // Every record starts at the MAC header, whose LEN covers the rest.
+      if ((frame[0] >> 6) == DocsisHeader::kPacketPDU)
+        {
+          data++;
+          NS_TEST_ASSERT_MSG_EQ ((uint32_t) ((frame[2] << 8) + frame[3] + 6), origLen, "The record does not start at the MAC header");
+        }
+      else if (frame[0] == ((DocsisHeader::kMacSpecific << 6) | (DocsisHeader::kMacManagement << 1)))
+        management++;
+    }
+  file.Close ();
+}
+
+void
+DocsisPcapTestCase::DoRun (void)
+{
+  NodeContainer cmtsNode;
+  cmtsNode.Create (1);
+  NodeContainer cmNodes;
+  cmNodes.Create (1);
+
+  DocsisHelper docsis;
+  NetDeviceContainer devices = docsis.Install (cmtsNode.Get (0), cmNodes);
+  std::string cmtsCapture = CreateTempDirFilename ("docsis-cmts.pcap");
+  std::string cmCapture = CreateTempDirFilename ("docsis-cm.pcap");
+  docsis.EnablePcap (cmtsCapture, devices.Get (0), false, true);
+  docsis.EnablePcap (cmCapture, devices.Get (1), false, true);
+
+  for (uint32_t i = 0; i < 5; i++)
+    Simulator::Schedule (MilliSeconds (10 * i), &DocsisPcapTestCase::Send, this, devices.Get (1), devices.Get (0)->GetAddress ());
+  Simulator::Stop (MilliSeconds (100));
+  Simulator::Run ();
+  // The captures are complete once the writers are flushed.
+  Simulator::Destroy ();
+
+  uint32_t data, management;
+  CountFrames (cmtsCapture, data, management);
+  NS_TEST_EXPECT_MSG_EQ (data, 5, "The CMTS capture misses upstream data");
+  NS_TEST_EXPECT_MSG_GT (management, 10, "The CMTS capture misses the MAPs");
+  CountFrames (cmCapture, data, management);
+  NS_TEST_EXPECT_MSG_EQ (data, 5, "The CM capture misses upstream data");
+  NS_TEST_EXPECT_MSG_GT (management, 10, "The CM capture misses the MAPs");
+}
+
+class DocsisHeaderTestCase : public TestCase
+{
+public:
+  DocsisHeaderTestCase ();
+
+private:
+  virtual void DoRun (void);
+};
+
+DocsisHeaderTestCase::DocsisHeaderTestCase ()
+  : TestCase ("Docsis MAC headers survive a round trip behind PHY overhead")
+{
+}
+
+void
+DocsisHeaderTestCase::DoRun (void)
+{
+  Ptr<Packet> packet = Create<Packet> (100);
+  PDUHeader pdu;
+  pdu.Setup (Mac48Address ("00:00:00:00:00:01"), Mac48Address ("00:00:00:00:00:02"), 0x800);
+  packet->AddHeader (pdu);
+
+  DocsisHeader dh;
+  dh.setupPduPacket (30, packet->GetSize (), kUpstream);
+  DocsisHeader::ExtendedHeader::ExtendedHeaderElement request;
+  request.m_type = DocsisHeader::kEHRequest;
+  request.m_length = 3;
+  request.m_sid = 0x1234;
+  request.m_minislots = 17;
+  dh.addExtendedHeader (request);
+  DocsisHeader::ExtendedHeader::ExtendedHeaderElement privacy;
+  privacy.m_type = DocsisHeader::kUpstreamPrivacy;
+  privacy.m_length = 5;
+  privacy.m_sid = 0x0321;
+  privacy.m_firstFragment = true;
+  privacy.m_fragmentSequence = 9;
+  dh.addExtendedHeader (privacy);
+  packet->AddHeader (dh);
+  NS_TEST_ASSERT_MSG_EQ (packet->GetSize (), 30 + 6 + 10 + 14 + 100, "Wrong frame size");
+
+  DocsisHeader received (30);
+  packet->RemoveHeader (received);
+  NS_TEST_ASSERT_MSG_EQ (received.IsDataPacket (), true, "The frame type was lost");
+  NS_TEST_ASSERT_MSG_EQ (received.GetLength (), 114, "Wrong LEN");
+  const DocsisHeader::ExtendedHeader::ExtendedHeaderElement *ehe = received.findExtendedHeader (DocsisHeader::kEHRequest);
+  NS_TEST_ASSERT_MSG_NE (ehe, 0, "The request element was lost");
+  NS_TEST_EXPECT_MSG_EQ (ehe->m_sid, 0x1234, "Wrong request SID");
+  NS_TEST_EXPECT_MSG_EQ ((uint32_t) ehe->m_minislots, 17, "Wrong requested minislots");
+  ehe = received.findExtendedHeader (DocsisHeader::kUpstreamPrivacy);
+  NS_TEST_ASSERT_MSG_NE (ehe, 0, "The privacy element was lost");
+  NS_TEST_EXPECT_MSG_EQ (ehe->m_sid, 0x0321, "Wrong fragment SID");
+  NS_TEST_EXPECT_MSG_EQ (ehe->m_firstFragment, true, "Wrong first fragment flag");
+  NS_TEST_EXPECT_MSG_EQ ((uint32_t) ehe->m_fragmentSequence, 9, "Wrong fragment sequence");
+
+  PDUHeader receivedPdu;
+  packet->RemoveHeader (receivedPdu);
+  NS_TEST_EXPECT_MSG_EQ (receivedPdu.GetSource (), Mac48Address ("00:00:00:00:00:01"), "Wrong source");
+  NS_TEST_EXPECT_MSG_EQ (receivedPdu.GetDestination (), Mac48Address ("00:00:00:00:00:02"), "Wrong destination");
+  NS_TEST_EXPECT_MSG_EQ (receivedPdu.GetTypeLength (), 0x800, "Wrong type");
+  NS_TEST_EXPECT_MSG_EQ (packet->GetSize (), 100, "The headers took payload with them");
+
+  // Six one byte elements, two more than are parsed, ahead of 10 bytes of
+  // PDU. The header has to come out as it went in.
+  uint8_t frame[] = { 0x01, 12, 0, 22, 0xD1, 0, 0xD1, 0, 0xD1, 0, 0xD1, 0, 0xD1, 5, 0xD1, 6, 0, 0,
+                      0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+  packet = Create<Packet> (frame, sizeof (frame));
+  DocsisHeader crowded (0);
+  packet->RemoveHeader (crowded);
+  NS_TEST_EXPECT_MSG_EQ (crowded.GetSerializedSize (), 18, "The elements past the parsed ones were dropped");
+  NS_TEST_EXPECT_MSG_EQ (crowded.GetLength (), 10, "Wrong LEN");
+  NS_TEST_EXPECT_MSG_EQ (packet->GetSize (), 10, "The header took payload with it");
+  packet->AddHeader (crowded);
+  uint8_t copy[sizeof (frame)];
+  NS_TEST_ASSERT_MSG_EQ (packet->CopyData (copy, sizeof (copy)), sizeof (frame), "Wrong frame size");
+  NS_TEST_EXPECT_MSG_EQ (std::equal (frame, frame + sizeof (frame), copy), true, "The header did not serialize back as received");
+}
+
+// A low latency downstream flow carries an overloading classic source and
+// a light L4S one. The L frames stay under a millisecond while the classic
+// queue sits at its target, and an L4S source that floods the L queue is
+// sanctioned into the classic one.
+class DocsisDualQueueTestCase : public TestCase
+{
+public:
+  DocsisDualQueueTestCase ();
+
+private:
+  virtual void DoRun (void);
+  void Send (Ptr<NetDevice> device, Address address, Ipv4Address source, uint8_t ecn, Time interval);
+  void Connect (Ptr<CmtsDevice> cmts, Mac48Address cm);
+  void LowLatencySojourn (Time sojourn);
+  void ClassicSojourn (Time sojourn);
+  void Sanction (Ptr<const Packet> packet);
+
+  Time m_lowLatencyTotal;
+  uint32_t m_lowLatencyPackets;
+  Time m_lowLatencyMax;
+  Time m_classicTotal;
+  uint32_t m_classicPackets;
+  uint32_t m_sanctioned;
+};
+
+DocsisDualQueueTestCase::DocsisDualQueueTestCase ()
+  : TestCase ("Docsis dual queue keeps L4S traffic under a millisecond")
+{
+}
+
+void
+DocsisDualQueueTestCase::Send (Ptr<NetDevice> device, Address address, Ipv4Address source, uint8_t ecn, Time interval)
+{
+  device->Send (CreateIpv4Packet (1000, 17, source, 9, 0, ecn), address, 0x800);
+  Simulator::Schedule (interval, &DocsisDualQueueTestCase::Send, this, device, address, source, ecn, interval);
+}
+
+void
+DocsisDualQueueTestCase::Connect (Ptr<CmtsDevice> cmts, Mac48Address cm)
+{
+  Ptr<DocsisDualQueue> queue = cmts->GetDownstreamQueue (cm, 0);
+  NS_TEST_ASSERT_MSG_NE (queue, 0, "The low latency flow got no dual queue");
+  queue->TraceConnectWithoutContext ("LowLatencySojourn", MakeCallback (&DocsisDualQueueTestCase::LowLatencySojourn, this));
+  queue->TraceConnectWithoutContext ("ClassicSojourn", MakeCallback (&DocsisDualQueueTestCase::ClassicSojourn, this));
+  queue->TraceConnectWithoutContext ("Sanction", MakeCallback (&DocsisDualQueueTestCase::Sanction, this));
+}
+
+void
+DocsisDualQueueTestCase::LowLatencySojourn (Time sojourn)
+{
+  m_lowLatencyTotal += sojourn;
+  m_lowLatencyPackets++;
+  m_lowLatencyMax = std::max (m_lowLatencyMax, sojourn);
+}
+
+void
+DocsisDualQueueTestCase::ClassicSojourn (Time sojourn)
+{
+  m_classicTotal += sojourn;
+  m_classicPackets++;
+}
+
+void
+DocsisDualQueueTestCase::Sanction (Ptr<const Packet> packet)
+{
+  m_sanctioned++;
+}
+
+void
+DocsisDualQueueTestCase::DoRun (void)
+{
+  m_lowLatencyTotal = m_classicTotal = m_lowLatencyMax = Time (0);
+  m_lowLatencyPackets = m_classicPackets = m_sanctioned = 0;
+
+  Ptr<CmtsDevice> cmts = CreateObject<CmtsDevice> ();
+  Ptr<CmDevice> cm = CreateObject<CmDevice> ();
+  Ptr<Hfc> channel = CreateObject<Hfc> ();
+
+  DocsisServiceFlow downstream;
+  downstream.maxSustainedRate = DataRate ("10Mbps");
+  downstream.lowLatency = true;
+  cm->SetDownstreamServiceFlow (0, downstream);
+
+  ConnectDevices (cmts, cm, channel);
+
+  DocsisServiceFlow upstream;
+  upstream.lowLatency = true;
+  uint32_t reference = cm->AddUpstreamServiceFlow (upstream);
+  NS_TEST_ASSERT_MSG_NE (DynamicCast<DocsisDualQueue> (cm->GetQueue (reference)), 0, "The low latency upstream flow got no dual queue");
+
+  // The classic source alone offers 110% of the flow's 10 Mbps, and the
+  // L4S one another 10%.
+  Address address = cm->GetAddress ();
+  Simulator::Schedule (MilliSeconds (500), &DocsisDualQueueTestCase::Connect, this, cmts, Mac48Address::ConvertFrom (address));
+  Simulator::Schedule (Seconds (1), &DocsisDualQueueTestCase::Send, this, cmts, address, Ipv4Address ("10.1.0.1"),
+                       (uint8_t) Ipv4Header::NotECT, MicroSeconds (727));
+  Simulator::Schedule (Seconds (1), &DocsisDualQueueTestCase::Send, this, cmts, address, Ipv4Address ("10.1.0.2"),
+                       (uint8_t) Ipv4Header::ECT1, MilliSeconds (8));
+  Simulator::Stop (Seconds (2));
+  Simulator::Run ();
+
+  // The base probability has settled after a second of overload.
+  m_lowLatencyTotal = m_classicTotal = m_lowLatencyMax = Time (0);
+  m_lowLatencyPackets = m_classicPackets = 0;
+  Simulator::Stop (Seconds (1));
+  Simulator::Run ();
+
+  NS_TEST_ASSERT_MSG_GT (m_lowLatencyPackets, 100, "L4S frames were lost");
+  NS_TEST_ASSERT_MSG_GT (m_classicPackets, 1000, "The classic queue did not keep the link busy");
+  Time lowLatencyMean = Seconds (m_lowLatencyTotal.GetSeconds () / m_lowLatencyPackets);
+  Time classicMean = Seconds (m_classicTotal.GetSeconds () / m_classicPackets);
+  NS_TEST_EXPECT_MSG_LT (lowLatencyMean, MilliSeconds (1), "L4S frames queued for more than a millisecond");
+  NS_TEST_EXPECT_MSG_GT (classicMean, MilliSeconds (3), "The classic queue did not build up to its target");
+  NS_TEST_EXPECT_MSG_LT (classicMean, MilliSeconds (30), "The coupled AQM let the classic queue grow");
+  NS_TEST_EXPECT_MSG_EQ (m_sanctioned, 0, "A well behaved L4S source was sanctioned");
+
+  // An L4S source flooding at the flow's rate is sent to the classic queue,
+  // and the light one keeps its latency.
+  m_lowLatencyTotal = m_lowLatencyMax = Time (0);
+  m_lowLatencyPackets = 0;
+  Simulator::Schedule (Seconds (0), &DocsisDualQueueTestCase::Send, this, cmts, address, Ipv4Address ("10.1.0.3"),
+                       (uint8_t) Ipv4Header::ECT1, MicroSeconds (800));
+  RunSimulation (Seconds (2));
+
+  NS_TEST_EXPECT_MSG_GT (m_sanctioned, 1000, "The flooding L4S source was not sanctioned");
+  NS_TEST_EXPECT_MSG_LT (Seconds (m_lowLatencyTotal.GetSeconds () / m_lowLatencyPackets), MilliSeconds (1), "A flooding L4S source hurt the latency of the rest");
+}
+
+// A voice flow on UGS and a gaming flow on PGS share the upstream with bulk
+// data. Their grants come at exactly their intervals, and the voice frames
+// go out without asking.
+class DocsisPeriodicGrantTestCase : public TestCase
+{
+public:
+  DocsisPeriodicGrantTestCase ();
+
+private:
+  virtual void DoRun (void);
+  void SendData (Ptr<NetDevice> device, Address address);
+  void SendVoice (Ptr<NetDevice> device, Address address);
+  bool Receive (Ptr<NetDevice> device, Ptr<const Packet> packet, uint16_t protocol, const Address &source);
+  void PeriodicGrant (uint16_t sid, Time start, Time jitter);
+
+  std::map<uint16_t, std::vector<Time> > m_grants;	// Starts, by SID
+  Time m_worstJitter;
+  uint32_t m_voiceReceived;
+};
+
+DocsisPeriodicGrantTestCase::DocsisPeriodicGrantTestCase ()
+  : TestCase ("Docsis UGS and PGS grants keep their intervals")
+{
+}
+
+void
+DocsisPeriodicGrantTestCase::SendData (Ptr<NetDevice> device, Address address)
+{
+  device->Send (CreateIpv4Packet (1000, 17, Ipv4Address ("10.1.0.2"), 9, 0), address, 0x800);
+  Simulator::Schedule (MicroSeconds (250), &DocsisPeriodicGrantTestCase::SendData, this, device, address);
+}
+
+void
+DocsisPeriodicGrantTestCase::SendVoice (Ptr<NetDevice> device, Address address)
+{
+  device->Send (CreateIpv4Packet (160, 17, Ipv4Address ("10.1.0.2"), 5060, 46), address, 0x800);
+  Simulator::Schedule (MilliSeconds (20), &DocsisPeriodicGrantTestCase::SendVoice, this, device, address);
+}
+
+bool
+DocsisPeriodicGrantTestCase::Receive (Ptr<NetDevice> device, Ptr<const Packet> packet, uint16_t protocol, const Address &source)
+{
+  Ptr<Packet> copy = packet->Copy ();
+  Ipv4Header ip;
+  UdpHeader udp;
+  copy->RemoveHeader (ip);
+  copy->RemoveHeader (udp);
+  if (udp.GetDestinationPort () == 5060)
+    m_voiceReceived++;
+  return true;
+}
+
+void
+DocsisPeriodicGrantTestCase::PeriodicGrant (uint16_t sid, Time start, Time jitter)
+{
+  m_grants[sid].push_back (start);
+  m_worstJitter = std::max (m_worstJitter, jitter);
+}
+
+void
+DocsisPeriodicGrantTestCase::DoRun (void)
+{
+  m_worstJitter = Time (0);
+  m_voiceReceived = 0;
+
+  Ptr<CmtsDevice> cmts = CreateObject<CmtsDevice> ();
+  Ptr<CmDevice> cm = CreateObject<CmDevice> ();
+  Ptr<Hfc> channel = CreateObject<Hfc> ();
+
+  ConnectDevices (cmts, cm, channel);
+  cm->SetAttribute ("RequestStrategy", EnumValue (kRequestQueueDepth));
+  cmts->SetReceiveCallback (MakeCallback (&DocsisPeriodicGrantTestCase::Receive, this));
+  cmts->TraceConnectWithoutContext ("PeriodicGrant", MakeCallback (&DocsisPeriodicGrantTestCase::PeriodicGrant, this));
+
+  // 27 byte minislots last 80 timestamp ticks, so the intervals and the
+  // MAPs are whole numbers of grid cells and no grant straddles two MAPs.
+  channel->SetUpstreamPhyProfile (0, Hfc::PhyProfile (64, 5120000, 0.1, 27, 8));
+
+  DocsisServiceFlow voice;
+  voice.mode = kUnsolicitedGrant;
+  voice.grantInterval = MilliSeconds (20);
+  voice.grantSize = 250;
+  DocsisClassifierRule rule;
+  rule.protocol = 17;
+  rule.destinationPortStart = rule.destinationPortEnd = 5060;
+  rule.flow = cm->AddUpstreamServiceFlow (voice);
+  cm->AddUpstreamClassifier (rule);
+
+  DocsisServiceFlow gaming;
+  gaming.mode = kProactiveGrant;
+  gaming.grantInterval = MilliSeconds (5);
+  gaming.grantSize = 300;
+  rule.destinationPortStart = rule.destinationPortEnd = 3074;
+  rule.flow = cm->AddUpstreamServiceFlow (gaming);
+  cm->AddUpstreamClassifier (rule);
+
+  Simulator::Schedule (MilliSeconds (100), &DocsisPeriodicGrantTestCase::SendData, this, cm, cmts->GetAddress ());
+  Simulator::Schedule (MilliSeconds (105), &DocsisPeriodicGrantTestCase::SendVoice, this, cm, cmts->GetAddress ());
+  RunSimulation (Seconds (2));
+
+  NS_TEST_ASSERT_MSG_EQ (m_grants.size (), 2, "The periodic flows were not both granted");
+  Time intervals[] = { MilliSeconds (20), MilliSeconds (5) };
+  uint32_t flow = 0;
+  for (std::map<uint16_t, std::vector<Time> >::const_iterator grants = m_grants.begin (); grants != m_grants.end (); grants++, flow++)
+    {
+      const std::vector<Time> &starts = grants->second;
+      NS_TEST_EXPECT_MSG_GT (starts.size (), Seconds (1.9) / intervals[flow], "Periodic grants were skipped");
+      Time shortest = Seconds (1);
+      Time longest = Seconds (0);
+      for (uint32_t i = 1; i < starts.size (); i++)
+        {
+          shortest = std::min (shortest, starts[i] - starts[i - 1]);
+          longest = std::max (longest, starts[i] - starts[i - 1]);
+        }
+      NS_TEST_EXPECT_MSG_LT (longest - shortest, NanoSeconds (2), "The grant interval varied");
+      NS_TEST_EXPECT_MSG_LT (Abs (longest - intervals[flow]), MicroSeconds (10), "The grant interval is off the flow's");
+    }
+  NS_TEST_EXPECT_MSG_EQ (m_worstJitter, Time (0), "Periodic grants were moved off their nominal start");
+  NS_TEST_EXPECT_MSG_GT (m_voiceReceived, 90, "Voice frames were lost");
+}
+
+// OFDM channels send every CM's frames at the rate of its modulation
+// profile, and the upstream minislots of a profile carry what that rate
+// fits in them.
+class DocsisOfdmProfileTestCase : public TestCase
+{
+public:
+  DocsisOfdmProfileTestCase ();
+
+private:
+  virtual void DoRun (void);
+  Time Run (uint32_t profile, bool upstream);
+  void SendBurst (Ptr<NetDevice> device, Address address);
+  bool Receive (Ptr<NetDevice> device, Ptr<const Packet> packet, uint16_t protocol, const Address &source);
+
+  uint32_t m_received;
+  Time m_lastReceived;
+};
+
+DocsisOfdmProfileTestCase::DocsisOfdmProfileTestCase ()
+  : TestCase ("Docsis OFDM channels with per CM profiles"), m_received (0)
+{
+}
+
+void
+DocsisOfdmProfileTestCase::SendBurst (Ptr<NetDevice> device, Address address)
+{
+  for (uint32_t i = 0; i < 100; i++)
+    device->Send (Create<Packet> (1400), address, 0x800);
+}
+
+bool
+DocsisOfdmProfileTestCase::Receive (Ptr<NetDevice> device, Ptr<const Packet> packet, uint16_t protocol, const Address &source)
+{
+  m_received++;
+  m_lastReceived = Simulator::Now ();
+  return true;
+}
+
+// 50 kHz subcarriers with a 5 us cyclic prefix, 40000 symbols per second,
+// and a quarter of the raw rate spent on FEC. Profile A is 256-QAM
+// downstream and 64-QAM upstream, B and C load more bits.
+static Hfc::OfdmChannel
+CreateOfdmChannel (uint32_t minislots, uint8_t bitsA, uint8_t bitsB, uint8_t bitsC)
+{
+  Hfc::OfdmChannel ofdm;
+  ofdm.cyclicPrefix = MicroSeconds (5);
+  ofdm.fecOverhead = 0.25;
+  ofdm.profiles.push_back (std::vector<uint8_t> (minislots, bitsA));
+  ofdm.profiles.push_back (std::vector<uint8_t> (minislots, bitsB));
+  ofdm.profiles.push_back (std::vector<uint8_t> (minislots, bitsC));
+  return ofdm;
+}
+
+Time
+DocsisOfdmProfileTestCase::Run (uint32_t profile, bool upstream)
+{
+  m_received = 0;
+
+  Ptr<CmtsDevice> cmts = CreateObject<CmtsDevice> ();
+  Ptr<CmDevice> cm = CreateObject<CmDevice> ();
+  Ptr<Hfc> channel = CreateObject<Hfc> ();
+  channel->SetDownstreamOfdmChannel (0, CreateOfdmChannel (100, 8, 10, 12));
+  channel->SetUpstreamOfdmChannel (0, CreateOfdmChannel (16, 6, 8, 10));
+
+  ConnectDevices (cmts, cm, channel, MicroSeconds (100));
+  cm->SetAttribute ("RequestStrategy", EnumValue (kRequestQueueDepth));
+  channel->SetCmProfile (cm, upstream ? kUpstream : kDownstream, 0, profile);
+
+  if (upstream)
+    {
+      cmts->SetReceiveCallback (MakeCallback (&DocsisOfdmProfileTestCase::Receive, this));
+      Simulator::Schedule (Seconds (1.0), &DocsisOfdmProfileTestCase::SendBurst, this, cm, cmts->GetAddress ());
+    }
+  else
+    {
+      cm->SetReceiveCallback (MakeCallback (&DocsisOfdmProfileTestCase::Receive, this));
+      Simulator::Schedule (Seconds (1.0), &DocsisOfdmProfileTestCase::SendBurst, this, cmts, cm->GetAddress ());
+    }
+
+  RunSimulation (Seconds (2.0));
+
+  NS_TEST_EXPECT_MSG_EQ (m_received, 100, "Frames were lost");
+  return m_lastReceived - Seconds (1.0);
+}
+
+void
+DocsisOfdmProfileTestCase::DoRun (void)
+{
+  Ptr<Hfc> channel = CreateObject<Hfc> ();
+  channel->SetDownstreamOfdmChannel (0, CreateOfdmChannel (100, 8, 10, 12));
+  Hfc::OfdmChannel upstream = CreateOfdmChannel (16, 6, 8, 10);
+  // Profile C leaves out every other minislot, at twice the bits.
+  for (uint32_t minislot = 0; minislot < 16; minislot++)
+    upstream.profiles[2][minislot] = minislot % 2 ? 0 : 12;
+  channel->SetUpstreamOfdmChannel (0, upstream);
+
+  // 100 minislots of 8 subcarriers, 6400 bits per symbol on profile A.
+  NS_TEST_ASSERT_MSG_EQ (channel->GetProfilesAmount (kDownstream, 0), 3, "Profiles were lost");
+  NS_TEST_ASSERT_MSG_EQ_TOL ((double) channel->GetDownstreamDataRate (0).GetBitRate (), 192e6, 1, "Wrong profile A rate");
+  NS_TEST_ASSERT_MSG_EQ (channel->GetDownstreamPhyProfile (0).modulationOrder, 256, "Profile A does not set the reported modulation");
+
+  // Six symbols of 25 us shared out among 16 minislots, at 23.04 Mbps.
+  NS_TEST_ASSERT_MSG_EQ_TOL ((double) channel->GetUpstreamDataRate (0).GetBitRate (), 23.04e6, 1, "Wrong upstream profile A rate");
+  NS_TEST_ASSERT_MSG_EQ (channel->GetUpstreamMinislotSize (0), 27, "Wrong profile A minislot size");
+
+  Ptr<CmtsDevice> cmts = CreateObject<CmtsDevice> ();
+  cmts->Attach (channel);
+  Ptr<CmDevice> cms[3];
+  for (uint32_t i = 0; i < 3; i++)
+    {
+      cms[i] = CreateObject<CmDevice> ();
+      cms[i]->Attach (channel);
+      channel->SetCmProfile (cms[i], kDownstream, 0, i);
+      channel->SetCmProfile (cms[i], kUpstream, 0, i);
+    }
+  NS_TEST_ASSERT_MSG_EQ_TOL (cmts->MinislotToTime (0, 1).GetSeconds (), channel->GetUpstreamTxTime (0, 27).GetSeconds (), 1e-7, "Minislot does not match profile A");
+  NS_TEST_ASSERT_MSG_EQ_TOL ((double) channel->GetDownstreamDataRate (0, cms[2]->GetHandle ()).GetBitRate (), 288e6, 1, "Wrong profile C rate");
+  NS_TEST_ASSERT_MSG_EQ_TOL (channel->GetDownstreamTxTime (0, 1500, cms[0]->GetHandle ()).GetSeconds () / channel->GetDownstreamTxTime (0, 1500, cms[1]->GetHandle ()).GetSeconds (),
+                             10.0 / 8, 1e-4, "Tx time does not follow the profile");
+  NS_TEST_ASSERT_MSG_EQ (channel->GetUpstreamMinislotSize (0, cms[1]->GetHandle ()), 36, "Wrong profile B minislot size");
+  NS_TEST_ASSERT_MSG_EQ (channel->GetUpstreamMinislotSize (0, cms[2]->GetHandle ()), 27, "Excluded minislots were loaded");
+
+  // A CM that leaves frees its profile with its handle.
+  uint32_t handle = cms[2]->GetHandle ();
+  cms[2]->Deattach ();
+  NS_TEST_ASSERT_MSG_EQ (channel->GetCmProfile (handle, kDownstream, 0), 0, "A freed handle kept its profile");
+  cmts->Dispose ();
+
+  // The same bursts on profile A and on profile C.
+  Time downA = Run (0, false);
+  Time downC = Run (2, false);
+  NS_TEST_ASSERT_MSG_EQ_TOL (downA.GetSeconds () / downC.GetSeconds (), 12.0 / 8, 0.1, "Downstream capacity does not follow the profile");
+  Time upA = Run (0, true);
+  Time upC = Run (2, true);
+  // The request-grant cycle weighs more on the slower profile.
+  NS_TEST_ASSERT_MSG_GT (upA.GetSeconds () / upC.GetSeconds (), 10.0 / 6 - 0.1, "Upstream capacity does not follow the profile");
+}
+
+// Minislot times are whole timestamp ticks that do not drift, and 32 bit
+// minislot numbers that wrap mid run still put the CM's bursts in the
+// grants the CMTS gave.
+class DocsisMinislotClockTestCase : public TestCase
+{
+public:
+  DocsisMinislotClockTestCase ();
+
+private:
+  virtual void DoRun (void);
+  void SendOnePacket (Ptr<NetDevice> device, Address address);
+  bool Receive (Ptr<NetDevice> device, Ptr<const Packet> packet, uint16_t protocol, const Address &source);
+
+  uint32_t m_received;
+  Time m_sentTime;
+  Time m_worstDelay;
+};
+
+DocsisMinislotClockTestCase::DocsisMinislotClockTestCase ()
+  : TestCase ("Docsis minislot clock counts integer ticks and wraps")
+{
+}
+
+void
+DocsisMinislotClockTestCase::SendOnePacket (Ptr<NetDevice> device, Address address)
+{
+  m_sentTime = Simulator::Now ();
+  device->Send (Create<Packet> (100), address, 0x800);
+}
+
+bool
+DocsisMinislotClockTestCase::Receive (Ptr<NetDevice> device, Ptr<const Packet> packet, uint16_t protocol, const Address &source)
+{
+  m_received++;
+  m_worstDelay = std::max (m_worstDelay, Simulator::Now () - m_sentTime);
+  return true;
+}
+
+void
+DocsisMinislotClockTestCase::DoRun (void)
+{
+  m_received = 0;
+  m_worstDelay = Seconds (0);
+
+  // 48 ticks of 1/10.24 MHz are 4687.5 ns, so a million minislots are an
+  // exact number of nanoseconds and odd ones round up to the next.
+  DocsisMinislotClock clock (48);
+  NS_TEST_ASSERT_MSG_EQ (DocsisMinislotClock::GetTicksCovering (NanoSeconds (4630)), 48, "Minislot not rounded up to whole ticks");
+  NS_TEST_ASSERT_MSG_EQ (clock.GetMinislotStart (1), NanoSeconds (4688), "Minislot start not rounded up to the nanosecond");
+  NS_TEST_ASSERT_MSG_EQ (clock.GetDuration (1000000), NanoSeconds (4687500000ULL), "Minislot durations drift");
+  NS_TEST_ASSERT_MSG_EQ (clock.GetMinislot (NanoSeconds (4687500000ULL)), 1000000, "Time to minislot drifts");
+  NS_TEST_ASSERT_MSG_EQ (clock.GetNextMinislot (NanoSeconds (4688)), 1, "A minislot start is not its own next minislot");
+  NS_TEST_ASSERT_MSG_EQ (clock.GetNextMinislot (NanoSeconds (4689)), 2, "A time past a minislot start is not after it");
+  NS_TEST_ASSERT_MSG_EQ (clock.GetMinislotsCovering (MicroSeconds (47)), 11, "Duration not covered");
+  NS_TEST_ASSERT_MSG_EQ (clock.GetMinislotsWithin (MicroSeconds (47)), 10, "Duration not floored");
+
+  // The timestamp is 32 bits wide, and minislot numbers that wrapped are
+  // taken as the ones nearest to the present.
+  DocsisMinislotClock late (48, ((uint64_t) 1 << 32) * 48 - 2 * 48);
+  NS_TEST_ASSERT_MSG_EQ (late.GetTimestamp (Seconds (0)), (uint32_t) -96, "Wrong timestamp");
+  NS_TEST_ASSERT_MSG_EQ (late.GetTimestamp (NanoSeconds (9375)), 0, "The timestamp did not wrap");
+  NS_TEST_ASSERT_MSG_EQ (late.GetMinislot (Seconds (0)), (uint32_t) -2, "Wrong minislot");
+  NS_TEST_ASSERT_MSG_EQ (late.GetMinislotStart (1), NanoSeconds (14063), "Wrapped minislot not ahead");
+  NS_TEST_ASSERT_MSG_EQ (late.GetMinislotStart ((uint32_t) -5), Seconds (0) - NanoSeconds (14062), "Minislot before the wrap not behind");
+
+  // Minislot numbers wrap after 100000 minislots, half a second in.
+  Ptr<CmtsDevice> cmts = CreateObject<CmtsDevice> ();
+  Ptr<CmDevice> cm = CreateObject<CmDevice> ();
+  Ptr<Hfc> channel = CreateObject<Hfc> ();
+
+  cmts->SetAttribute ("InitialTimestamp", UintegerValue ((((uint64_t) 1 << 32) - 100000) * 48));
+  ConnectDevices (cmts, cm, channel);
+  cmts->SetReceiveCallback (MakeCallback (&DocsisMinislotClockTestCase::Receive, this));
+
+  NS_TEST_ASSERT_MSG_EQ (cmts->GetMinislotClock (0).GetTicksPerMinislot (), 48, "The default minislot is not 48 ticks");
+  for (uint32_t i = 0; i < 90; i++)
+    Simulator::Schedule (MilliSeconds (100 + 10 * i), &DocsisMinislotClockTestCase::SendOnePacket, this, cm, cmts->GetAddress ());
+  RunSimulation (Seconds (1.1));
+
+  NS_TEST_ASSERT_MSG_EQ (m_received, 90, "Packets were lost across the minislot wrap");
+  NS_TEST_ASSERT_MSG_LT (m_worstDelay, MilliSeconds (10), "The request-grant cycle stalled at the wrap");
+}
+
+// A chassis serves several segments, each on its own Hfc and MAC domain,
+// behind one IP interface that reaches the CMs of every segment.
+class DocsisCmtsChassisTestCase : public TestCase
+{
+public:
+  DocsisCmtsChassisTestCase ();
+
+private:
+  virtual void DoRun (void);
+  void Send (Ptr<Socket> socket, Ipv4Address destination);
+  void Receive (Ptr<Socket> socket);
+
+  uint32_t m_received;
+};
+
+DocsisCmtsChassisTestCase::DocsisCmtsChassisTestCase ()
+  : TestCase ("Docsis CMTS chassis serves many segments"), m_received (0)
+{
+}
+
+void
+DocsisCmtsChassisTestCase::Send (Ptr<Socket> socket, Ipv4Address destination)
+{
+  socket->SendTo (Create<Packet> (500), 0, InetSocketAddress (destination, 9));
+}
+
+void
+DocsisCmtsChassisTestCase::Receive (Ptr<Socket> socket)
+{
+  while (socket->Recv ())
+    m_received++;
+}
+
+void
+DocsisCmtsChassisTestCase::DoRun (void)
+{
+  NodeContainer cmtsNode;
+  cmtsNode.Create (1);
+
+  DocsisHelper docsis;
+  docsis.SetChannelsAmount (2, 2);
+  Ptr<CmtsChassis> chassis = docsis.InstallChassis (cmtsNode.Get (0));
+  NetDeviceContainer devices (chassis);
+  NodeContainer cmNodes[3];
+  for (uint32_t segment = 0; segment < 3; segment++)
+    {
+      cmNodes[segment].Create (4);
+      NetDeviceContainer cms = docsis.Install (chassis, cmNodes[segment]);
+      NS_TEST_ASSERT_MSG_EQ (cms.GetN (), 4, "Wrong number of CMs");
+      for (uint32_t i = 0; i < cms.GetN (); i++)
+        NS_TEST_ASSERT_MSG_EQ (cms.Get (i)->GetChannel (), chassis->GetMacDomain (segment)->GetChannel (), "CM is not on its segment");
+      devices.Add (cms);
+    }
+  docsis.AssignStreams (devices, 1);
+
+  NS_TEST_ASSERT_MSG_EQ (chassis->GetNMacDomains (), 3, "Wrong number of segments");
+  NS_TEST_ASSERT_MSG_EQ (cmtsNode.Get (0)->GetNDevices (), 1, "The MAC domains were added to the node");
+  NS_TEST_ASSERT_MSG_NE (chassis->GetMacDomain (0)->GetChannel (), chassis->GetMacDomain (1)->GetChannel (), "Segments share a Hfc");
+  NS_TEST_ASSERT_MSG_EQ (chassis->GetMacDomain (2)->GetAddress (), chassis->GetAddress (), "A MAC domain has its own address");
+  NS_TEST_ASSERT_MSG_EQ (chassis->FindMacDomain (Mac48Address::ConvertFrom (devices.Get (9)->GetAddress ())), chassis->GetMacDomain (2), "CM found on the wrong segment");
+  NS_TEST_ASSERT_MSG_EQ (chassis->Send (Create<Packet> (100), Mac48Address::Allocate (), 0x800), false, "Sent to a CM no segment serves");
+
+  // The chassis follows a CM that moves to another segment, and then goes.
+  Ptr<CmDevice> moved = DynamicCast<CmDevice> (devices.Get (9));
+  moved->Attach (DynamicCast<Hfc> (chassis->GetMacDomain (0)->GetChannel ()));
+  NS_TEST_ASSERT_MSG_EQ (chassis->FindMacDomain (Mac48Address::ConvertFrom (moved->GetAddress ())), chassis->GetMacDomain (0), "Moved CM found on its old segment");
+  moved->Deattach ();
+  NS_TEST_ASSERT_MSG_EQ (chassis->FindMacDomain (Mac48Address::ConvertFrom (moved->GetAddress ())), 0, "Found a CM that is gone");
+
+  Ipv4InterfaceContainer interfaces = docsis.InstallInternetStack (devices, "10.1.0.0", "255.255.0.0");
+
+  TypeId udp = UdpSocketFactory::GetTypeId ();
+  Ptr<Socket> cmtsSocket = Socket::CreateSocket (cmtsNode.Get (0), udp);
+  cmtsSocket->Bind (InetSocketAddress (Ipv4Address::GetAny (), 9));
+  cmtsSocket->SetRecvCallback (MakeCallback (&DocsisCmtsChassisTestCase::Receive, this));
+  for (uint32_t segment = 0; segment < 3; segment++)
+    {
+      Ptr<Socket> cmSocket = Socket::CreateSocket (cmNodes[segment].Get (3), udp);
+      cmSocket->Bind (InetSocketAddress (Ipv4Address::GetAny (), 9));
+      cmSocket->SetRecvCallback (MakeCallback (&DocsisCmtsChassisTestCase::Receive, this));
+
+      Simulator::Schedule (Seconds (0.1), &DocsisCmtsChassisTestCase::Send, this, cmSocket, interfaces.GetAddress (0));
+      Simulator::Schedule (Seconds (0.2), &DocsisCmtsChassisTestCase::Send, this, cmtsSocket, interfaces.GetAddress (4 * segment + 4));
+    }
+
+  RunSimulation (Seconds (0.3));
+
+  NS_TEST_ASSERT_MSG_EQ (m_received, 6, "UDP datagrams did not make it across every segment");
+}
+
 // The TestSuite class names the TestSuite, identifies what type of TestSuite,
 // and enables the TestCases to be run.  Typically, only the constructor for
 // this class must be defined
@@ -91,6 +2619,34 @@ DocsisTestSuite::DocsisTestSuite ()
 {
   // TestDuration for TestCase can be QUICK, EXTENSIVE or TAKES_FOREVER
   AddTestCase (new DocsisTestCase1, TestCase::QUICK);
+  AddTestCase (new DocsisUpstreamTestCase, TestCase::QUICK);
+  AddTestCase (new DocsisContentionTestCase, TestCase::QUICK);
+  AddTestCase (new DocsisRequestStrategyTestCase, TestCase::QUICK);
+  AddTestCase (new DocsisConcatenationTestCase, TestCase::QUICK);
+  AddTestCase (new DocsisDownstreamBondingTestCase, TestCase::QUICK);
+  AddTestCase (new DocsisUpstreamBondingTestCase, TestCase::QUICK);
+  AddTestCase (new DocsisPhyProfileTestCase, TestCase::QUICK);
+  AddTestCase (new DocsisHelperTestCase, TestCase::QUICK);
+  AddTestCase (new DocsisCmRegistryTestCase, TestCase::QUICK);
+  AddTestCase (new DocsisCmtsReattachTestCase, TestCase::QUICK);
+  AddTestCase (new DocsisMapLookupTestCase, TestCase::QUICK);
+  AddTestCase (new DocsisBroadcastDeliveryTestCase, TestCase::QUICK);
+  AddTestCase (new DocsisPieQueueTestCase, TestCase::QUICK);
+  AddTestCase (new DocsisClassifierTestCase, TestCase::QUICK);
+  AddTestCase (new DocsisServiceFlowTestCase, TestCase::QUICK);
+  AddTestCase (new DocsisRateShapingTestCase, TestCase::QUICK);
+  AddTestCase (new DocsisDownstreamSchedulerTestCase, TestCase::QUICK);
+  AddTestCase (new DocsisInitializationTestCase, TestCase::QUICK);
+  AddTestCase (new DocsisBroadcastContextTestCase, TestCase::QUICK);
+  AddTestCase (new DocsisSidReuseTestCase, TestCase::EXTENSIVE);
+  AddTestCase (new DocsisErrorModelTestCase, TestCase::QUICK);
+  AddTestCase (new DocsisPcapTestCase, TestCase::QUICK);
+  AddTestCase (new DocsisHeaderTestCase, TestCase::QUICK);
+  AddTestCase (new DocsisDualQueueTestCase, TestCase::QUICK);
+  AddTestCase (new DocsisPeriodicGrantTestCase, TestCase::QUICK);
+  AddTestCase (new DocsisOfdmProfileTestCase, TestCase::QUICK);
+  AddTestCase (new DocsisMinislotClockTestCase, TestCase::QUICK);
+  AddTestCase (new DocsisCmtsChassisTestCase, TestCase::QUICK);
 }
 
 // Do not forget to allocate an instance of this TestSuite
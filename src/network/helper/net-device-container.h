@@ -194,6 +194,14 @@ public:
    */
   void Add (std::string deviceName);
 
+  /**
+   * \brief Make room for a number of devices, so appending them does not
+   * grow the container one device at a time.
+   *
+   * \param n The number of devices the container will hold.
+   */
+  void Reserve (uint32_t n);
+
 private:
   std::vector<Ptr<NetDevice> > m_devices;
 };